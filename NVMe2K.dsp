@@ -86,6 +86,11 @@ SOURCE=.\nvme2k.rc
 # End Source File
 # Begin Source File
 
+SOURCE=.\nvme2k_cache.c
+# PROP Exclude_From_Build 1
+# End Source File
+# Begin Source File
+
 SOURCE=.\nvme2k_cpl.c
 # PROP Exclude_From_Build 1
 # End Source File
@@ -101,6 +106,10 @@ SOURCE=.\nvme2k_scsi.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\nvme2kdb.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\scsiext.h
 # End Source File
 # Begin Source File
@@ -60,6 +60,8 @@
 #define NVME_ADMIN_ABORT        0x08
 #define NVME_ADMIN_SET_FEATURES 0x09
 #define NVME_ADMIN_GET_FEATURES 0x0A
+#define NVME_ADMIN_ASYNC_EVENT  0x0C  // Asynchronous Event Request
+#define NVME_ADMIN_FORMAT_NVM   0x80
 
 //
 // NVMe I/O Command Opcodes
@@ -71,12 +73,87 @@
 #define NVME_CMD_ZERO           0x08
 #define NVME_CMD_DSM            0x09  // Dataset Management (TRIM/UNMAP)
 #define NVME_CMD_VERIFY         0x0C
+#define NVME_CMD_COPY           0x19  // Copy (Simple Copy, NVMe 2.0)
+
+//
+// Read/Write CDW12 control bits
+//
+#define NVME_RW_FUA             0x40000000  // Bit 30: Force Unit Access
 
 //
 // NVMe Identify CNS values
 //
 #define NVME_CNS_NAMESPACE    0x00
 #define NVME_CNS_CONTROLLER   0x01
+#define NVME_CNS_ACTIVE_NSIDS 0x02  // Active namespace ID list (NVMe 1.1+)
+
+//
+// NVMe Feature Identifiers (Get/Set Features CDW10 bits 7:0)
+//
+#define NVME_FEATURE_ARBITRATION            0x01
+#define NVME_FEATURE_POWER_MANAGEMENT       0x02
+#define NVME_FEATURE_LBA_RANGE_TYPE         0x03  // data: up to 64 64-byte entries
+#define NVME_FEATURE_TEMPERATURE_THRESHOLD  0x04
+#define NVME_FEATURE_ERROR_RECOVERY         0x05
+#define NVME_FEATURE_VOLATILE_WRITE_CACHE   0x06
+#define NVME_FEATURE_NUMBER_OF_QUEUES       0x07
+#define NVME_FEATURE_INTERRUPT_COALESCING   0x08
+#define NVME_FEATURE_INTERRUPT_VECTOR_CONFIG 0x09
+#define NVME_FEATURE_WRITE_ATOMICITY        0x0A
+#define NVME_FEATURE_ASYNC_EVENT_CONFIG     0x0B
+#define NVME_FEATURE_AUTONOMOUS_POWER_STATE 0x0C  // data: 32 8-byte entries
+#define NVME_FEATURE_HOST_MEMORY_BUFFER     0x0D
+#define NVME_FEATURE_TIMESTAMP              0x0E  // data: 8 bytes
+#define NVME_FEATURE_THERMAL_MANAGEMENT     0x10
+#define NVME_FEATURE_NONOP_POWER_STATE      0x11
+
+#define NVME_FEATURE_FID_MASK   0x000000FF  // CDW10 bits 7:0
+#define NVME_FEATURE_SAVE       0x80000000  // Set Features CDW10 bit 31: SV
+
+//
+// Asynchronous Event Configuration (feature 0x0B) bits
+//
+#define NVME_AEC_SMART_WARNINGS 0x0000001F  // Bits 4:0: one per SMART/Health critical warning bit
+#define NVME_AEC_NS_ATTRIBUTE   0x00000100  // Bit 8: namespace attribute notices
+#define NVME_AEC_FW_ACTIVATION  0x00000200  // Bit 9: firmware activation notices
+
+//
+// Identify Controller OAES bits (NVMe 1.2+), same positions as the AEC notice bits
+//
+#define NVME_OAES_NOTICES       (NVME_AEC_NS_ATTRIBUTE | NVME_AEC_FW_ACTIVATION)
+
+//
+// Asynchronous Event Request completion DW0
+//
+#define NVME_AER_TYPE(dw0)          ((dw0) & 0x07)          // Bits 2:0: event type
+#define NVME_AER_INFO(dw0)          (((dw0) >> 8) & 0xFF)   // Bits 15:8: event information
+#define NVME_AER_LOG_PAGE(dw0)      (((dw0) >> 16) & 0xFF)  // Bits 23:16: log page to read
+#define NVME_AER_TYPE_ERROR         0
+#define NVME_AER_TYPE_SMART         1
+#define NVME_AER_TYPE_NOTICE        2
+#define NVME_AER_TYPE_VENDOR        7
+
+//
+// Identify Controller VWC bits
+//
+#define NVME_VWC_PRESENT        0x01  // Bit 0: volatile write cache present
+
+//
+// Identify Controller OACS and FNA bits
+//
+#define NVME_OACS_FORMAT_NVM    0x0002  // Bit 1: Format NVM supported
+#define NVME_FNA_FORMAT_ALL     0x01    // Bit 0: a format applies to every namespace
+
+//
+// Identify Controller ONCS bits
+//
+#define NVME_ONCS_DSM           0x0004  // Bit 2: Dataset Management supported
+#define NVME_ONCS_COPY          0x0100  // Bit 8: Copy supported
+
+//
+// Identify Controller LPA bits
+//
+#define NVME_LPA_EXTENDED_DATA  0x04    // Bit 2: Get Log Page takes NUMDU and an offset (LPOL/LPOU)
 
 //
 // NVMe Log Page Identifiers
@@ -84,6 +161,7 @@
 #define NVME_LOG_PAGE_ERROR_INFO        0x01
 #define NVME_LOG_PAGE_SMART_HEALTH      0x02
 #define NVME_LOG_PAGE_FW_SLOT_INFO      0x03
+#define NVME_LOG_PAGE_CHANGED_NS_LIST   0x04
 
 //
 // NVMe Status Codes (Status Code field, bits 7:1 of Status Word DW3[15:0])
@@ -186,6 +264,62 @@ typedef struct _NVME_COMPLETION {
     USHORT Status;      // Status and phase
 } NVME_COMPLETION, *PNVME_COMPLETION;
 
+//
+// Dataset Management range (the command's data buffer holds CDW10.NR + 1 of these)
+//
+#define NVME_DSM_ATTR_DEALLOCATE    (1 << 2)    // CDW11 bit 2: AD - deallocate the ranges
+#define NVME_DSM_MAX_RANGES         256         // 16 bytes each, exactly one page
+
+typedef struct _NVME_DSM_RANGE {
+    ULONG ContextAttributes;
+    ULONG Length;               // in logical blocks
+    ULONGLONG StartingLba;
+} NVME_DSM_RANGE, *PNVME_DSM_RANGE;
+
+//
+// Copy source range, descriptor format 0 (the command's data buffer holds CDW12.NR + 1
+// of these, CDW10/11 is the destination LBA)
+//
+#define NVME_COPY_MAX_RANGES        128         // 32 bytes each, what fits one page
+
+typedef struct _NVME_COPY_RANGE {
+    ULONGLONG Reserved0;
+    ULONGLONG StartingLba;
+    USHORT NumberOfBlocks;      // NLB, 0's based
+    USHORT Reserved1;
+    ULONG Reserved2[3];         // protection information fields, unused
+} NVME_COPY_RANGE, *PNVME_COPY_RANGE;
+
+//
+// Power State Descriptor (Identify Controller, one per power state up to NPSS)
+//
+#define NVME_MAX_POWER_STATES   32
+#define NVME_PSD_NOPS           0x02    // Flags bit 1: non-operational state, no I/O is processed in it
+
+typedef struct _NVME_POWER_STATE_DESCRIPTOR {
+    USHORT MaxPower;                // Offset 0 (MP - centiwatts, or 0.0001W if MXPS)
+    UCHAR Reserved0;                // Offset 2
+    UCHAR Flags;                    // Offset 3 (bit 0 MXPS, bit 1 NOPS)
+    ULONG EntryLatency;             // Offset 4 (ENLAT - microseconds, 0 if not reported)
+    ULONG ExitLatency;              // Offset 8 (EXLAT - microseconds, 0 if not reported)
+    UCHAR RelativeReadThroughput;   // Offset 12 (RRT)
+    UCHAR RelativeReadLatency;      // Offset 13 (RRL)
+    UCHAR RelativeWriteThroughput;  // Offset 14 (RWT)
+    UCHAR RelativeWriteLatency;     // Offset 15 (RWL)
+    UCHAR Reserved1[16];            // Offset 16-31
+} NVME_POWER_STATE_DESCRIPTOR, *PNVME_POWER_STATE_DESCRIPTOR;
+
+//
+// Autonomous Power State Transition (feature 0x0C): Set Features CDW11 bit 0 enables
+// it, the data buffer holds one 64-bit entry per power state saying which state to
+// go to after how long idle in this one
+//
+#define NVME_APSTA_SUPPORTED    0x01    // Identify Controller APSTA bit 0
+#define NVME_APST_ENABLE        0x01    // CDW11 bit 0: APSTE
+#define NVME_APST_ITPS_SHIFT    3       // entry bits 7:3 - idle transition power state
+#define NVME_APST_ITPT_SHIFT    8       // entry bits 31:8 - idle time prior to transition (ms)
+#define NVME_APST_ITPT_MAX      0xFFFFFF
+
 //
 // NVMe Identify Controller Structure (partial)
 //
@@ -199,9 +333,27 @@ typedef struct _NVME_IDENTIFY_CONTROLLER {
     UCHAR Ieee[3];                  // Offset 73-75 (IEEE OUI)
     UCHAR Cmic;                     // Offset 76
     UCHAR MaxDataTransferSize;      // Offset 77 (MDTS - as a power of 2, in units of minimum page size)
-    UCHAR Reserved1[438];           // Offset 78-515
+    UCHAR Reserved1[14];            // Offset 78-91
+    ULONG AsyncEventsSupported;     // Offset 92 (OAES - NVMe 1.2+)
+    UCHAR Reserved1b[160];          // Offset 96-255
+    USHORT OptionalAdminCommands;   // Offset 256 (OACS)
+    UCHAR AbortCommandLimit;        // Offset 258 (ACL - 0's based)
+    UCHAR AsyncEventRequestLimit;   // Offset 259 (AERL - 0's based)
+    UCHAR Reserved1c;               // Offset 260
+    UCHAR LogPageAttributes;        // Offset 261 (LPA - bit 2: extended Get Log Page data)
+    UCHAR Reserved1e;               // Offset 262
+    UCHAR NumberOfPowerStates;      // Offset 263 (NPSS - 0's based)
+    UCHAR Reserved1d;               // Offset 264
+    UCHAR ApstAttributes;           // Offset 265 (APSTA - bit 0: APST supported)
+    UCHAR Reserved1a[250];          // Offset 266-515
     ULONG NumberOfNamespaces;       // Offset 516 (NN field)
-    UCHAR Reserved2[3576];          // Offset 520-4095 (rest of 4096 byte structure)
+    USHORT OptionalNvmCommands;     // Offset 520 (ONCS)
+    USHORT FusedOperations;         // Offset 522 (FUSES)
+    UCHAR FormatNvmAttributes;      // Offset 524 (FNA)
+    UCHAR VolatileWriteCache;       // Offset 525 (VWC - bit 0: cache present)
+    UCHAR Reserved2[1522];          // Offset 526-2047
+    NVME_POWER_STATE_DESCRIPTOR PowerStates[NVME_MAX_POWER_STATES]; // Offset 2048-3071 (PSD0-PSD31)
+    UCHAR VendorSpecific[1024];     // Offset 3072-4095
 } NVME_IDENTIFY_CONTROLLER, *PNVME_IDENTIFY_CONTROLLER;
 
 //
@@ -213,6 +365,14 @@ typedef struct _NVME_LBA_FORMAT {
     UCHAR RelativePerformance;  // Bits 31:24 - Relative Performance
 } NVME_LBA_FORMAT, *PNVME_LBA_FORMAT;
 
+#define NVME_NSFEAT_OPTPERF         0x10    // NSFEAT bit 4: NPWG, NPWA, NPDG, NPDA and NOWS are valid
+#define NVME_DLFEAT_READ_MASK       0x07    // DLFEAT bits 2:0 - what reads of deallocated blocks return
+#define NVME_DLFEAT_READ_ZEROES     0x01    //   all bytes 0x00
+#define NVME_DLFEAT_READ_ONES       0x02    //   all bytes 0xFF
+#define NVME_FLBAS_FORMAT_MASK      0x0F    // FLBAS bits 3:0 - index into LbaFormats
+#define NVME_LBAF_RP_MASK           0x03    // RP bits 1:0 - 0 best, 3 degraded performance
+#define NVME_MAX_LBA_FORMATS        16
+
 //
 // NVMe Identify Namespace Structure (partial)
 //
@@ -224,10 +384,32 @@ typedef struct _NVME_IDENTIFY_NAMESPACE {
     UCHAR NumberOfLbaFormats;       // Offset 25: NLBAF
     UCHAR FormattedLbaSize;         // Offset 26: FLBAS - Formatted LBA Size
     UCHAR MetadataCapabilities;     // Offset 27: MC
-    UCHAR Reserved1[100];           // Offset 28-127
+    UCHAR DataProtectionCaps;       // Offset 28: DPC
+    UCHAR DataProtectionSettings;   // Offset 29: DPS
+    UCHAR Nmic;                     // Offset 30: NMIC
+    UCHAR ReservationCaps;          // Offset 31: RESCAP
+    UCHAR FormatProgress;           // Offset 32: FPI
+    UCHAR DeallocateFeatures;       // Offset 33: DLFEAT
+    USHORT Nawun;                   // Offset 34: NAWUN
+    USHORT Nawupf;                  // Offset 36: NAWUPF
+    USHORT Nacwu;                   // Offset 38: NACWU
+    USHORT Nabsn;                   // Offset 40: NABSN
+    USHORT Nabo;                    // Offset 42: NABO
+    USHORT Nabspf;                  // Offset 44: NABSPF
+    USHORT OptimalIoBoundary;       // Offset 46: NOIOB - in LBAs, 0 if not reported
+    UCHAR NvmCapacity[16];          // Offset 48-63: NVMCAP
+    USHORT PreferredWriteGranularity;   // Offset 64: NPWG - 0's based, valid with NSFEAT OPTPERF
+    USHORT PreferredWriteAlignment;     // Offset 66: NPWA - 0's based
+    USHORT PreferredDeallocGranularity; // Offset 68: NPDG - 0's based
+    USHORT PreferredDeallocAlignment;   // Offset 70: NPDA - 0's based
+    USHORT OptimalWriteSize;        // Offset 72: NOWS - 0's based
+    USHORT MaxSourceRangeLength;    // Offset 74: MSSRL - blocks per Copy source range
+    ULONG MaxCopyLength;            // Offset 76: MCL - blocks per Copy command
+    UCHAR MaxSourceRangeCount;      // Offset 80: MSRC - 0's based source ranges per Copy command
+    UCHAR Reserved1[23];            // Offset 81-103
     UCHAR Nguid[16];                // Offset 104-119: NGUID
     UCHAR Eui64[8];                 // Offset 120-127: EUI64
-    NVME_LBA_FORMAT LbaFormats[16]; // Offset 128-191: LBAF0-LBAF15
+    NVME_LBA_FORMAT LbaFormats[NVME_MAX_LBA_FORMATS]; // Offset 128-191: LBAF0-LBAF15
     UCHAR Reserved2[3904];          // Offset 192-4095
 } NVME_IDENTIFY_NAMESPACE, *PNVME_IDENTIFY_NAMESPACE;
 
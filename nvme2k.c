@@ -162,6 +162,9 @@ ULONG HwFoundAdapter(
     ConfigInfo->Dma64BitAddresses = TRUE;  // NVMe supports 64-bit addressing
 #endif    
     ConfigInfo->MaximumNumberOfTargets = 2;  // Support TargetId 0 and 1
+#if (_WIN32_WINNT >= 0x500)
+    ConfigInfo->MaximumNumberOfLogicalUnits = NVME_MAX_NAMESPACES;  // One LUN per active namespace
+#endif
     ConfigInfo->NumberOfPhysicalBreaks = 511;  // PRP1 + PRP list (512 entries)
     ConfigInfo->AlignmentMask = 0x3;  // DWORD alignment
     ConfigInfo->NeedPhysicalAddresses = TRUE;  // Required for ScsiPortGetPhysicalAddress to work
@@ -292,21 +295,38 @@ ULONG HwFoundAdapter(
 // - Utility buffer / PRP list pool: (SgListPages pages * 4KB, page-aligned)
 // - Admin CQ: 4096 bytes (4KB aligned)
 // - I/O CQ: 4096 bytes (4KB aligned)
-// Total: ~60KB with alignment
+// - TRIM pattern: 4096 bytes (4KB aligned)
+// - Read cache, if ReadCacheKB is set: slot pages and slot table (see nvme2k_cache.c)
+// Total: ~64KB with alignment, plus the read cache
 //
 
     // Allocate uncached memory block
     DevExt->SgListPages = 32;
-    DevExt->UncachedExtensionSize = (NVME_PAGE_SIZE * (DevExt->SgListPages + 4 + 1));
+    DevExt->UncachedExtensionSize = (NVME_PAGE_SIZE * (DevExt->SgListPages + 5 + 1)) +
+                                    NvmeCacheMemorySize(DevExt);
 
     DevExt->UncachedExtensionBase = ScsiPortGetUncachedExtension(
         (PVOID)DevExt,
         ConfigInfo,
         DevExt->UncachedExtensionSize);
 
+    if (DevExt->UncachedExtensionBase == NULL && DevExt->ReadCacheSlots != 0) {
+        // The read cache is optional, run without it rather than with fewer PRP pages
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: HwFoundAdapter - no uncached memory for the read cache, turning it off\n");
+#endif
+        DevExt->ReadCacheSlots = 0;
+        DevExt->UncachedExtensionSize = (NVME_PAGE_SIZE * (DevExt->SgListPages + 5 + 1));
+
+        DevExt->UncachedExtensionBase = ScsiPortGetUncachedExtension(
+            (PVOID)DevExt,
+            ConfigInfo,
+            DevExt->UncachedExtensionSize);
+    }
+
     if (DevExt->UncachedExtensionBase == NULL) {
         DevExt->SgListPages = 16;
-        DevExt->UncachedExtensionSize = (NVME_PAGE_SIZE * (DevExt->SgListPages + 4 + 1));
+        DevExt->UncachedExtensionSize = (NVME_PAGE_SIZE * (DevExt->SgListPages + 5 + 1));
 
         DevExt->UncachedExtensionBase = ScsiPortGetUncachedExtension(
             (PVOID)DevExt,
@@ -368,6 +388,73 @@ ULONG HwFoundAdapter(
     return SP_RETURN_FOUND;
 }
 
+//
+// ParseDriverParameters - Apply the DriverParameter registry string
+// (HKLM\System\CurrentControlSet\Services\nvme2k\Parameters\Device),
+// e.g. "IoScheduler=deadline;ReadExpireMs=20;WriteExpireMs=250;WriteInFlightKB=512;LatencyTargetUs=2000;Emulate512=0;ReadCacheKB=256;SmartCacheMs=30000;ApstLatencyUs=5000"
+//
+static VOID ParseDriverParameters(IN PHW_DEVICE_EXTENSION DevExt, IN PCHAR ArgumentString)
+{
+    PCHAR value;
+    ULONG writeCapKb;
+    ULONG cacheKb;
+
+    DevExt->IoScheduler = NVME_SCHED_NONE;
+    value = NvmeFindArgument(ArgumentString, "IoScheduler");
+    if (value && NvmeArgumentIs(value, "deadline")) {
+        DevExt->IoScheduler = NVME_SCHED_DEADLINE;
+    }
+
+    DevExt->ReadExpireMs = NvmeArgumentToUlong(
+        NvmeFindArgument(ArgumentString, "ReadExpireMs"), NVME_SCHED_READ_EXPIRE_MS);
+    DevExt->WriteExpireMs = NvmeArgumentToUlong(
+        NvmeFindArgument(ArgumentString, "WriteExpireMs"), NVME_SCHED_WRITE_EXPIRE_MS);
+    writeCapKb = NvmeArgumentToUlong(
+        NvmeFindArgument(ArgumentString, "WriteInFlightKB"), NVME_SCHED_WRITE_CAP_KB);
+    if (writeCapKb == 0 || writeCapKb > 0x3FFFFF) {
+        writeCapKb = NVME_SCHED_WRITE_CAP_KB;
+    }
+    DevExt->WriteBytesCap = writeCapKb * 1024;
+
+    // 0 keeps the queue depth limit fixed at NVME_MAX_QUEUE_SIZE
+    DevExt->LatencyTargetUs = NvmeArgumentToUlong(
+        NvmeFindArgument(ArgumentString, "LatencyTargetUs"), 0);
+
+    // Namespaces with LBAs larger than 512 bytes are reported as 512e unless turned off
+    DevExt->Emulate512 = NvmeArgumentToUlong(
+        NvmeFindArgument(ArgumentString, "Emulate512"), 1) ? TRUE : FALSE;
+
+    // Read cache size, rounded down to a power of 2 number of slots, 0 (off) by default
+    cacheKb = NvmeArgumentToUlong(NvmeFindArgument(ArgumentString, "ReadCacheKB"), 0);
+    if (cacheKb > NVME_CACHE_MAX_KB) {
+        cacheKb = NVME_CACHE_MAX_KB;
+    }
+    DevExt->ReadCacheSlots = 0;
+    if ((cacheKb >> (NVME_PAGE_SHIFT - 10)) != 0) {
+        DevExt->ReadCacheSlots = 1UL << log2(cacheKb >> (NVME_PAGE_SHIFT - 10));
+    }
+
+    // How long a SMART/Health log answers monitoring polls, 0 sends every one to the device
+    DevExt->SmartCacheMs = NvmeArgumentToUlong(
+        NvmeFindArgument(ArgumentString, "SmartCacheMs"), NVME_SMART_CACHE_MS);
+
+    // Wake-up latency budget for APST power states, 0 turns APST off
+    value = NvmeFindArgument(ArgumentString, "ApstLatencyUs");
+    if (value && NvmeArgumentIs(value, "firmware")) {
+        DevExt->ApstLatencyUs = NVME_APST_FIRMWARE;
+    } else {
+        DevExt->ApstLatencyUs = NvmeArgumentToUlong(value, NVME_APST_LATENCY_US);
+    }
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: DriverParameter '%s' - scheduler %s, read %u ms, write %u ms, write cap %u KB, latency target %u us, 512e %u, read cache %u slots, SMART cache %u ms, APST budget %u us\n",
+                   ArgumentString ? ArgumentString : "",
+                   DevExt->IoScheduler == NVME_SCHED_DEADLINE ? "deadline" : "none",
+                   DevExt->ReadExpireMs, DevExt->WriteExpireMs, writeCapKb, DevExt->LatencyTargetUs,
+                   DevExt->Emulate512, DevExt->ReadCacheSlots, DevExt->SmartCacheMs, DevExt->ApstLatencyUs);
+#endif
+}
+
 //
 // HwFindAdapter - Locate and configure the adapter
 //
@@ -467,6 +554,7 @@ scanloop:
             ScsiDebugPrint(0, "nvme2k: HwFindAdapter - uh oh no HwContext! are we going to scan whole thing again?\n");
         }
 #endif
+        ParseDriverParameters(DevExt, ArgumentString);
         return HwFoundAdapter(DevExt, ConfigInfo, pciBuffer);
     }
 #ifdef NVME2K_DBG
@@ -534,12 +622,14 @@ BOOLEAN HwStartIo(IN PVOID DeviceExtension, IN PSCSI_REQUEST_BLOCK Srb)
     }
 #endif
 
-    // Check if the request is for our device (PathId=0, TargetId=0, Lun=0)
-    if (Srb->PathId != 0 || Srb->TargetId != 0 || Srb->Lun != 0) {
+    // Check if the request is for our device (PathId=0, TargetId=0, Lun=one per active namespace)
+    // LUN 0 is always accepted so SRBs sent before init completes still see the device
+    if (Srb->PathId != 0 || Srb->TargetId != 0 ||
+        (Srb->Lun != 0 && Srb->Lun >= DevExt->NamespaceCount)) {
         // Not our device - distinguish between invalid target and invalid LUN
         if (Srb->Function == SRB_FUNCTION_EXECUTE_SCSI) {
-            // Check if this is an invalid LUN on our target (Path=0, Target=0, but Lun != 0)
-            if (Srb->PathId == 0 && Srb->TargetId == 0 && Srb->Lun != 0) {
+            // Check if this is an invalid LUN on our target (Path=0, Target=0, no namespace behind Lun)
+            if (Srb->PathId == 0 && Srb->TargetId == 0) {
                 // Invalid LUN on our target - return error with sense data
                 PSENSE_DATA senseBuffer;
 
@@ -627,6 +717,10 @@ BOOLEAN HwStartIo(IN PVOID DeviceExtension, IN PSCSI_REQUEST_BLOCK Srb)
                 case SCSIOP_MODE_SENSE:
                 case SCSIOP_MODE_SENSE10:
                     return ScsiHandleModeSense(DevExt, Srb);
+
+                case SCSIOP_MODE_SELECT:
+                case SCSIOP_MODE_SELECT10:
+                    return ScsiHandleModeSelect(DevExt, Srb);
                     
                 case SCSIOP_START_STOP_UNIT:
                     // Accept but do nothing
@@ -803,10 +897,28 @@ BOOLEAN HwInterrupt(IN PVOID DeviceExtension)
 BOOLEAN HwResetBus(IN PVOID DeviceExtension, IN ULONG PathId)
 {
     PHW_DEVICE_EXTENSION DevExt = (PHW_DEVICE_EXTENSION)DeviceExtension;
+    ULONG i;
 
     // TODO: Reset the SCSI bus
     // Perform hardware reset
 
+    // Staged SRBs never reached the device, ScsiPort completes them below
+    ScsiFlushStagedSrbs(DevExt);
+
+    // Commands still on the device complete into CIDs without an SRB
+    NvmeDetachIoRequests(DevExt);
+
+    // Admin ones too, and SMART requests sharing a Get Log Page stop waiting on it
+    for (i = 0; i < NVME_MAX_ADMIN_COMMANDS; i++) {
+        DevExt->AdminRequests[i].Srb = NULL;
+    }
+    NvmeSmartLogReset(DevExt);
+
+    // ScsiPort completes every SRB below, none is left to wait for
+    DevExt->OrderedInFlight = NULL;
+    DevExt->NonTaggedInFlight = NULL;
+    DevExt->Busy = FALSE;
+
     // Complete all outstanding requests
     ScsiPortCompleteRequest(DeviceExtension, (UCHAR)PathId, 
                            SP_UNTAGGED, SP_UNTAGGED,
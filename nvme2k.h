@@ -13,6 +13,7 @@
 #include <ntdddisk.h>
 #include "nvme.h"
 #include "scsiext.h"
+#include "nvme2kdb.h"
 
 //#define NVME2K_DBG
 // extra spammy logging for NVMe commands
@@ -96,22 +97,222 @@ typedef struct _NVME_QUEUE {
     ULONG reserved2;
 } NVME_QUEUE, *PNVME_QUEUE;
 
-// Command ID encoding
-// Bit 15: Set for non-tagged request
-// Bit 14: Set for ORDERED flush (used with bit 15 clear)
-// Bits 0-13: QueueTag (tagged) or sequence number (non-tagged)
-#define CID_NON_TAGGED_FLAG 0x8000
-#define CID_ORDERED_FLUSH_FLAG 0x4000
-#define CID_VALUE_MASK      0x3FFF
-
 //
 // SRB Extension - per-request data stored by ScsiPort
+// Per-command state (CID, PRP list, kind) lives in DevExt->IoRequests
 //
 typedef struct _NVME_SRB_EXTENSION {
-    UCHAR PrpListPage;              // Which PRP list page is allocated (0xFF if none)
-    UCHAR Reserved[3];              // Padding for alignment
+    ULONGLONG StageTime;            // Staging queue: NvmeReadTimestamp() when it was staged
+    struct _SCSI_REQUEST_BLOCK *NextStaged; // Staging queue: next SRB in arrival order
+    ULONG FlushGeneration;          // Device flush or deallocate: WriteGeneration when it was submitted
+    struct _SCSI_REQUEST_BLOCK *NextWaiter; // Device flush: chain of flushes piggybacking on it
+    ULONGLONG SplitLba;             // Split I/O (512e or NOIOB): first SCSI LBA
+    ULONG SplitBlocks;              // Split I/O: SCSI logical blocks
+    UCHAR SplitPending;             // Split I/O: NVMe commands still outstanding
+    UCHAR SplitStatus;              // Split I/O: first NVMe error status
+    UCHAR Reserved[2];
 } NVME_SRB_EXTENSION, *PNVME_SRB_EXTENSION;
 
+//
+// Staging queue bound - I/O SRBs held in the driver while the SQ, CID table or
+// PRP pool is exhausted. ScsiPort is only asked for more while there is room.
+//
+#define NVME_MAX_STAGED_REQUESTS    64
+
+// Staged plus scheduler queued SRBs share the bound
+#define NVME_STAGING_FULL(DevExt) \
+    ((DevExt)->StagedCount + (DevExt)->SchedQueued >= NVME_MAX_STAGED_REQUESTS)
+
+//
+// I/O scheduler, picked at load time with IoScheduler= in DriverParameter
+// NONE submits in arrival order. DEADLINE holds SIMPLE tagged reads and writes in
+// separate FIFOs, prefers reads, and lets a write go first once it has waited
+// WriteExpireMs or NVME_SCHED_WRITES_STARVED reads went ahead of it. While reads
+// wait, no more than WriteInFlightKB of writes are outstanding.
+//
+#define NVME_SCHED_NONE             0
+#define NVME_SCHED_DEADLINE         1
+
+#define NVME_SCHED_READ_EXPIRE_MS   50      // DriverParameter ReadExpireMs
+#define NVME_SCHED_WRITE_EXPIRE_MS  500     // DriverParameter WriteExpireMs
+#define NVME_SCHED_WRITE_CAP_KB     1024    // DriverParameter WriteInFlightKB
+#define NVME_SCHED_WRITES_STARVED   16      // reads dispatched past a waiting write (no clock on non-x86)
+
+//
+// Adaptive queue depth, enabled with LatencyTargetUs= in DriverParameter
+// Read/write submissions beyond QueueDepthLimit are staged. The limit moves
+// between NVME_QD_LIMIT_MIN and NVME_MAX_QUEUE_SIZE to hold the latency target.
+// Needs a timestamp source, the limit stays at NVME_MAX_QUEUE_SIZE otherwise.
+//
+#define NVME_QD_LIMIT_MIN           2
+
+//
+// I/O queue Command IDs
+// CIDs are driver allocated indexes into DevExt->IoRequests, independent of
+// the SRB QueueTag, so completion is a plain array access.
+//
+#define NVME_MAX_IO_COMMANDS    NVME_MAX_QUEUE_SIZE
+#define NVME_IO_CID_NONE        0xFFFF
+
+//
+// I/O request kinds
+//
+#define IO_KIND_FREE            0
+#define IO_KIND_READ            1
+#define IO_KIND_WRITE           2   // Write
+#define IO_KIND_FLUSH           3   // NVMe Flush for SYNCHRONIZE CACHE / SRB flush
+#define IO_KIND_SPLIT_READ      4   // Piece of an unaligned 512e or boundary crossing read
+#define IO_KIND_SPLIT_WRITE     5   // Piece of an unaligned 512e or boundary crossing write
+#define IO_KIND_RMW_READ        6   // Read of a partial block, becomes its IO_KIND_SPLIT_WRITE
+#define IO_KIND_CACHE_FILL      7   // Read of a whole read cache chunk, Segment is the slot
+#define IO_KIND_DEALLOCATE      8   // TRIM pattern pages of a write (DSM deallocate), range list in PrpListPage,
+                                    // completes as an IO_KIND_SPLIT_WRITE piece
+#define IO_KIND_DSM             9   // NVME2KDB DEALLOCATE IOCTL or SAT ATA TRIM, range list in PrpListPage,
+                                    // Segment is the LUN
+#define IO_KIND_USER            10  // NvmeMini I/O queue command, data in the SRB buffer, Segment is the LUN
+#define IO_KIND_COPY            11  // NVME2KDB COPY through the Copy command, source ranges in PrpListPage
+#define IO_KIND_COPY_READ       12  // NVME2KDB COPY without it: read into PrpListPage and Segment (second page),
+#define IO_KIND_COPY_WRITE      13  // then written from there on the same CID
+
+//
+// Pieces of an unaligned 512e read or write (NVME_IO_REQUEST.Segment)
+// Whole device blocks go to the SRB buffer directly, a partially covered block
+// at either end goes through a bounce page held in PrpListPage.
+//
+#define NVME_SPLIT_MIDDLE       0   // whole device blocks, straight to the SRB buffer
+#define NVME_SPLIT_HEAD         1   // partial first block
+#define NVME_SPLIT_TAIL         2   // partial last block
+#define NVME_SPLIT_ONLY         3   // the whole transfer is inside one block
+
+//
+// Pieces of an aligned read or write that crosses the namespace's optimal I/O
+// boundary (NOIOB): NVME_SPLIT_PIECE + n is piece n, straight to the SRB buffer.
+// Transfers that would need more pieces than NVME_MAX_BOUNDARY_PIECES go whole.
+//
+#define NVME_SPLIT_PIECE        4
+#define NVME_MAX_BOUNDARY_PIECES 8
+#define NVME_SPLIT_BOUNCED(Segment) ((Segment) != NVME_SPLIT_MIDDLE && (Segment) < NVME_SPLIT_PIECE)
+
+//
+// TRIM mode (NVME2KDB_IOCTL_TRIM_MODE_ON): the 4KB pages of a write that hold the
+// pattern are deallocated instead of written. The write is cut into runs of
+// pattern and other pages; all pattern runs go as one DSM (IO_KIND_DEALLOCATE),
+// each other run as its own write (IO_KIND_SPLIT_WRITE, NVME_SPLIT_MIDDLE). A write
+// that would take more than NVME_MAX_BOUNDARY_PIECES commands is written whole.
+//
+#define NVME_TRIM_PAGE_SIZE     4096
+#define NVME_TRIM_MAX_RUNS      (2 * NVME_MAX_BOUNDARY_PIECES)
+
+typedef struct _NVME_TRIM_RUN {
+    ULONGLONG DeviceLba;                // first device LBA of the run
+    ULONG Offset;                       // bytes into the SRB buffer
+    ULONG Length;                       // bytes, whole device blocks
+    BOOLEAN Pattern;                    // TRUE: deallocate, FALSE: write
+    UCHAR Reserved[7];
+} NVME_TRIM_RUN, *PNVME_TRIM_RUN;
+
+typedef struct _NVME_IO_REQUEST {
+    ULONGLONG SubmitTime;               // NvmeReadTimestamp() when submitted to the SQ
+    struct _SCSI_REQUEST_BLOCK *Srb;    // Request to complete
+    UCHAR Kind;                         // IO_KIND_*, IO_KIND_FREE if CID unused
+    UCHAR PrpListPage;                  // PRP list page or bounce page (0xFF if none)
+    UCHAR Segment;                      // NVME_SPLIT_* for IO_KIND_SPLIT_* and IO_KIND_RMW_READ,
+                                        // read cache slot for IO_KIND_CACHE_FILL, LUN for IO_KIND_DSM and IO_KIND_USER,
+                                        // second bounce page (0xFF if none) for IO_KIND_COPY_READ/WRITE
+    UCHAR Reserved;
+} NVME_IO_REQUEST, *PNVME_IO_REQUEST;
+
+//
+// Read cache (ReadCacheKB in DriverParameter, see nvme2k_cache.c)
+// Direct mapped, one NVME_PAGE_SIZE chunk of a LUN per slot. The slot pages live
+// in the uncached extension so a miss reads the whole chunk straight into its slot.
+//
+#define NVME_CACHE_MAX_KB       1024
+#define NVME_CACHE_FREE         0
+#define NVME_CACHE_VALID        1
+#define NVME_CACHE_FILLING      2   // fill read outstanding
+#define NVME_CACHE_NO_SLOT      0xFFFFFFFF
+
+typedef struct _NVME_CACHE_ENTRY {
+    ULONGLONG Lba;                      // SCSI LBA of the first block of the chunk
+    UCHAR Lun;
+    UCHAR State;                        // NVME_CACHE_*
+    BOOLEAN Stale;                      // written to while filling, dropped when the fill completes
+    UCHAR Reserved[5];
+} NVME_CACHE_ENTRY, *PNVME_CACHE_ENTRY;
+
+//
+// Deallocated extent map (see nvme2k_cache.c)
+// Ranges of a LUN known to read back as zeroes: deallocated by a successful DSM
+// and not written since. Merged on insert; when all slots are in use the smallest
+// extent gives way, so the map only ever forgets ranges.
+//
+#define NVME_MAX_DEALLOC_EXTENTS 32
+
+typedef struct _NVME_DEALLOC_EXTENT {
+    ULONGLONG Start;                    // first SCSI LBA
+    ULONGLONG End;                      // SCSI LBA after the last one, 0 if the slot is free
+    UCHAR Lun;
+    UCHAR Reserved[7];
+} NVME_DEALLOC_EXTENT, *PNVME_DEALLOC_EXTENT;
+
+//
+// SMART/Health log cache (SmartCacheMs in DriverParameter, see nvme2k_cache.c)
+// LOG SENSE, SAT SMART READ DATA and the SMART IOCTL are answered from the last
+// SMART/Health log for SmartCacheMs, and share one Get Log Page when it is stale.
+//
+#define NVME_SMART_CACHE_MS         10000
+#define NVME_SMART_LOG_BUSY         0   // no admin slot or PRP page, retry later
+#define NVME_SMART_LOG_CACHED       1   // answered from the cache, SrbStatus set
+#define NVME_SMART_LOG_PENDING      2   // completed from NvmeProcessGetLogPageCompletion
+
+//
+// Autonomous power state transitions (ApstLatencyUs in DriverParameter, see NvmeConfigureApst)
+// Only non-operational states whose entry + exit latency fits the budget are used,
+// a state is entered after NVME_APST_IDLE_FACTOR times its latency of idle time.
+// ApstLatencyUs=0 turns APST off, ApstLatencyUs=firmware leaves the drive's setting.
+//
+#define NVME_APST_LATENCY_US        2000
+#define NVME_APST_FIRMWARE          0xFFFFFFFF
+#define NVME_APST_IDLE_FACTOR       50
+
+// Namespaces
+// Every active namespace is its own LUN on target 0, in active NSID list order:
+// LUN n is DevExt->Namespaces[n]. Flush elision state lives here too, an NVMe
+// Flush only covers the namespace it is sent to.
+// BlockSize and SizeInBlocks are what SCSI sees. A namespace formatted with LBAs
+// larger than 512 bytes (up to NVME_PAGE_SIZE) is reported as 512e unless
+// Emulate512=0: 512-byte logical blocks, device LBA = SCSI LBA >> LbaShift.
+//
+#define NVME_MAX_NAMESPACES     8   // ScsiPort scans LUNs 0-7
+
+typedef struct _NVME_NAMESPACE {
+    ULONGLONG SizeInBlocks;             // NSZE << LbaShift, 0 if not identified (LUN not ready)
+    ULONG NamespaceId;                  // NSID
+    ULONG BlockSize;                    // Logical block size in bytes (LBA data size >> LbaShift)
+    UCHAR Features;                     // NSFEAT
+    UCHAR FormattedLbaSize;             // FLBAS
+    UCHAR LbaShift;                     // log2(512-byte blocks per device LBA), 0 if not emulated
+    UCHAR NumberOfLbaFormats;           // NLBAF + 1
+    ULONG WriteGeneration;              // bumped on every write completion
+    ULONG FlushedGeneration;            // WriteGeneration covered by last good flush
+    ULONG WritesOutstanding;            // writes submitted, not yet completed
+    struct _SCSI_REQUEST_BLOCK *FlushInFlight; // newest outstanding device flush
+    ULONG OptimalWriteBlocks;           // NOWS + 1 in device LBAs, 0 if not reported
+    UCHAR BoundaryShift;                // log2(NOIOB), 0 if none or not a power of two
+    UCHAR PhysicalShift;                // log2(logical blocks per preferred write unit)
+    BOOLEAN DeallocReadsZero;           // DLFEAT: deallocated blocks read back as zeroes
+    BOOLEAN DeallocDeterministic;       // DLFEAT: deallocated blocks read back as zeroes or as ones
+    ULONG MaxCopyBlocks;                // MCL in device LBAs, 0 if the namespace can't take a Copy command
+    USHORT MaxCopyRangeBlocks;          // MSSRL in device LBAs
+    USHORT MaxCopyRanges;               // MSRC + 1, at most NVME_COPY_MAX_RANGES
+    NVME_LBA_FORMAT LbaFormats[NVME_MAX_LBA_FORMATS]; // LBAF table from Identify Namespace
+} NVME_NAMESPACE, *PNVME_NAMESPACE;
+
+// Namespace addressed by an SRB (HwStartIo only lets valid LUNs through)
+#define NVME_SRB_NAMESPACE(DevExt, Srb) \
+    (&(DevExt)->Namespaces[(Srb)->Lun < NVME_MAX_NAMESPACES ? (Srb)->Lun : 0])
+
 //
 // Admin Command IDs for initialization sequence
 // These double as both Command IDs and state tracking
@@ -119,19 +320,60 @@ typedef struct _NVME_SRB_EXTENSION {
 #define ADMIN_CID_CREATE_IO_CQ          1
 #define ADMIN_CID_CREATE_IO_SQ          2
 #define ADMIN_CID_IDENTIFY_CONTROLLER   3
-#define ADMIN_CID_IDENTIFY_NAMESPACE    4
-#define ADMIN_CID_INIT_COMPLETE         5
+#define ADMIN_CID_IDENTIFY_NS_LIST      4   // active NSID list, NSIDs 1..NN are scanned if it fails
+#define ADMIN_CID_IDENTIFY_NAMESPACE    5   // once per namespace
+#define ADMIN_CID_GET_FEATURES_VWC      6   // only sent if the controller has a volatile write cache
+#define ADMIN_CID_SET_FEATURES_AEC      7   // asynchronous event configuration, last step
+#define ADMIN_CID_SET_FEATURES_APST     8   // APST table, between identify controller and the namespace list
+#define ADMIN_CID_INIT_COMPLETE         9
 
 //
 // Admin Command IDs for post-init operations (must be > ADMIN_CID_INIT_COMPLETE)
+// Driver and userspace initiated admin commands get their own CID space:
+// CID = ADMIN_CID_TABLE_BASE + slot in DevExt->AdminRequests. The slot holds
+// the SRB and PRP page, so admin commands never use NonTaggedInFlight and
+// several can be outstanding alongside untagged I/O.
+//
+#define NVME_MAX_ADMIN_COMMANDS         8
+#define ADMIN_CID_TABLE_BASE            0x100
+#define ADMIN_CID_IS_TABLE(cid)         ((cid) >= ADMIN_CID_TABLE_BASE && \
+                                         (cid) < ADMIN_CID_TABLE_BASE + NVME_MAX_ADMIN_COMMANDS)
+
+//
+// Asynchronous Event Requests - kept outstanding once init completes, AERL + 1 of
+// them up to NVME_MAX_ASYNC_EVENTS. They never complete on their own, so they are
+// not in the admin request table: CID = ADMIN_CID_AER_BASE + bit in AsyncEventCids.
 //
-#define ADMIN_CID_GET_LOG_PAGE          (6|CID_NON_TAGGED_FLAG)   // Get Log Page (untagged, only one at a time)
+#define NVME_MAX_ASYNC_EVENTS           8
+#define ADMIN_CID_AER_BASE              0x200
+#define ADMIN_CID_IS_AER(cid)           ((cid) >= ADMIN_CID_AER_BASE && \
+                                         (cid) < ADMIN_CID_AER_BASE + NVME_MAX_ASYNC_EVENTS)
 
 //
-// Admin Command IDs for userspace initiated Samsung extension and NvmeMini operations
+// Admin request kinds - selects the completion handler
 //
-#define ADMIN_CID_USER_IDENTIFY         (7|CID_NON_TAGGED_FLAG)  // IDENTIFY from userspace via NvmeMini
-#define ADMIN_CID_USER_GET_LOG_PAGE     (8|CID_NON_TAGGED_FLAG)  // GET_LOG_PAGE same
+#define ADMIN_KIND_FREE                 0
+#define ADMIN_KIND_GET_LOG_PAGE         1   // SMART log for LOG SENSE, SAT and SMART IOCTL
+#define ADMIN_KIND_SET_FEATURES_VWC     2   // Set Features VWC from MODE SELECT
+#define ADMIN_KIND_USER_IDENTIFY        3   // IDENTIFY from userspace via NvmeMini
+#define ADMIN_KIND_USER_GET_LOG_PAGE    4   // GET_LOG_PAGE same
+#define ADMIN_KIND_FORMAT_NVM           5   // Format NVM from NVME2KDB FORMAT_BEST_LBAF
+#define ADMIN_KIND_FORMAT_IDENTIFY      6   // re-identify of the namespace after the format
+#define ADMIN_KIND_ASYNC_EVENT_LOG      7   // log page an asynchronous event asked for (no SRB)
+#define ADMIN_KIND_USER_FEATURES        8   // Get/Set Features from userspace via NvmeMini
+
+typedef struct _NVME_ADMIN_REQUEST {
+    struct _SCSI_REQUEST_BLOCK *Srb;    // Request to complete (NULL if none)
+    UCHAR Kind;                         // ADMIN_KIND_*, ADMIN_KIND_FREE if slot unused
+    UCHAR PrpListPage;                  // Data buffer PRP page (0xFF if none)
+    UCHAR LogPageId;                    // Get Log Page: LID
+    UCHAR Flags;                        // ADMIN_REQUEST_*
+    ULONG TransferOffset;               // NvmeMini: bytes of the caller's buffer done once this command completes
+    ULONG TransferLength;               // NvmeMini: bytes the caller asked for in total
+} NVME_ADMIN_REQUEST, *PNVME_ADMIN_REQUEST;
+
+// The data went straight into the caller's buffer, no PRP page to copy from
+#define ADMIN_REQUEST_DIRECT            0x01
 
 //
 // Admin Command IDs for shutdown sequence (special, non-colliding values)
@@ -173,7 +415,7 @@ typedef struct _HW_DEVICE_EXTENSION {
 
     // Command tracking
     PSCSI_REQUEST_BLOCK NonTaggedInFlight;          // Offset 0xB0 (176)
-    USHORT NextNonTaggedId;                         // Offset 0xB4 (180)
+    USHORT NextIoCommandId;                         // Offset 0xB4 (180) - where the next CID search starts
     BOOLEAN Busy;                                   // Offset 0xB6 (182)
     BOOLEAN InitComplete;                           // Offset 0xB7 (183)
 
@@ -213,12 +455,16 @@ typedef struct _HW_DEVICE_EXTENSION {
     UCHAR ControllerFirmwareRevision[9];            // Offset 0x156 (342)
     BOOLEAN SMARTEnabled;                           // Offset 0x15F (351)
     UCHAR MaxDataTransferSizePower;                 // Offset 0x160 (352) - MDTS from controller (power of 2)
-    UCHAR Reserved5_1[3];                           // Offset 0x161 (353) - alignment
+    UCHAR Reserved5_1;                              // Offset 0x161 (353) - alignment
+    USHORT OptionalNvmCommands;                     // Offset 0x162 (354) - Identify Controller ONCS
     ULONG MaxTransferSizeBytes;                     // Offset 0x164 (356) - Computed max transfer in bytes
 
-    // Namespace information
-    ULONGLONG NamespaceSizeInBlocks;                // Offset 0x168 (360) [8-byte aligned]
-    ULONG NamespaceBlockSize;                       // Offset 0x170 (368)
+    // Namespace information (LUN n = Namespaces[n])
+    ULONG NamespaceCount;                           // Offset 0x168 (360) - LUNs backed by a namespace
+    ULONG NamespaceInitIndex;                       // Offset 0x16C (364) - namespace being identified during init
+    USHORT OptionalAdminCommands;                   // Offset 0x170 (368) - Identify Controller OACS
+    UCHAR FormatNvmAttributes;                      // Offset 0x172 (370) - Identify Controller FNA
+    UCHAR Reserved5_2;                              // Offset 0x173 (371)
     ULONG UncachedExtensionOffset;                  // Offset 0x174 (372)
 
     // Uncached memory allocation
@@ -229,10 +475,144 @@ typedef struct _HW_DEVICE_EXTENSION {
 
     // TRIM mode support
     BOOLEAN TrimEnable;                             // Offset 0x18C (396)
-    UCHAR Reserved5[3];                             // Offset 0x18D (397) - 3 byte alignment
-    ULONG TrimPattern[1024];                        // Offset 0x190 (400) - 4KB pattern buffer [4-byte aligned]
 
-} HW_DEVICE_EXTENSION, *PHW_DEVICE_EXTENSION;       // Total size: 0x1190 (4496) bytes
+    // Volatile write cache state
+    BOOLEAN VolatileWriteCache;                     // Offset 0x18D (397) - Identify Controller VWC bit 0
+    BOOLEAN WriteCacheEnabled;                      // Offset 0x18E (398) - current Set Features 06h value
+    BOOLEAN WriteCacheRequested;                    // Offset 0x18F (399) - value of in-flight MODE SELECT
+    PULONG TrimPattern;                             // Offset 0x190 (400) - 4KB pattern page in the uncached extension
+    ULONG TrimFingerprint[2];                       // Offset 0x194 (404) - pattern dwords 0 and 1023, checked before the full compare
+    ULONG TrimPages;                                // Offset 0x19C (412) - 4KB write pages deallocated instead of written
+
+    // Flush elision (see ScsiHandleFlush, per namespace state is in Namespaces[])
+    ULONG FlushesIssued;                            // Offset 0x1A0 (416)
+    ULONG FlushesElided;                            // Offset 0x1A4 (420)
+    ULONG FlushesMerged;                            // Offset 0x1A8 (424)
+
+    // ORDERED tag barrier (see ScsiOrderedBarrier)
+    PSCSI_REQUEST_BLOCK OrderedInFlight;            // Offset 0x1AC (428) - submitted, nothing starts until done
+
+    // Staging queue (see ScsiStageSrb)
+    PSCSI_REQUEST_BLOCK StagedHead;                 // Offset 0x1B0 (432) - oldest staged SRB
+    PSCSI_REQUEST_BLOCK StagedTail;                 // Offset 0x1B4 (436)
+    PSCSI_REQUEST_BLOCK StagedRestarting;           // Offset 0x1B8 (440) - SRB being restarted by ScsiStartStagedSrbs
+    ULONG StagedCount;                              // Offset 0x1BC (444)
+    ULONG RequestsStaged;                           // Offset 0x1C0 (448) - total SRBs ever staged
+    ULONG MaxStagedDepth;                           // Offset 0x1C4 (452)
+    ULONG BusyReturned;                             // Offset 0x1C8 (456) - I/O SRBs handed back with SRB_STATUS_BUSY
+    ULONGLONG StagedTimeTotal;                      // Offset 0x1D0 (464) [8-byte aligned] - timestamp ticks
+    ULONGLONG StagedTimeMax;                        // Offset 0x1D8 (472) [8-byte aligned]
+
+    // Deadline I/O scheduler (see ScsiSchedDispatch)
+    ULONG IoScheduler;                              // Offset 0x1E0 (480) - NVME_SCHED_*
+    ULONG ReadExpireMs;                             // Offset 0x1E4 (484)
+    ULONG WriteExpireMs;                            // Offset 0x1E8 (488)
+    ULONG WriteBytesCap;                            // Offset 0x1EC (492) - write bytes in flight allowed while reads wait
+    ULONGLONG ReadExpireTicks;                      // Offset 0x1F0 (496) [8-byte aligned] - timestamp ticks, set after calibration
+    ULONGLONG WriteExpireTicks;                     // Offset 0x1F8 (504) [8-byte aligned]
+    PSCSI_REQUEST_BLOCK SchedReadHead;              // Offset 0x200 (512)
+    PSCSI_REQUEST_BLOCK SchedReadTail;              // Offset 0x204 (516)
+    PSCSI_REQUEST_BLOCK SchedWriteHead;             // Offset 0x208 (520)
+    PSCSI_REQUEST_BLOCK SchedWriteTail;             // Offset 0x20C (524)
+    ULONG SchedQueued;                              // Offset 0x210 (528) - SRBs in both FIFOs
+    ULONG WriteBytesInFlight;                       // Offset 0x214 (532)
+    ULONG WritesStarved;                            // Offset 0x218 (536) - reads dispatched while a write waited
+    ULONG WritesExpired;                            // Offset 0x21C (540) - writes sent ahead of waiting reads
+    ULONG WriteCapHits;                             // Offset 0x220 (544) - reads sent while the write cap held writes
+    ULONG ReadWaitHistogram[NVME2KDB_WAIT_BUCKETS]; // Offset 0x224 (548) - 32 bytes
+    ULONG WriteWaitHistogram[NVME2KDB_WAIT_BUCKETS]; // Offset 0x244 (580) - 32 bytes
+
+    // Adaptive queue depth (see NvmeThrottleSample)
+    ULONG QueueDepthLimit;                          // Offset 0x264 (612) - read/write commands allowed outstanding
+    ULONG LatencyTargetUs;                          // Offset 0x268 (616) - 0 if the limit is fixed
+    ULONG ThrottleWindowCount;                      // Offset 0x26C (620) - completions since the last adjustment
+    ULONGLONG LatencyTargetTicks;                   // Offset 0x270 (624) [8-byte aligned] - timestamp ticks, set after calibration
+    ULONGLONG LatencyEstimate;                      // Offset 0x278 (632) [8-byte aligned] - smoothed completion latency, ticks
+    ULONG ThrottleDecreases;                        // Offset 0x280 (640)
+    ULONG ThrottleIncreases;                        // Offset 0x284 (644)
+    BOOLEAN ThrottleLimitReached;                   // Offset 0x288 (648) - a submission hit the limit this window
+
+    // 512-byte sector emulation (see ScsiSubmitSplitReadWrite)
+    BOOLEAN Emulate512;                             // Offset 0x289 (649) - Emulate512 in DriverParameter, default on
+    UCHAR Reserved6[2];                             // Offset 0x28A (650) - alignment
+    ULONG UnalignedReads;                           // Offset 0x28C (652) - reads split around partial device blocks
+    ULONG RmwWrites;                                // Offset 0x290 (656) - writes that needed read-modify-write
+    ULONG BoundarySplits;                           // Offset 0x294 (660) - reads/writes split at NOIOB
+
+    // Read cache (see nvme2k_cache.c)
+    PHYSICAL_ADDRESS ReadCacheDataPhys;             // Offset 0x298 (664) [8-byte aligned]
+    PNVME_CACHE_ENTRY ReadCache;                    // Offset 0x2A0 (672) - slot table, NULL if off
+    PUCHAR ReadCacheData;                           // Offset 0x2A4 (676) - NVME_PAGE_SIZE per slot
+    ULONG ReadCacheSlots;                           // Offset 0x2A8 (680) - power of 2, 0 if off
+    ULONG ReadCacheHits;                            // Offset 0x2AC (684)
+    ULONG ReadCacheMisses;                          // Offset 0x2B0 (688) - cacheable reads sent to the device
+    ULONG ReadCacheInvalidations;                   // Offset 0x2B4 (692) - chunks dropped by writes, TRIM or format
+
+    // Deallocated extent map (see nvme2k_cache.c)
+    ULONG DeallocExtentCount;                       // Offset 0x2B8 (696) - slots in use
+    ULONG DeallocReads;                             // Offset 0x2BC (700) - reads zero-filled without device I/O
+    ULONG DeallocExtentsDropped;                    // Offset 0x2C0 (704) - ranges forgotten because the map was full
+    ULONG Reserved7;                                // Offset 0x2C4 (708) - alignment
+    NVME_DEALLOC_EXTENT DeallocExtents[NVME_MAX_DEALLOC_EXTENTS]; // Offset 0x2C8 (712) - 768 bytes [8-byte aligned]
+
+    // SMART/Health log cache (see nvme2k_cache.c)
+    ULONGLONG SmartLogTime;                         // Offset 0x5C8 (1480) [8-byte aligned] - timestamp of the last refresh
+    ULONGLONG SmartLogTtlTicks;                     // Offset 0x5D0 (1488) [8-byte aligned] - SmartCacheMs in timestamp ticks, 0 without a clock
+    PSCSI_REQUEST_BLOCK SmartLogRefresh;            // Offset 0x5D8 (1496) - SRB whose Get Log Page is outstanding, others wait on its NextWaiter chain
+    ULONG SmartCacheMs;                             // Offset 0x5DC (1500) - SmartCacheMs in DriverParameter, 0 if off
+    ULONG SmartLogGeneration;                       // Offset 0x5E0 (1504) - bumped by NvmeSmartLogInvalidate
+    ULONG SmartLogRefreshGeneration;                // Offset 0x5E4 (1508) - SmartLogGeneration when the refresh was sent
+    ULONG SmartLogHits;                             // Offset 0x5E8 (1512) - requests answered from the cache
+    ULONG SmartLogRefreshes;                        // Offset 0x5EC (1516) - Get Log Page commands sent
+    ULONG SmartLogMerged;                           // Offset 0x5F0 (1520) - requests that waited for an outstanding refresh
+    BOOLEAN SmartLogValid;                          // Offset 0x5F4 (1524)
+    UCHAR Reserved8[3];                             // Offset 0x5F5 (1525) - alignment
+    NVME_SMART_INFO SmartLog;                       // Offset 0x5F8 (1528) - 512 bytes
+
+    // Asynchronous events (see NvmeArmAsyncEvents)
+    ULONG AsyncEventsSupported;                     // Offset 0x7F8 (2040) - Identify Controller OAES
+    ULONG AsyncEventLimit;                          // Offset 0x7FC (2044) - AERs kept outstanding, 0 while shutting down
+    ULONG AsyncEventCids;                           // Offset 0x800 (2048) - bit n set: CID ADMIN_CID_AER_BASE + n outstanding
+    ULONG AsyncEventLogsPending;                    // Offset 0x804 (2052) - bit n set: log page n still to be read
+    ULONG AsyncEvents;                              // Offset 0x808 (2056) - events reported
+    ULONG AsyncEventsError;                         // Offset 0x80C (2060)
+    ULONG AsyncEventsHealth;                        // Offset 0x810 (2064)
+    ULONG AsyncEventsNotice;                        // Offset 0x814 (2068)
+    ULONG LastAsyncEvent;                           // Offset 0x818 (2072) - completion DW0 of the last event
+    UCHAR CriticalWarning;                          // Offset 0x81C (2076) - from the last SMART/Health log read
+
+    // Autonomous power state transitions (see NvmeConfigureApst)
+    UCHAR ApstStatus;                               // Offset 0x81D (2077) - NVME2KDB_APST_*
+    UCHAR PowerStateCount;                          // Offset 0x81E (2078) - Identify Controller NPSS + 1
+    UCHAR Reserved9;                                // Offset 0x81F (2079) - alignment
+    ULONG ApstLatencyUs;                            // Offset 0x820 (2080) - ApstLatencyUs in DriverParameter, NVME_APST_FIRMWARE to leave it
+    ULONG ApstStates;                               // Offset 0x824 (2084) - bit n set: power state n is an APST target
+    ULONG ApstIdleMs;                               // Offset 0x828 (2088) - idle time before PS0 steps down
+    ULONG ApstWakeUs;                               // Offset 0x82C (2092) - entry + exit latency of the deepest target
+
+    // Identify Controller LPA, NVME_LPA_EXTENDED_DATA lets NvmeMini read large logs in pieces
+    UCHAR LogPageAttributes;                        // Offset 0x830 (2096)
+    UCHAR Reserved10[3];                            // Offset 0x831 (2097) - alignment
+
+    // Outstanding post-init admin commands, indexed by CID - ADMIN_CID_TABLE_BASE
+    NVME_ADMIN_REQUEST AdminRequests[NVME_MAX_ADMIN_COMMANDS]; // Offset 0x834 (2100) - 128 bytes
+
+    // Timestamps for per-command latency (see NvmeReadTimestamp)
+    ULONG TimestampTicksPerMs;                      // Offset 0x8B4 (2228) - 0 if timestamps are only a sequence
+    ULONGLONG TimestampSequence;                    // Offset 0x8B8 (2232) [8-byte aligned]
+
+    // Namespaces exposed as LUNs
+    NVME_NAMESPACE Namespaces[NVME_MAX_NAMESPACES]; // Offset 0x8C0 (2240) - 960 bytes [8-byte aligned]
+
+    // Outstanding I/O commands, indexed by CID
+    NVME_IO_REQUEST IoRequests[NVME_MAX_IO_COMMANDS]; // Offset 0xC80 (3200) - 1024 bytes [8-byte aligned]
+
+} HW_DEVICE_EXTENSION, *PHW_DEVICE_EXTENSION;       // Total size: 0x1080 (4224) bytes
+
+//
+// Flushes only matter when the controller has a volatile write cache and it is enabled
+//
+#define NVME_WRITE_CACHE_ACTIVE(DevExt) ((DevExt)->VolatileWriteCache && (DevExt)->WriteCacheEnabled)
 
 //
 // Forward declarations of miniport entry points
@@ -282,29 +662,67 @@ BOOLEAN NvmeSanitizeController(IN PHW_DEVICE_EXTENSION DevExt);
 BOOLEAN NvmeInitializeController(IN PHW_DEVICE_EXTENSION DevExt);
 VOID NvmeEnableInterrupts(IN PHW_DEVICE_EXTENSION DevExt);
 VOID FallbackTimer(IN PVOID DeviceExtension);
-VOID NvmeProcessGetLogPageCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT status, USHORT commandId);
+VOID NvmeProcessGetLogPageCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status);
+BOOLEAN NvmeConfigureAsyncEvents(IN PHW_DEVICE_EXTENSION DevExt);
+BOOLEAN NvmeConfigureApst(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IDENTIFY_CONTROLLER CtrlData);
+VOID NvmeArmAsyncEvents(IN PHW_DEVICE_EXTENSION DevExt);
 BOOLEAN NvmeProcessIoCompletion(IN PHW_DEVICE_EXTENSION DevExt);
 VOID NvmeRingDoorbell(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT QueueId, IN BOOLEAN IsSubmission, IN USHORT Value);
 BOOLEAN NvmeCreateIoCQ(IN PHW_DEVICE_EXTENSION DevExt);
 BOOLEAN NvmeCreateIoSQ(IN PHW_DEVICE_EXTENSION DevExt);
 int NvmeBuildReadWriteCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_COMMAND Cmd, IN USHORT CommandId);
-USHORT NvmeBuildCommandId(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
-USHORT NvmeBuildFlushCommandId(IN PSCSI_REQUEST_BLOCK Srb);
-PSCSI_REQUEST_BLOCK NvmeGetSrbFromCommandId(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT CommandId);
+int NvmeBuildSplitCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_COMMAND Cmd, IN USHORT CommandId, IN BOOLEAN Fua);
+ULONGLONG NvmeGetSplitSegment(IN PNVME_NAMESPACE Namespace, IN PNVME_SRB_EXTENSION SrbExt, IN UCHAR Segment,
+                              OUT PULONG SrbOffset, OUT PULONG BounceOffset, OUT PULONG Length);
+ULONG NvmeTrimClassify(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, OUT PNVME_TRIM_RUN Runs);
+int NvmeBuildTrimDeallocCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_COMMAND Cmd, IN USHORT CommandId,
+                                IN PNVME_TRIM_RUN Runs, IN ULONG Count);
+int NvmeBuildTrimWriteCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_COMMAND Cmd, IN USHORT CommandId,
+                              IN PNVME_TRIM_RUN Run, IN BOOLEAN Fua);
+ULONG NvmeIoQueueFreeSlots(IN PHW_DEVICE_EXTENSION DevExt);
+USHORT NvmeAllocIoRequest(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR Kind);
+PNVME_IO_REQUEST NvmeGetIoRequest(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT CommandId);
+VOID NvmeFreeIoRequest(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IO_REQUEST Request);
+VOID NvmeDetachIoRequests(IN PHW_DEVICE_EXTENSION DevExt);
+USHORT NvmeAllocAdminRequest(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR Kind, IN BOOLEAN NeedPrpPage);
+PNVME_ADMIN_REQUEST NvmeGetAdminRequest(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT CommandId);
+VOID NvmeFreeAdminRequest(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request);
 BOOLEAN NvmeIdentifyController(IN PHW_DEVICE_EXTENSION DevExt);
-BOOLEAN NvmeIdentifyNamespace(IN PHW_DEVICE_EXTENSION DevExt);
-BOOLEAN NvmeIdentifyEx(IN PHW_DEVICE_EXTENSION DevExt, IN ULONG NamespaceId, IN ULONG CNS, IN USHORT CommandId, IN PSCSI_REQUEST_BLOCK Srb);
-BOOLEAN NvmeGetLogPageEx(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR LogPageId, IN ULONG NamespaceId, IN USHORT CommandId, IN ULONG NumDwords);
-VOID NvmeToAtaIdentify(IN PHW_DEVICE_EXTENSION DevExt, OUT PATA_IDENTIFY_DEVICE_STRUCT AtaIdentify);
+BOOLEAN NvmeIdentifyActiveNamespaces(IN PHW_DEVICE_EXTENSION DevExt);
+BOOLEAN NvmeIdentifyNamespace(IN PHW_DEVICE_EXTENSION DevExt, IN ULONG NamespaceId);
+BOOLEAN NvmeIdentifyEx(IN PHW_DEVICE_EXTENSION DevExt, IN ULONG NamespaceId, IN ULONG CNS, IN UCHAR Kind, IN PSCSI_REQUEST_BLOCK Srb);
+BOOLEAN NvmeGetFeatures(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR FeatureId, IN USHORT CommandId);
+BOOLEAN NvmeSetFeatures(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR FeatureId, IN ULONG Value, IN UCHAR Kind);
+BOOLEAN NvmeFlushWriteCache(IN PHW_DEVICE_EXTENSION DevExt);
+BOOLEAN NvmeUserFeatures(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PULONG Command,
+                         IN PVOID Data, IN ULONG DataLength);
+BOOLEAN NvmeFormatNvm(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN ULONG NamespaceId, IN UCHAR LbaFormat);
+int NvmeDeallocateRanges(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR Lun,
+                         IN PNVME2KDB_RANGE Ranges, IN ULONG Count, OUT PULONG RangesSent);
+int NvmeDeallocateAtaRanges(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb,
+                            IN PUCHAR Entries, IN ULONG Count, OUT PULONG RangesSent);
+BOOLEAN NvmeGetLogPageEx(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR LogPageId, IN ULONG NamespaceId, IN UCHAR Kind, IN ULONG NumDwords);
+BOOLEAN NvmeUserTransfer(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_ADMIN_REQUEST Request,
+                         IN UCHAR Kind, IN ULONG Offset, IN ULONG Length);
+int NvmeUserIoCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR Lun, IN ULONG Length);
+BOOLEAN NvmeCopyStart(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME2KDB_COPY Copy);
+ULONG NvmeBuildCopyPieceCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IO_REQUEST Request, IN PNVME2KDB_COPY Copy,
+                                IN PNVME_COMMAND Cmd, IN USHORT CommandId);
+VOID NvmeToAtaIdentify(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_NAMESPACE Namespace, OUT PATA_IDENTIFY_DEVICE_STRUCT AtaIdentify);
+BOOLEAN NvmeLbaFormatUsable(IN PNVME_LBA_FORMAT LbaFormat);
+UCHAR NvmeBestLbaFormat(IN PNVME_NAMESPACE Namespace);
+VOID NvmeToLbaFormats(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_NAMESPACE Namespace, IN OUT PNVME2KDB_LBA_FORMATS Formats);
 BOOLEAN NvmeLogPageToScsiLogPage(IN PNVME_SMART_INFO NvmeSmart, IN UCHAR ScsiPageCode, OUT PVOID ScsiLogBuffer, IN ULONG BufferSize, OUT PULONG BytesWritten);
 
 // SCSI helper functions
 BOOLEAN ScsiParseSatCommand(IN PSCSI_REQUEST_BLOCK Srb, OUT PUCHAR AtaCommand, OUT PUCHAR AtaFeatures, OUT PUCHAR AtaCylLow, OUT PUCHAR AtaCylHigh);
 UCHAR ScsiGetLogPageCodeFromSrb(IN PSCSI_REQUEST_BLOCK Srb);
+BOOLEAN ScsiParseReadWriteCdb(IN PSCSI_REQUEST_BLOCK Srb, OUT PULONGLONG Lba, OUT PULONG NumBlocks, OUT PBOOLEAN Fua);
 
 // helpers for completing SRBs
 BOOLEAN ScsiSuccess(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
 BOOLEAN ScsiBusy(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
+BOOLEAN ScsiOrderedBusy(IN PHW_DEVICE_EXTENSION DevExt);
 BOOLEAN ScsiError(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR SrbStatus);
 BOOLEAN ScsiPending(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Sr, IN int Next);
 
@@ -326,15 +744,25 @@ BOOLEAN ScsiHandleReadCapacity(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_
 BOOLEAN ScsiHandleReadCapacity16(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
 BOOLEAN ScsiHandleReadWrite(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
 BOOLEAN ScsiHandleFlush(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
+VOID ScsiStartStagedSrbs(IN PHW_DEVICE_EXTENSION DevExt);
+VOID ScsiFlushStagedSrbs(IN PHW_DEVICE_EXTENSION DevExt);
+VOID ScsiSchedDispatch(IN PHW_DEVICE_EXTENSION DevExt);
 BOOLEAN ScsiHandleLogSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
 BOOLEAN ScsiHandleSatPassthrough(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
 BOOLEAN ScsiHandleModeSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
+BOOLEAN ScsiHandleModeSelect(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
 BOOLEAN ScsiHandleReadDefectData10(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
 
 //
 // Completion handlers
 //
-VOID NvmeProcessUserExtensionCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT commandId, IN USHORT status, IN PNVME_COMPLETION cqEntry);
+VOID NvmeProcessFlushCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN USHORT status);
+VOID NvmeProcessSetFeaturesCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status);
+BOOLEAN NvmeProcessUserExtensionCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status, IN PNVME_COMPLETION cqEntry);
+VOID NvmeProcessUserFeaturesCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status, IN PNVME_COMPLETION cqEntry);
+VOID NvmeProcessUserIoCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IO_REQUEST Request, IN USHORT status, IN PNVME_COMPLETION cqEntry);
+VOID NvmeProcessFormatCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status);
+VOID NvmeProcessFormatIdentifyCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status);
 
 //
 // PRP list page allocator
@@ -344,6 +772,51 @@ VOID FreePrpListPage(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR PageIndex);
 PVOID GetPrpListPageVirtual(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR PageIndex);
 PHYSICAL_ADDRESS GetPrpListPagePhysical(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR PageIndex);
 
+//
+// Read cache, deallocated extent map and SMART/Health log cache
+//
+ULONG NvmeCacheMemorySize(IN PHW_DEVICE_EXTENSION DevExt);
+VOID NvmeCacheInitialize(IN PHW_DEVICE_EXTENSION DevExt);
+BOOLEAN NvmeCacheLookup(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
+ULONG NvmeCacheClaimSlot(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
+VOID NvmeCacheReleaseSlot(IN PHW_DEVICE_EXTENSION DevExt, IN ULONG Slot);
+VOID NvmeBuildCacheFillCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_COMMAND Cmd, IN USHORT CommandId);
+VOID NvmeProcessCacheFillCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IO_REQUEST Request, IN USHORT status);
+VOID NvmeCacheInvalidate(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun, IN ULONGLONG Lba, IN ULONGLONG Blocks);
+VOID NvmeCacheInvalidateSrb(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
+VOID NvmeCacheInvalidateLun(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun);
+VOID NvmeCacheReset(IN PHW_DEVICE_EXTENSION DevExt);
+VOID NvmeDeallocReset(IN PHW_DEVICE_EXTENSION DevExt);
+BOOLEAN NvmeDeallocLookup(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
+VOID NvmeDeallocAdd(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun, IN ULONGLONG Lba, IN ULONGLONG Blocks);
+VOID NvmeDeallocRemove(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun, IN ULONGLONG Lba, IN ULONGLONG Blocks);
+VOID NvmeDeallocRemoveSrb(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
+BOOLEAN NvmeCacheInvalidateUserIo(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun, IN PULONG Command);
+VOID NvmeCacheInvalidateCopy(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME2KDB_COPY Copy, IN ULONGLONG Blocks);
+VOID NvmeDeallocRecord(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR Lun, IN ULONGLONG Lba, IN ULONGLONG Blocks);
+VOID NvmeProcessDeallocCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IO_REQUEST Request, IN UCHAR Lun,
+                                  IN ULONG Count, IN USHORT status);
+VOID NvmeProcessDsmCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IO_REQUEST Request, IN USHORT status);
+VOID NvmeSmartLogReset(IN PHW_DEVICE_EXTENSION DevExt);
+VOID NvmeSmartLogInvalidate(IN PHW_DEVICE_EXTENSION DevExt);
+VOID NvmeSmartLogStore(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_SMART_INFO NvmeSmart);
+UCHAR NvmeSmartLogRequest(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb);
+VOID NvmeSmartLogFillSrb(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_SMART_INFO NvmeSmart);
+
+//
+// Timestamps
+//
+ULONGLONG NvmeReadTimestamp(IN PHW_DEVICE_EXTENSION DevExt);
+VOID NvmeCalibrateTimestamp(IN PHW_DEVICE_EXTENSION DevExt);
+ULONGLONG NvmeTimestampToUs(IN PHW_DEVICE_EXTENSION DevExt, IN ULONGLONG Ticks);
+
+//
+// Load-time parameters (DriverParameter registry string)
+//
+PCHAR NvmeFindArgument(IN PCHAR ArgumentString, IN PCHAR Key);
+BOOLEAN NvmeArgumentIs(IN PCHAR Value, IN PCHAR Keyword);
+ULONG NvmeArgumentToUlong(IN PCHAR Value, IN ULONG Default);
+
 //
 // Uncached memory allocator
 //
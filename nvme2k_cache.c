@@ -0,0 +1,769 @@
+// driver side read cache, deallocated extent map and SMART/Health log cache
+#include "nvme2k.h"
+#include "utils.h"
+
+//
+// Read cache (ReadCacheKB in DriverParameter, off by default)
+// Small reads that fall inside one NVME_PAGE_SIZE chunk of a LUN (file system
+// metadata, directory blocks, boot sector probes) are remembered per chunk in a
+// direct mapped table, so the next read of the same chunk completes in HwStartIo
+// without an NVMe command. A miss reads the whole chunk into its slot page
+// (IO_KIND_CACHE_FILL) and copies the requested blocks out when it completes.
+//
+// Everything that changes blocks drops the chunks they are in: writes when
+// ScsiHandleReadWrite accepts them and again when they complete (a fill sent in
+// between may have read the old data), TRIM-converted writes with them, and the
+// whole LUN on Format NVM. A chunk written to while its fill is outstanding is
+// marked Stale and not kept.
+//
+
+//
+// NvmeCacheMemorySize - Uncached extension bytes the read cache needs
+// (slot pages, then the slot table), 0 if it is off
+//
+ULONG NvmeCacheMemorySize(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    ULONG tableSize;
+
+    if (DevExt->ReadCacheSlots == 0) {
+        return 0;
+    }
+    tableSize = DevExt->ReadCacheSlots * sizeof(NVME_CACHE_ENTRY);
+    tableSize = (tableSize + NVME_PAGE_SIZE - 1) & ~(NVME_PAGE_SIZE - 1);
+    return (DevExt->ReadCacheSlots << NVME_PAGE_SHIFT) + tableSize;
+}
+
+//
+// NvmeCacheInitialize - Carve the slot pages and table out of the uncached extension
+// Runs after the queues and the PRP pool have their memory; the cache is turned off
+// if what is left isn't enough.
+//
+VOID NvmeCacheInitialize(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    PVOID table;
+    PHYSICAL_ADDRESS tablePhys;
+
+    DevExt->ReadCache = NULL;
+    DevExt->ReadCacheData = NULL;
+    DevExt->ReadCacheHits = 0;
+    DevExt->ReadCacheMisses = 0;
+    DevExt->ReadCacheInvalidations = 0;
+    if (DevExt->ReadCacheSlots == 0) {
+        return;
+    }
+
+    if (!AllocateUncachedMemory(DevExt, DevExt->ReadCacheSlots << NVME_PAGE_SHIFT, NVME_PAGE_SIZE,
+                                (PVOID *)&DevExt->ReadCacheData, &DevExt->ReadCacheDataPhys) ||
+        !AllocateUncachedMemory(DevExt, DevExt->ReadCacheSlots * sizeof(NVME_CACHE_ENTRY), 8,
+                                &table, &tablePhys)) {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: NvmeCacheInitialize - no room for %u slots, read cache off\n",
+                       DevExt->ReadCacheSlots);
+#endif
+        DevExt->ReadCacheData = NULL;
+        DevExt->ReadCacheSlots = 0;
+        return;
+    }
+    DevExt->ReadCache = (PNVME_CACHE_ENTRY)table;
+    NvmeCacheReset(DevExt);
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: NvmeCacheInitialize - %u KB read cache, %u slots\n",
+                   DevExt->ReadCacheSlots << (NVME_PAGE_SHIFT - 10), DevExt->ReadCacheSlots);
+#endif
+}
+
+//
+// NvmeCacheReset - Forget everything, used when outstanding fills are thrown away
+//
+VOID NvmeCacheReset(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    if (DevExt->ReadCache != NULL) {
+        memset(DevExt->ReadCache, 0, DevExt->ReadCacheSlots * sizeof(NVME_CACHE_ENTRY));
+    }
+}
+
+//
+// NvmeCacheBlocksPerChunk - Logical blocks per chunk of a namespace, 0 if its
+// blocks (or device LBAs on 512e) are larger than a chunk
+//
+static ULONG NvmeCacheBlocksPerChunk(IN PNVME_NAMESPACE Namespace)
+{
+    if (Namespace->BlockSize == 0 ||
+        (Namespace->BlockSize << Namespace->LbaShift) > NVME_PAGE_SIZE) {
+        return 0;
+    }
+    return NVME_PAGE_SIZE / Namespace->BlockSize;
+}
+
+//
+// NvmeCacheSlot - Slot of a LUN's chunk
+//
+static ULONG NvmeCacheSlot(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun, IN ULONGLONG ChunkLba, IN ULONG BlocksPerChunk)
+{
+    ULONGLONG chunk = ChunkLba >> log2(BlocksPerChunk);
+    ULONG hash = (ULONG)chunk ^ (ULONG)(chunk >> 32) ^ ((ULONG)Lun << 7);
+
+    return hash & (DevExt->ReadCacheSlots - 1);
+}
+
+//
+// NvmeCacheChunk - Chunk a READ falls in, FALSE if it can't be cached: a write,
+// FUA, or not inside one chunk that lies entirely within the namespace
+//
+static BOOLEAN NvmeCacheChunk(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    OUT PULONGLONG ChunkLba,
+    OUT PULONG Slot,
+    OUT PULONG Offset,
+    OUT PULONG Length)
+{
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    ULONGLONG lba;
+    ULONG numBlocks;
+    ULONG blocksPerChunk;
+    BOOLEAN fua;
+
+    if (DevExt->ReadCacheSlots == 0 || Srb->Function != SRB_FUNCTION_EXECUTE_SCSI ||
+        Srb->SrbExtension == NULL) {
+        return FALSE;
+    }
+    if (ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua) || fua || numBlocks == 0) {
+        return FALSE;
+    }
+    blocksPerChunk = NvmeCacheBlocksPerChunk(ns);
+    if (blocksPerChunk == 0 || numBlocks > blocksPerChunk ||
+        numBlocks * ns->BlockSize > Srb->DataTransferLength) {
+        return FALSE;
+    }
+
+    *ChunkLba = lba & ~(ULONGLONG)(blocksPerChunk - 1);
+    if (lba + numBlocks > *ChunkLba + blocksPerChunk ||
+        *ChunkLba + blocksPerChunk > ns->SizeInBlocks) {
+        return FALSE;
+    }
+    *Slot = NvmeCacheSlot(DevExt, Srb->Lun, *ChunkLba, blocksPerChunk);
+    *Offset = (ULONG)(lba - *ChunkLba) * ns->BlockSize;
+    *Length = numBlocks * ns->BlockSize;
+    return TRUE;
+}
+
+//
+// NvmeCacheLookup - Copy a cached chunk slice into the SRB buffer
+// Returns TRUE on a hit, the caller completes the SRB.
+//
+BOOLEAN NvmeCacheLookup(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    PNVME_CACHE_ENTRY entry;
+    ULONGLONG chunkLba;
+    ULONG offset;
+    ULONG length;
+    ULONG slot;
+
+    if (!NvmeCacheChunk(DevExt, Srb, &chunkLba, &slot, &offset, &length)) {
+        return FALSE;
+    }
+    entry = &DevExt->ReadCache[slot];
+    if (entry->State != NVME_CACHE_VALID || entry->Lun != Srb->Lun || entry->Lba != chunkLba) {
+        DevExt->ReadCacheMisses++;
+        return FALSE;
+    }
+
+    memcpy(Srb->DataBuffer, DevExt->ReadCacheData + (slot << NVME_PAGE_SHIFT) + offset, length);
+    DevExt->ReadCacheHits++;
+    return TRUE;
+}
+
+//
+// NvmeCacheClaimSlot - Take the slot of a cacheable read's chunk for a fill
+// Returns the slot (now NVME_CACHE_FILLING) or NVME_CACHE_NO_SLOT if the read isn't
+// cacheable or the slot has a fill outstanding, then it is sent as a plain read.
+//
+ULONG NvmeCacheClaimSlot(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    PNVME_CACHE_ENTRY entry;
+    ULONGLONG chunkLba;
+    ULONG offset;
+    ULONG length;
+    ULONG slot;
+
+    if (!NvmeCacheChunk(DevExt, Srb, &chunkLba, &slot, &offset, &length)) {
+        return NVME_CACHE_NO_SLOT;
+    }
+    entry = &DevExt->ReadCache[slot];
+    if (entry->State == NVME_CACHE_FILLING) {
+        return NVME_CACHE_NO_SLOT;
+    }
+    entry->Lba = chunkLba;
+    entry->Lun = Srb->Lun;
+    entry->State = NVME_CACHE_FILLING;
+    entry->Stale = FALSE;
+    return slot;
+}
+
+//
+// NvmeCacheReleaseSlot - Give back a claimed slot whose fill was never submitted
+//
+VOID NvmeCacheReleaseSlot(IN PHW_DEVICE_EXTENSION DevExt, IN ULONG Slot)
+{
+    DevExt->ReadCache[Slot].State = NVME_CACHE_FREE;
+}
+
+//
+// NvmeBuildCacheFillCommand - NVMe Read of a whole chunk into its slot page
+// The CID is IO_KIND_CACHE_FILL with the claimed slot in Segment.
+//
+VOID NvmeBuildCacheFillCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_COMMAND Cmd, IN USHORT CommandId)
+{
+    PNVME_IO_REQUEST request = &DevExt->IoRequests[CommandId];
+    PNVME_CACHE_ENTRY entry = &DevExt->ReadCache[request->Segment];
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    ULONGLONG deviceLba = entry->Lba >> ns->LbaShift;
+    ULONG deviceBlocks = (NVME_PAGE_SIZE / ns->BlockSize) >> ns->LbaShift;
+
+    memset(Cmd, 0, sizeof(NVME_COMMAND));
+    Cmd->CDW0.Fields.Opcode = NVME_CMD_READ;
+    Cmd->CDW0.Fields.Flags = NVME_CMD_PRP;
+    Cmd->CDW0.Fields.CommandId = CommandId;
+    Cmd->NSID = ns->NamespaceId;
+    Cmd->CDW10 = (ULONG)(deviceLba & 0xFFFFFFFF);
+    Cmd->CDW11 = (ULONG)(deviceLba >> 32);
+    Cmd->CDW12 = deviceBlocks - 1;
+
+    // One page, never crosses a page boundary
+    Cmd->PRP1 = DevExt->ReadCacheDataPhys.QuadPart + ((ULONGLONG)request->Segment << NVME_PAGE_SHIFT);
+    Cmd->PRP2 = 0;
+
+    DevExt->TotalRequests++;
+    DevExt->TotalReads++;
+    DevExt->TotalBytesRead += Srb->DataTransferLength;
+
+#ifdef NVME2K_DBG_CMD
+    ScsiDebugPrint(0, "nvme2k: NvmeBuildCacheFillCommand - CID=%u slot %u device LBA %08X%08X blocks %u\n",
+                   CommandId, request->Segment, (ULONG)(deviceLba >> 32),
+                   (ULONG)(deviceLba & 0xFFFFFFFF), deviceBlocks);
+#endif
+}
+
+//
+// NvmeProcessCacheFillCompletion - Hand the requested blocks of a filled chunk to
+// the SRB and keep the chunk unless it was written to meanwhile
+// The SRB then completes like an IO_KIND_READ.
+//
+VOID NvmeProcessCacheFillCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IO_REQUEST Request, IN USHORT status)
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
+    PNVME_CACHE_ENTRY entry = &DevExt->ReadCache[Request->Segment];
+    ULONGLONG lba;
+    ULONG numBlocks;
+    ULONG blockSize;
+    BOOLEAN fua;
+
+    if (status == NVME_SC_SUCCESS && Srb != NULL) {
+        ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua);
+        blockSize = NVME_SRB_NAMESPACE(DevExt, Srb)->BlockSize;
+        memcpy(Srb->DataBuffer,
+               DevExt->ReadCacheData + ((ULONG)Request->Segment << NVME_PAGE_SHIFT) +
+                   (ULONG)(lba - entry->Lba) * blockSize,
+               numBlocks * blockSize);
+    }
+
+    if (status == NVME_SC_SUCCESS && !entry->Stale) {
+        entry->State = NVME_CACHE_VALID;
+    } else {
+        entry->State = NVME_CACHE_FREE;
+    }
+}
+
+//
+// NvmeCacheDropChunk - Drop one chunk if it is cached or being filled
+//
+static VOID NvmeCacheDropChunk(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_CACHE_ENTRY Entry)
+{
+    if (Entry->State == NVME_CACHE_VALID) {
+        Entry->State = NVME_CACHE_FREE;
+        DevExt->ReadCacheInvalidations++;
+    } else if (Entry->State == NVME_CACHE_FILLING && !Entry->Stale) {
+        Entry->Stale = TRUE;
+        DevExt->ReadCacheInvalidations++;
+    }
+}
+
+//
+// NvmeCacheInvalidate - Drop every chunk of a LUN overlapping Blocks logical blocks at Lba
+//
+VOID NvmeCacheInvalidate(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun, IN ULONGLONG Lba, IN ULONGLONG Blocks)
+{
+    PNVME_CACHE_ENTRY entry;
+    ULONGLONG chunk;
+    ULONGLONG lastChunk;
+    ULONG blocksPerChunk;
+    ULONG i;
+
+    if (DevExt->ReadCacheSlots == 0 || Lun >= NVME_MAX_NAMESPACES || Blocks == 0) {
+        return;
+    }
+    blocksPerChunk = NvmeCacheBlocksPerChunk(&DevExt->Namespaces[Lun]);
+    if (blocksPerChunk == 0) {
+        return;
+    }
+    chunk = Lba & ~(ULONGLONG)(blocksPerChunk - 1);
+    lastChunk = (Lba + Blocks - 1) & ~(ULONGLONG)(blocksPerChunk - 1);
+
+    // Large ranges: cheaper to look at every slot than at every chunk
+    if (((lastChunk - chunk) >> log2(blocksPerChunk)) >= DevExt->ReadCacheSlots) {
+        for (i = 0; i < DevExt->ReadCacheSlots; i++) {
+            entry = &DevExt->ReadCache[i];
+            if (entry->Lun == Lun && entry->Lba >= chunk && entry->Lba <= lastChunk) {
+                NvmeCacheDropChunk(DevExt, entry);
+            }
+        }
+        return;
+    }
+
+    for (;;) {
+        entry = &DevExt->ReadCache[NvmeCacheSlot(DevExt, Lun, chunk, blocksPerChunk)];
+        if (entry->Lun == Lun && entry->Lba == chunk) {
+            NvmeCacheDropChunk(DevExt, entry);
+        }
+        if (chunk == lastChunk) {
+            break;
+        }
+        chunk += blocksPerChunk;
+    }
+}
+
+//
+// NvmeCacheInvalidateSrb - Drop the chunks a WRITE SRB covers, reads are ignored
+//
+VOID NvmeCacheInvalidateSrb(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    ULONGLONG lba;
+    ULONG numBlocks;
+    BOOLEAN fua;
+
+    if (DevExt->ReadCacheSlots == 0) {
+        return;
+    }
+    if (ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua)) {
+        NvmeCacheInvalidate(DevExt, Srb->Lun, lba, numBlocks);
+    }
+}
+
+//
+// NvmeCacheInvalidateLun - Drop everything cached for a LUN (Format NVM)
+//
+VOID NvmeCacheInvalidateLun(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun)
+{
+    ULONG i;
+
+    for (i = 0; i < DevExt->ReadCacheSlots; i++) {
+        if (DevExt->ReadCache[i].Lun == Lun) {
+            NvmeCacheDropChunk(DevExt, &DevExt->ReadCache[i]);
+        }
+    }
+}
+
+//
+// Deallocated extent map
+// On namespaces whose DLFEAT says deallocated blocks read back as zeroes, ranges
+// a successful DSM deallocated are remembered until something writes to them, and
+// reads entirely inside one are zero-filled in HwStartIo. Full-volume scans of a
+// mostly empty disk then don't touch the device for the empty parts.
+//
+// Writes drop their range from the map when ScsiHandleReadWrite accepts them and
+// when they are submitted. A DSM only adds its range if no other write to the
+// namespace completed while it was outstanding and no overlapping one is still
+// outstanding, otherwise the device may have run that write after the deallocate.
+// DSM deallocation is advisory, but the blocks were freed by the file system when
+// it sent the TRIM, so zeroes are as good as whatever the device kept.
+//
+
+//
+// NvmeDeallocReset - Forget every extent
+//
+VOID NvmeDeallocReset(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    memset(DevExt->DeallocExtents, 0, sizeof(DevExt->DeallocExtents));
+    DevExt->DeallocExtentCount = 0;
+}
+
+//
+// NvmeDeallocFreeSlot - Unused extent slot, NULL if the map is full
+//
+static PNVME_DEALLOC_EXTENT NvmeDeallocFreeSlot(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    ULONG i;
+
+    for (i = 0; i < NVME_MAX_DEALLOC_EXTENTS; i++) {
+        if (DevExt->DeallocExtents[i].End == 0) {
+            return &DevExt->DeallocExtents[i];
+        }
+    }
+    return NULL;
+}
+
+static VOID NvmeDeallocFree(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_DEALLOC_EXTENT Extent)
+{
+    Extent->Start = 0;
+    Extent->End = 0;
+    DevExt->DeallocExtentCount--;
+}
+
+//
+// NvmeDeallocAdd - Record Blocks logical blocks at Lba of a LUN as reading back zeroes
+// Overlapping and adjacent extents are merged into it. If the map is full the
+// smallest extent is dropped to make room, or the new one if it is the smallest.
+//
+VOID NvmeDeallocAdd(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun, IN ULONGLONG Lba, IN ULONGLONG Blocks)
+{
+    PNVME_DEALLOC_EXTENT extent;
+    PNVME_DEALLOC_EXTENT smallest;
+    ULONGLONG start = Lba;
+    ULONGLONG end = Lba + Blocks;
+    BOOLEAN merged;
+    ULONG i;
+
+    if (Lun >= NVME_MAX_NAMESPACES || !DevExt->Namespaces[Lun].DeallocReadsZero || Blocks == 0) {
+        return;
+    }
+
+    // Absorb everything it touches, growing it may make it touch more
+    do {
+        merged = FALSE;
+        for (i = 0; i < NVME_MAX_DEALLOC_EXTENTS; i++) {
+            extent = &DevExt->DeallocExtents[i];
+            if (extent->End != 0 && extent->Lun == Lun &&
+                extent->Start <= end && start <= extent->End) {
+                if (extent->Start < start) {
+                    start = extent->Start;
+                }
+                if (extent->End > end) {
+                    end = extent->End;
+                }
+                NvmeDeallocFree(DevExt, extent);
+                merged = TRUE;
+            }
+        }
+    } while (merged);
+
+    extent = NvmeDeallocFreeSlot(DevExt);
+    if (extent == NULL) {
+        smallest = &DevExt->DeallocExtents[0];
+        for (i = 1; i < NVME_MAX_DEALLOC_EXTENTS; i++) {
+            if (DevExt->DeallocExtents[i].End - DevExt->DeallocExtents[i].Start <
+                smallest->End - smallest->Start) {
+                smallest = &DevExt->DeallocExtents[i];
+            }
+        }
+        DevExt->DeallocExtentsDropped++;
+        if (smallest->End - smallest->Start >= end - start) {
+            return;
+        }
+        NvmeDeallocFree(DevExt, smallest);
+        extent = smallest;
+    }
+
+    extent->Start = start;
+    extent->End = end;
+    extent->Lun = Lun;
+    DevExt->DeallocExtentCount++;
+}
+
+//
+// NvmeDeallocRemove - Forget Blocks logical blocks at Lba of a LUN
+// An extent split in two needs a second slot; if the map is full the smaller
+// half is forgotten as well.
+//
+VOID NvmeDeallocRemove(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun, IN ULONGLONG Lba, IN ULONGLONG Blocks)
+{
+    PNVME_DEALLOC_EXTENT extent;
+    PNVME_DEALLOC_EXTENT tail;
+    ULONGLONG end = Lba + Blocks;
+    ULONG i;
+
+    if (DevExt->DeallocExtentCount == 0 || Blocks == 0) {
+        return;
+    }
+
+    for (i = 0; i < NVME_MAX_DEALLOC_EXTENTS; i++) {
+        extent = &DevExt->DeallocExtents[i];
+        if (extent->End == 0 || extent->Lun != Lun || extent->End <= Lba || end <= extent->Start) {
+            continue;
+        }
+
+        if (Lba <= extent->Start && extent->End <= end) {
+            NvmeDeallocFree(DevExt, extent);
+        } else if (extent->Start < Lba && end < extent->End) {
+            tail = NvmeDeallocFreeSlot(DevExt);
+            if (tail != NULL) {
+                tail->Start = end;
+                tail->End = extent->End;
+                tail->Lun = Lun;
+                DevExt->DeallocExtentCount++;
+                extent->End = Lba;
+            } else {
+                DevExt->DeallocExtentsDropped++;
+                if (Lba - extent->Start >= extent->End - end) {
+                    extent->End = Lba;
+                } else {
+                    extent->Start = end;
+                }
+            }
+        } else if (extent->Start < Lba) {
+            extent->End = Lba;
+        } else {
+            extent->Start = end;
+        }
+    }
+}
+
+//
+// NvmeDeallocRemoveSrb - Forget the range a WRITE SRB covers, reads are ignored
+//
+VOID NvmeDeallocRemoveSrb(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    ULONGLONG lba;
+    ULONG numBlocks;
+    BOOLEAN fua;
+
+    if (DevExt->DeallocExtentCount == 0) {
+        return;
+    }
+    if (ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua)) {
+        NvmeDeallocRemove(DevExt, Srb->Lun, lba, numBlocks);
+    }
+}
+
+//
+// NvmeCacheInvalidateUserIo - Drop cached chunks and deallocated extents an NvmeMini
+// I/O queue command may change (Command is the caller's 16 dwords)
+// A DSM's range list is in the caller's buffer, so it drops the whole LUN.
+// Returns TRUE if the command writes to the namespace.
+//
+BOOLEAN NvmeCacheInvalidateUserIo(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR Lun, IN PULONG Command)
+{
+    PNVME_NAMESPACE ns = &DevExt->Namespaces[Lun];
+    ULONGLONG lba;
+    ULONGLONG blocks;
+
+    switch (Command[0] & 0xFF) {
+        case NVME_CMD_WRITE:
+        case NVME_CMD_ZERO:
+            // SLBA in CDW10/11 and the 0's based NLB in CDW12, in device blocks
+            lba = (((ULONGLONG)Command[11] << 32) | Command[10]) << ns->LbaShift;
+            blocks = ((ULONGLONG)(Command[12] & 0xFFFF) + 1) << ns->LbaShift;
+            NvmeCacheInvalidate(DevExt, Lun, lba, blocks);
+            NvmeDeallocRemove(DevExt, Lun, lba, blocks);
+            return TRUE;
+        case NVME_CMD_DSM:
+            NvmeCacheInvalidateLun(DevExt, Lun);
+            NvmeDeallocRemove(DevExt, Lun, 0, ns->SizeInBlocks);
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+//
+// NvmeCacheInvalidateCopy - Drop cached chunks and deallocated extents of the next
+// Blocks destination blocks of an NVME2KDB COPY (from BlocksDone on)
+//
+VOID NvmeCacheInvalidateCopy(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME2KDB_COPY Copy, IN ULONGLONG Blocks)
+{
+    ULONGLONG lba = Copy->DestinationLba + Copy->BlocksDone;
+
+    NvmeCacheInvalidate(DevExt, (UCHAR)Copy->Lun, lba, Blocks);
+    NvmeDeallocRemove(DevExt, (UCHAR)Copy->Lun, lba, Blocks);
+}
+
+//
+// NvmeDeallocLookup - Zero-fill a read that lies entirely inside one extent
+// Returns TRUE if it did, the caller completes the SRB.
+//
+BOOLEAN NvmeDeallocLookup(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    PNVME_DEALLOC_EXTENT extent;
+    ULONGLONG lba;
+    ULONG numBlocks;
+    ULONG i;
+    BOOLEAN fua;
+
+    if (DevExt->DeallocExtentCount == 0 || Srb->Function != SRB_FUNCTION_EXECUTE_SCSI) {
+        return FALSE;
+    }
+    if (ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua) || numBlocks == 0 ||
+        numBlocks * ns->BlockSize > Srb->DataTransferLength) {
+        return FALSE;
+    }
+
+    for (i = 0; i < NVME_MAX_DEALLOC_EXTENTS; i++) {
+        extent = &DevExt->DeallocExtents[i];
+        if (extent->End != 0 && extent->Lun == Srb->Lun &&
+            extent->Start <= lba && lba + numBlocks <= extent->End) {
+            memset(Srb->DataBuffer, 0, numBlocks * ns->BlockSize);
+            DevExt->DeallocReads++;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+//
+// NvmeDeallocRecord - Add a deallocated range unless a write to it is still outstanding
+// Srb is the deallocating SRB itself, which is skipped. The caller has checked the
+// DSM status and that no other write completed while it was outstanding.
+//
+VOID NvmeDeallocRecord(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR Lun,
+                       IN ULONGLONG Lba, IN ULONGLONG Blocks)
+{
+    PSCSI_REQUEST_BLOCK other;
+    ULONGLONG otherLba;
+    ULONG otherBlocks;
+    ULONG i;
+    BOOLEAN fua;
+
+    // A write still outstanding over the range may land either side of the deallocate
+    for (i = 0; i < NVME_MAX_IO_COMMANDS; i++) {
+        other = DevExt->IoRequests[i].Srb;
+        switch (DevExt->IoRequests[i].Kind) {
+            case IO_KIND_WRITE:
+            case IO_KIND_DEALLOCATE:
+            case IO_KIND_SPLIT_WRITE:
+            case IO_KIND_RMW_READ:
+                break;
+            default:
+                continue;
+        }
+        if (other == NULL || other == Srb || other->Lun != Lun) {
+            continue;
+        }
+        ScsiParseReadWriteCdb(other, &otherLba, &otherBlocks, &fua);
+        if (otherLba < Lba + Blocks && Lba < otherLba + otherBlocks) {
+            return;
+        }
+    }
+
+    NvmeDeallocAdd(DevExt, Lun, Lba, Blocks);
+}
+
+//
+// NvmeProcessDeallocCompletion - Bookkeeping for a completed DSM deallocate
+// The range list in the request's PrpListPage ends after Count ranges or at an
+// empty one. Cached copies of the ranges go whatever the status (reads that filled
+// the cache while it was outstanding may hold the old data); the ranges are
+// recorded if the namespace reads them back as zeroes and no write to it completed
+// in between. Called before the CID is freed and before WriteGeneration counts it.
+//
+VOID NvmeProcessDeallocCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IO_REQUEST Request, IN UCHAR Lun,
+                                  IN ULONG Count, IN USHORT status)
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
+    PNVME_NAMESPACE ns = &DevExt->Namespaces[Lun];
+    PNVME_DSM_RANGE dsmRanges;
+    ULONG i;
+    BOOLEAN record;
+
+    if (Srb == NULL || Request->PrpListPage == 0xFF) {
+        return;
+    }
+    dsmRanges = (PNVME_DSM_RANGE)GetPrpListPageVirtual(DevExt, Request->PrpListPage);
+    record = (status == NVME_SC_SUCCESS && ns->DeallocReadsZero && Srb->SrbExtension &&
+              ((PNVME_SRB_EXTENSION)Srb->SrbExtension)->FlushGeneration == ns->WriteGeneration);
+    for (i = 0; i < Count && dsmRanges[i].Length != 0; i++) {
+        NvmeCacheInvalidate(DevExt, Lun, dsmRanges[i].StartingLba << ns->LbaShift,
+                            (ULONGLONG)dsmRanges[i].Length << ns->LbaShift);
+        if (record) {
+            NvmeDeallocRecord(DevExt, Srb, Lun, dsmRanges[i].StartingLba << ns->LbaShift,
+                              (ULONGLONG)dsmRanges[i].Length << ns->LbaShift);
+        }
+    }
+}
+
+//
+// SMART/Health log cache (SmartCacheMs in DriverParameter, NVME_SMART_CACHE_MS by default)
+// Monitoring tools poll the SMART/Health log through LOG SENSE, SAT SMART READ DATA
+// and the SMART IOCTL, each of which used to cost a Get Log Page. The last log is
+// kept in the device extension and answers these in HwStartIo for SmartCacheMs.
+// Once it is stale the first request sends the Get Log Page and the ones arriving
+// while it is outstanding wait on its NextWaiter chain, so concurrent pollers share
+// one admin command. A SMART/Health or error asynchronous event drops the copy
+// (NvmeSmartLogInvalidate) and stores the log it reads instead. Without a timestamp source nothing is kept,
+// but refreshes are still shared.
+//
+
+//
+// NvmeSmartLogReset - Forget the cached log, used when outstanding admin commands
+// are thrown away
+//
+VOID NvmeSmartLogReset(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    DevExt->SmartLogValid = FALSE;
+    DevExt->SmartLogRefresh = NULL;
+    DevExt->SmartLogGeneration++;
+}
+
+//
+// NvmeSmartLogInvalidate - The next request reads the log from the device
+// A refresh already outstanding still answers its waiters but isn't kept.
+//
+VOID NvmeSmartLogInvalidate(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    DevExt->SmartLogValid = FALSE;
+    DevExt->SmartLogGeneration++;
+}
+
+//
+// NvmeSmartLogStore - Keep a SMART/Health log just read from the device
+//
+VOID NvmeSmartLogStore(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_SMART_INFO NvmeSmart)
+{
+    memcpy(&DevExt->SmartLog, NvmeSmart, sizeof(NVME_SMART_INFO));
+    DevExt->SmartLogTime = NvmeReadTimestamp(DevExt);
+    DevExt->SmartLogValid = TRUE;
+    DevExt->CriticalWarning = NvmeSmart->CriticalWarning;
+}
+
+//
+// NvmeSmartLogRequest - Get the SMART/Health log for an SRB
+// Returns NVME_SMART_LOG_CACHED if the SRB was answered from the cache (status set,
+// not completed), NVME_SMART_LOG_PENDING if it waits for a Get Log Page and
+// NVME_SMART_LOG_BUSY if no admin slot or PRP page is free.
+//
+UCHAR NvmeSmartLogRequest(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+
+    // SmartLogTtlTicks is 0 without a timestamp source
+    if (DevExt->SmartLogValid &&
+        NvmeReadTimestamp(DevExt) - DevExt->SmartLogTime < DevExt->SmartLogTtlTicks) {
+        DevExt->SmartLogHits++;
+        NvmeSmartLogFillSrb(DevExt, Srb, &DevExt->SmartLog);
+        return NVME_SMART_LOG_CACHED;
+    }
+
+    // Wait for the refresh already outstanding
+    if (DevExt->SmartLogRefresh != NULL && srbExt != NULL) {
+        PNVME_SRB_EXTENSION refreshExt = (PNVME_SRB_EXTENSION)DevExt->SmartLogRefresh->SrbExtension;
+
+        srbExt->NextWaiter = refreshExt->NextWaiter;
+        refreshExt->NextWaiter = Srb;
+        DevExt->SmartLogMerged++;
+        return NVME_SMART_LOG_PENDING;
+    }
+
+    if (!NvmeGetLogPage(DevExt, Srb, NVME_LOG_PAGE_SMART_HEALTH)) {
+        return NVME_SMART_LOG_BUSY;
+    }
+    DevExt->SmartLogRefreshes++;
+
+    // Later requests can only wait on an SRB with an extension to chain them
+    if (DevExt->SmartLogRefresh == NULL && srbExt != NULL) {
+        srbExt->NextWaiter = NULL;
+        DevExt->SmartLogRefresh = Srb;
+        DevExt->SmartLogRefreshGeneration = DevExt->SmartLogGeneration;
+    }
+    return NVME_SMART_LOG_PENDING;
+}
@@ -2,153 +2,320 @@
 #include "nvme2k.h"
 #include "utils.h"
 
+//
+// NvmeSmartLogFillSrb - Answer a LOG SENSE, SAT SMART READ DATA or SMART IOCTL SRB
+// from a SMART/Health log, NULL if the Get Log Page failed
+// Sets the SRB status, the caller completes it.
+//
+VOID NvmeSmartLogFillSrb(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_SMART_INFO NvmeSmart)
+{
+    // Determine the request type: LOG SENSE, SAT PASS-THROUGH, or SMART IOCTL
+    if (Srb->Function == SRB_FUNCTION_EXECUTE_SCSI && Srb->Cdb[0] == SCSIOP_LOG_SENSE) {
+        // This is a LOG SENSE completion
+        if (NvmeSmart) {
+            UCHAR pageCode = ScsiGetLogPageCodeFromSrb(Srb);
+            ULONG bytesWritten = 0;
+
+            // Convert NVMe log page to proper SCSI log page format
+            if (NvmeLogPageToScsiLogPage(NvmeSmart, pageCode, Srb->DataBuffer,
+                                         Srb->DataTransferLength, &bytesWritten)) {
+                Srb->DataTransferLength = bytesWritten;
+                Srb->SrbStatus = SRB_STATUS_SUCCESS;
+            } else {
+                Srb->DataTransferLength = 0;
+                Srb->SrbStatus = SRB_STATUS_ERROR;
+            }
+        } else {
+            Srb->DataTransferLength = 0;
+            Srb->SrbStatus = SRB_STATUS_ERROR;
+        }
+    } else if (Srb->Function == SRB_FUNCTION_EXECUTE_SCSI &&
+               (Srb->Cdb[0] == SCSIOP_ATA_PASSTHROUGH16 || Srb->Cdb[0] == SCSIOP_ATA_PASSTHROUGH12)) {
+        // This is a SAT ATA PASS-THROUGH completion
+        if (NvmeSmart) {
+            UCHAR ataCommand;
+            UCHAR ataFeatures;
+            UCHAR ataCylLow;
+            UCHAR ataCylHigh;
+
+            if (!ScsiParseSatCommand(Srb, &ataCommand, &ataFeatures, &ataCylLow, &ataCylHigh)) {
+                Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+            } else {
+                // Check which ATA command was requested
+                if (ataCommand == ATA_SMART_CMD && ataFeatures == ATA_SMART_READ_DATA) {
+                    // SMART READ DATA - convert NVMe SMART to ATA SMART format
+                    // For SAT commands, the data buffer is the raw 512-byte payload.
+                    // It does NOT include a SENDCMDOUTPARAMS header.
+                    PATA_SMART_DATA ataSmart = (PATA_SMART_DATA)Srb->DataBuffer;
+
+                    NvmeSmartToAtaSmart(NvmeSmart, ataSmart);
+
+                    Srb->DataTransferLength = 512;
+                    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+                } else {
+                    Srb->SrbStatus = SRB_STATUS_ERROR;
+                }
+            }
+        } else {
+            Srb->DataTransferLength = 0;
+            Srb->SrbStatus = SRB_STATUS_ERROR;
+        }
+    } else if (Srb->Function == SRB_FUNCTION_IO_CONTROL) {
+        // This is a SMART IOCTL completion
+        PSRB_IO_CONTROL srbControl = (PSRB_IO_CONTROL)Srb->DataBuffer;
+        PSENDCMDOUTPARAMS sendCmdOut = (PSENDCMDOUTPARAMS)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+
+        if (!NvmeSmart) {
+            // Command failed
+#ifdef NVME2K_DBG
+            ScsiDebugPrint(0, "nvme2k: FAILED Log Page completion for SRB_FUNCTION_IO_CONTROL 0x%02X\n", Srb->Function);
+#endif
+            sendCmdOut->cBufferSize = 0;
+            sendCmdOut->DriverStatus.bDriverError = 1;
+            sendCmdOut->DriverStatus.bIDEError = 0x04;  // Aborted
+            srbControl->ReturnCode = 1;
+            Srb->DataTransferLength = 0;
+            Srb->SrbStatus = SRB_STATUS_ERROR;
+        } else
+        if (memcmp(srbControl->Signature, "SCSIDISK", 8) == 0
+            && srbControl->ControlCode == IOCTL_SCSI_MINIPORT_READ_SMART_ATTRIBS) {
+                PATA_SMART_DATA ataSmart = (PATA_SMART_DATA)sendCmdOut->bBuffer;
+
+                // Convert NVMe SMART/Health log to ATA SMART format
+                NvmeSmartToAtaSmart(NvmeSmart, ataSmart);
+
+                sendCmdOut->cBufferSize = 512;
+                memset(&sendCmdOut->DriverStatus, 0, sizeof(DRIVERSTATUS));
+                sendCmdOut->DriverStatus.bDriverError = 0;
+                sendCmdOut->DriverStatus.bIDEError = 0;
+
+                // Set DataTransferLength to total size returned
+                Srb->DataTransferLength = sizeof(SRB_IO_CONTROL) + sizeof(SENDCMDOUTPARAMS) + 512 - 1;
+
+                srbControl->ReturnCode = 0;
+                Srb->SrbStatus = SRB_STATUS_SUCCESS;
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: Get Log Page completion for SRB_FUNCTION_IO_CONTROL/IOCTL_SCSI_MINIPORT_READ_SMART_ATTRIBS 0x%02X\n", Srb->Function);
+#endif
+        }
+    } else {
+        // Unknown request type for Get Log Page
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: Get Log Page completion for unknown SRB function 0x%02X\n", Srb->Function);
+#endif
+        Srb->SrbStatus = SRB_STATUS_ERROR;
+    }
+}
+
 //
 // NvmeProcessGetLogPageCompletion - Handle Get Log Page command completion
+// A refresh of the SMART/Health log cache also answers the SRBs that waited for it
 //
-VOID NvmeProcessGetLogPageCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT status, USHORT commandId)
+VOID NvmeProcessGetLogPageCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status)
 {
     PSCSI_REQUEST_BLOCK Srb;
-    PVOID prpBuffer;
-    PNVME_SRB_EXTENSION srbExt;
+    PSCSI_REQUEST_BLOCK waiter;
+    PSCSI_REQUEST_BLOCK nextWaiter;
+    PNVME_SMART_INFO nvmeSmart;
     UCHAR prpPageIndex;
 
-    // Get the untagged SRB from ScsiPort
-    // ScsiPort guarantees only one untagged request at a time
-    Srb = NvmeGetSrbFromCommandId(DevExt, commandId);
+    // SRB and PRP page come from the admin request slot, the caller frees both
+    Srb = Request->Srb;
+    prpPageIndex = Request->PrpListPage;
 
     if (!Srb) {
 #ifdef NVME2K_DBG
         ScsiDebugPrint(0, "nvme2k: Get Log Page completion - missing Srb!\n");
 #endif
-        // we can use prpPageIndex to free the log page so we dont leak them
-    } else {
-        // Get PRP page index from SRB extension
-        srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
-        prpPageIndex = srbExt->PrpListPage;
+        return;
+    }
 
 #ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: GetLogPageCpl - CID=%u PRP=%u Status=0x%04X\n",
-                       ADMIN_CID_GET_LOG_PAGE, prpPageIndex, status);
+    ScsiDebugPrint(0, "nvme2k: GetLogPageCpl - PRP=%u Status=0x%04X\n",
+                   prpPageIndex, status);
 #endif
-        prpBuffer = GetPrpListPageVirtual(DevExt, prpPageIndex);
+    nvmeSmart = NULL;
+    if (status == NVME_SC_SUCCESS) {
+        nvmeSmart = (PNVME_SMART_INFO)GetPrpListPageVirtual(DevExt, prpPageIndex);
+    }
 
-        // Determine the request type: LOG SENSE, SAT PASS-THROUGH, or SMART IOCTL
-        if (Srb->Function == SRB_FUNCTION_EXECUTE_SCSI && Srb->Cdb[0] == SCSIOP_LOG_SENSE) {
-            // This is a LOG SENSE completion
-            if (status == NVME_SC_SUCCESS && prpBuffer) {
-                PNVME_SMART_INFO nvmeSmart = (PNVME_SMART_INFO)prpBuffer;
-                UCHAR pageCode = ScsiGetLogPageCodeFromSrb(Srb);
-                ULONG bytesWritten = 0;
+    waiter = NULL;
+    if (DevExt->SmartLogRefresh == Srb) {
+        DevExt->SmartLogRefresh = NULL;
+        waiter = ((PNVME_SRB_EXTENSION)Srb->SrbExtension)->NextWaiter;
+        ((PNVME_SRB_EXTENSION)Srb->SrbExtension)->NextWaiter = NULL;
 
-                // Convert NVMe log page to proper SCSI log page format
-                if (NvmeLogPageToScsiLogPage(nvmeSmart, pageCode, Srb->DataBuffer,
-                                             Srb->DataTransferLength, &bytesWritten)) {
-                    Srb->DataTransferLength = bytesWritten;
-                    Srb->SrbStatus = SRB_STATUS_SUCCESS;
-                } else {
-                    Srb->DataTransferLength = 0;
-                    Srb->SrbStatus = SRB_STATUS_ERROR;
-                }
-            } else {
-                Srb->DataTransferLength = 0;
-                Srb->SrbStatus = SRB_STATUS_ERROR;
-            }
-        } else if (Srb->Function == SRB_FUNCTION_EXECUTE_SCSI &&
-                   (Srb->Cdb[0] == SCSIOP_ATA_PASSTHROUGH16 || Srb->Cdb[0] == SCSIOP_ATA_PASSTHROUGH12)) {
-            // This is a SAT ATA PASS-THROUGH completion
-            if (status == NVME_SC_SUCCESS && prpBuffer) {
-                UCHAR ataCommand;
-                UCHAR ataFeatures;
-                UCHAR ataCylLow;
-                UCHAR ataCylHigh;
-
-                if (!ScsiParseSatCommand(Srb, &ataCommand, &ataFeatures, &ataCylLow, &ataCylHigh)) {
-                    Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-                } else {
-                    // Check which ATA command was requested
-                    if (ataCommand == ATA_SMART_CMD && ataFeatures == ATA_SMART_READ_DATA) {
-                        // SMART READ DATA - convert NVMe SMART to ATA SMART format
-                        // For SAT commands, the data buffer is the raw 512-byte payload.
-                        // It does NOT include a SENDCMDOUTPARAMS header.
-                        PNVME_SMART_INFO nvmeSmart = (PNVME_SMART_INFO)prpBuffer;
-                        PATA_SMART_DATA ataSmart = (PATA_SMART_DATA)Srb->DataBuffer;
-
-                        NvmeSmartToAtaSmart(nvmeSmart, ataSmart);
-
-                        Srb->DataTransferLength = 512;
-                        Srb->SrbStatus = SRB_STATUS_SUCCESS;
-                    } else {
-                        Srb->SrbStatus = SRB_STATUS_ERROR;
-                    }
-                }
-            } else {
-                Srb->DataTransferLength = 0;
-                Srb->SrbStatus = SRB_STATUS_ERROR;
-            }
-        } else if (Srb->Function == SRB_FUNCTION_IO_CONTROL) {
-            // This is a SMART IOCTL completion
-            PSRB_IO_CONTROL srbControl = (PSRB_IO_CONTROL)Srb->DataBuffer;
-            PSENDCMDOUTPARAMS sendCmdOut = (PSENDCMDOUTPARAMS)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+        // Not kept if an event made the log stale while the command was outstanding
+        if (nvmeSmart && DevExt->SmartLogRefreshGeneration == DevExt->SmartLogGeneration) {
+            NvmeSmartLogStore(DevExt, nvmeSmart);
+        }
+    }
 
-            if (status != NVME_SC_SUCCESS || !prpBuffer) {
-                // Command failed
-#ifdef NVME2K_DBG
-                ScsiDebugPrint(0, "nvme2k: FAILED Log Page completion for SRB_FUNCTION_IO_CONTROL 0x%02X\n", Srb->Function);
+    NvmeSmartLogFillSrb(DevExt, Srb, nvmeSmart);
+    // Complete the SRB, scsiport takes control
+    ScsiPortNotification(RequestComplete, DevExt, Srb);
+
+    while (waiter) {
+        nextWaiter = ((PNVME_SRB_EXTENSION)waiter->SrbExtension)->NextWaiter;
+        ((PNVME_SRB_EXTENSION)waiter->SrbExtension)->NextWaiter = NULL;
+
+        NvmeSmartLogFillSrb(DevExt, waiter, nvmeSmart);
+        ScsiPortNotification(RequestComplete, DevExt, waiter);
+        waiter = nextWaiter;
+    }
+}
+
+//
+// NvmeProcessFlushCompletion - Bookkeeping for a completed device flush
+// Completes any flushes that were merged into it with the same result
+//
+VOID NvmeProcessFlushCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN USHORT status)
+{
+    PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    PSCSI_REQUEST_BLOCK waiter;
+    PSCSI_REQUEST_BLOCK nextWaiter;
+
+    // Everything completed before this flush was submitted is now durable
+    if (status == NVME_SC_SUCCESS &&
+        (LONG)(srbExt->FlushGeneration - ns->FlushedGeneration) > 0) {
+        ns->FlushedGeneration = srbExt->FlushGeneration;
+    }
+
+    if (ns->FlushInFlight == Srb) {
+        ns->FlushInFlight = NULL;
+    }
+
+    waiter = srbExt->NextWaiter;
+    srbExt->NextWaiter = NULL;
+
+    while (waiter) {
+        nextWaiter = ((PNVME_SRB_EXTENSION)waiter->SrbExtension)->NextWaiter;
+        ((PNVME_SRB_EXTENSION)waiter->SrbExtension)->NextWaiter = NULL;
+
+        if (DevExt->NonTaggedInFlight == waiter) {
+            DevExt->NonTaggedInFlight = NULL;
+        }
+
+        waiter->SrbStatus = (status == NVME_SC_SUCCESS) ? SRB_STATUS_SUCCESS : SRB_STATUS_ERROR;
+#ifdef NVME2K_DBG_EXTRA
+        ScsiDebugPrint(0, "nvme2k: Completing merged flush SRB=%p status=0x%02X\n", waiter, status);
 #endif
-                sendCmdOut->cBufferSize = 0;
-                sendCmdOut->DriverStatus.bDriverError = 1;
-                sendCmdOut->DriverStatus.bIDEError = 0x04;  // Aborted
-                srbControl->ReturnCode = 1;
-                Srb->DataTransferLength = 0;
-                Srb->SrbStatus = SRB_STATUS_ERROR;
-            } else
-            if (memcmp(srbControl->Signature, "SCSIDISK", 8) == 0
-                && srbControl->ControlCode == IOCTL_SCSI_MINIPORT_READ_SMART_ATTRIBS) {
-                    PNVME_SMART_INFO nvmeSmart = (PNVME_SMART_INFO)prpBuffer;
-                    PATA_SMART_DATA ataSmart = (PATA_SMART_DATA)sendCmdOut->bBuffer;
+        ScsiPortNotification(RequestComplete, DevExt, waiter);
+        waiter = nextWaiter;
+    }
+}
+
+//
+// NvmeProcessDsmCompletion - Bookkeeping for a completed NVME2KDB DEALLOCATE or
+// SAT ATA TRIM
+// Called before the CID and its range list page are freed; the SRB is then
+// completed like any other I/O command.
+//
+VOID NvmeProcessDsmCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IO_REQUEST Request, IN USHORT status)
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
 
-                    // Convert NVMe SMART/Health log to ATA SMART format
-                    NvmeSmartToAtaSmart(nvmeSmart, ataSmart);
+    if (Srb == NULL) {
+        return;
+    }
+    if (Srb->Function == SRB_FUNCTION_IO_CONTROL) {
+        ((PSRB_IO_CONTROL)Srb->DataBuffer)->ReturnCode =
+            (status == NVME_SC_SUCCESS) ? NVME2KDB_RC_SUCCESS : NVME2KDB_RC_ERROR;
+    }
 
-                    sendCmdOut->cBufferSize = 512;
-                    memset(&sendCmdOut->DriverStatus, 0, sizeof(DRIVERSTATUS));
-                    sendCmdOut->DriverStatus.bDriverError = 0;
-                    sendCmdOut->DriverStatus.bIDEError = 0;
+    NvmeProcessDeallocCompletion(DevExt, Request, Request->Segment, NVME_DSM_MAX_RANGES, status);
 
-                    // Set DataTransferLength to total size returned
-                    Srb->DataTransferLength = sizeof(SRB_IO_CONTROL) + sizeof(SENDCMDOUTPARAMS) + 512 - 1;
+    // Like a write, a later flush can't be elided
+    DevExt->Namespaces[Request->Segment].WriteGeneration++;
+}
+
+//
+// NvmeProcessUserIoCompletion - NvmeMini I/O queue command finished
+// The completion entry goes back in Completion[] and ReturnCode says whether it
+// succeeded; the SRB itself succeeds like for Get/Set Features. Called before the
+// CID is freed. Writes drop what they covered from the read cache once more (a fill
+// may have run alongside), stop counting as outstanding and count towards
+// WriteGeneration like any other write.
+//
+VOID NvmeProcessUserIoCompletion(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PNVME_IO_REQUEST Request,
+    IN USHORT status,
+    IN PNVME_COMPLETION cqEntry)
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
+    PNVME_PASS_THROUGH nvmePassThru;
+
+    if (Srb == NULL) {
+        return;
+    }
+
+    nvmePassThru = (PNVME_PASS_THROUGH)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+    nvmePassThru->Completion[0] = cqEntry->DW0;
+    nvmePassThru->Completion[1] = cqEntry->DW1;
+    nvmePassThru->Completion[2] = ((ULONG)cqEntry->SQID << 16) | cqEntry->SQHead;
+    nvmePassThru->Completion[3] = ((ULONG)cqEntry->Status << 16) | cqEntry->CID;
+    ((PSRB_IO_CONTROL)Srb->DataBuffer)->ReturnCode = (status == NVME_SC_SUCCESS) ? 0 : 1;
+
+    if (NvmeCacheInvalidateUserIo(DevExt, Request->Segment, nvmePassThru->Command)) {
+        PNVME_NAMESPACE ns = &DevExt->Namespaces[Request->Segment];
+
+        if (ns->WritesOutstanding > 0) {
+            ns->WritesOutstanding--;
+        }
+        ns->WriteGeneration++;
+    }
 
-                    srbControl->ReturnCode = 0;
-                    Srb->SrbStatus = SRB_STATUS_SUCCESS;
 #ifdef NVME2K_DBG
-            ScsiDebugPrint(0, "nvme2k: Get Log Page completion for SRB_FUNCTION_IO_CONTROL/IOCTL_SCSI_MINIPORT_READ_SMART_ATTRIBS 0x%02X\n", Srb->Function);
+    if (status != NVME_SC_SUCCESS) {
+        ScsiDebugPrint(0, "nvme2k: NvmeMini I/O command %02X failed with NVMe status 0x%04X\n",
+                       nvmePassThru->Command[0] & 0xFF, status);
+    }
 #endif
-            }
-        } else {
-            // Unknown request type for Get Log Page
+}
+
+//
+// NvmeProcessSetFeaturesCompletion - Handle Set Features completion for MODE SELECT
+//
+VOID NvmeProcessSetFeaturesCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status)
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
+
+    if (status == NVME_SC_SUCCESS) {
+        DevExt->WriteCacheEnabled = DevExt->WriteCacheRequested;
+    } else {
+        DevExt->WriteCacheRequested = DevExt->WriteCacheEnabled;
+    }
+
 #ifdef NVME2K_DBG
-            ScsiDebugPrint(0, "nvme2k: Get Log Page completion for unknown SRB function 0x%02X\n", Srb->Function);
+    ScsiDebugPrint(0, "nvme2k: SetFeaturesCpl - Status=0x%04X WCE=%u\n",
+                   status, DevExt->WriteCacheEnabled);
 #endif
-            Srb->SrbStatus = SRB_STATUS_ERROR;
-        }
-        // Complete the SRB, scsiport takes control
-        ScsiPortNotification(RequestComplete, DevExt, Srb);
+
+    if (!Srb) {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: Set Features completion - missing Srb!\n");
+#endif
+        return;
     }
 
-    FreePrpListPage(DevExt, prpPageIndex);
+    Srb->SrbStatus = (status == NVME_SC_SUCCESS) ? SRB_STATUS_SUCCESS : SRB_STATUS_ERROR;
+    ScsiPortNotification(RequestComplete, DevExt, Srb);
 }
 
 //
 // NvmeProcessUserExtensionCompletion - Handle userspace called NVMe extension completion
+// Returns FALSE if the slot went out again with the next piece of a large log,
+// TRUE once the caller should release it.
 //
-VOID NvmeProcessUserExtensionCompletion(
+BOOLEAN NvmeProcessUserExtensionCompletion(
     IN PHW_DEVICE_EXTENSION DevExt,
-    IN USHORT commandId,
+    IN PNVME_ADMIN_REQUEST Request,
     IN USHORT status,
     IN PNVME_COMPLETION cqEntry)
 {
     PSCSI_REQUEST_BLOCK Srb;
-    PNVME_SRB_EXTENSION srbExt;
     PVOID prpBuffer;
     PNVME_PASS_THROUGH nvmePassThru;
     ULONG copySize;
@@ -156,26 +323,54 @@ VOID NvmeProcessUserExtensionCompletion(
 
 #ifdef NVME2K_DBG
     ScsiDebugPrint(0, "nvme2k: User extension completion - CID=%04X Status=0x%04X DW0=%08X DW1=%08X\n",
-                   commandId, status, cqEntry->DW0, cqEntry->DW1);
+                   cqEntry->CID, status, cqEntry->DW0, cqEntry->DW1);
 #endif
 
-    // Retrieve SRB using ScsiPortGetSrb (untagged because SCSI doesn't use tags here)
-    // If that fails, use NonTaggedInFlight as backup
-    Srb = NvmeGetSrbFromCommandId(DevExt, commandId);
+    // SRB and PRP page come from the admin request slot, the caller frees both
+    Srb = Request->Srb;
 
     if (!Srb) {
-        return;
+        return TRUE;
     }
 
-    // Get PRP buffer pointer
-    srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
-    if (srbExt && srbExt->PrpListPage != 0xFF) {
-        prpBuffer = GetPrpListPageVirtual(DevExt, srbExt->PrpListPage);
+    // A direct transfer's page, if any, is its PRP list rather than data
+    if (Request->PrpListPage != 0xFF && !(Request->Flags & ADMIN_REQUEST_DIRECT)) {
+        prpBuffer = GetPrpListPageVirtual(DevExt, Request->PrpListPage);
     } else {
         prpBuffer = NULL;
     }
 
-    if (status == NVME_SC_SUCCESS && prpBuffer) {
+    if (status == NVME_SC_SUCCESS && (Request->Flags & ADMIN_REQUEST_DIRECT)) {
+        PSRB_IO_CONTROL srbControl = (PSRB_IO_CONTROL)Srb->DataBuffer;
+
+        // NvmeUserTransfer pointed the PRPs at the caller's buffer, the data is already there
+        nvmePassThru = (PNVME_PASS_THROUGH)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+        nvmePassThru->Completion[0] = cqEntry->DW0;
+        nvmePassThru->Completion[1] = cqEntry->DW1;
+        nvmePassThru->Completion[2] = ((ULONG)cqEntry->SQID << 16) | cqEntry->SQHead;
+        nvmePassThru->Completion[3] = ((ULONG)cqEntry->Status << 16) | cqEntry->CID;
+
+        if (Request->TransferOffset < Request->TransferLength) {
+            // More of a large log to read, the next piece keeps the SRB and this slot
+            if (NvmeUserTransfer(DevExt, Srb, Request, Request->Kind, Request->TransferOffset,
+                                 Request->TransferLength)) {
+                return FALSE;
+            }
+#ifdef NVME2K_DBG
+            ScsiDebugPrint(0, "nvme2k: NvmeMini log read stopped at %u of %u bytes\n",
+                           Request->TransferOffset, Request->TransferLength);
+#endif
+            Srb->SrbStatus = SRB_STATUS_ERROR;
+            srbControl->ReturnCode = 1;  // Error
+        } else {
+#ifdef NVME2K_DBG
+            ScsiDebugPrint(0, "nvme2k: NvmeMini IO_CONTROL completed - %u bytes transferred in place\n",
+                           Request->TransferLength);
+#endif
+            Srb->SrbStatus = SRB_STATUS_SUCCESS;
+            srbControl->ReturnCode = 0;  // success
+        }
+    } else if (status == NVME_SC_SUCCESS && prpBuffer) {
         // Handle different buffer layouts based on SRB function
         if (Srb->Function == SRB_FUNCTION_EXECUTE_SCSI) {
             // Direct SCSI command (0xB5) - simple buffer layout
@@ -203,9 +398,8 @@ VOID NvmeProcessUserExtensionCompletion(
             // IO_CONTROL path (NvmeMini) - complex buffer layout
             // Buffer layout: SRB_IO_CONTROL + NVME_PASS_THROUGH + data
             //
-            // srbControl->Length = total payload after SRB_IO_CONTROL
-            // The 4KB NVMe data is at the END of the payload
-            // So: dataOffset = sizeof(SRB_IO_CONTROL) + (Length - 4096)
+            // Only a buffer NvmeUserTransfer couldn't map comes here, bounced
+            // through the PRP page and never more than 4KB
             nvmePassThru = (PNVME_PASS_THROUGH)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
             dataOffset = sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH);
 
@@ -216,8 +410,8 @@ VOID NvmeProcessUserExtensionCompletion(
             nvmePassThru->Completion[3] = ((ULONG)cqEntry->Status << 16) | cqEntry->CID;
 
             // Verify we have enough space
-            if (Srb->DataTransferLength >= dataOffset + NVME_PAGE_SIZE) {
-                copySize = NVME_PAGE_SIZE;
+            copySize = Request->TransferLength;
+            if (Srb->DataTransferLength >= dataOffset + copySize) {
                 memcpy((PUCHAR)Srb->DataBuffer + dataOffset, prpBuffer, copySize);
 #ifdef NVME2K_DBG
                 ScsiDebugPrint(0, "nvme2k: NvmeMini IO_CONTROL completed - copied %u bytes to offset %u (TotalLen=%u, Length=%u)\n",
@@ -254,17 +448,369 @@ VOID NvmeProcessUserExtensionCompletion(
 #endif
     }
 
-    // Free PRP list page if allocated
-    if (srbExt && srbExt->PrpListPage != 0xFF) {
-        FreePrpListPage(DevExt, srbExt->PrpListPage);
-        srbExt->PrpListPage = 0xFF;
+    // Complete the request
+    ScsiPortNotification(RequestComplete, DevExt, Srb);
+    ScsiPortNotification(NextRequest, DevExt, NULL);
+    return TRUE;
+}
+
+//
+// NvmeProcessUserFeaturesCompletion - Get/Set Features from NvmeMini finished
+// The completion entry goes back in Completion[] (DW0 holds the feature value)
+// whatever the status, so the SRB itself succeeds and ReturnCode carries the
+// outcome. A Get with a data buffer copies the feature data back from the page.
+//
+VOID NvmeProcessUserFeaturesCompletion(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PNVME_ADMIN_REQUEST Request,
+    IN USHORT status,
+    IN PNVME_COMPLETION cqEntry)
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
+    PSRB_IO_CONTROL srbControl;
+    PNVME_PASS_THROUGH nvmePassThru;
+    ULONG dataOffset;
+    ULONG copySize;
+    UCHAR opcode;
+    UCHAR featureId;
+
+    if (!Srb) {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: User features completion - missing Srb!\n");
+#endif
+        return;
+    }
+
+    srbControl = (PSRB_IO_CONTROL)Srb->DataBuffer;
+    nvmePassThru = (PNVME_PASS_THROUGH)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+    dataOffset = sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH);
+    opcode = (UCHAR)(nvmePassThru->Command[0] & 0xFF);
+    featureId = (UCHAR)(nvmePassThru->Command[10] & NVME_FEATURE_FID_MASK);
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: User features completion - OPC=%02X FID=%02X Status=0x%04X DW0=%08X\n",
+                   opcode, featureId, status, cqEntry->DW0);
+#endif
+
+    nvmePassThru->Completion[0] = cqEntry->DW0;
+    nvmePassThru->Completion[1] = cqEntry->DW1;
+    nvmePassThru->Completion[2] = ((ULONG)cqEntry->SQID << 16) | cqEntry->SQHead;
+    nvmePassThru->Completion[3] = ((ULONG)cqEntry->Status << 16) | cqEntry->CID;
+
+    if (opcode == NVME_ADMIN_SET_FEATURES) {
+        switch (featureId) {
+            case NVME_FEATURE_VOLATILE_WRITE_CACHE:
+                // WriteCacheRequested was set when the command was sent, as for MODE SELECT
+                if (status == NVME_SC_SUCCESS) {
+                    DevExt->WriteCacheEnabled = DevExt->WriteCacheRequested;
+                } else {
+                    DevExt->WriteCacheRequested = DevExt->WriteCacheEnabled;
+                }
+                break;
+            case NVME_FEATURE_TEMPERATURE_THRESHOLD:
+                // The temperature warning bit may flip with the new threshold
+                if (status == NVME_SC_SUCCESS) {
+                    NvmeSmartLogInvalidate(DevExt);
+                }
+                break;
+            case NVME_FEATURE_AUTONOMOUS_POWER_STATE:
+                // The table programmed at init no longer applies
+                if (status == NVME_SC_SUCCESS) {
+                    DevExt->ApstStatus = NVME2KDB_APST_USER;
+                }
+                break;
+        }
+    } else if (status == NVME_SC_SUCCESS && Request->PrpListPage != 0xFF &&
+               Srb->DataTransferLength > dataOffset) {
+        copySize = Srb->DataTransferLength - dataOffset;
+        if (copySize > nvmePassThru->DataBufferLen) {
+            copySize = nvmePassThru->DataBufferLen;
+        }
+        if (copySize > NVME_PAGE_SIZE) {
+            copySize = NVME_PAGE_SIZE;
+        }
+        memcpy((PUCHAR)Srb->DataBuffer + dataOffset,
+               GetPrpListPageVirtual(DevExt, Request->PrpListPage), copySize);
     }
 
-    // Complete the request
+    srbControl->ReturnCode = (status == NVME_SC_SUCCESS) ? 0 : 1;
+    Srb->SrbStatus = SRB_STATUS_SUCCESS;
     ScsiPortNotification(RequestComplete, DevExt, Srb);
     ScsiPortNotification(NextRequest, DevExt, NULL);
 }
 
+//
+// NvmeApplyNamespaceIdentify - Take block size, capacity and LBA formats from Identify Namespace
+// Used at init and after a Format NVM. Leaves SizeInBlocks at 0 (LUN not ready) for
+// formats with metadata.
+//
+static VOID NvmeApplyNamespaceIdentify(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PNVME_NAMESPACE ns,
+    IN PNVME_IDENTIFY_NAMESPACE nsData)
+{
+    PNVME_LBA_FORMAT lbaFormat = &nsData->LbaFormats[nsData->FormattedLbaSize & NVME_FLBAS_FORMAT_MASK];
+
+    ns->Features = nsData->NamespaceFeatures;
+    ns->FormattedLbaSize = nsData->FormattedLbaSize;
+    ns->SizeInBlocks = 0;
+
+    // Keep the whole LBAF table for QUERY_LBA_FORMATS and FORMAT_BEST_LBAF
+    ns->NumberOfLbaFormats = (UCHAR)(nsData->NumberOfLbaFormats + 1);
+    if (ns->NumberOfLbaFormats > NVME_MAX_LBA_FORMATS) {
+        ns->NumberOfLbaFormats = NVME_MAX_LBA_FORMATS;
+    }
+    memcpy(ns->LbaFormats, nsData->LbaFormats, sizeof(ns->LbaFormats));
+
+    // Block size comes from the LBA format FLBAS selects
+    if (lbaFormat->LbaDataSize >= 9 && lbaFormat->LbaDataSize <= 16) {
+        ns->BlockSize = 1UL << lbaFormat->LbaDataSize;
+    } else {
+        ns->BlockSize = 512;  // Default
+    }
+
+    // Formats with metadata would need a metadata buffer the SCSI path doesn't have
+    if (lbaFormat->MetadataSize == 0) {
+        ns->SizeInBlocks = nsData->NamespaceSize;
+    }
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: Identified namespace %u - blocks=%I64u blocksize=%u bytes metadata=%u LBAF=%u/%u\n",
+                ns->NamespaceId, nsData->NamespaceSize, ns->BlockSize, lbaFormat->MetadataSize,
+                nsData->FormattedLbaSize & NVME_FLBAS_FORMAT_MASK, ns->NumberOfLbaFormats);
+#endif
+
+    // 512e: 512-byte logical blocks on top of larger device LBAs,
+    // a partial block is bounced through one PRP pool page
+    ns->LbaShift = 0;
+    if (DevExt->Emulate512 && ns->BlockSize > 512 && ns->BlockSize <= NVME_PAGE_SIZE) {
+        ns->LbaShift = (UCHAR)(log2(ns->BlockSize) - 9);
+        ns->BlockSize = 512;
+        ns->SizeInBlocks <<= ns->LbaShift;
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: Namespace %u reported as 512e, %u logical blocks per device LBA\n",
+                    ns->NamespaceId, 1UL << ns->LbaShift);
+#endif
+    }
+
+    // Commands crossing NOIOB are slow on some drives, aligned I/O is split there.
+    // Only power of two boundaries, so the split is shifts and masks.
+    ns->BoundaryShift = 0;
+    if (nsData->OptimalIoBoundary > 1 &&
+        (nsData->OptimalIoBoundary & (nsData->OptimalIoBoundary - 1)) == 0) {
+        ns->BoundaryShift = (UCHAR)log2(nsData->OptimalIoBoundary);
+    }
+
+    // Copy limits for the NVME2KDB COPY offload, all 0 sends it through read/write
+    ns->MaxCopyBlocks = 0;
+    ns->MaxCopyRangeBlocks = 0;
+    ns->MaxCopyRanges = 0;
+    if ((DevExt->OptionalNvmCommands & NVME_ONCS_COPY) &&
+        nsData->MaxCopyLength != 0 && nsData->MaxSourceRangeLength != 0) {
+        ns->MaxCopyBlocks = nsData->MaxCopyLength;
+        ns->MaxCopyRangeBlocks = nsData->MaxSourceRangeLength;
+        ns->MaxCopyRanges = (USHORT)nsData->MaxSourceRangeCount + 1;
+        if (ns->MaxCopyRanges > NVME_COPY_MAX_RANGES) {
+            ns->MaxCopyRanges = NVME_COPY_MAX_RANGES;
+        }
+    }
+
+    // Preferred write unit (NPWG, aligned to NPWA) becomes the physical block size
+    // and NOWS the optimal transfer length, so partitions and the filesystem line up
+    ns->PhysicalShift = ns->LbaShift;
+    ns->OptimalWriteBlocks = 0;
+    if (nsData->NamespaceFeatures & NVME_NSFEAT_OPTPERF) {
+        ULONG unit = (ULONG)nsData->PreferredWriteGranularity + 1;
+        ULONG alignment = (ULONG)nsData->PreferredWriteAlignment + 1;
+
+        if (alignment > unit) {
+            unit = alignment;
+        }
+        if ((unit & (unit - 1)) == 0 && ns->LbaShift + log2(unit) <= 15) {
+            ns->PhysicalShift = (UCHAR)(ns->LbaShift + log2(unit));
+        }
+        ns->OptimalWriteBlocks = (ULONG)nsData->OptimalWriteSize + 1;
+    }
+
+    // Deallocated blocks that read back as zeroes can be served from the extent map
+    ns->DeallocReadsZero = ((nsData->DeallocateFeatures & NVME_DLFEAT_READ_MASK) == NVME_DLFEAT_READ_ZEROES);
+    // Reported to SAT as deterministic read after TRIM
+    ns->DeallocDeterministic = (ns->DeallocReadsZero ||
+                                (nsData->DeallocateFeatures & NVME_DLFEAT_READ_MASK) == NVME_DLFEAT_READ_ONES);
+
+#ifdef NVME2K_DBG
+    if (ns->BoundaryShift || ns->PhysicalShift != ns->LbaShift || ns->OptimalWriteBlocks) {
+        ScsiDebugPrint(0, "nvme2k: Namespace %u NOIOB=%u NPWG=%u NPWA=%u NOWS=%u - physical exponent %u\n",
+                    ns->NamespaceId, nsData->OptimalIoBoundary, nsData->PreferredWriteGranularity,
+                    nsData->PreferredWriteAlignment, nsData->OptimalWriteSize, ns->PhysicalShift);
+    }
+#endif
+}
+
+//
+// NvmeProcessFormatCompletion - Format NVM from FORMAT_BEST_LBAF finished
+// The namespace is re-identified whether or not the format worked, the device
+// decides what format it is left in
+//
+VOID NvmeProcessFormatCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status)
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
+    PSRB_IO_CONTROL srbControl;
+    PNVME2KDB_LBA_FORMATS formats;
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: Format NVM completed - Status=0x%04X\n", status);
+#endif
+
+    if (!Srb) {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: Format NVM completion - missing Srb!\n");
+#endif
+        return;
+    }
+
+    srbControl = (PSRB_IO_CONTROL)Srb->DataBuffer;
+    formats = (PNVME2KDB_LBA_FORMATS)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+    srbControl->ReturnCode = (status == NVME_SC_SUCCESS) ? NVME2KDB_RC_SUCCESS : NVME2KDB_RC_ERROR;
+
+    if (NvmeIdentifyEx(DevExt, DevExt->Namespaces[formats->Lun].NamespaceId, NVME_CNS_NAMESPACE,
+                       ADMIN_KIND_FORMAT_IDENTIFY, Srb)) {
+        return;
+    }
+
+    // The LUN stays not ready until the next rescan re-initializes the adapter
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: Format NVM - could not re-identify namespace\n");
+#endif
+    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+    Srb->SrbStatus = SRB_STATUS_ERROR;
+    ScsiPortNotification(RequestComplete, DevExt, Srb);
+    ScsiPortNotification(NextRequest, DevExt, NULL);
+}
+
+//
+// NvmeProcessFormatIdentifyCompletion - Namespace re-identified after Format NVM
+// Applies the new geometry and returns the new LBA format table
+//
+VOID NvmeProcessFormatIdentifyCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status)
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
+    PSRB_IO_CONTROL srbControl;
+    PNVME2KDB_LBA_FORMATS formats;
+    PNVME_NAMESPACE ns;
+
+    if (!Srb) {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: Format identify completion - missing Srb!\n");
+#endif
+        return;
+    }
+
+    srbControl = (PSRB_IO_CONTROL)Srb->DataBuffer;
+    formats = (PNVME2KDB_LBA_FORMATS)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+    ns = &DevExt->Namespaces[formats->Lun];
+
+    if (status == NVME_SC_SUCCESS && Request->PrpListPage != 0xFF) {
+        NvmeApplyNamespaceIdentify(DevExt, ns,
+                                   (PNVME_IDENTIFY_NAMESPACE)GetPrpListPageVirtual(DevExt, Request->PrpListPage));
+    } else {
+        srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+    }
+
+    NvmeToLbaFormats(DevExt, ns, formats);
+    srbControl->Length = sizeof(NVME2KDB_LBA_FORMATS);
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: Namespace %u after format - LBAF=%u blocks=%I64u status=0x%04X\n",
+                   ns->NamespaceId, formats->CurrentFormat, ns->SizeInBlocks, status);
+#endif
+
+    Srb->SrbStatus = (srbControl->ReturnCode == NVME2KDB_RC_SUCCESS) ? SRB_STATUS_SUCCESS : SRB_STATUS_ERROR;
+    ScsiPortNotification(RequestComplete, DevExt, Srb);
+    ScsiPortNotification(NextRequest, DevExt, NULL);
+}
+
+//
+// NvmeProcessAsyncEvent - An Asynchronous Event Request completed
+// The event is counted and logged, and the log page it names is queued to be read
+// (that unmasks the event type); NvmeArmAsyncEvents sends a new request for the
+// CID. A request that failed is not replaced, so a controller rejecting them
+// (AERL exceeded, aborted) ends up with fewer outstanding rather than a loop.
+//
+static VOID NvmeProcessAsyncEvent(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT CommandId, IN USHORT status, IN ULONG Dw0)
+{
+    UCHAR type;
+    UCHAR lid;
+
+    DevExt->AsyncEventCids &= ~(1UL << (CommandId - ADMIN_CID_AER_BASE));
+
+    if (status != NVME_SC_SUCCESS) {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: AER CID %04X failed with status 0x%04X, not re-armed\n", CommandId, status);
+#endif
+        if (DevExt->AsyncEventLimit > 0) {
+            DevExt->AsyncEventLimit--;
+        }
+        return;
+    }
+
+    type = (UCHAR)NVME_AER_TYPE(Dw0);
+    lid = (UCHAR)NVME_AER_LOG_PAGE(Dw0);
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: Asynchronous event DW0=%08X - type %u info 0x%02X log page 0x%02X\n",
+                   Dw0, type, NVME_AER_INFO(Dw0), lid);
+#endif
+
+    DevExt->AsyncEvents++;
+    DevExt->LastAsyncEvent = Dw0;
+
+    switch (type) {
+        case NVME_AER_TYPE_ERROR:
+            DevExt->AsyncEventsError++;
+            // Media and internal errors show up in the SMART/Health counters too
+            NvmeSmartLogInvalidate(DevExt);
+            ScsiPortLogError(DevExt, NULL, 0, 0, 0, SP_INTERNAL_ADAPTER_ERROR, Dw0);
+            break;
+
+        case NVME_AER_TYPE_SMART:
+            DevExt->AsyncEventsHealth++;
+            NvmeSmartLogInvalidate(DevExt);
+            ScsiPortLogError(DevExt, NULL, 0, 0, 0, SP_INTERNAL_ADAPTER_ERROR, Dw0);
+            break;
+
+        case NVME_AER_TYPE_NOTICE:
+            DevExt->AsyncEventsNotice++;
+            break;
+
+        default:
+            break;
+    }
+
+    // The event type stays masked until its log page is read
+    if (lid < 32) {
+        DevExt->AsyncEventLogsPending |= 1UL << lid;
+    }
+}
+
+//
+// NvmeProcessAsyncEventLogCompletion - A log page read for an asynchronous event
+// A SMART/Health log refreshes the cached copy and CriticalWarning.
+//
+static VOID NvmeProcessAsyncEventLogCompletion(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request, IN USHORT status)
+{
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: Asynchronous event log page 0x%02X read, status 0x%04X\n",
+                   Request->LogPageId, status);
+#endif
+    if (status == NVME_SC_SUCCESS && Request->LogPageId == NVME_LOG_PAGE_SMART_HEALTH) {
+        NvmeSmartLogStore(DevExt, (PNVME_SMART_INFO)GetPrpListPageVirtual(DevExt, Request->PrpListPage));
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: SMART/Health critical warning 0x%02X\n", DevExt->CriticalWarning);
+#endif
+    }
+}
+
 //
 // NvmeProcessAdminCompletion - Process admin queue completions
 //
@@ -275,7 +821,6 @@ BOOLEAN NvmeProcessAdminCompletion(IN PHW_DEVICE_EXTENSION DevExt)
     BOOLEAN processed = FALSE;
     USHORT status;
     USHORT commandId;
-    PNVME_IDENTIFY_NAMESPACE nsData;
     ULONG queueIndex;
     ULONG expectedPhase;
 
@@ -358,6 +903,24 @@ BOOLEAN NvmeProcessAdminCompletion(IN PHW_DEVICE_EXTENSION DevExt)
                         DevExt->ControllerFirmwareRevision[8] = 0;
 
                         DevExt->NumberOfNamespaces = ctrlData->NumberOfNamespaces;
+                        DevExt->OptionalAdminCommands = ctrlData->OptionalAdminCommands;
+                        DevExt->OptionalNvmCommands = ctrlData->OptionalNvmCommands;
+                        DevExt->FormatNvmAttributes = ctrlData->FormatNvmAttributes;
+
+                        // AERL is 0's based
+                        DevExt->AsyncEventsSupported = ctrlData->AsyncEventsSupported;
+                        DevExt->AsyncEventLimit = (ULONG)ctrlData->AsyncEventRequestLimit + 1;
+                        if (DevExt->AsyncEventLimit > NVME_MAX_ASYNC_EVENTS) {
+                            DevExt->AsyncEventLimit = NVME_MAX_ASYNC_EVENTS;
+                        }
+
+                        // Without a volatile write cache every completed write is already durable
+                        DevExt->VolatileWriteCache = (ctrlData->VolatileWriteCache & NVME_VWC_PRESENT) ? TRUE : FALSE;
+                        DevExt->WriteCacheEnabled = DevExt->VolatileWriteCache;
+                        DevExt->WriteCacheRequested = DevExt->VolatileWriteCache;
+
+                        // NvmeMini reads logs past one command's worth only with extended data
+                        DevExt->LogPageAttributes = ctrlData->LogPageAttributes;
 
                         // Read MDTS (Maximum Data Transfer Size)
                         // Per NVMe spec: MDTS specifies the maximum data transfer size for a command
@@ -396,25 +959,109 @@ BOOLEAN NvmeProcessAdminCompletion(IN PHW_DEVICE_EXTENSION DevExt)
                                         DevExt->MaxTransferSizeBytes);
                         }
 #endif
-                        NvmeIdentifyNamespace(DevExt);
+                        // The namespace list follows the APST table, or comes right away
+                        if (!NvmeConfigureApst(DevExt, ctrlData)) {
+                            NvmeIdentifyActiveNamespaces(DevExt);
+                        }
                     }
                     break;
 
-                case ADMIN_CID_IDENTIFY_NAMESPACE:
+                case ADMIN_CID_SET_FEATURES_APST:
+                    // Without APST the drive keeps whatever it had, init goes on either way
                     if (status == NVME_SC_SUCCESS) {
-                        nsData = (PNVME_IDENTIFY_NAMESPACE)DevExt->UtilityBuffer;
-                        DevExt->NamespaceSizeInBlocks = nsData->NamespaceSize;
+                        DevExt->ApstStatus = DevExt->ApstStates ? NVME2KDB_APST_ENABLED : NVME2KDB_APST_DISABLED;
+                    } else {
+                        DevExt->ApstStatus = NVME2KDB_APST_FAILED;
+                        DevExt->ApstStates = 0;
+                        DevExt->ApstIdleMs = 0;
+                        DevExt->ApstWakeUs = 0;
+                    }
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: APST configuration status 0x%04X, policy %u\n", status, DevExt->ApstStatus);
+#endif
+                    NvmeIdentifyActiveNamespaces(DevExt);
+                    break;
+
+                case ADMIN_CID_IDENTIFY_NS_LIST:
+                    {
+                        PULONG nsList = (PULONG)DevExt->UtilityBuffer;
+                        ULONG count = 0;
+                        ULONG i;
+
+                        // Active NSIDs in increasing order, terminated by 0
+                        if (status == NVME_SC_SUCCESS) {
+                            for (i = 0; i < NVME_PAGE_SIZE / sizeof(ULONG) && count < NVME_MAX_NAMESPACES; i++) {
+                                if (nsList[i] == 0) {
+                                    break;
+                                }
+                                DevExt->Namespaces[count++].NamespaceId = nsList[i];
+                            }
+                        }
 
-                        // Extract block size from formatted LBA size
-                        DevExt->NamespaceBlockSize = 1 << (nsData->FormattedLbaSize & 0x0F);
-                        if (DevExt->NamespaceBlockSize == 1) {
-                            DevExt->NamespaceBlockSize = 512;  // Default
+                        // NVMe 1.0 has no list: try NSIDs 1..NN, inactive ones identify with NSZE 0
+                        if (count == 0) {
+                            count = DevExt->NumberOfNamespaces;
+                            if (count == 0) {
+                                count = 1;
+                            } else if (count > NVME_MAX_NAMESPACES) {
+                                count = NVME_MAX_NAMESPACES;
+                            }
+                            for (i = 0; i < count; i++) {
+                                DevExt->Namespaces[i].NamespaceId = i + 1;
+                            }
                         }
 
 #ifdef NVME2K_DBG
-                        ScsiDebugPrint(0, "nvme2k: Identified namespace - blocks=%I64u blocksize=%u bytes\n",
-                                    DevExt->NamespaceSizeInBlocks, DevExt->NamespaceBlockSize);
+                        ScsiDebugPrint(0, "nvme2k: %u namespace(s) to identify (list status 0x%04X)\n", count, status);
 #endif
+                        DevExt->NamespaceCount = count;
+                        DevExt->NamespaceInitIndex = 0;
+                        NvmeIdentifyNamespace(DevExt, DevExt->Namespaces[0].NamespaceId);
+                    }
+                    break;
+
+                case ADMIN_CID_IDENTIFY_NAMESPACE:
+                    {
+                        PNVME_NAMESPACE ns = &DevExt->Namespaces[DevExt->NamespaceInitIndex];
+                        ULONG i, count;
+
+                        ns->SizeInBlocks = 0;
+                        if (status == NVME_SC_SUCCESS) {
+                            NvmeApplyNamespaceIdentify(DevExt, ns, (PNVME_IDENTIFY_NAMESPACE)DevExt->UtilityBuffer);
+                        }
+
+                        // Next namespace
+                        if (++DevExt->NamespaceInitIndex < DevExt->NamespaceCount) {
+                            NvmeIdentifyNamespace(DevExt, DevExt->Namespaces[DevExt->NamespaceInitIndex].NamespaceId);
+                            break;
+                        }
+
+                        // Drop inactive and unusable namespaces, LUNs are numbered densely
+                        count = 0;
+                        for (i = 0; i < DevExt->NamespaceCount; i++) {
+                            if (DevExt->Namespaces[i].SizeInBlocks != 0) {
+                                if (i != count) {
+                                    DevExt->Namespaces[count] = DevExt->Namespaces[i];
+                                    memset(&DevExt->Namespaces[i], 0, sizeof(NVME_NAMESPACE));
+                                    DevExt->Namespaces[i].BlockSize = 512;
+                                }
+                                count++;
+                            }
+                        }
+                        DevExt->NamespaceCount = count;
+
+#ifdef NVME2K_DBG
+                        ScsiDebugPrint(0, "nvme2k: %u namespace(s) exposed as LUNs\n", count);
+#endif
+
+                        // Read the current write cache state if there is one to read
+                        if (DevExt->VolatileWriteCache &&
+                            NvmeGetFeatures(DevExt, NVME_FEATURE_VOLATILE_WRITE_CACHE, ADMIN_CID_GET_FEATURES_VWC)) {
+                            break;
+                        }
+                        if (NvmeConfigureAsyncEvents(DevExt)) {
+                            break;
+                        }
 
                         DevExt->InitComplete = TRUE;
 
@@ -424,6 +1071,38 @@ BOOLEAN NvmeProcessAdminCompletion(IN PHW_DEVICE_EXTENSION DevExt)
                     }
                     break;
 
+                case ADMIN_CID_GET_FEATURES_VWC:
+                    // DW0 bit 0 = WCE. On failure keep assuming the cache is on.
+                    if (status == NVME_SC_SUCCESS) {
+                        DevExt->WriteCacheEnabled = (cqEntry->DW0 & 1) ? TRUE : FALSE;
+                        DevExt->WriteCacheRequested = DevExt->WriteCacheEnabled;
+                    }
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: Volatile write cache present, WCE=%u (status 0x%04X)\n",
+                                   DevExt->WriteCacheEnabled, status);
+#endif
+                    if (NvmeConfigureAsyncEvents(DevExt)) {
+                        break;
+                    }
+                    DevExt->InitComplete = TRUE;
+
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: Init complete - driver ready for I/O\n");
+#endif
+                    break;
+
+                case ADMIN_CID_SET_FEATURES_AEC:
+                    // Events the controller enables by default still arrive if this failed
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: Asynchronous event configuration status 0x%04X\n", status);
+#endif
+                    DevExt->InitComplete = TRUE;
+
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: Init complete - driver ready for I/O\n");
+#endif
+                    break;
+
                 default:
 #ifdef NVME2K_DBG
                     ScsiDebugPrint(0, "nvme2k: unknown init time admin CID %04X\n", commandId);
@@ -433,11 +1112,48 @@ BOOLEAN NvmeProcessAdminCompletion(IN PHW_DEVICE_EXTENSION DevExt)
             }
         } else {
             // Post-initialization admin commands
-            // Check if this is a Get Log Page command
-            if (commandId == ADMIN_CID_GET_LOG_PAGE) {
-                NvmeProcessGetLogPageCompletion(DevExt, status, commandId);
-            } else if (commandId == ADMIN_CID_USER_IDENTIFY || commandId == ADMIN_CID_USER_GET_LOG_PAGE) {
-                NvmeProcessUserExtensionCompletion(DevExt, commandId, status, cqEntry);
+            // SRB and PRP page are tracked in the admin request table, keyed by CID
+            PNVME_ADMIN_REQUEST request = NvmeGetAdminRequest(DevExt, commandId);
+
+            if (request) {
+                switch (request->Kind) {
+                    case ADMIN_KIND_GET_LOG_PAGE:
+                        NvmeProcessGetLogPageCompletion(DevExt, request, status);
+                        break;
+                    case ADMIN_KIND_SET_FEATURES_VWC:
+                        NvmeProcessSetFeaturesCompletion(DevExt, request, status);
+                        break;
+                    case ADMIN_KIND_USER_IDENTIFY:
+                    case ADMIN_KIND_USER_GET_LOG_PAGE:
+                        if (!NvmeProcessUserExtensionCompletion(DevExt, request, status, cqEntry)) {
+                            // The slot carries the next piece of the log
+                            request = NULL;
+                        }
+                        break;
+                    case ADMIN_KIND_USER_FEATURES:
+                        NvmeProcessUserFeaturesCompletion(DevExt, request, status, cqEntry);
+                        break;
+                    case ADMIN_KIND_FORMAT_NVM:
+                        NvmeProcessFormatCompletion(DevExt, request, status);
+                        break;
+                    case ADMIN_KIND_FORMAT_IDENTIFY:
+                        NvmeProcessFormatIdentifyCompletion(DevExt, request, status);
+                        break;
+                    case ADMIN_KIND_ASYNC_EVENT_LOG:
+                        NvmeProcessAsyncEventLogCompletion(DevExt, request, status);
+                        break;
+                    default:
+#ifdef NVME2K_DBG
+                        ScsiDebugPrint(0, "nvme2k: admin CID %04X has unknown kind %u\n", commandId, request->Kind);
+#endif
+                        break;
+                }
+                // Releases the PRP page even if the SRB went missing
+                if (request) {
+                    NvmeFreeAdminRequest(DevExt, request);
+                }
+            } else if (ADMIN_CID_IS_AER(commandId)) {
+                NvmeProcessAsyncEvent(DevExt, commandId, status, cqEntry->DW0);
             } else {
                 if (ADMIN_CID_SHUTDOWN_DELETE_SQ == commandId) {
                     if (status != NVME_SC_SUCCESS) {
@@ -466,9 +1182,250 @@ BOOLEAN NvmeProcessAdminCompletion(IN PHW_DEVICE_EXTENSION DevExt)
         NvmeRingDoorbell(DevExt, Queue->QueueId, FALSE, (USHORT)(Queue->CompletionQueueHead & Queue->QueueSizeMask));
     }
 
+
+    // Re-arm Asynchronous Event Requests and read the logs events asked for
+    if (DevExt->InitComplete) {
+        NvmeArmAsyncEvents(DevExt);
+    }
+
     return processed;
 }
 
+//
+// NvmeThrottleSample - Adaptive queue depth limit (LatencyTargetUs)
+// Read/write completion latency is smoothed into LatencyEstimate with a 1/8 weight.
+// Every QueueDepthLimit completions the limit is cut by a quarter if the estimate is
+// above target, or raised by one if it is below and submissions actually ran into
+// the limit during that window (AIMD), so the limit tracks the depth at which the
+// drive's latency turns (e.g. SLC cache exhaustion) instead of a fixed SQ size.
+//
+static VOID NvmeThrottleSample(IN PHW_DEVICE_EXTENSION DevExt, IN ULONGLONG SubmitTime)
+{
+    ULONGLONG latency;
+    ULONG limit;
+
+    if (DevExt->LatencyTargetTicks == 0) {
+        return;
+    }
+
+    latency = NvmeReadTimestamp(DevExt) - SubmitTime;
+    if (latency > DevExt->LatencyEstimate) {
+        DevExt->LatencyEstimate += (latency - DevExt->LatencyEstimate) >> 3;
+    } else {
+        DevExt->LatencyEstimate -= (DevExt->LatencyEstimate - latency) >> 3;
+    }
+
+    if (++DevExt->ThrottleWindowCount < DevExt->QueueDepthLimit) {
+        return;
+    }
+    DevExt->ThrottleWindowCount = 0;
+
+    limit = DevExt->QueueDepthLimit;
+    if (DevExt->LatencyEstimate > DevExt->LatencyTargetTicks) {
+        limit -= (limit >= 8) ? limit / 4 : 1;
+        if (limit < NVME_QD_LIMIT_MIN) {
+            limit = NVME_QD_LIMIT_MIN;
+        }
+    } else if (DevExt->ThrottleLimitReached && limit < NVME_MAX_QUEUE_SIZE) {
+        limit++;
+    }
+    DevExt->ThrottleLimitReached = FALSE;
+
+    if (limit < DevExt->QueueDepthLimit) {
+        DevExt->ThrottleDecreases++;
+    } else if (limit > DevExt->QueueDepthLimit) {
+        DevExt->ThrottleIncreases++;
+    }
+#ifdef NVME2K_DBG_EXTRA
+    if (limit != DevExt->QueueDepthLimit) {
+        ScsiDebugPrint(0, "nvme2k: Queue depth limit %u -> %u (latency %u us)\n", DevExt->QueueDepthLimit, limit,
+                       (ULONG)NvmeTimestampToUs(DevExt, DevExt->LatencyEstimate));
+    }
+#endif
+    DevExt->QueueDepthLimit = limit;
+}
+
+//
+// NvmeProcessSplitCompletion - One command of a split (512e or NOIOB) read or write completed
+// Copies a read's bounce page into the SRB buffer, and merges the SRB data into a
+// pre-read block and writes it back on the same CID. Returns TRUE once the last
+// command of the SRB is done, with the SRB's first error in *Status and the kind
+// of the whole SRB (IO_KIND_READ or IO_KIND_WRITE) in *Kind; the caller then
+// completes it like a plain read or write and frees the CID. Otherwise the CID is
+// freed or reused here.
+//
+static BOOLEAN NvmeProcessSplitCompletion(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PNVME_IO_REQUEST Request,
+    IN USHORT CommandId,
+    IN OUT PUSHORT Status,
+    IN OUT PUCHAR Kind)
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
+    PNVME_SRB_EXTENSION srbExt;
+    PNVME_NAMESPACE ns;
+    PUCHAR bounce;
+    ULONG srbOffset;
+    ULONG bounceOffset;
+    ULONG length;
+
+    if (Srb == NULL || Srb->SrbExtension == NULL) {
+        return TRUE;
+    }
+    srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+    ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+
+    if (*Status == NVME_SC_SUCCESS && NVME_SPLIT_BOUNCED(Request->Segment)) {
+        NvmeGetSplitSegment(ns, srbExt, Request->Segment, &srbOffset, &bounceOffset, &length);
+        bounce = (PUCHAR)GetPrpListPageVirtual(DevExt, Request->PrpListPage);
+
+        if (Request->Kind == IO_KIND_SPLIT_READ) {
+            memcpy((PUCHAR)Srb->DataBuffer + srbOffset, bounce + bounceOffset, length);
+        } else if (Request->Kind == IO_KIND_RMW_READ) {
+            NVME_COMMAND nvmeCmd;
+            ULONGLONG lba;
+            ULONG numBlocks;
+            BOOLEAN fua;
+
+            // Modify, then write the whole block back from the same bounce page
+            memcpy(bounce + bounceOffset, (PUCHAR)Srb->DataBuffer + srbOffset, length);
+            ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua);
+            Request->Kind = IO_KIND_SPLIT_WRITE;
+            NvmeBuildSplitCommand(DevExt, Srb, &nvmeCmd, CommandId, fua);
+
+            // This completion freed the SQ slot it goes into
+            if (NvmeSubmitIoCommand(DevExt, &nvmeCmd)) {
+                DevExt->CurrentQueueDepth--;
+                return FALSE;
+            }
+            *Status = NVME_SC_INTERNAL;
+        }
+    }
+
+    if (*Status != NVME_SC_SUCCESS && srbExt->SplitStatus == NVME_SC_SUCCESS) {
+        srbExt->SplitStatus = (UCHAR)*Status;
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: Split I/O CID=%d segment %u failed - NVMe Status=0x%02X\n",
+                       CommandId, Request->Segment, *Status);
+#endif
+    }
+
+    if (srbExt->SplitPending > 1) {
+        srbExt->SplitPending--;
+        NvmeFreeIoRequest(DevExt, Request);
+        DevExt->CurrentQueueDepth--;
+        return FALSE;
+    }
+
+    // Last one: complete the SRB
+    srbExt->SplitPending = 0;
+    *Status = srbExt->SplitStatus;
+    *Kind = (Srb->SrbFlags & SRB_FLAGS_DATA_OUT) ? IO_KIND_WRITE : IO_KIND_READ;
+    return TRUE;
+}
+
+//
+// NvmeProcessCopyCompletion - A command of an NVME2KDB COPY step completed
+// A read goes back out as the write of the same pages on the same CID, and a write
+// moves BlocksDone on and reads the next piece while the step has room. Returns
+// TRUE once the step is over (the caller frees the CID and completes the SRB),
+// FALSE while the CID is still in use. The outcome goes in ReturnCode and the SRB
+// itself succeeds, so the progress gets back to the caller either way.
+//
+static BOOLEAN NvmeProcessCopyCompletion(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PNVME_IO_REQUEST Request,
+    IN USHORT CommandId,
+    IN OUT PUSHORT Status)
+{
+    PSCSI_REQUEST_BLOCK Srb = Request->Srb;
+    PSRB_IO_CONTROL srbControl;
+    PNVME2KDB_COPY copy;
+    PNVME_NAMESPACE ns;
+    NVME_COMMAND nvmeCmd;
+    ULONG blocks;
+
+    if (Srb == NULL) {
+        if (Request->Segment != 0xFF) {
+            FreePrpListPage(DevExt, Request->Segment);
+            Request->Segment = 0xFF;
+        }
+        return TRUE;
+    }
+    srbControl = (PSRB_IO_CONTROL)Srb->DataBuffer;
+    copy = (PNVME2KDB_COPY)(srbControl + 1);
+    ns = &DevExt->Namespaces[copy->Lun];
+
+    switch (Request->Kind) {
+    case IO_KIND_COPY:
+        // Even a failed Copy may have written part of the destination
+        NvmeCacheInvalidateCopy(DevExt, copy, copy->BlocksCopied);
+        ns->WriteGeneration++;
+        if (*Status == NVME_SC_SUCCESS) {
+            copy->BlocksDone += copy->BlocksCopied;
+        } else {
+            copy->BlocksCopied = 0;
+        }
+        break;
+
+    case IO_KIND_COPY_READ:
+        if (*Status != NVME_SC_SUCCESS) {
+            break;
+        }
+        Request->Kind = IO_KIND_COPY_WRITE;
+        blocks = NvmeBuildCopyPieceCommand(DevExt, Request, copy, &nvmeCmd, CommandId);
+        NvmeCacheInvalidateCopy(DevExt, copy, blocks);
+
+        // This completion freed the SQ slot it goes into
+        if (NvmeSubmitIoCommand(DevExt, &nvmeCmd)) {
+            DevExt->CurrentQueueDepth--;
+            return FALSE;
+        }
+        *Status = NVME_SC_INTERNAL;
+        break;
+
+    case IO_KIND_COPY_WRITE:
+        // Rebuilt only for the size of the piece just written
+        blocks = NvmeBuildCopyPieceCommand(DevExt, Request, copy, &nvmeCmd, CommandId);
+        NvmeCacheInvalidateCopy(DevExt, copy, blocks);
+        ns->WriteGeneration++;
+        if (*Status != NVME_SC_SUCCESS) {
+            break;
+        }
+        copy->BlocksDone += blocks;
+        copy->BlocksCopied += blocks;
+
+        // Next piece while the step has room; a full SQ just ends the step early
+        if (copy->BlocksCopied * ns->BlockSize < NVME2KDB_COPY_STEP_BYTES) {
+            Request->Kind = IO_KIND_COPY_READ;
+            if (NvmeBuildCopyPieceCommand(DevExt, Request, copy, &nvmeCmd, CommandId) != 0 &&
+                NvmeSubmitIoCommand(DevExt, &nvmeCmd)) {
+                DevExt->CurrentQueueDepth--;
+                return FALSE;
+            }
+        }
+        break;
+    }
+
+    if (Request->Segment != 0xFF) {
+        FreePrpListPage(DevExt, Request->Segment);
+        Request->Segment = 0xFF;
+    }
+
+    if (*Status == NVME_SC_SUCCESS) {
+        srbControl->ReturnCode = NVME2KDB_RC_SUCCESS;
+    } else {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: COPY CID=%d kind %u failed at block %08X%08X - NVMe Status=0x%02X\n",
+                       CommandId, Request->Kind, (ULONG)(copy->BlocksDone >> 32),
+                       (ULONG)copy->BlocksDone, *Status);
+#endif
+        srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+        *Status = NVME_SC_SUCCESS;
+    }
+    return TRUE;
+}
+
 //
 // NvmeProcessIoCompletion - Process I/O queue completions
 //
@@ -480,6 +1437,8 @@ BOOLEAN NvmeProcessIoCompletion(IN PHW_DEVICE_EXTENSION DevExt)
     USHORT status;
     USHORT commandId;
     PSCSI_REQUEST_BLOCK Srb;
+    PNVME_IO_REQUEST request;
+    UCHAR kind;
     ULONG queueIndex;
     ULONG expectedPhase;
 
@@ -526,22 +1485,104 @@ BOOLEAN NvmeProcessIoCompletion(IN PHW_DEVICE_EXTENSION DevExt)
         ScsiDebugPrint(0, "nvme2k: NvmeProcessIoCompletion - CID=%d Status=0x%04X SQHead=%d\n",
                        commandId, status, Queue->SubmissionQueueHead);
 #endif
-        // Retrieve SRB from command ID using ScsiPortGetSrb
-        Srb = NvmeGetSrbFromCommandId(DevExt, commandId);
-
-        if (Srb == NULL) {
+        // Look up the command in the driver-owned CID table
+        request = NvmeGetIoRequest(DevExt, commandId);
+        if (request == NULL) {
 #ifdef NVME2K_DBG
-            ScsiDebugPrint(0, "nvme2k: ERROR - Got NULL SRB for CID=%d! This should not happen.\n", commandId);
+            ScsiDebugPrint(0, "nvme2k: ERROR - Completion for CID=%d which is not outstanding!\n", commandId);
 #endif
-            // Clear non-tagged flag to prevent driver from getting stuck
-            if (commandId & CID_NON_TAGGED_FLAG) {
+            continue;
+        }
+        Srb = request->Srb;
+        kind = request->Kind;
+
+        // TRIM pattern pages of a write: remember the deallocated ranges, then count it
+        // down like the write pieces sent with it
+        if (kind == IO_KIND_DEALLOCATE) {
+            if (Srb != NULL) {
+                NvmeProcessDeallocCompletion(DevExt, request, Srb->Lun, NVME_DSM_MAX_RANGES, status);
+            }
+            kind = IO_KIND_SPLIT_WRITE;
+        }
+
+        // Read cache fill: copy the requested blocks out, then complete it as a read
+        if (kind == IO_KIND_CACHE_FILL) {
+            NvmeProcessCacheFillCompletion(DevExt, request, status);
+            kind = IO_KIND_READ;
+        }
+
+        // NVME2KDB DEALLOCATE or SAT TRIM: record the ranges while the range list is still around
+        if (kind == IO_KIND_DSM) {
+            NvmeProcessDsmCompletion(DevExt, request, status);
+        }
+
+        // NvmeMini I/O queue command: the caller reads the NVMe status from Completion[]
+        if (kind == IO_KIND_USER) {
+            NvmeProcessUserIoCompletion(DevExt, request, status, cqEntry);
+            status = NVME_SC_SUCCESS;
+        }
+
+        // NVME2KDB COPY: a read goes out again as its write, a write may read the next piece
+        if (kind >= IO_KIND_COPY && kind <= IO_KIND_COPY_WRITE &&
+            !NvmeProcessCopyCompletion(DevExt, request, commandId, &status)) {
+            continue;
+        }
+
+        // Pieces of a split read or write, the last one completes the SRB
+        if (kind >= IO_KIND_SPLIT_READ && kind <= IO_KIND_RMW_READ &&
+            !NvmeProcessSplitCompletion(DevExt, request, commandId, &status, &kind)) {
+            continue;
+        }
+
+        // Feed read/write latency to the adaptive queue depth limit
+        if (kind == IO_KIND_READ || kind == IO_KIND_WRITE) {
+            NvmeThrottleSample(DevExt, request->SubmitTime);
+        }
+
+        // Free the PRP list page and the CID
+        NvmeFreeIoRequest(DevExt, request);
+
+        // Every completed write (successful or not) may have dirtied the namespace's cache
+        if (kind == IO_KIND_WRITE && Srb != NULL) {
+            PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+
+            if (ns->WritesOutstanding > 0) {
+                ns->WritesOutstanding--;
+            }
+            ns->WriteGeneration++;
+            // A fill sent while the write was outstanding may have read the old data
+            NvmeCacheInvalidateSrb(DevExt, Srb);
+            DevExt->WriteBytesInFlight -= (Srb->DataTransferLength < DevExt->WriteBytesInFlight) ?
+                Srb->DataTransferLength : DevExt->WriteBytesInFlight;
+        }
+
+        if (Srb != NULL && DevExt->NonTaggedInFlight == Srb) {
+            DevExt->NonTaggedInFlight = NULL;
+        }
+
+        // Decrement queue depth tracking, the CID was on the device whatever became of its SRB
+        if (DevExt->CurrentQueueDepth > 0) {
+            DevExt->CurrentQueueDepth--;
+        }
+
+        // The barrier goes with the CID, even if the SRB was completed elsewhere
+        if (Srb != NULL && DevExt->OrderedInFlight == Srb) {
+            DevExt->OrderedInFlight = NULL;
+        }
+
+        // Nothing new is started while an ORDERED SRB is running,
+        // and ScsiPort is only asked for more while the staging queue has room
+        if (DevExt->Busy && !DevExt->OrderedInFlight && !NVME_STAGING_FULL(DevExt)) {
+            // hopefully some resources freed up so signal that we can process next request
+            DevExt->Busy = FALSE;
+            ScsiPortNotification(NextRequest, DevExt, NULL);
+        }
+
+        if (Srb == NULL) {
 #ifdef NVME2K_DBG
-                ScsiDebugPrint(0, "nvme2k: Clearing NonTaggedInFlight flag for orphaned CID\n");
+            ScsiDebugPrint(0, "nvme2k: CID=%d completed without an SRB\n", commandId);
 #endif
-            }
         } else {
-            PNVME_SRB_EXTENSION srbExt;
-
             // Validate SRB before processing
             if (Srb->SrbStatus != SRB_STATUS_PENDING) {
 #ifdef NVME2K_DBG
@@ -553,7 +1594,8 @@ BOOLEAN NvmeProcessIoCompletion(IN PHW_DEVICE_EXTENSION DevExt)
                 continue;
             }
 
-            if (Srb->Function != SRB_FUNCTION_EXECUTE_SCSI) {
+            if (Srb->Function != SRB_FUNCTION_EXECUTE_SCSI && kind != IO_KIND_DSM && kind != IO_KIND_USER &&
+                (kind < IO_KIND_COPY || kind > IO_KIND_COPY_WRITE)) {
 #ifdef NVME2K_DBG
                 ScsiDebugPrint(0, "nvme2k: ERROR - SRB CID=%d has invalid function 0x%02X\n",
                                commandId, Srb->Function);
@@ -568,42 +1610,6 @@ BOOLEAN NvmeProcessIoCompletion(IN PHW_DEVICE_EXTENSION DevExt)
                 continue;
             }
 
-            // Get SRB extension for PRP list cleanup
-            srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
-
-            // Free PRP list page if allocated
-            if (srbExt->PrpListPage != 0xFF) {
-                FreePrpListPage(DevExt, srbExt->PrpListPage);
-                srbExt->PrpListPage = 0xFF;
-            }
-
-            // Check if this was a TRIM operation that we need to restore buffer for
-            if (DevExt->TrimEnable && Srb->DataTransferLength >= 4096) {
-                PCDB cdb = (PCDB)Srb->Cdb;
-                BOOLEAN isWrite = FALSE;
-
-                // Check if this is a write operation
-                switch (cdb->CDB10.OperationCode) {
-                    case SCSIOP_WRITE6:
-                    case SCSIOP_WRITE:
-                        isWrite = TRUE;
-                        break;
-                }
-
-                // If write, check if bytes 16-4095 match TrimPattern (excluding first 16 bytes we corrupted)
-                if (isWrite && Srb->DataBuffer) {
-                    PUCHAR dataBuffer = (PUCHAR)Srb->DataBuffer;
-                    // Compare bytes 16-4095 with TrimPattern offset by 4 ULONGs (16 bytes)
-                    if (memcmp(dataBuffer + 16, (PUCHAR)DevExt->TrimPattern + 16, 4096 - 16) == 0) {
-                        // This was a TRIM operation - restore the first 16 bytes from TrimPattern
-#ifdef NVME2K_DBG_EXTRA
-                        ScsiDebugPrint(0, "nvme2k: Restoring first 16 bytes of TRIM buffer\n");
-#endif
-                        memcpy(dataBuffer, DevExt->TrimPattern, 16);
-                    }
-                }
-            }
-
             // Set SRB status based on NVMe status
             if (status == NVME_SC_SUCCESS) {
                 Srb->SrbStatus = SRB_STATUS_SUCCESS;
@@ -637,22 +1643,26 @@ BOOLEAN NvmeProcessIoCompletion(IN PHW_DEVICE_EXTENSION DevExt)
 #endif
             }
 
-            // Complete the request - ScsiPort takes ownership of the SRB
-            ScsiPortNotification(RequestComplete, DevExt, Srb);
-            if (DevExt->Busy) {
-                // hopefully some resources freed up so signal that we can process next request
-                DevExt->Busy = FALSE;
-                ScsiPortNotification(NextRequest, DevExt, NULL);
+            // Device flush: record what it covered and release piggybacked flushes
+            if (kind == IO_KIND_FLUSH) {
+                NvmeProcessFlushCompletion(DevExt, Srb, status);
             }
 
-
-            // Decrement queue depth tracking
-            if (DevExt->CurrentQueueDepth > 0) {
-                DevExt->CurrentQueueDepth--;
-            }
+            // Complete the request - ScsiPort takes ownership of the SRB
+            ScsiPortNotification(RequestComplete, DevExt, Srb);
         }
     }
 
+    // Completions freed SQ slots, CIDs and PRP pages: feed the scheduler FIFOs first
+    // (they only hold SRBs older than anything staged), then staged SRBs
+    // (including an ORDERED one whose predecessors have all completed)
+    if (processed && DevExt->SchedQueued) {
+        ScsiSchedDispatch(DevExt);
+    }
+    if (processed && DevExt->StagedHead) {
+        ScsiStartStagedSrbs(DevExt);
+    }
+
     // Ring completion doorbell ONCE with the final head position after processing all completions
     // This acknowledges all processed completions and clears the interrupt
     if (processed) {
@@ -138,6 +138,12 @@ BOOLEAN NvmeSubmitIoCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_COMMAND Cmd
     result = NvmeSubmitCommand(DevExt, &DevExt->IoQueue, Cmd);
 
     if (result) {
+        PNVME_IO_REQUEST request = NvmeGetIoRequest(DevExt, Cmd->CDW0.Fields.CommandId);
+
+        if (request) {
+            request->SubmitTime = NvmeReadTimestamp(DevExt);
+        }
+
         // Command successfully submitted - update queue depth tracking
         DevExt->CurrentQueueDepth++;
 
@@ -215,10 +221,36 @@ BOOLEAN NvmeIdentifyController(IN PHW_DEVICE_EXTENSION DevExt)
     return NvmeSubmitAdminCommand(DevExt, &cmd);
 }
 
+//
+// NvmeIdentifyActiveNamespaces - Send Identify for the active namespace ID list
+//
+BOOLEAN NvmeIdentifyActiveNamespaces(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    NVME_COMMAND cmd;
+
+    memset(&cmd, 0, sizeof(NVME_COMMAND));
+
+    // Build Identify command, CNS 02h: NSIDs above NSID (0 = from the start)
+    cmd.CDW0.Fields.Opcode = NVME_ADMIN_IDENTIFY;
+    cmd.CDW0.Fields.Flags = 0;
+    cmd.CDW0.Fields.CommandId = ADMIN_CID_IDENTIFY_NS_LIST;
+    cmd.NSID = 0;
+    cmd.PRP1 = DevExt->UtilityBufferPhys.QuadPart;
+    cmd.PRP2 = 0;  // Single page transfer, no PRP2 needed
+    cmd.CDW10 = NVME_CNS_ACTIVE_NSIDS;
+
+#ifdef NVME2K_DBG_CMD
+    ScsiDebugPrint(0, "nvme2k: NvmeIdentifyActiveNamespaces - CDW0=%08X (OPC=%02X CID=%04X) PRP1=%08X%08X CDW10=%08X\n",
+                   cmd.CDW0.AsUlong, cmd.CDW0.Fields.Opcode, cmd.CDW0.Fields.CommandId,
+                   (ULONG)(cmd.PRP1 >> 32), (ULONG)(cmd.PRP1 & 0xFFFFFFFF), cmd.CDW10);
+#endif
+    return NvmeSubmitAdminCommand(DevExt, &cmd);
+}
+
 //
 // NvmeIdentifyNamespace - Send Identify Namespace command
 //
-BOOLEAN NvmeIdentifyNamespace(IN PHW_DEVICE_EXTENSION DevExt)
+BOOLEAN NvmeIdentifyNamespace(IN PHW_DEVICE_EXTENSION DevExt, IN ULONG NamespaceId)
 {
     NVME_COMMAND cmd;
 
@@ -228,7 +260,7 @@ BOOLEAN NvmeIdentifyNamespace(IN PHW_DEVICE_EXTENSION DevExt)
     cmd.CDW0.Fields.Opcode = NVME_ADMIN_IDENTIFY;
     cmd.CDW0.Fields.Flags = 0;
     cmd.CDW0.Fields.CommandId = ADMIN_CID_IDENTIFY_NAMESPACE;
-    cmd.NSID = 1;  // Namespace ID 1
+    cmd.NSID = NamespaceId;
     cmd.PRP1 = DevExt->UtilityBufferPhys.QuadPart;
     cmd.PRP2 = 0;  // Single page transfer, no PRP2 needed
     cmd.CDW10 = NVME_CNS_NAMESPACE;
@@ -244,50 +276,37 @@ BOOLEAN NvmeIdentifyNamespace(IN PHW_DEVICE_EXTENSION DevExt)
 
 //
 // NvmeIdentifyEx - Send Identify command with custom parameters
+// The 4KB result lands in the admin request's PRP page
 //
 BOOLEAN NvmeIdentifyEx(
     IN PHW_DEVICE_EXTENSION DevExt,
     IN ULONG NamespaceId,
     IN ULONG CNS,
-    IN USHORT CommandId,
+    IN UCHAR Kind,
     IN PSCSI_REQUEST_BLOCK Srb)
 {
     NVME_COMMAND cmd;
-    PVOID prpPageVirt;
-    UCHAR prpPageIndex;
-    PNVME_SRB_EXTENSION srbExt;
-
-    // Store PRP page index in SRB extension so we can free it on completion
-    if (!Srb->SrbExtension) {
-#ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: NvmeIdentifyEx - SRB has no extension\n");
-#endif
-        return FALSE;
-    }
-    srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+    USHORT commandId;
+    PNVME_ADMIN_REQUEST request;
 
-    // Allocate a PRP page for the identify data buffer (4KB)
-    prpPageIndex = AllocatePrpListPage(DevExt);
-    if (prpPageIndex == 0xFF) {
+    // Claim an admin slot and a zeroed PRP page for the identify data buffer (4KB)
+    commandId = NvmeAllocAdminRequest(DevExt, Srb, Kind, TRUE);
+    if (commandId == 0) {
 #ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: NvmeIdentifyEx - Failed to allocate PRP page\n");
+        ScsiDebugPrint(0, "nvme2k: NvmeIdentifyEx - no admin slot or PRP page\n");
 #endif
         return FALSE;
     }
-    srbExt->PrpListPage = prpPageIndex;
-
-    // Zero out the page to prevent stale data issues
-    prpPageVirt = GetPrpListPageVirtual(DevExt, prpPageIndex);
-    memset(prpPageVirt, 0, NVME_PAGE_SIZE);
+    request = NvmeGetAdminRequest(DevExt, commandId);
 
     memset(&cmd, 0, sizeof(NVME_COMMAND));
 
     // Build Identify command
     cmd.CDW0.Fields.Opcode = NVME_ADMIN_IDENTIFY;
     cmd.CDW0.Fields.Flags = 0;
-    cmd.CDW0.Fields.CommandId = CommandId;
+    cmd.CDW0.Fields.CommandId = commandId;
     cmd.NSID = NamespaceId;
-    cmd.PRP1 = GetPrpListPagePhysical(DevExt, prpPageIndex).QuadPart;
+    cmd.PRP1 = GetPrpListPagePhysical(DevExt, request->PrpListPage).QuadPart;
     cmd.PRP2 = 0;  // Single page transfer, no PRP2 needed
     cmd.CDW10 = CNS;
 
@@ -298,9 +317,8 @@ BOOLEAN NvmeIdentifyEx(
                    cmd.CDW10);
 #endif
 
-    DevExt->NonTaggedInFlight = Srb;
     if (!NvmeSubmitAdminCommand(DevExt, &cmd)) {
-        DevExt->NonTaggedInFlight = NULL;
+        NvmeFreeAdminRequest(DevExt, request);
         return FALSE;
     } else {
         return TRUE;
@@ -309,46 +327,33 @@ BOOLEAN NvmeIdentifyEx(
 
 //
 // NvmeGetLogPage - Retrieve a log page from NVMe device asynchronously
-// Uses PRP page allocator for DMA buffer, untagged operation
-// ScsiPort guarantees only one untagged request at a time
+// Uses PRP page allocator for DMA buffer, tracked in an admin request slot
+// so it does not occupy the non-tagged I/O slot
 //
 BOOLEAN NvmeGetLogPage(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR LogPageId)
 {
     NVME_COMMAND cmd;
-    PVOID prpPageVirt;
-    UCHAR prpPageIndex;
+    USHORT commandId;
+    PNVME_ADMIN_REQUEST request;
     ULONG numdl;
-    PNVME_SRB_EXTENSION srbExt;
-
-    // Store PRP page index in SRB extension so we can free it on completion
-    if (!Srb->SrbExtension) {
-#ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: NvmeGetLogPage - SRB has no extension\n");
-#endif
-        return FALSE;
-    }
-    srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
 
-    // Allocate a PRP page for the log data buffer (4KB)
-    prpPageIndex = AllocatePrpListPage(DevExt);
-    if (prpPageIndex == 0xFF) {
+    // Claim an admin slot and a zeroed PRP page for the log data buffer (4KB)
+    commandId = NvmeAllocAdminRequest(DevExt, Srb, ADMIN_KIND_GET_LOG_PAGE, TRUE);
+    if (commandId == 0) {
 #ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: NvmeGetLogPage - Failed to allocate PRP page\n");
+        ScsiDebugPrint(0, "nvme2k: NvmeGetLogPage - no admin slot or PRP page\n");
 #endif
         return FALSE;
     }
-    srbExt->PrpListPage = prpPageIndex;
-
-    // Zero out the page to prevent stale data issues
-    prpPageVirt = GetPrpListPageVirtual(DevExt, prpPageIndex);
-    memset(prpPageVirt, 0, NVME_PAGE_SIZE);
+    request = NvmeGetAdminRequest(DevExt, commandId);
+    request->LogPageId = LogPageId;
 
     memset(&cmd, 0, sizeof(NVME_COMMAND));
 
     cmd.CDW0.Fields.Opcode = NVME_ADMIN_GET_LOG_PAGE;
-    cmd.CDW0.Fields.CommandId = ADMIN_CID_GET_LOG_PAGE;
+    cmd.CDW0.Fields.CommandId = commandId;
     cmd.NSID = 0xFFFFFFFF;  // Global log page (not namespace-specific)
-    cmd.PRP1 = GetPrpListPagePhysical(DevExt, prpPageIndex).QuadPart;
+    cmd.PRP1 = GetPrpListPagePhysical(DevExt, request->PrpListPage).QuadPart;
     cmd.PRP2 = 0;  // Single page transfer
 
     // Calculate NUMDL (number of dwords - 1) for 512 bytes (SMART log size)
@@ -359,15 +364,12 @@ BOOLEAN NvmeGetLogPage(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Sr
     cmd.CDW10 = (LogPageId & 0xFF) | ((numdl & 0xFFFF) << 16);
 
 #ifdef NVME2K_DBG
-    ScsiDebugPrint(0, "nvme2k: NvmeGetLogPage - LID=0x%02X PRP=%u Phys=%08X%08X\n",
-                   LogPageId, prpPageIndex, (ULONG)(cmd.PRP1 >> 32), (ULONG)(cmd.PRP1));
+    ScsiDebugPrint(0, "nvme2k: NvmeGetLogPage - LID=0x%02X CID=%04X PRP=%u Phys=%08X%08X\n",
+                   LogPageId, commandId, request->PrpListPage, (ULONG)(cmd.PRP1 >> 32), (ULONG)(cmd.PRP1));
 #endif
 
-    // ScsiPort manages the untagged SRB, we can retrieve it in completion with ScsiPortGetSrb()
-    
-    DevExt->NonTaggedInFlight = Srb;
     if (!NvmeSubmitAdminCommand(DevExt, &cmd)) {
-        DevExt->NonTaggedInFlight = NULL;
+        NvmeFreeAdminRequest(DevExt, request);
         return FALSE;
     } else {
         return TRUE;
@@ -382,44 +384,31 @@ BOOLEAN NvmeGetLogPageEx(
     IN PSCSI_REQUEST_BLOCK Srb,
     IN UCHAR LogPageId,
     IN ULONG NamespaceId,
-    IN USHORT CommandId,
+    IN UCHAR Kind,
     IN ULONG NumDwords)
 {
     NVME_COMMAND cmd;
-    PVOID prpPageVirt;
-    UCHAR prpPageIndex;
+    USHORT commandId;
+    PNVME_ADMIN_REQUEST request;
     ULONG numdl;
-    PNVME_SRB_EXTENSION srbExt;
-
-    // Store PRP page index in SRB extension so we can free it on completion
-    if (!Srb->SrbExtension) {
-#ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: NvmeGetLogPageEx - SRB has no extension\n");
-#endif
-        return FALSE;
-    }
-    srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
 
-    // Allocate a PRP page for the log data buffer (4KB)
-    prpPageIndex = AllocatePrpListPage(DevExt);
-    if (prpPageIndex == 0xFF) {
+    // Claim an admin slot and a zeroed PRP page for the log data buffer (4KB)
+    commandId = NvmeAllocAdminRequest(DevExt, Srb, Kind, TRUE);
+    if (commandId == 0) {
 #ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: NvmeGetLogPageEx - Failed to allocate PRP page\n");
+        ScsiDebugPrint(0, "nvme2k: NvmeGetLogPageEx - no admin slot or PRP page\n");
 #endif
         return FALSE;
     }
-    srbExt->PrpListPage = prpPageIndex;
-
-    // Zero out the page to prevent stale data issues
-    prpPageVirt = GetPrpListPageVirtual(DevExt, prpPageIndex);
-    memset(prpPageVirt, 0, NVME_PAGE_SIZE);
+    request = NvmeGetAdminRequest(DevExt, commandId);
+    request->LogPageId = LogPageId;
 
     memset(&cmd, 0, sizeof(NVME_COMMAND));
 
     cmd.CDW0.Fields.Opcode = NVME_ADMIN_GET_LOG_PAGE;
-    cmd.CDW0.Fields.CommandId = CommandId;
+    cmd.CDW0.Fields.CommandId = commandId;
     cmd.NSID = NamespaceId;
-    cmd.PRP1 = GetPrpListPagePhysical(DevExt, prpPageIndex).QuadPart;
+    cmd.PRP1 = GetPrpListPagePhysical(DevExt, request->PrpListPage).QuadPart;
     cmd.PRP2 = 0;  // Single page transfer
 
     // NUMDL = number of dwords minus 1
@@ -437,12 +426,11 @@ BOOLEAN NvmeGetLogPageEx(
 
 #ifdef NVME2K_DBG
     ScsiDebugPrint(0, "nvme2k: NvmeGetLogPageEx - LID=0x%02X NSID=%08X CID=%04X NUMDL=%u PRP=%u Phys=%08X%08X\n",
-                   LogPageId, NamespaceId, CommandId, numdl, prpPageIndex, (ULONG)(cmd.PRP1 >> 32), (ULONG)(cmd.PRP1));
+                   LogPageId, NamespaceId, commandId, numdl, request->PrpListPage, (ULONG)(cmd.PRP1 >> 32), (ULONG)(cmd.PRP1));
 #endif
 
-    DevExt->NonTaggedInFlight = Srb;
     if (!NvmeSubmitAdminCommand(DevExt, &cmd)) {
-        DevExt->NonTaggedInFlight = NULL;
+        NvmeFreeAdminRequest(DevExt, request);
         return FALSE;
     } else {
         return TRUE;
@@ -450,410 +438,1753 @@ BOOLEAN NvmeGetLogPageEx(
 }
 
 //
-// NvmeBuildCommandId - Build NVMe Command ID from SRB
-// For tagged requests: Use QueueTag directly (bit 15 clear)
-// For non-tagged requests: Generate sequence number with bit 15 set
+// NvmeGetFeatures - Read the current value of a feature (no data buffer)
+// Used during init; the value comes back in completion DW0
+//
+BOOLEAN NvmeGetFeatures(IN PHW_DEVICE_EXTENSION DevExt, IN UCHAR FeatureId, IN USHORT CommandId)
+{
+    NVME_COMMAND cmd;
+
+    memset(&cmd, 0, sizeof(NVME_COMMAND));
+
+    cmd.CDW0.Fields.Opcode = NVME_ADMIN_GET_FEATURES;
+    cmd.CDW0.Fields.Flags = 0;
+    cmd.CDW0.Fields.CommandId = CommandId;
+    cmd.NSID = 0;
+    // Bits 10:08 = SEL (0 = current), Bits 07:00 = FID
+    cmd.CDW10 = FeatureId;
+
+#ifdef NVME2K_DBG_CMD
+    ScsiDebugPrint(0, "nvme2k: NvmeGetFeatures - FID=0x%02X CID=%04X\n", FeatureId, CommandId);
+#endif
+    return NvmeSubmitAdminCommand(DevExt, &cmd);
+}
+
+//
+// NvmeSetFeatures - Set a feature value (no data buffer) on behalf of an SRB
+// The SRB is completed from NvmeProcessSetFeaturesCompletion
 //
-USHORT NvmeBuildCommandId(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+BOOLEAN NvmeSetFeatures(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN UCHAR FeatureId,
+    IN ULONG Value,
+    IN UCHAR Kind)
 {
+    NVME_COMMAND cmd;
     USHORT commandId;
 
-    // Check if this is a tagged request
-    // Note: QueueTag == SP_UNTAGGED (0xFF) means non-tagged even if SRB_FLAGS_QUEUE_ACTION_ENABLE is set
-    if ((Srb->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) && (Srb->QueueTag != SP_UNTAGGED)) {
-        // Tagged request - use QueueTag directly
-        commandId = (USHORT)Srb->QueueTag & CID_VALUE_MASK;
+    commandId = NvmeAllocAdminRequest(DevExt, Srb, Kind, FALSE);
+    if (commandId == 0) {
+        return FALSE;
+    }
+
+    memset(&cmd, 0, sizeof(NVME_COMMAND));
+
+    cmd.CDW0.Fields.Opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.CDW0.Fields.Flags = 0;
+    cmd.CDW0.Fields.CommandId = commandId;
+    cmd.NSID = 0;
+    // Bit 31 = SV (save across power cycles) left clear, Bits 07:00 = FID
+    cmd.CDW10 = FeatureId;
+    cmd.CDW11 = Value;
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: NvmeSetFeatures - FID=0x%02X Value=%08X CID=%04X\n", FeatureId, Value, commandId);
+#endif
+
+    if (!NvmeSubmitAdminCommand(DevExt, &cmd)) {
+        NvmeFreeAdminRequest(DevExt, NvmeGetAdminRequest(DevExt, commandId));
+        return FALSE;
     } else {
-        // Non-tagged request - generate sequence number with flag bit set
-        commandId = (DevExt->NextNonTaggedId & CID_VALUE_MASK) | CID_NON_TAGGED_FLAG;
-        DevExt->NextNonTaggedId++;
-        // Wrap around at 15 bits
-        if (DevExt->NextNonTaggedId >= 0x8000) {
-            DevExt->NextNonTaggedId = 0;
+        return TRUE;
+    }
+}
+
+//
+// NvmeFlushWriteCache - Flush every namespace written since its last flush, sent
+// alongside the Set Features that turns the volatile write cache off
+// With the cache off SYNCHRONIZE CACHE is elided, so what it still holds goes out
+// now. Returns FALSE while a write is outstanding (the flush could miss it) or when
+// no CID or SQ slot is left; the caller sends the Set Features later.
+//
+BOOLEAN NvmeFlushWriteCache(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    NVME_COMMAND cmd;
+    PNVME_NAMESPACE ns;
+    USHORT commandId;
+    ULONG lun;
+
+    for (lun = 0; lun < DevExt->NamespaceCount; lun++) {
+        if (DevExt->Namespaces[lun].WritesOutstanding != 0) {
+            return FALSE;
         }
     }
 
-    return commandId;
+    for (lun = 0; lun < DevExt->NamespaceCount; lun++) {
+        ns = &DevExt->Namespaces[lun];
+        if (ns->SizeInBlocks == 0 || ns->WriteGeneration == ns->FlushedGeneration) {
+            continue;
+        }
+
+        // No SRB: the completion only frees the CID
+        commandId = NvmeAllocIoRequest(DevExt, NULL, IO_KIND_FLUSH);
+        if (commandId == NVME_IO_CID_NONE) {
+            return FALSE;
+        }
+
+        memset(&cmd, 0, sizeof(NVME_COMMAND));
+        cmd.CDW0.Fields.Opcode = NVME_CMD_FLUSH;
+        cmd.CDW0.Fields.CommandId = commandId;
+        cmd.NSID = ns->NamespaceId;
+
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: NvmeFlushWriteCache - NSID=%u CID=%d\n", ns->NamespaceId, commandId);
+#endif
+
+        if (!NvmeSubmitIoCommand(DevExt, &cmd)) {
+            NvmeFreeIoRequest(DevExt, &DevExt->IoRequests[commandId]);
+            return FALSE;
+        }
+        DevExt->FlushesIssued++;
+    }
+
+    return TRUE;
 }
 
 //
-// NvmeBuildFlushCommandId - Build CID for ORDERED tag flush command
-// Uses the SRB's QueueTag with the ORDERED_FLUSH flag bit set
+// NvmeUserFeatures - Get/Set Features from NvmeMini on behalf of an SRB
+// Command is the caller's 16 dword command. Only opcode, NSID and CDW10-15 are
+// used: the command ID and the data pointer are always the driver's own. Features
+// with a data buffer (DataLength != 0) go through a PRP pool page, a Set copies
+// Data into it first. The SRB is completed from NvmeProcessUserFeaturesCompletion.
 //
-USHORT NvmeBuildFlushCommandId(IN PSCSI_REQUEST_BLOCK Srb)
+BOOLEAN NvmeUserFeatures(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN PULONG Command,
+    IN PVOID Data,
+    IN ULONG DataLength)
 {
+    NVME_COMMAND cmd;
     USHORT commandId;
+    PNVME_ADMIN_REQUEST request;
+    UCHAR opcode = (UCHAR)(Command[0] & 0xFF);
+
+    if (DataLength > NVME_PAGE_SIZE) {
+        return FALSE;
+    }
 
-    // For ORDERED flush, use QueueTag with flush flag bit set
-    commandId = ((USHORT)Srb->QueueTag & CID_VALUE_MASK) | CID_ORDERED_FLUSH_FLAG;
+    commandId = NvmeAllocAdminRequest(DevExt, Srb, ADMIN_KIND_USER_FEATURES, (BOOLEAN)(DataLength != 0));
+    if (commandId == 0) {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: NvmeUserFeatures - no admin slot or PRP page\n");
+#endif
+        return FALSE;
+    }
+    request = NvmeGetAdminRequest(DevExt, commandId);
 
-    return commandId;
+    memset(&cmd, 0, sizeof(NVME_COMMAND));
+
+    cmd.CDW0.Fields.Opcode = opcode;
+    cmd.CDW0.Fields.Flags = 0;
+    cmd.CDW0.Fields.CommandId = commandId;
+    cmd.NSID = Command[1];
+    cmd.CDW10 = Command[10];
+    cmd.CDW11 = Command[11];
+    cmd.CDW12 = Command[12];
+    cmd.CDW13 = Command[13];
+    cmd.CDW14 = Command[14];
+    cmd.CDW15 = Command[15];
+
+    if (DataLength != 0) {
+        if (opcode == NVME_ADMIN_SET_FEATURES && Data) {
+            memcpy(GetPrpListPageVirtual(DevExt, request->PrpListPage), Data, DataLength);
+        }
+        cmd.PRP1 = GetPrpListPagePhysical(DevExt, request->PrpListPage).QuadPart;
+        cmd.PRP2 = 0;  // Feature data never crosses the page
+    }
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: NvmeUserFeatures - OPC=%02X NSID=%08X CDW10=%08X CDW11=%08X DataLength=%u CID=%04X\n",
+                   opcode, cmd.NSID, cmd.CDW10, cmd.CDW11, DataLength, commandId);
+#endif
+
+    if (!NvmeSubmitAdminCommand(DevExt, &cmd)) {
+        NvmeFreeAdminRequest(DevExt, request);
+        return FALSE;
+    } else {
+        return TRUE;
+    }
+}
+
+//
+// NvmeConfigureAsyncEvents - Last init step: ask for events on every SMART/Health
+// critical warning and on the notices the controller supports
+// Returns FALSE if the command could not be sent, init then completes without it.
+//
+BOOLEAN NvmeConfigureAsyncEvents(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    NVME_COMMAND cmd;
+
+    if (DevExt->AsyncEventLimit == 0) {
+        return FALSE;
+    }
+
+    memset(&cmd, 0, sizeof(NVME_COMMAND));
+
+    cmd.CDW0.Fields.Opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.CDW0.Fields.Flags = 0;
+    cmd.CDW0.Fields.CommandId = ADMIN_CID_SET_FEATURES_AEC;
+    cmd.NSID = 0;
+    cmd.CDW10 = NVME_FEATURE_ASYNC_EVENT_CONFIG;
+    cmd.CDW11 = NVME_AEC_SMART_WARNINGS | (DevExt->AsyncEventsSupported & NVME_OAES_NOTICES);
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: NvmeConfigureAsyncEvents - AEC=%08X, %u AERs\n", cmd.CDW11, DevExt->AsyncEventLimit);
+#endif
+    return NvmeSubmitAdminCommand(DevExt, &cmd);
+}
+
+//
+// NvmeConfigureApst - Init step after Identify Controller: program autonomous power
+// state transitions from the power state descriptors
+// Only non-operational states whose entry + exit latency fits ApstLatencyUs are
+// targets, so a request never waits longer than that for the drive to wake up.
+// Walking from the deepest state up, each state steps down to the next deeper
+// target after NVME_APST_IDLE_FACTOR times that target's latency of idle time, so
+// deeper states need proportionally longer quiet periods. The table is built in the
+// second page of the utility buffer, the first still holds the Identify data.
+// Returns FALSE if nothing was sent, init then goes on to the namespace list.
+//
+BOOLEAN NvmeConfigureApst(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IDENTIFY_CONTROLLER CtrlData)
+{
+    NVME_COMMAND cmd;
+    PNVME_POWER_STATE_DESCRIPTOR psd;
+    PULONGLONG table;
+    ULONGLONG entry = 0;
+    ULONG latency;
+    ULONG idleMs;
+    LONG state;
+
+    DevExt->PowerStateCount = (UCHAR)(CtrlData->NumberOfPowerStates + 1);
+    DevExt->ApstStates = 0;
+    DevExt->ApstIdleMs = 0;
+    DevExt->ApstWakeUs = 0;
+
+    if (!(CtrlData->ApstAttributes & NVME_APSTA_SUPPORTED)) {
+        DevExt->ApstStatus = NVME2KDB_APST_UNSUPPORTED;
+        return FALSE;
+    }
+    if (DevExt->ApstLatencyUs == NVME_APST_FIRMWARE) {
+        DevExt->ApstStatus = NVME2KDB_APST_FIRMWARE;
+        return FALSE;
+    }
+
+    table = (PULONGLONG)((PUCHAR)DevExt->UtilityBuffer + NVME_PAGE_SIZE);
+    memset(table, 0, NVME_MAX_POWER_STATES * sizeof(ULONGLONG));
+
+    // A budget of 0 leaves the table empty, APST is then turned off
+    for (state = DevExt->ApstLatencyUs ? CtrlData->NumberOfPowerStates : 0; state >= 0; state--) {
+        if (state >= NVME_MAX_POWER_STATES) {
+            continue;
+        }
+        table[state] = entry;
+        if (state == 0) {
+            break;
+        }
+
+        psd = &CtrlData->PowerStates[state];
+        if (!(psd->Flags & NVME_PSD_NOPS) ||
+            psd->EntryLatency > DevExt->ApstLatencyUs ||
+            psd->ExitLatency > DevExt->ApstLatencyUs - psd->EntryLatency) {
+            continue;
+        }
+        latency = psd->EntryLatency + psd->ExitLatency;
+
+        idleMs = (latency + (1000 / NVME_APST_IDLE_FACTOR) - 1) / (1000 / NVME_APST_IDLE_FACTOR);
+        if (idleMs == 0) {
+            idleMs = 1;
+        } else if (idleMs > NVME_APST_ITPT_MAX) {
+            idleMs = NVME_APST_ITPT_MAX;
+        }
+        entry = ((ULONGLONG)idleMs << NVME_APST_ITPT_SHIFT) | ((ULONG)state << NVME_APST_ITPS_SHIFT);
+
+        if (DevExt->ApstStates == 0) {
+            DevExt->ApstWakeUs = latency;
+        }
+        DevExt->ApstStates |= 1UL << state;
+        DevExt->ApstIdleMs = idleMs;
+    }
+
+    memset(&cmd, 0, sizeof(NVME_COMMAND));
+
+    cmd.CDW0.Fields.Opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.CDW0.Fields.Flags = 0;
+    cmd.CDW0.Fields.CommandId = ADMIN_CID_SET_FEATURES_APST;
+    cmd.NSID = 0;
+    cmd.PRP1 = DevExt->UtilityBufferPhys.QuadPart + NVME_PAGE_SIZE;
+    cmd.PRP2 = 0;
+    cmd.CDW10 = NVME_FEATURE_AUTONOMOUS_POWER_STATE;
+    cmd.CDW11 = DevExt->ApstStates ? NVME_APST_ENABLE : 0;
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: NvmeConfigureApst - %u power states, budget %u us, targets %08X, PS0 idle %u ms, wake %u us\n",
+                   DevExt->PowerStateCount, DevExt->ApstLatencyUs, DevExt->ApstStates,
+                   DevExt->ApstIdleMs, DevExt->ApstWakeUs);
+#endif
+    return NvmeSubmitAdminCommand(DevExt, &cmd);
+}
+
+//
+// NvmeAsyncEventLogDwords - How much of a log page an event asked for to read
+// Reading it (without RAE) is what lets the controller report that event type again.
+//
+static ULONG NvmeAsyncEventLogDwords(IN UCHAR LogPageId)
+{
+    switch (LogPageId) {
+        case NVME_LOG_PAGE_ERROR_INFO:
+            return 64 / 4;                  // newest entry
+        case NVME_LOG_PAGE_CHANGED_NS_LIST:
+            return NVME_PAGE_SIZE / 4;
+        default:
+            return 512 / 4;                 // SMART/Health, firmware slot
+    }
+}
+
+//
+// NvmeArmAsyncEvents - Keep AsyncEventLimit Asynchronous Event Requests outstanding
+// and read the log pages events asked for. Runs after every admin completion pass
+// once init is complete; whatever can't be sent for lack of an SQ entry, admin slot
+// or PRP page is retried on the next pass.
+//
+VOID NvmeArmAsyncEvents(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    NVME_COMMAND cmd;
+    ULONG pending;
+    UCHAR lid;
+    ULONG i;
+
+    pending = DevExt->AsyncEventLogsPending;
+    for (lid = 0; pending != 0; lid++, pending >>= 1) {
+        if ((pending & 1) &&
+            NvmeGetLogPageEx(DevExt, NULL, lid, 0xFFFFFFFF, ADMIN_KIND_ASYNC_EVENT_LOG,
+                             NvmeAsyncEventLogDwords(lid))) {
+            DevExt->AsyncEventLogsPending &= ~(1UL << lid);
+        }
+    }
+
+    for (i = 0; i < DevExt->AsyncEventLimit; i++) {
+        if (DevExt->AsyncEventCids & (1UL << i)) {
+            continue;
+        }
+
+        memset(&cmd, 0, sizeof(NVME_COMMAND));
+        cmd.CDW0.Fields.Opcode = NVME_ADMIN_ASYNC_EVENT;
+        cmd.CDW0.Fields.CommandId = (USHORT)(ADMIN_CID_AER_BASE + i);
+
+        if (!NvmeSubmitAdminCommand(DevExt, &cmd)) {
+            break;
+        }
+        DevExt->AsyncEventCids |= 1UL << i;
+    }
+}
+
+//
+// NvmeFormatNvm - Low level format a namespace to another LBA format (no data buffer)
+// No secure erase and no protection information. The SRB is completed after the
+// namespace has been re-identified, see NvmeProcessFormatCompletion.
+//
+BOOLEAN NvmeFormatNvm(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN ULONG NamespaceId,
+    IN UCHAR LbaFormat)
+{
+    NVME_COMMAND cmd;
+    USHORT commandId;
+
+    commandId = NvmeAllocAdminRequest(DevExt, Srb, ADMIN_KIND_FORMAT_NVM, FALSE);
+    if (commandId == 0) {
+        return FALSE;
+    }
+
+    memset(&cmd, 0, sizeof(NVME_COMMAND));
+
+    cmd.CDW0.Fields.Opcode = NVME_ADMIN_FORMAT_NVM;
+    cmd.CDW0.Fields.Flags = 0;
+    cmd.CDW0.Fields.CommandId = commandId;
+    cmd.NSID = NamespaceId;
+    // Bits 11:09 = SES (0 = no secure erase), Bits 08:05 = PIL/PI (0), Bit 04 = MSET, Bits 03:00 = LBAF
+    cmd.CDW10 = LbaFormat & NVME_FLBAS_FORMAT_MASK;
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: NvmeFormatNvm - NSID=%u LBAF=%u CID=%04X\n", NamespaceId, LbaFormat, commandId);
+#endif
+
+    if (!NvmeSubmitAdminCommand(DevExt, &cmd)) {
+        NvmeFreeAdminRequest(DevExt, NvmeGetAdminRequest(DevExt, commandId));
+        return FALSE;
+    } else {
+        return TRUE;
+    }
+}
+
+//
+// NvmeAllocIoRequest - Claim an I/O Command ID for an SRB
+// CIDs are handed out round robin so a just completed CID is not reused at once.
+// Returns the CID, or NVME_IO_CID_NONE if every CID is outstanding.
+//
+USHORT NvmeAllocIoRequest(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR Kind)
+{
+    PNVME_IO_REQUEST request;
+    USHORT commandId;
+    ULONG i;
+
+    commandId = DevExt->NextIoCommandId;
+    for (i = 0; i < NVME_MAX_IO_COMMANDS; i++) {
+        if (commandId >= NVME_MAX_IO_COMMANDS) {
+            commandId = 0;
+        }
+        request = &DevExt->IoRequests[commandId];
+        if (request->Kind == IO_KIND_FREE) {
+            request->Srb = Srb;
+            request->Kind = Kind;
+            request->PrpListPage = 0xFF;
+            request->Segment = NVME_SPLIT_MIDDLE;
+            request->SubmitTime = 0;
+            DevExt->NextIoCommandId = commandId + 1;
+            return commandId;
+        }
+        commandId++;
+    }
+
+    return NVME_IO_CID_NONE;
 }
 
 //
-// NvmeGetSrbFromCommandId - Retrieve SRB from Command ID
-// Decodes the CID and calls ScsiPortGetSrb with appropriate parameters
+// NvmeGetIoRequest - Look up an outstanding I/O command by CID
+// Returns NULL for CIDs that are out of range or not outstanding
+//
+PNVME_IO_REQUEST NvmeGetIoRequest(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT CommandId)
+{
+    PNVME_IO_REQUEST request;
+
+    if (CommandId >= NVME_MAX_IO_COMMANDS) {
+        return NULL;
+    }
+
+    request = &DevExt->IoRequests[CommandId];
+    if (request->Kind == IO_KIND_FREE) {
+        return NULL;
+    }
+    return request;
+}
+
+//
+// NvmeFreeIoRequest - Release an I/O Command ID and its PRP list page
+//
+VOID NvmeFreeIoRequest(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_IO_REQUEST Request)
+{
+    if (Request->PrpListPage != 0xFF) {
+        FreePrpListPage(DevExt, Request->PrpListPage);
+        Request->PrpListPage = 0xFF;
+    }
+    Request->Srb = NULL;
+    Request->Kind = IO_KIND_FREE;
+}
+
 //
-PSCSI_REQUEST_BLOCK NvmeGetSrbFromCommandId(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT commandId)
+// NvmeDetachIoRequests - Drop the SRBs of outstanding I/O commands before a bus reset
+// completes them
+// The CIDs stay allocated until the device completes them, then they are only freed.
+// A write gives back its share of the write accounting here, once per SRB even when
+// it went out as several pieces, and keeps a later flush from being elided.
+//
+VOID NvmeDetachIoRequests(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    PSCSI_REQUEST_BLOCK Srb;
+    PNVME_PASS_THROUGH nvmePassThru;
+    PNVME_NAMESPACE ns;
+    UCHAR kind;
+    ULONG i;
+    ULONG j;
+
+    for (i = 0; i < NVME_MAX_IO_COMMANDS; i++) {
+        Srb = DevExt->IoRequests[i].Srb;
+        kind = DevExt->IoRequests[i].Kind;
+        if (Srb == NULL) {
+            continue;
+        }
+
+        // Every piece of a split SRB points at it
+        for (j = i; j < NVME_MAX_IO_COMMANDS; j++) {
+            if (DevExt->IoRequests[j].Srb == Srb) {
+                DevExt->IoRequests[j].Srb = NULL;
+            }
+        }
+
+        if ((kind == IO_KIND_WRITE || kind == IO_KIND_DEALLOCATE ||
+             (kind >= IO_KIND_SPLIT_READ && kind <= IO_KIND_RMW_READ)) &&
+            Srb->Function == SRB_FUNCTION_EXECUTE_SCSI && (Srb->SrbFlags & SRB_FLAGS_DATA_OUT)) {
+            ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+            if (ns->WritesOutstanding > 0) {
+                ns->WritesOutstanding--;
+            }
+            ns->WriteGeneration++;
+            NvmeCacheInvalidateSrb(DevExt, Srb);
+            DevExt->WriteBytesInFlight -= (Srb->DataTransferLength < DevExt->WriteBytesInFlight) ?
+                Srb->DataTransferLength : DevExt->WriteBytesInFlight;
+        } else if (kind == IO_KIND_USER) {
+            nvmePassThru = (PNVME_PASS_THROUGH)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+            if (NvmeCacheInvalidateUserIo(DevExt, DevExt->IoRequests[i].Segment, nvmePassThru->Command)) {
+                ns = &DevExt->Namespaces[DevExt->IoRequests[i].Segment];
+                if (ns->WritesOutstanding > 0) {
+                    ns->WritesOutstanding--;
+                }
+                ns->WriteGeneration++;
+            }
+        }
+    }
+}
+
+//
+// NvmeAllocAdminRequest - Claim an admin request slot for a post-init admin command
+// Optionally allocates a zeroed PRP page for the data buffer.
+// Returns the Command ID to use, or 0 if no slot or PRP page is available.
+//
+USHORT NvmeAllocAdminRequest(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN UCHAR Kind,
+    IN BOOLEAN NeedPrpPage)
+{
+    PNVME_ADMIN_REQUEST request;
+    UCHAR prpPageIndex = 0xFF;
+    ULONG slot;
+
+    for (slot = 0; slot < NVME_MAX_ADMIN_COMMANDS; slot++) {
+        if (DevExt->AdminRequests[slot].Kind == ADMIN_KIND_FREE) {
+            break;
+        }
+    }
+    if (slot == NVME_MAX_ADMIN_COMMANDS) {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: NvmeAllocAdminRequest - all %u admin slots busy\n", NVME_MAX_ADMIN_COMMANDS);
+#endif
+        return 0;
+    }
+
+    if (NeedPrpPage) {
+        prpPageIndex = AllocatePrpListPage(DevExt);
+        if (prpPageIndex == 0xFF) {
+            return 0;
+        }
+        // Zero out the page to prevent stale data issues
+        memset(GetPrpListPageVirtual(DevExt, prpPageIndex), 0, NVME_PAGE_SIZE);
+    }
+
+    request = &DevExt->AdminRequests[slot];
+    request->Srb = Srb;
+    request->Kind = Kind;
+    request->PrpListPage = prpPageIndex;
+    request->Flags = 0;
+    request->TransferOffset = 0;
+    request->TransferLength = 0;
+
+    return (USHORT)(ADMIN_CID_TABLE_BASE + slot);
+}
+
+//
+// NvmeGetAdminRequest - Look up the admin request slot for a Command ID
+// Returns NULL for CIDs outside the table or slots that are not in use
+//
+PNVME_ADMIN_REQUEST NvmeGetAdminRequest(IN PHW_DEVICE_EXTENSION DevExt, IN USHORT CommandId)
+{
+    PNVME_ADMIN_REQUEST request;
+
+    if (!ADMIN_CID_IS_TABLE(CommandId)) {
+        return NULL;
+    }
+
+    request = &DevExt->AdminRequests[CommandId - ADMIN_CID_TABLE_BASE];
+    if (request->Kind == ADMIN_KIND_FREE) {
+        return NULL;
+    }
+    return request;
+}
+
+//
+// NvmeFreeAdminRequest - Release an admin request slot and its PRP page
+//
+VOID NvmeFreeAdminRequest(IN PHW_DEVICE_EXTENSION DevExt, IN PNVME_ADMIN_REQUEST Request)
+{
+    if (Request->PrpListPage != 0xFF) {
+        FreePrpListPage(DevExt, Request->PrpListPage);
+        Request->PrpListPage = 0xFF;
+    }
+    Request->Srb = NULL;
+    Request->Kind = ADMIN_KIND_FREE;
+}
+
+//
+// NvmeBuildPrpEntries - Fill PRP1/PRP2 for a buffer inside an SRB's data buffer
+// Uses PRP2 directly for up to two pages and a PRP list page (released with the
+// CID) beyond that, stored in *PrpListPage of the I/O or admin request. Returns 1
+// on success, 0 if no PRP list page is available and -1 if the buffer has no
+// physical address; the caller completes the SRB.
+//
+static int NvmeBuildPrpEntries(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN OUT PUCHAR PrpListPage,
+    IN PNVME_COMMAND Cmd,
+    IN PVOID Buffer,
+    IN ULONG Length)
+{
+    PHYSICAL_ADDRESS physAddr;
+    PHYSICAL_ADDRESS physAddr2;
+    ULONG length;
+    ULONG offsetInPage;
+    ULONG firstPageBytes;
+    PVOID currentPageVirtual;
+    ULONG remainingBytes;
+    ULONG currentOffset;
+    UCHAR prpListPage;
+    PULONGLONG prpList;
+    PHYSICAL_ADDRESS prpListPhys;
+    ULONG prpIndex;
+    ULONG numPrpEntries;
+
+    // Get physical address of data buffer
+    length = Length;
+    physAddr = ScsiPortGetPhysicalAddress(DevExt, Srb, Buffer, &length);
+    if (physAddr.QuadPart == 0) {
+        return -1;
+    }
+
+#ifdef NVME2K_DBG_CMD
+    ScsiDebugPrint(0, "nvme2k: NvmeBuildPrpEntries - Buffer=%p TransferLen=%u PhysAddr=%08X%08X ReturnedLen=%u\n",
+                   Buffer, Length,
+                   (ULONG)(physAddr.QuadPart >> 32), (ULONG)(physAddr.QuadPart & 0xFFFFFFFF),
+                   length);
+#endif
+    // Set PRP1 to the start of the data
+    Cmd->PRP1 = physAddr.QuadPart;
+
+    // Calculate offset within the page
+    offsetInPage = (ULONG)(physAddr.QuadPart & NVME_PAGE_MASK);
+
+    // Calculate how many bytes fit in the first page
+    firstPageBytes = NVME_PAGE_SIZE - offsetInPage;
+
+    // Determine if we need PRP2 or a PRP list
+    if (Length <= firstPageBytes) {
+        // Transfer fits in one page
+        Cmd->PRP2 = 0;
+#ifdef NVME2K_DBG_CMD
+        ScsiDebugPrint(0, "nvme2k: NvmeBuildPrpEntries - Single page transfer, PRP2=0\n");
+#endif
+    } else if (Length <= (firstPageBytes + NVME_PAGE_SIZE)) {
+        // Transfer spans exactly 2 pages, use PRP2 directly
+        currentPageVirtual = (PVOID)((PUCHAR)Buffer + firstPageBytes);
+        length = Length - firstPageBytes;
+        physAddr2 = ScsiPortGetPhysicalAddress(DevExt, Srb, currentPageVirtual, &length);
+        if (physAddr2.QuadPart == 0) {
+            return -1;
+        }
+
+#ifdef NVME2K_DBG_CMD
+        ScsiDebugPrint(0, "nvme2k: NvmeBuildPrpEntries - Two page transfer: PhysAddr2=%08X%08X\n",
+                       (ULONG)(physAddr2.QuadPart >> 32), (ULONG)(physAddr2.QuadPart & 0xFFFFFFFF));
+#endif
+        Cmd->PRP2 = physAddr2.QuadPart;
+    } else {
+        // Transfer spans more than 2 pages, need PRP list
+        prpListPage = AllocatePrpListPage(DevExt);
+        if (prpListPage == 0xFF) {
+            // No PRP list pages available - this shouldn't happen if we sized correctly
+            ScsiDebugPrint(0, "nvme2k: No PRP list pages available %d/%d!\n", DevExt->CurrentPrpListPagesUsed, DevExt->SgListPages);
+            Cmd->PRP2 = 0;
+            DevExt->RejectedRequests++;
+            return 0;
+        }
+
+        // The PRP list page is released together with the CID
+        *PrpListPage = prpListPage;
+
+        // Get virtual and physical addresses of PRP list
+        prpList = (PULONGLONG)GetPrpListPageVirtual(DevExt, prpListPage);
+        prpListPhys = GetPrpListPagePhysical(DevExt, prpListPage);
+
+        // Build PRP list for remaining pages
+        remainingBytes = Length - firstPageBytes;
+        currentOffset = firstPageBytes;
+        prpIndex = 0;
+
+        while (remainingBytes > 0 && prpIndex < 512) {
+            currentPageVirtual = (PVOID)((PUCHAR)Buffer + currentOffset);
+            length = remainingBytes;
+            physAddr2 = ScsiPortGetPhysicalAddress(DevExt, Srb, currentPageVirtual, &length);
+            if (physAddr2.QuadPart == 0) {
+                // PRP list page is freed with the CID by the caller
+                return -1;
+            }
+
+            prpList[prpIndex] = physAddr2.QuadPart;
+            prpIndex++;
+
+            if (remainingBytes <= NVME_PAGE_SIZE) {
+                break;
+            }
+
+            remainingBytes -= NVME_PAGE_SIZE;
+            currentOffset += NVME_PAGE_SIZE;
+        }
+
+        numPrpEntries = prpIndex;
+
+#ifdef NVME2K_DBG_CMD
+        ScsiDebugPrint(0, "nvme2k: NvmeBuildPrpEntries - PRP list: page=%u entries=%u listPhys=%08X%08X\n",
+                       prpListPage, numPrpEntries,
+                       (ULONG)(prpListPhys.QuadPart >> 32), (ULONG)(prpListPhys.QuadPart & 0xFFFFFFFF));
+#endif
+
+        // Set PRP2 to point to the PRP list
+        Cmd->PRP2 = prpListPhys.QuadPart;
+    }
+
+    return 1;
+}
+
+//
+// NvmeUserTransfer - Send an NvmeMini IDENTIFY or GET_LOG_PAGE for bytes Offset
+// onwards of a Length byte transfer. The command comes from the caller's
+// NVME_PASS_THROUGH and the PRPs point straight at the caller's data buffer, so
+// nothing is copied on completion. A log larger than one command can move is
+// read in MDTS sized pieces, each at its own log page offset (LPOL/LPOU); the
+// completion sends the next piece on the slot of the one that finished (Request),
+// so a busy admin table can't stop a log halfway; NULL claims a new slot. Only a
+// buffer without a physical address falls back to a zeroed PRP page and a copy,
+// which limits it to 4KB. On failure the slot is released.
+//
+BOOLEAN NvmeUserTransfer(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN PNVME_ADMIN_REQUEST Request,
+    IN UCHAR Kind,
+    IN ULONG Offset,
+    IN ULONG Length)
+{
+    PNVME_PASS_THROUGH nvmePassThru;
+    PUCHAR data;
+    NVME_COMMAND cmd;
+    USHORT commandId;
+    PNVME_ADMIN_REQUEST request;
+    ULONG pageOffset;
+    ULONG chunk;
+    ULONG numd;
+    ULONGLONG logOffset;
+    int rc;
+
+    nvmePassThru = (PNVME_PASS_THROUGH)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+    data = (PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH) + Offset;
+
+    // Stop each piece at a page boundary so the next one starts page aligned and
+    // a single PRP list page always covers the piece
+    pageOffset = (ULONG)((ULONG_PTR)data & NVME_PAGE_MASK);
+    chunk = Length - Offset;
+    if (chunk > DevExt->MaxTransferSizeBytes - pageOffset) {
+        chunk = DevExt->MaxTransferSizeBytes - pageOffset;
+    }
+
+    if (Request != NULL) {
+        // Next piece: drop the last one's PRP list, keep the slot and its SRB
+        request = Request;
+        commandId = (USHORT)(ADMIN_CID_TABLE_BASE + (request - DevExt->AdminRequests));
+        if (request->PrpListPage != 0xFF) {
+            FreePrpListPage(DevExt, request->PrpListPage);
+            request->PrpListPage = 0xFF;
+        }
+        request->Flags = 0;
+    } else {
+        commandId = NvmeAllocAdminRequest(DevExt, Srb, Kind, FALSE);
+        if (commandId == 0) {
+            return FALSE;
+        }
+        request = NvmeGetAdminRequest(DevExt, commandId);
+    }
+    request->TransferOffset = Offset + chunk;
+    request->TransferLength = Length;
+
+    memset(&cmd, 0, sizeof(NVME_COMMAND));
+    cmd.CDW0.Fields.Opcode = (UCHAR)(nvmePassThru->Command[0] & 0xFF);
+    cmd.CDW0.Fields.CommandId = commandId;
+    cmd.NSID = nvmePassThru->Command[1];
+    cmd.CDW10 = nvmePassThru->Command[10];
+    cmd.CDW11 = nvmePassThru->Command[11];
+    cmd.CDW12 = nvmePassThru->Command[12];
+    cmd.CDW13 = nvmePassThru->Command[13];
+    cmd.CDW14 = nvmePassThru->Command[14];
+    cmd.CDW15 = nvmePassThru->Command[15];
+
+    if (cmd.CDW0.Fields.Opcode == NVME_ADMIN_GET_LOG_PAGE) {
+        // NUMDL in CDW10 31:16, NUMDU in CDW11 15:0, 0's based dwords of this piece
+        numd = (chunk >> 2) - 1;
+        request->LogPageId = (UCHAR)(cmd.CDW10 & 0xFF);
+        cmd.CDW10 = (cmd.CDW10 & 0x0000FFFF) | ((numd & 0xFFFF) << 16);
+        cmd.CDW11 = (cmd.CDW11 & 0xFFFF0000) | (numd >> 16);
+
+        // LPOL/LPOU: the caller's log offset plus what earlier pieces read
+        logOffset = ((ULONGLONG)cmd.CDW13 << 32) | cmd.CDW12;
+        logOffset += Offset;
+        cmd.CDW12 = (ULONG)(logOffset & 0xFFFFFFFF);
+        cmd.CDW13 = (ULONG)(logOffset >> 32);
+    }
+
+    rc = NvmeBuildPrpEntries(DevExt, Srb, &request->PrpListPage, &cmd, data, chunk);
+    if (rc == 1 && (cmd.PRP1 & 3) == 0) {
+        request->Flags |= ADMIN_REQUEST_DIRECT;
+    } else {
+        // PRP1 must be dword aligned and the buffer mapped, else bounce one page
+        if (request->PrpListPage != 0xFF) {
+            FreePrpListPage(DevExt, request->PrpListPage);
+            request->PrpListPage = 0xFF;
+        }
+        if (Length > NVME_PAGE_SIZE || rc == 0) {
+            NvmeFreeAdminRequest(DevExt, request);
+            return FALSE;
+        }
+        request->PrpListPage = AllocatePrpListPage(DevExt);
+        if (request->PrpListPage == 0xFF) {
+            NvmeFreeAdminRequest(DevExt, request);
+            return FALSE;
+        }
+        memset(GetPrpListPageVirtual(DevExt, request->PrpListPage), 0, NVME_PAGE_SIZE);
+        cmd.PRP1 = GetPrpListPagePhysical(DevExt, request->PrpListPage).QuadPart;
+        cmd.PRP2 = 0;
+    }
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: NvmeUserTransfer - Opcode=%02X CID=%04X Offset=%u Bytes=%u of %u %s\n",
+                   cmd.CDW0.Fields.Opcode, commandId, Offset, chunk, Length,
+                   (request->Flags & ADMIN_REQUEST_DIRECT) ? "direct" : "bounced");
+#endif
+
+    if (!NvmeSubmitAdminCommand(DevExt, &cmd)) {
+        NvmeFreeAdminRequest(DevExt, request);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//
+// NvmeBuildReadWriteCommand - Build NVMe Read/Write command from SCSI CDB
+// On a 512e namespace the caller only sends I/O aligned to the device LBA size here,
+// the SCSI LBA and block count are shifted down to device LBAs.
+//
+int NvmeBuildReadWriteCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_COMMAND Cmd, IN USHORT CommandId)
+{
+    ULONGLONG lba = 0;
+    ULONG numBlocks = 0;
+    BOOLEAN isWrite = FALSE;
+    BOOLEAN fua = FALSE;
+    int rc;
+    PNVME_IO_REQUEST request = &DevExt->IoRequests[CommandId];
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+
+    // Parse CDB based on opcode
+    isWrite = ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua);
+
+    // validate against buffer size
+    if (numBlocks * ns->BlockSize > Srb->DataTransferLength) {
+        ScsiDebugPrint(0, "nvme2k: Transfer size in blocks %u exceeds buffer size %u - rejecting\n",
+                       numBlocks, Srb->DataTransferLength);
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: Transfer size in blocks %u exceeds buffer size %u - rejecting\n",
+                       numBlocks, Srb->DataTransferLength);
+#endif
+        DevExt->RejectedRequests++;
+        DevExt->NonTaggedInFlight = NULL;
+        ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+        return -1;
+    }
+    // Validate transfer size against MDTS
+    if (numBlocks * ns->BlockSize > DevExt->MaxTransferSizeBytes) {
+        ScsiDebugPrint(0, "nvme2k: Transfer size in blocks %u exceeds MDTS limit %u - rejecting\n",
+                       numBlocks, DevExt->MaxTransferSizeBytes);
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: Transfer size in blocks %u exceeds MDTS limit %u - rejecting\n",
+                       numBlocks, DevExt->MaxTransferSizeBytes);
+#endif
+        DevExt->RejectedRequests++;
+        DevExt->NonTaggedInFlight = NULL;
+        ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+        return -1;
+    }
+
+    // 512e: device LBAs (anything not aligned to them takes the split path instead)
+    lba >>= ns->LbaShift;
+    numBlocks >>= ns->LbaShift;
+
+    // Build NVMe command
+    if (isWrite) {
+        Cmd->CDW0.Fields.Opcode = NVME_CMD_WRITE;
+    } else {
+        Cmd->CDW0.Fields.Opcode = NVME_CMD_READ;
+    }
+    Cmd->CDW0.Fields.Flags = NVME_CMD_PRP;
+    Cmd->CDW0.Fields.CommandId = CommandId;
+
+    Cmd->NSID = ns->NamespaceId;
+
+    // Track I/O statistics
+    DevExt->TotalRequests++;
+    if (isWrite) {
+        request->Kind = IO_KIND_WRITE;
+        DevExt->TotalWrites++;
+        DevExt->TotalBytesWritten += Srb->DataTransferLength;
+        if (Srb->DataTransferLength > DevExt->MaxWriteSize) {
+            DevExt->MaxWriteSize = Srb->DataTransferLength;
+        }
+    } else {
+        DevExt->TotalReads++;
+        DevExt->TotalBytesRead += Srb->DataTransferLength;
+        if (Srb->DataTransferLength > DevExt->MaxReadSize) {
+            DevExt->MaxReadSize = Srb->DataTransferLength;
+        }
+    }
+#if NVME2K_DBG_STATS
+    // Print statistics every 10000 requests
+    // Note: QDepth tracking removed (always 0) since we no longer store SRBs
+    if ((DevExt->TotalRequests % 10000) == 0) {
+        ScsiDebugPrint(0, "nvme2k: Stats - Reqs=%u R=%u W=%u BytesR=%I64u BytesW=%I64u MaxR=%u MaxW=%u PRP=%u/%u Rejected=%u\n",
+                       DevExt->TotalRequests,
+                       DevExt->TotalReads,
+                       DevExt->TotalWrites,
+                       DevExt->TotalBytesRead,
+                       DevExt->TotalBytesWritten,
+                       DevExt->MaxReadSize,
+                       DevExt->MaxWriteSize,
+                       DevExt->CurrentPrpListPagesUsed,
+                       DevExt->MaxPrpListPagesUsed,
+                       DevExt->RejectedRequests);
+    }
+#endif
+
+    // Set LBA and number of blocks
+    Cmd->CDW10 = (ULONG)(lba & 0xFFFFFFFF);
+    Cmd->CDW11 = (ULONG)(lba >> 32);
+    Cmd->CDW12 = (numBlocks > 0) ? (numBlocks - 1) : 0;
+    // FUA: the device must not complete until these blocks are on media,
+    // so journal writes don't need a full cache flush
+    if (fua) {
+        Cmd->CDW12 |= NVME_RW_FUA;
+    }
+    Cmd->CDW13 = 0;
+    Cmd->CDW14 = 0;
+    Cmd->CDW15 = 0;
+
+    // Build PRPs
+    rc = NvmeBuildPrpEntries(DevExt, Srb, &request->PrpListPage, Cmd, Srb->DataBuffer, Srb->DataTransferLength);
+    if (rc < 0) {
+        DevExt->RejectedRequests++;
+        DevExt->NonTaggedInFlight = NULL;
+        ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+        return -1;
+    }
+
+    return rc;
+}
+
+//
+// NvmeGetSplitSegment - Locate one piece of an unaligned 512e read or write, or
+// of an aligned one split at the optimal I/O boundary (NVME_SPLIT_PIECE + n)
+// Returns the device LBA the piece starts at, and where its bytes are in the SRB
+// buffer and in the bounce page. Length is 0 for an empty NVME_SPLIT_MIDDLE.
+//
+ULONGLONG NvmeGetSplitSegment(
+    IN PNVME_NAMESPACE Namespace,
+    IN PNVME_SRB_EXTENSION SrbExt,
+    IN UCHAR Segment,
+    OUT PULONG SrbOffset,
+    OUT PULONG BounceOffset,
+    OUT PULONG Length)
+{
+    ULONG shift = Namespace->LbaShift;
+    ULONG mask = (1UL << shift) - 1;
+    ULONGLONG lba = SrbExt->SplitLba;
+    ULONGLONG end = lba + SrbExt->SplitBlocks;
+    ULONGLONG first = lba >> shift;
+    ULONGLONG last = (end - 1) >> shift;
+
+    *SrbOffset = 0;
+    *BounceOffset = 0;
+
+    if (Segment >= NVME_SPLIT_PIECE) {
+        // Whole device blocks from one boundary (or the start) to the next (or the end)
+        ULONG boundary = Namespace->BoundaryShift;
+        ULONGLONG pieceStart = ((first >> boundary) + (Segment - NVME_SPLIT_PIECE)) << boundary;
+        ULONGLONG pieceEnd = pieceStart + (1UL << boundary);
+
+        if (pieceStart < first) {
+            pieceStart = first;
+        }
+        if (pieceEnd > last + 1) {
+            pieceEnd = last + 1;
+        }
+        *SrbOffset = (ULONG)(pieceStart - first) * (Namespace->BlockSize << shift);
+        *Length = (ULONG)(pieceEnd - pieceStart) * (Namespace->BlockSize << shift);
+        return pieceStart;
+    }
+
+    switch (Segment) {
+        case NVME_SPLIT_ONLY:
+            *BounceOffset = (ULONG)(lba & mask) * Namespace->BlockSize;
+            *Length = SrbExt->SplitBlocks * Namespace->BlockSize;
+            return first;
+
+        case NVME_SPLIT_HEAD:
+            *BounceOffset = (ULONG)(lba & mask) * Namespace->BlockSize;
+            *Length = ((mask + 1) - (ULONG)(lba & mask)) * Namespace->BlockSize;
+            return first;
+
+        case NVME_SPLIT_TAIL:
+            *SrbOffset = (ULONG)((last << shift) - lba) * Namespace->BlockSize;
+            *Length = (ULONG)(end - (last << shift)) * Namespace->BlockSize;
+            return last;
+
+        default:
+            // Whole blocks between the partial ones
+            if (lba & mask) {
+                first++;
+            }
+            if (end & mask) {
+                last--;
+            }
+            if (last + 1 <= first) {
+                *Length = 0;
+                return first;
+            }
+            *SrbOffset = (ULONG)((first << shift) - lba) * Namespace->BlockSize;
+            *Length = (ULONG)(last + 1 - first) * (Namespace->BlockSize << shift);
+            return first;
+    }
+}
+
+//
+// NvmeBuildSplitCommand - Build the NVMe command for one piece of a split read or write
+// The piece (Request->Segment) reads or writes whole device blocks: the middle and
+// NOIOB pieces go straight to the SRB buffer, a partial block at either end
+// through a bounce page from the PRP pool, held in PrpListPage so it is released
+// with the CID.
+// A bounce page already held (pre-read turned into the merged write) is reused.
+// Returns 1 on success, 0 if no PRP pool page is available and -1 if the buffer
+// has no physical address; the caller completes the SRB.
+//
+int NvmeBuildSplitCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_COMMAND Cmd, IN USHORT CommandId, IN BOOLEAN Fua)
+{
+    PNVME_IO_REQUEST request = &DevExt->IoRequests[CommandId];
+    PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    ULONGLONG deviceLba;
+    ULONG srbOffset;
+    ULONG bounceOffset;
+    ULONG length;
+    BOOLEAN isWrite = (request->Kind == IO_KIND_SPLIT_WRITE);
+
+    deviceLba = NvmeGetSplitSegment(ns, srbExt, request->Segment, &srbOffset, &bounceOffset, &length);
+
+    memset(Cmd, 0, sizeof(NVME_COMMAND));
+    Cmd->CDW0.Fields.Opcode = isWrite ? NVME_CMD_WRITE : NVME_CMD_READ;
+    Cmd->CDW0.Fields.Flags = NVME_CMD_PRP;
+    Cmd->CDW0.Fields.CommandId = CommandId;
+    Cmd->NSID = ns->NamespaceId;
+    Cmd->CDW10 = (ULONG)(deviceLba & 0xFFFFFFFF);
+    Cmd->CDW11 = (ULONG)(deviceLba >> 32);
+    if (isWrite && Fua) {
+        Cmd->CDW12 = NVME_RW_FUA;
+    }
+
+    if (!NVME_SPLIT_BOUNCED(request->Segment)) {
+        Cmd->CDW12 |= (length / (ns->BlockSize << ns->LbaShift)) - 1;
+        return NvmeBuildPrpEntries(DevExt, Srb, &request->PrpListPage, Cmd, (PUCHAR)Srb->DataBuffer + srbOffset, length);
+    }
+
+    // One device block, never more than a page
+    if (request->PrpListPage == 0xFF) {
+        request->PrpListPage = AllocatePrpListPage(DevExt);
+        if (request->PrpListPage == 0xFF) {
+            return 0;
+        }
+    }
+    Cmd->PRP1 = GetPrpListPagePhysical(DevExt, request->PrpListPage).QuadPart;
+    Cmd->PRP2 = 0;
+
+#ifdef NVME2K_DBG_CMD
+    ScsiDebugPrint(0, "nvme2k: NvmeBuildSplitCommand - CID=%u %s segment %u device LBA %08X%08X bounce page %u\n",
+                   CommandId, isWrite ? "write" : "read", request->Segment,
+                   (ULONG)(deviceLba >> 32), (ULONG)(deviceLba & 0xFFFFFFFF), request->PrpListPage);
+#endif
+    return 1;
+}
+
+//
+// NvmeTrimClassify - Cut a write in TRIM mode into runs of pattern and other pages
+// A page is only compared in full if its first and last dwords match the pattern's.
+// A partial page at the end is always written. Returns the number of runs, 0 if
+// the write should go whole: nothing matched, it would take more commands than
+// NVME_MAX_BOUNDARY_PIECES, the device has no DSM, a run isn't whole device blocks
+// (device LBA larger than a page, or a 512e write that isn't aligned) or the
+// write is invalid (the normal path rejects it then).
+//
+ULONG NvmeTrimClassify(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, OUT PNVME_TRIM_RUN Runs)
+{
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    PULONG page;
+    ULONGLONG lba;
+    ULONG numBlocks;
+    ULONG transfer;
+    ULONG offset;
+    ULONG length;
+    ULONG runs = 0;
+    ULONG writes = 0;
+    ULONG patterns = 0;
+    ULONG deviceBlockSize = ns->BlockSize << ns->LbaShift;
+    ULONG i;
+    BOOLEAN fua;
+    BOOLEAN match;
+
+    if (DevExt->TrimPattern == NULL || !(DevExt->OptionalNvmCommands & NVME_ONCS_DSM) ||
+        deviceBlockSize > NVME_TRIM_PAGE_SIZE || Srb->SrbExtension == NULL ||
+        !ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua)) {
+        return 0;
+    }
+    transfer = numBlocks * ns->BlockSize;
+    if (transfer < NVME_TRIM_PAGE_SIZE || transfer > Srb->DataTransferLength ||
+        transfer > DevExt->MaxTransferSizeBytes ||
+        lba >= ns->SizeInBlocks || numBlocks > ns->SizeInBlocks - lba) {
+        return 0;
+    }
+
+    for (offset = 0; offset < transfer; offset += length) {
+        length = transfer - offset;
+        if (length > NVME_TRIM_PAGE_SIZE) {
+            length = NVME_TRIM_PAGE_SIZE;
+        }
+        page = (PULONG)((PUCHAR)Srb->DataBuffer + offset);
+        match = (length == NVME_TRIM_PAGE_SIZE &&
+                 page[0] == DevExt->TrimFingerprint[0] &&
+                 page[NVME_TRIM_PAGE_SIZE / sizeof(ULONG) - 1] == DevExt->TrimFingerprint[1] &&
+                 memcmp(page, DevExt->TrimPattern, NVME_TRIM_PAGE_SIZE) == 0);
+
+        if (runs != 0 && Runs[runs - 1].Pattern == match) {
+            Runs[runs - 1].Length += length;
+            continue;
+        }
+        // One DSM for all pattern runs, one write per other run
+        if (match) {
+            patterns++;
+        } else if (++writes >= NVME_MAX_BOUNDARY_PIECES) {
+            return 0;
+        }
+        Runs[runs].DeviceLba = (lba + offset / ns->BlockSize) >> ns->LbaShift;
+        Runs[runs].Offset = offset;
+        Runs[runs].Length = length;
+        Runs[runs].Pattern = match;
+        runs++;
+    }
+
+    // The DSM ranges and the writes are counted in device blocks
+    for (i = 0; i < runs; i++) {
+        if ((Runs[i].DeviceLba << ns->LbaShift) != lba + Runs[i].Offset / ns->BlockSize ||
+            Runs[i].Length % deviceBlockSize != 0) {
+            return 0;
+        }
+    }
+    return (patterns != 0) ? runs : 0;
+}
+
+//
+// NvmeBuildTrimDeallocCommand - Build the DSM deallocate for the pattern runs of a
+// write in TRIM mode
+// The range list goes in a PRP pool page held in PrpListPage and ends with an
+// empty range for NvmeProcessDeallocCompletion; the SRB buffer isn't touched.
+// Returns 1 on success, 0 if no PRP pool page is available.
+//
+int NvmeBuildTrimDeallocCommand(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN PNVME_COMMAND Cmd,
+    IN USHORT CommandId,
+    IN PNVME_TRIM_RUN Runs,
+    IN ULONG Count)
+{
+    PNVME_IO_REQUEST request = &DevExt->IoRequests[CommandId];
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    PNVME_DSM_RANGE dsmRanges;
+    ULONG i;
+    ULONG n = 0;
+
+    request->PrpListPage = AllocatePrpListPage(DevExt);
+    if (request->PrpListPage == 0xFF) {
+        return 0;
+    }
+    dsmRanges = (PNVME_DSM_RANGE)GetPrpListPageVirtual(DevExt, request->PrpListPage);
+    for (i = 0; i < Count; i++) {
+        if (Runs[i].Pattern) {
+            dsmRanges[n].ContextAttributes = 0;
+            dsmRanges[n].Length = Runs[i].Length / (ns->BlockSize << ns->LbaShift);
+            dsmRanges[n].StartingLba = Runs[i].DeviceLba;
+            n++;
+        }
+    }
+    dsmRanges[n].ContextAttributes = 0;
+    dsmRanges[n].Length = 0;
+    dsmRanges[n].StartingLba = 0;
+
+    memset(Cmd, 0, sizeof(NVME_COMMAND));
+    Cmd->CDW0.Fields.Opcode = NVME_CMD_DSM;
+    Cmd->CDW0.Fields.Flags = NVME_CMD_PRP;
+    Cmd->CDW0.Fields.CommandId = CommandId;
+    Cmd->NSID = ns->NamespaceId;
+    Cmd->PRP1 = GetPrpListPagePhysical(DevExt, request->PrpListPage).QuadPart;
+    Cmd->CDW10 = n - 1;
+    Cmd->CDW11 = NVME_DSM_ATTR_DEALLOCATE;
+
+#ifdef NVME2K_DBG_EXTRA
+    ScsiDebugPrint(0, "nvme2k: TRIM pattern in %u runs of write at device LBA %08X%08X - deallocating\n",
+                   n, (ULONG)(Runs[0].DeviceLba >> 32), (ULONG)(Runs[0].DeviceLba & 0xFFFFFFFF));
+#endif
+    return 1;
+}
+
+//
+// NvmeBuildTrimWriteCommand - Build the write for one non-pattern run of a write
+// in TRIM mode, straight from the SRB buffer
+// Returns like NvmeBuildSplitCommand.
+//
+int NvmeBuildTrimWriteCommand(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN PNVME_COMMAND Cmd,
+    IN USHORT CommandId,
+    IN PNVME_TRIM_RUN Run,
+    IN BOOLEAN Fua)
+{
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+
+    memset(Cmd, 0, sizeof(NVME_COMMAND));
+    Cmd->CDW0.Fields.Opcode = NVME_CMD_WRITE;
+    Cmd->CDW0.Fields.Flags = NVME_CMD_PRP;
+    Cmd->CDW0.Fields.CommandId = CommandId;
+    Cmd->NSID = ns->NamespaceId;
+    Cmd->CDW10 = (ULONG)(Run->DeviceLba & 0xFFFFFFFF);
+    Cmd->CDW11 = (ULONG)(Run->DeviceLba >> 32);
+    Cmd->CDW12 = (Run->Length / (ns->BlockSize << ns->LbaShift)) - 1;
+    if (Fua) {
+        Cmd->CDW12 |= NVME_RW_FUA;
+    }
+    return NvmeBuildPrpEntries(DevExt, Srb, &DevExt->IoRequests[CommandId].PrpListPage, Cmd,
+                               (PUCHAR)Srb->DataBuffer + Run->Offset, Run->Length);
+}
+
+//
+// NvmeDsmAddRange - Append a LUN block range to a DSM range list
+// The range is shrunk to whole device blocks (a partial device block at either end
+// can't be deallocated without losing the rest of it) and merged into the previous
+// one if it follows it. Cached copies go now, reads racing the deallocate get
+// whichever data the device has. Returns the new number of ranges.
+//
+static ULONG NvmeDsmAddRange(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN UCHAR Lun,
+    IN PNVME_DSM_RANGE DsmRanges,
+    IN ULONG Count,
+    IN ULONGLONG Lba,
+    IN ULONGLONG Blocks)
+{
+    PNVME_NAMESPACE ns = &DevExt->Namespaces[Lun];
+    ULONGLONG mask = ((ULONGLONG)1 << ns->LbaShift) - 1;
+    ULONGLONG start = (Lba + mask) & ~mask;
+    ULONGLONG end = (Lba + Blocks) & ~mask;
+    ULONGLONG length;
+
+    if (end <= start) {
+        return Count;
+    }
+    NvmeCacheInvalidate(DevExt, Lun, start, end - start);
+
+    start >>= ns->LbaShift;
+    length = (end >> ns->LbaShift) - start;
+    if (Count != 0 && DsmRanges[Count - 1].StartingLba + DsmRanges[Count - 1].Length == start &&
+        DsmRanges[Count - 1].Length + length <= 0xFFFFFFFF) {
+        DsmRanges[Count - 1].Length += (ULONG)length;
+        return Count;
+    }
+    DsmRanges[Count].ContextAttributes = 0;
+    DsmRanges[Count].Length = (ULONG)length;
+    DsmRanges[Count].StartingLba = start;
+    return Count + 1;
+}
+
+//
+// NvmeDsmBegin - Claim a CID (IO_KIND_DSM) and a range list page for a deallocate
+// Returns NVME_IO_CID_NONE if either is short.
+//
+static USHORT NvmeDsmBegin(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN UCHAR Lun,
+    OUT PNVME_DSM_RANGE *DsmRanges)
+{
+    PNVME_IO_REQUEST request;
+    USHORT commandId;
+
+    commandId = NvmeAllocIoRequest(DevExt, Srb, IO_KIND_DSM);
+    if (commandId == NVME_IO_CID_NONE) {
+        return NVME_IO_CID_NONE;
+    }
+    request = &DevExt->IoRequests[commandId];
+    request->Segment = Lun;
+    request->PrpListPage = AllocatePrpListPage(DevExt);
+    if (request->PrpListPage == 0xFF) {
+        NvmeFreeIoRequest(DevExt, request);
+        return NVME_IO_CID_NONE;
+    }
+    *DsmRanges = (PNVME_DSM_RANGE)GetPrpListPageVirtual(DevExt, request->PrpListPage);
+    return commandId;
+}
+
+//
+// NvmeDsmSubmit - Submit the deallocate of Count ranges set up by NvmeDsmBegin
+// An empty range ends a list shorter than a page for NvmeProcessDeallocCompletion.
+// Returns 0 if the SQ is full, 1 if it was submitted or there was nothing to send
+// (the CID is released in both cases unless submitted).
+//
+static int NvmeDsmSubmit(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN UCHAR Lun,
+    IN USHORT CommandId,
+    IN PNVME_DSM_RANGE DsmRanges,
+    IN ULONG Count)
+{
+    PNVME_NAMESPACE ns = &DevExt->Namespaces[Lun];
+    PNVME_IO_REQUEST request = &DevExt->IoRequests[CommandId];
+    NVME_COMMAND cmd;
+
+    if (Count == 0) {
+        NvmeFreeIoRequest(DevExt, request);
+        return 1;
+    }
+    if (Count < NVME_DSM_MAX_RANGES) {
+        DsmRanges[Count].ContextAttributes = 0;
+        DsmRanges[Count].Length = 0;
+        DsmRanges[Count].StartingLba = 0;
+    }
+
+    memset(&cmd, 0, sizeof(NVME_COMMAND));
+    cmd.CDW0.Fields.Opcode = NVME_CMD_DSM;
+    cmd.CDW0.Fields.CommandId = CommandId;
+    cmd.NSID = ns->NamespaceId;
+    cmd.PRP1 = GetPrpListPagePhysical(DevExt, request->PrpListPage).QuadPart;
+    cmd.CDW10 = Count - 1;  // NR is 0's based
+    cmd.CDW11 = NVME_DSM_ATTR_DEALLOCATE;
+
+    if (Srb->SrbExtension) {
+        ((PNVME_SRB_EXTENSION)Srb->SrbExtension)->FlushGeneration = ns->WriteGeneration;
+    }
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: NvmeDsmSubmit - LUN %u CID=%u %u ranges\n", Lun, CommandId, Count);
+#endif
+
+    if (!NvmeSubmitIoCommand(DevExt, &cmd)) {
+        NvmeFreeIoRequest(DevExt, request);
+        return 0;
+    }
+    return 1;
+}
+
+//
+// NvmeDeallocateRanges - Send one Dataset Management deallocate for the NVME2KDB DEALLOCATE IOCTL
+// Ranges are in LUN blocks and go to the range list page through NvmeDsmAddRange;
+// the caller has checked the LUN and DSM support. Returns -1 if a range is
+// outside the namespace, 0 if no CID, PRP page or SQ slot is free (try again), 1 if
+// the command was submitted or *RangesSent is 0 because nothing was left to send.
+// Completed in NvmeProcessDsmCompletion.
+//
+int NvmeDeallocateRanges(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN UCHAR Lun,
+    IN PNVME2KDB_RANGE Ranges,
+    IN ULONG Count,
+    OUT PULONG RangesSent)
+{
+    PNVME_NAMESPACE ns = &DevExt->Namespaces[Lun];
+    PNVME_DSM_RANGE dsmRanges;
+    USHORT commandId;
+    ULONG i;
+    ULONG n = 0;
+    int rc;
+
+    *RangesSent = 0;
+    for (i = 0; i < Count; i++) {
+        if (Ranges[i].Blocks == 0 || Ranges[i].Lba >= ns->SizeInBlocks ||
+            Ranges[i].Blocks > ns->SizeInBlocks - Ranges[i].Lba) {
+            return -1;
+        }
+    }
+
+    commandId = NvmeDsmBegin(DevExt, Srb, Lun, &dsmRanges);
+    if (commandId == NVME_IO_CID_NONE) {
+        return 0;
+    }
+    for (i = 0; i < Count; i++) {
+        n = NvmeDsmAddRange(DevExt, Lun, dsmRanges, n, Ranges[i].Lba, Ranges[i].Blocks);
+    }
+
+    rc = NvmeDsmSubmit(DevExt, Srb, Lun, commandId, dsmRanges, n);
+    if (rc > 0) {
+        *RangesSent = n;
+    }
+    return rc;
+}
+
+//
+// NvmeDeallocateAtaRanges - Send one Dataset Management deallocate for an ATA
+// DATA SET MANAGEMENT (TRIM) that came through SAT ATA PASS-THROUGH
+// Each 8-byte entry holds a 48-bit LBA and a 16-bit sector count in LUN blocks;
+// empty entries are padding. Returns like NvmeDeallocateRanges, *RangesSent is the
+// number of NVMe ranges sent (adjacent entries are merged).
+//
+int NvmeDeallocateAtaRanges(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN PUCHAR Entries,
+    IN ULONG Count,
+    OUT PULONG RangesSent)
 {
-    LONG queueTag;
-    PSCSI_REQUEST_BLOCK Srb;
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    PNVME_DSM_RANGE dsmRanges;
+    PUCHAR entry;
+    ULONGLONG lba;
+    ULONG blocks;
+    USHORT commandId;
+    ULONG i;
+    ULONG n = 0;
+    int rc;
+
+    *RangesSent = 0;
+    for (i = 0; i < Count; i++) {
+        entry = Entries + i * ATA_DSM_ENTRY_SIZE;
+        lba = ATA_DSM_ENTRY_LBA(entry);
+        blocks = ATA_DSM_ENTRY_COUNT(entry);
+        if (blocks != 0 && (lba >= ns->SizeInBlocks || blocks > ns->SizeInBlocks - lba)) {
+            return -1;
+        }
+    }
 
-    // Check if this is a non-tagged request (bit 15 set)
-    if (commandId & CID_NON_TAGGED_FLAG) {
-        // Non-tagged request - use SP_UNTAGGED
-        queueTag = SP_UNTAGGED;
-    } else if (commandId & CID_ORDERED_FLUSH_FLAG) {
-        // There is no actual SRB for the flush, the next command has SRB
-        return NULL;
-    } else {
-        // Normal tagged request - extract QueueTag
-        queueTag = (LONG)(commandId & CID_VALUE_MASK);
+    commandId = NvmeDsmBegin(DevExt, Srb, Srb->Lun, &dsmRanges);
+    if (commandId == NVME_IO_CID_NONE) {
+        return 0;
+    }
+    for (i = 0; i < Count; i++) {
+        entry = Entries + i * ATA_DSM_ENTRY_SIZE;
+        blocks = ATA_DSM_ENTRY_COUNT(entry);
+        if (blocks != 0) {
+            n = NvmeDsmAddRange(DevExt, Srb->Lun, dsmRanges, n, ATA_DSM_ENTRY_LBA(entry), blocks);
+        }
     }
 
-    // Call ScsiPortGetSrb to retrieve the SRB
-    // PathId=0, TargetId=0, Lun=0 for our single device
-    Srb = ScsiPortGetSrb(DevExt, 0, 0, 0, queueTag);
-    if (queueTag == SP_UNTAGGED) {
-        if (!Srb)
-            Srb = DevExt->NonTaggedInFlight;
-        DevExt->NonTaggedInFlight = NULL;
+    rc = NvmeDsmSubmit(DevExt, Srb, Srb->Lun, commandId, dsmRanges, n);
+    if (rc > 0) {
+        *RangesSent = n;
     }
-    return Srb;
+    return rc;
 }
 
 //
-// NvmeBuildReadWriteCommand - Build NVMe Read/Write command from SCSI CDB
+// NvmeUserIoCommand - Send an NvmeMini I/O queue command (IO_KIND_USER)
+// CDW10-15 come from the caller's NVME_PASS_THROUGH, the CID, NSID and PRPs from
+// the driver; the PRPs point at the Length bytes after NVME_PASS_THROUGH and there
+// is never a metadata pointer. HandleIO_NvmeMiniIo has checked the opcode, LUN and
+// Length. Returns -1 if the buffer has no physical address, 0 if no CID, PRP list
+// page or SQ slot is free (try again), 1 if the command was submitted.
+// Completed in NvmeProcessUserIoCompletion.
 //
-int NvmeBuildReadWriteCommand(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME_COMMAND Cmd, IN USHORT CommandId)
+int NvmeUserIoCommand(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN UCHAR Lun,
+    IN ULONG Length)
 {
-    PCDB cdb = (PCDB)Srb->Cdb;
-    ULONGLONG lba = 0;
-    ULONG numBlocks = 0;
-    BOOLEAN isWrite = FALSE;
-    PHYSICAL_ADDRESS physAddr;
-    PHYSICAL_ADDRESS physAddr2;
-    ULONG length;
-    ULONG offsetInPage;
-    ULONG firstPageBytes;
-    PVOID currentPageVirtual;
-    ULONG remainingBytes;
-    ULONG currentOffset;
-    UCHAR prpListPage;
-    PULONGLONG prpList;
-    PHYSICAL_ADDRESS prpListPhys;
-    ULONG prpIndex;
-    ULONG numPrpEntries;
-    PNVME_SRB_EXTENSION srbExt;
-
-    // Initialize SRB extension
-    srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
-    srbExt->PrpListPage = 0xFF;  // No PRP list initially
-
-    // Parse CDB based on opcode
-    switch (cdb->CDB10.OperationCode) {
-        case SCSIOP_READ6:
-        case SCSIOP_WRITE6:
-            lba = ((ULONG)(cdb->CDB6READWRITE.LogicalBlockMsb1) << 16) |
-                  ((ULONG)(cdb->CDB6READWRITE.LogicalBlockMsb0) << 8) |
-                  ((ULONG)(cdb->CDB6READWRITE.LogicalBlockLsb));
-            numBlocks = cdb->CDB6READWRITE.TransferBlocks;
-            if (numBlocks == 0) {
-                numBlocks = 256;  // 0 means 256 blocks in READ(6)/WRITE(6)
-            }
-            isWrite = (cdb->CDB6READWRITE.OperationCode == SCSIOP_WRITE6);
-            break;
+    PNVME_PASS_THROUGH nvmePassThru;
+    PNVME_IO_REQUEST request;
+    NVME_COMMAND cmd;
+    USHORT commandId;
+    BOOLEAN writes;
+    int rc;
 
-        case SCSIOP_READ:
-        case SCSIOP_WRITE:
-            lba = ((ULONG)cdb->CDB10.LogicalBlockByte0 << 24) |
-                  ((ULONG)cdb->CDB10.LogicalBlockByte1 << 16) |
-                  ((ULONG)cdb->CDB10.LogicalBlockByte2 << 8) |
-                  ((ULONG)cdb->CDB10.LogicalBlockByte3);
-            numBlocks = ((ULONG)cdb->CDB10.TransferBlocksMsb << 8) |
-                        ((ULONG)cdb->CDB10.TransferBlocksLsb);
-            isWrite = (cdb->CDB10.OperationCode == SCSIOP_WRITE);
-            break;
+    nvmePassThru = (PNVME_PASS_THROUGH)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
 
-        case SCSIOP_READ16:
-        case SCSIOP_WRITE16:
-            // READ(16)/WRITE(16) - Bytes 2-9: LBA (64-bit big-endian)
-            lba = ((ULONGLONG)Srb->Cdb[2] << 56) |
-                  ((ULONGLONG)Srb->Cdb[3] << 48) |
-                  ((ULONGLONG)Srb->Cdb[4] << 40) |
-                  ((ULONGLONG)Srb->Cdb[5] << 32) |
-                  ((ULONGLONG)Srb->Cdb[6] << 24) |
-                  ((ULONGLONG)Srb->Cdb[7] << 16) |
-                  ((ULONGLONG)Srb->Cdb[8] << 8) |
-                  ((ULONGLONG)Srb->Cdb[9]);
-            // Bytes 10-13: Transfer Length (32-bit big-endian)
-            numBlocks = ((ULONG)Srb->Cdb[10] << 24) |
-                        ((ULONG)Srb->Cdb[11] << 16) |
-                        ((ULONG)Srb->Cdb[12] << 8) |
-                        ((ULONG)Srb->Cdb[13]);
-            isWrite = (Srb->Cdb[0] == SCSIOP_WRITE16);
-            break;
+    commandId = NvmeAllocIoRequest(DevExt, Srb, IO_KIND_USER);
+    if (commandId == NVME_IO_CID_NONE) {
+        return 0;
     }
+    request = &DevExt->IoRequests[commandId];
+    request->Segment = Lun;
 
-    // validate against buffer size
-    if (numBlocks * DevExt->NamespaceBlockSize > Srb->DataTransferLength) {
-        ScsiDebugPrint(0, "nvme2k: Transfer size in blocks %u exceeds buffer size %u - rejecting\n",
-                       numBlocks, Srb->DataTransferLength);
-#ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: Transfer size in blocks %u exceeds buffer size %u - rejecting\n",
-                       numBlocks, Srb->DataTransferLength);
-#endif
-        DevExt->RejectedRequests++;
-        DevExt->NonTaggedInFlight = NULL;
-        ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
-        return -1;
+    memset(&cmd, 0, sizeof(NVME_COMMAND));
+    cmd.CDW0.Fields.Opcode = (UCHAR)(nvmePassThru->Command[0] & 0xFF);
+    cmd.CDW0.Fields.Flags = NVME_CMD_PRP;
+    cmd.CDW0.Fields.CommandId = commandId;
+    cmd.NSID = DevExt->Namespaces[Lun].NamespaceId;
+    cmd.CDW10 = nvmePassThru->Command[10];
+    cmd.CDW11 = nvmePassThru->Command[11];
+    cmd.CDW12 = nvmePassThru->Command[12];
+    cmd.CDW13 = nvmePassThru->Command[13];
+    cmd.CDW14 = nvmePassThru->Command[14];
+    cmd.CDW15 = nvmePassThru->Command[15];
+
+    if (Length != 0) {
+        rc = NvmeBuildPrpEntries(DevExt, Srb, &request->PrpListPage, &cmd,
+                                 (PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH),
+                                 Length);
+        if (rc <= 0) {
+            NvmeFreeIoRequest(DevExt, request);
+            return rc;
+        }
     }
-    // Validate transfer size against MDTS
-    if (numBlocks * DevExt->NamespaceBlockSize > DevExt->MaxTransferSizeBytes) {
-        ScsiDebugPrint(0, "nvme2k: Transfer size in blocks %u exceeds MDTS limit %u - rejecting\n",
-                       numBlocks, DevExt->MaxTransferSizeBytes);
+
+    // Reads racing with a write must not fill the cache from before it
+    writes = NvmeCacheInvalidateUserIo(DevExt, Lun, nvmePassThru->Command);
+
 #ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: Transfer size in blocks %u exceeds MDTS limit %u - rejecting\n",
-                       numBlocks, DevExt->MaxTransferSizeBytes);
+    ScsiDebugPrint(0, "nvme2k: NvmeUserIoCommand - LUN %u CID=%u Opcode=%02X CDW10=%08X CDW12=%08X %u bytes\n",
+                   Lun, commandId, cmd.CDW0.Fields.Opcode, cmd.CDW10, cmd.CDW12, Length);
 #endif
-        DevExt->RejectedRequests++;
-        DevExt->NonTaggedInFlight = NULL;
-        ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
-        return -1;
-    }
 
-    // Build NVMe command
-    if (isWrite) {
-        Cmd->CDW0.Fields.Opcode = NVME_CMD_WRITE;
-    } else {
-        Cmd->CDW0.Fields.Opcode = NVME_CMD_READ;
+    if (!NvmeSubmitIoCommand(DevExt, &cmd)) {
+        NvmeFreeIoRequest(DevExt, request);
+        return 0;
     }
-    Cmd->CDW0.Fields.Flags = NVME_CMD_PRP;
-    Cmd->CDW0.Fields.CommandId = CommandId;
-
-    Cmd->NSID = 1;  // Namespace ID 1
 
-    // Track I/O statistics
-    DevExt->TotalRequests++;
-    if (isWrite) {
-        DevExt->TotalWrites++;
-        DevExt->TotalBytesWritten += Srb->DataTransferLength;
-        if (Srb->DataTransferLength > DevExt->MaxWriteSize) {
-            DevExt->MaxWriteSize = Srb->DataTransferLength;
-        }
-    } else {
-        DevExt->TotalReads++;
-        DevExt->TotalBytesRead += Srb->DataTransferLength;
-        if (Srb->DataTransferLength > DevExt->MaxReadSize) {
-            DevExt->MaxReadSize = Srb->DataTransferLength;
-        }
-    }
-#if NVME2K_DBG_STATS
-    // Print statistics every 10000 requests
-    // Note: QDepth tracking removed (always 0) since we no longer store SRBs
-    if ((DevExt->TotalRequests % 10000) == 0) {
-        ScsiDebugPrint(0, "nvme2k: Stats - Reqs=%u R=%u W=%u BytesR=%I64u BytesW=%I64u MaxR=%u MaxW=%u PRP=%u/%u Rejected=%u\n",
-                       DevExt->TotalRequests,
-                       DevExt->TotalReads,
-                       DevExt->TotalWrites,
-                       DevExt->TotalBytesRead,
-                       DevExt->TotalBytesWritten,
-                       DevExt->MaxReadSize,
-                       DevExt->MaxWriteSize,
-                       DevExt->CurrentPrpListPagesUsed,
-                       DevExt->MaxPrpListPagesUsed,
-                       DevExt->RejectedRequests);
+    // A flush doesn't get elided while it is outstanding, as for a SCSI write
+    if (writes) {
+        DevExt->Namespaces[Lun].WritesOutstanding++;
     }
-#endif
-
-    // Check for TRIM mode: if writing and TRIM is enabled, compare first 4KB with pattern
-    if (isWrite && DevExt->TrimEnable && Srb->DataTransferLength >= 4096) {
-        // Compare first 4KB of DataBuffer with TrimPattern
-        if (memcmp(Srb->DataBuffer, DevExt->TrimPattern, 4096) == 0) {
-            // Match! Convert to TRIM/UNMAP (Dataset Management) command
-#ifdef NVME2K_DBG_EXTRA
-            ScsiDebugPrint(0, "nvme2k: TRIM pattern detected at LBA %08X%08X, blocks=%u - converting to DSM\n",
-                           (ULONG)(lba >> 32), (ULONG)(lba & 0xFFFFFFFF), numBlocks);
-#endif
-            // Build Dataset Management command
-            Cmd->CDW0.Fields.Opcode = NVME_CMD_DSM;
-            // Flags and CommandId already set, NSID already set
-
-            // Clear reserved fields
-            Cmd->CDW2 = 0;
-            Cmd->CDW3 = 0;
-            Cmd->MPTR = 0;
-
-            // DSM command format:
-            // CDW10: NR (Number of Ranges) - 1 range = 0
-            // CDW11: Attributes - bit 2 (AD) = deallocate
-            // PRP points to range data: [Context Attributes (32bit)][Length in blocks (32bit)][Starting LBA (64bit)]
-            Cmd->CDW10 = 0;  // 0 = 1 range
-            Cmd->CDW11 = (1 << 2);  // AD (Attribute - Deallocate)
-            Cmd->CDW12 = 0;
-            Cmd->CDW13 = 0;
-            Cmd->CDW14 = 0;
-            Cmd->CDW15 = 0;
-
-            // Build range data structure in data buffer (reuse the buffer)
-            // Format: [Context Attributes: 32 bits][Length: 32 bits][SLBA: 64 bits]
-            {
-                PULONG rangeData = (PULONG)Srb->DataBuffer;
-                rangeData[0] = 0;  // Context attributes
-                rangeData[1] = numBlocks;  // Length in logical blocks
-                rangeData[2] = (ULONG)(lba & 0xFFFFFFFF);  // Starting LBA (low)
-                rangeData[3] = (ULONG)(lba >> 32);  // Starting LBA (high)
-#ifdef NVME2K_DBG_EXTRA
-                ScsiDebugPrint(0, "nvme2k: DSM range data - CtxAttr=0x%08X Len=%u SLBA=0x%08X%08X\n",
-                               rangeData[0], rangeData[1], rangeData[3], rangeData[2]);
-#endif
-            }
+    return 1;
+}
 
-            // Get physical address for the range data (only need 16 bytes)
-            length = 16;
-            physAddr = ScsiPortGetPhysicalAddress(DevExt, Srb, Srb->DataBuffer, &length);
-            if (physAddr.QuadPart == 0) {
-                DevExt->RejectedRequests++;
-                DevExt->NonTaggedInFlight = NULL;
-                ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
-                return -1;
-            }
+//
+// NVME2KDB COPY (see nvme2kdb.h)
+// On a namespace with Copy limits a step is one Copy command (IO_KIND_COPY) whose
+// source range descriptors sit in a PRP pool page. Otherwise blocks go through one
+// or two pool pages: a read (IO_KIND_COPY_READ), then the write of the same pages on
+// the same CID (IO_KIND_COPY_WRITE), repeated from the completion until the step
+// has moved NVME2KDB_COPY_STEP_BYTES. Progress lives in the caller's payload
+// (BlocksDone, BlocksCopied), and each piece is worked out again from it.
+//
 
-            Cmd->PRP1 = physAddr.QuadPart;
-            Cmd->PRP2 = 0;
+//
+// NvmeCopyLocate - Source range holding block Done of the back to back ranges
+// Returns its index with the offset into it in *Offset, NumberOfRanges past the end.
+//
+static ULONG NvmeCopyLocate(IN PNVME2KDB_COPY Copy, IN ULONGLONG Done, OUT PULONGLONG Offset)
+{
+    ULONG i;
 
-#ifdef NVME2K_DBG_EXTRA
-            ScsiDebugPrint(0, "nvme2k: DSM command - CDW10=0x%08X CDW11=0x%08X PRP1=0x%08X%08X\n",
-                           Cmd->CDW10, Cmd->CDW11,
-                           (ULONG)(Cmd->PRP1 >> 32), (ULONG)(Cmd->PRP1 & 0xFFFFFFFF));
-#endif
+    for (i = 0; i < Copy->NumberOfRanges; i++) {
+        if (Done < Copy->Ranges[i].Blocks) {
+            *Offset = Done;
+            return i;
+        }
+        Done -= Copy->Ranges[i].Blocks;
+    }
+    *Offset = 0;
+    return Copy->NumberOfRanges;
+}
 
-            return 1;
+//
+// NvmeBuildCopyCommand - Fill a Copy command for the next step, and its source
+// ranges in the request's PRP page, within the namespace's MSRC, MSSRL and MCL
+// Returns the LUN blocks it copies.
+//
+static ULONGLONG NvmeBuildCopyCommand(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PNVME_IO_REQUEST Request,
+    IN PNVME2KDB_COPY Copy,
+    IN PNVME_COMMAND Cmd,
+    IN USHORT CommandId)
+{
+    PNVME_NAMESPACE ns = &DevExt->Namespaces[Copy->Lun];
+    PNVME_COPY_RANGE ranges;
+    ULONGLONG maxRange = (ULONGLONG)ns->MaxCopyRangeBlocks << ns->LbaShift;
+    ULONGLONG remaining = (ULONGLONG)ns->MaxCopyBlocks << ns->LbaShift;
+    ULONGLONG offset;
+    ULONGLONG blocks;
+    ULONGLONG total = 0;
+    ULONGLONG lba;
+    ULONG i;
+    ULONG n;
+
+    ranges = (PNVME_COPY_RANGE)GetPrpListPageVirtual(DevExt, Request->PrpListPage);
+    memset(ranges, 0, NVME_PAGE_SIZE);
+
+    i = NvmeCopyLocate(Copy, Copy->BlocksDone, &offset);
+    for (n = 0; n < ns->MaxCopyRanges && i < Copy->NumberOfRanges && remaining != 0; n++) {
+        blocks = Copy->Ranges[i].Blocks - offset;
+        if (blocks > maxRange) {
+            blocks = maxRange;
+        }
+        if (blocks > remaining) {
+            blocks = remaining;
+        }
+        ranges[n].StartingLba = (Copy->Ranges[i].Lba + offset) >> ns->LbaShift;
+        ranges[n].NumberOfBlocks = (USHORT)((blocks >> ns->LbaShift) - 1);
+
+        total += blocks;
+        remaining -= blocks;
+        offset += blocks;
+        if (offset == Copy->Ranges[i].Blocks) {
+            i++;
+            offset = 0;
         }
     }
 
-    // Normal read/write: Set LBA and number of blocks
+    memset(Cmd, 0, sizeof(NVME_COMMAND));
+    Cmd->CDW0.Fields.Opcode = NVME_CMD_COPY;
+    Cmd->CDW0.Fields.Flags = NVME_CMD_PRP;
+    Cmd->CDW0.Fields.CommandId = CommandId;
+    Cmd->NSID = ns->NamespaceId;
+    lba = (Copy->DestinationLba + Copy->BlocksDone) >> ns->LbaShift;
     Cmd->CDW10 = (ULONG)(lba & 0xFFFFFFFF);
     Cmd->CDW11 = (ULONG)(lba >> 32);
-    Cmd->CDW12 = (numBlocks > 0) ? (numBlocks - 1) : 0;
-    Cmd->CDW13 = 0;
-    Cmd->CDW14 = 0;
-    Cmd->CDW15 = 0;
-
-    // Normal read/write path - build PRPs
-    // Get physical address of data buffer
-    length = Srb->DataTransferLength;
-    physAddr = ScsiPortGetPhysicalAddress(DevExt, Srb, Srb->DataBuffer, &length);
-    if (physAddr.QuadPart == 0) {
-        DevExt->RejectedRequests++;
-        DevExt->NonTaggedInFlight = NULL;
-        ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
-        return -1;
-    }
+    Cmd->CDW12 = n - 1;     // NR is 0's based, descriptor format 0
+    Cmd->PRP1 = GetPrpListPagePhysical(DevExt, Request->PrpListPage).QuadPart;
 
-#ifdef NVME2K_DBG_CMD
-    ScsiDebugPrint(0, "nvme2k: NvmeBuildReadWriteCommand - DataBuffer=%p TransferLen=%u PhysAddr=%08X%08X ReturnedLen=%u\n",
-                   Srb->DataBuffer, Srb->DataTransferLength,
-                   (ULONG)(physAddr.QuadPart >> 32), (ULONG)(physAddr.QuadPart & 0xFFFFFFFF),
-                   length);
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: NvmeBuildCopyCommand - LUN %u CID=%u %u ranges, %u blocks to %08X%08X\n",
+                   Copy->Lun, CommandId, n, (ULONG)total, Cmd->CDW11, Cmd->CDW10);
 #endif
-    // Set PRP1 to the start of the data
-    Cmd->PRP1 = physAddr.QuadPart;
-
-    // Calculate offset within the page
-    offsetInPage = (ULONG)(physAddr.QuadPart & NVME_PAGE_MASK);
+    return total;
+}
 
-    // Calculate how many bytes fit in the first page
-    firstPageBytes = NVME_PAGE_SIZE - offsetInPage;
+//
+// NvmeBuildCopyPieceCommand - Fill the read (IO_KIND_COPY_READ) or write
+// (IO_KIND_COPY_WRITE) of the piece of an NVME2KDB COPY at BlocksDone
+// A piece stays in one source range and fits the request's pool pages.
+// Returns its LUN blocks, 0 if every block was copied.
+//
+ULONG NvmeBuildCopyPieceCommand(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PNVME_IO_REQUEST Request,
+    IN PNVME2KDB_COPY Copy,
+    IN PNVME_COMMAND Cmd,
+    IN USHORT CommandId)
+{
+    PNVME_NAMESPACE ns = &DevExt->Namespaces[Copy->Lun];
+    ULONGLONG offset;
+    ULONGLONG blocks;
+    ULONGLONG lba;
+    ULONG maxBlocks;
+    ULONG i;
+
+    i = NvmeCopyLocate(Copy, Copy->BlocksDone, &offset);
+    if (i == Copy->NumberOfRanges) {
+        return 0;
+    }
 
-    // Determine if we need PRP2 or a PRP list
-    if (Srb->DataTransferLength <= firstPageBytes) {
-        // Transfer fits in one page
-        Cmd->PRP2 = 0;
-#ifdef NVME2K_DBG_CMD
-        ScsiDebugPrint(0, "nvme2k: NvmeBuildReadWriteCommand - Single page transfer, PRP2=0\n");
-#endif
-    } else if (Srb->DataTransferLength <= (firstPageBytes + NVME_PAGE_SIZE)) {
-        // Transfer spans exactly 2 pages, use PRP2 directly
-        currentPageVirtual = (PVOID)((PUCHAR)Srb->DataBuffer + firstPageBytes);
-        length = Srb->DataTransferLength - firstPageBytes;
-        physAddr2 = ScsiPortGetPhysicalAddress(DevExt, Srb, currentPageVirtual, &length);
-        if (physAddr2.QuadPart == 0) {
-            DevExt->RejectedRequests++;
-            DevExt->NonTaggedInFlight = NULL;
-            ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
-            return -1;
-        }
+    maxBlocks = ((Request->Segment != 0xFF) ? 2 * NVME_PAGE_SIZE : NVME_PAGE_SIZE) / ns->BlockSize;
+    blocks = Copy->Ranges[i].Blocks - offset;
+    if (blocks > maxBlocks) {
+        blocks = maxBlocks;
+    }
 
-#ifdef NVME2K_DBG_CMD
-        ScsiDebugPrint(0, "nvme2k: NvmeBuildReadWriteCommand - Two page transfer: PhysAddr2=%08X%08X\n",
-                       (ULONG)(physAddr2.QuadPart >> 32), (ULONG)(physAddr2.QuadPart & 0xFFFFFFFF));
-#endif
-        Cmd->PRP2 = physAddr2.QuadPart;
+    if (Request->Kind == IO_KIND_COPY_READ) {
+        lba = Copy->Ranges[i].Lba + offset;
     } else {
-        // Transfer spans more than 2 pages, need PRP list
-        prpListPage = AllocatePrpListPage(DevExt);
-        if (prpListPage == 0xFF) {
-            // No PRP list pages available - this shouldn't happen if we sized correctly
-            ScsiDebugPrint(0, "nvme2k: No PRP list pages available %d/%d!\n", DevExt->CurrentPrpListPagesUsed, DevExt->SgListPages);
-            Cmd->PRP2 = 0;
-            DevExt->RejectedRequests++;
-            DevExt->NonTaggedInFlight = NULL;
-            return 0;
-        }
-
-        // Store PRP list page in SRB extension
-        {
-            PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
-            srbExt->PrpListPage = prpListPage;
-        }
+        lba = Copy->DestinationLba + Copy->BlocksDone;
+    }
+    lba >>= ns->LbaShift;
 
-        // Get virtual and physical addresses of PRP list
-        prpList = (PULONGLONG)GetPrpListPageVirtual(DevExt, prpListPage);
-        prpListPhys = GetPrpListPagePhysical(DevExt, prpListPage);
+    memset(Cmd, 0, sizeof(NVME_COMMAND));
+    Cmd->CDW0.Fields.Opcode = (Request->Kind == IO_KIND_COPY_READ) ? NVME_CMD_READ : NVME_CMD_WRITE;
+    Cmd->CDW0.Fields.Flags = NVME_CMD_PRP;
+    Cmd->CDW0.Fields.CommandId = CommandId;
+    Cmd->NSID = ns->NamespaceId;
+    Cmd->CDW10 = (ULONG)(lba & 0xFFFFFFFF);
+    Cmd->CDW11 = (ULONG)(lba >> 32);
+    Cmd->CDW12 = (ULONG)(blocks >> ns->LbaShift) - 1;
+    Cmd->PRP1 = GetPrpListPagePhysical(DevExt, Request->PrpListPage).QuadPart;
+    if (blocks * ns->BlockSize > NVME_PAGE_SIZE) {
+        Cmd->PRP2 = GetPrpListPagePhysical(DevExt, Request->Segment).QuadPart;
+    }
+    return (ULONG)blocks;
+}
 
-        // Build PRP list for remaining pages
-        remainingBytes = Srb->DataTransferLength - firstPageBytes;
-        currentOffset = firstPageBytes;
-        prpIndex = 0;
+//
+// NvmeCopyStart - Send the first command of an NVME2KDB COPY step
+// HandleIO_NVME2KDB has checked the payload and that blocks are left. Returns FALSE
+// if no CID, pool page or SQ slot is free (try again). Completed in
+// NvmeProcessCopyCompletion.
+//
+BOOLEAN NvmeCopyStart(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN PNVME2KDB_COPY Copy)
+{
+    PNVME_NAMESPACE ns = &DevExt->Namespaces[Copy->Lun];
+    PNVME_IO_REQUEST request;
+    NVME_COMMAND cmd;
+    USHORT commandId;
+    BOOLEAN offload;
 
-        while (remainingBytes > 0 && prpIndex < 512) {
-            currentPageVirtual = (PVOID)((PUCHAR)Srb->DataBuffer + currentOffset);
-            length = remainingBytes;
-            physAddr2 = ScsiPortGetPhysicalAddress(DevExt, Srb, currentPageVirtual, &length);
-            if (physAddr2.QuadPart == 0) {
-                FreePrpListPage(DevExt, prpListPage);
-                DevExt->RejectedRequests++;
-                DevExt->NonTaggedInFlight = NULL;
-                ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
-                return -1;
-            }
+    offload = (BOOLEAN)(ns->MaxCopyBlocks != 0 && !(Copy->Flags & NVME2KDB_COPY_READ_WRITE));
 
-            prpList[prpIndex] = physAddr2.QuadPart;
-            prpIndex++;
+    commandId = NvmeAllocIoRequest(DevExt, Srb, offload ? IO_KIND_COPY : IO_KIND_COPY_READ);
+    if (commandId == NVME_IO_CID_NONE) {
+        return FALSE;
+    }
+    request = &DevExt->IoRequests[commandId];
+    request->Segment = 0xFF;
+    request->PrpListPage = AllocatePrpListPage(DevExt);
+    if (request->PrpListPage == 0xFF) {
+        NvmeFreeIoRequest(DevExt, request);
+        return FALSE;
+    }
 
-            if (remainingBytes <= NVME_PAGE_SIZE) {
-                break;
-            }
+    if (offload) {
+        // BlocksCopied is what this command moves, taken back if it fails
+        Copy->BlocksCopied = NvmeBuildCopyCommand(DevExt, request, Copy, &cmd, commandId);
+        Copy->Flags |= NVME2KDB_COPY_OFFLOADED;
+        NvmeCacheInvalidateCopy(DevExt, Copy, Copy->BlocksCopied);
+    } else {
+        // A second page doubles the piece, but the step works without it
+        request->Segment = AllocatePrpListPage(DevExt);
+        NvmeBuildCopyPieceCommand(DevExt, request, Copy, &cmd, commandId);
+    }
 
-            remainingBytes -= NVME_PAGE_SIZE;
-            currentOffset += NVME_PAGE_SIZE;
+    if (!NvmeSubmitIoCommand(DevExt, &cmd)) {
+        if (request->Segment != 0xFF) {
+            FreePrpListPage(DevExt, request->Segment);
         }
-
-        numPrpEntries = prpIndex;
-
-#ifdef NVME2K_DBG_CMD
-        ScsiDebugPrint(0, "nvme2k: NvmeBuildReadWriteCommand - PRP list: page=%u entries=%u listPhys=%08X%08X\n",
-                       prpListPage, numPrpEntries,
-                       (ULONG)(prpListPhys.QuadPart >> 32), (ULONG)(prpListPhys.QuadPart & 0xFFFFFFFF));
-#endif
-
-        // Set PRP2 to point to the PRP list
-        Cmd->PRP2 = prpListPhys.QuadPart;
+        NvmeFreeIoRequest(DevExt, request);
+        Copy->BlocksCopied = 0;
+        Copy->Flags &= ~NVME2KDB_COPY_OFFLOADED;
+        return FALSE;
     }
+    return TRUE;
+}
 
-    // CDW10-15 already set above before TRIM check
-    return 1;
+//
+// NvmeIoQueueFreeSlots - Number of commands that can still be put on the I/O SQ
+//
+ULONG NvmeIoQueueFreeSlots(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    PNVME_QUEUE Queue = &DevExt->IoQueue;
+
+    return (ULONG)((Queue->SubmissionQueueHead - Queue->SubmissionQueueTail - 1) & Queue->QueueSizeMask);
 }
 
 //
@@ -867,6 +2198,7 @@ VOID NvmeShutdownController(IN PHW_DEVICE_EXTENSION DevExt)
     ULONG timeoutMs = 5000;  // 5 second timeout
     ULONG elapsed = 0;
     ULONG shutdownStatus;
+    ULONG i;
 
 #ifdef NVME2K_DBG
     ScsiDebugPrint(0, "nvme2k: NvmeShutdownController - starting shutdown sequence\n");
@@ -874,6 +2206,9 @@ VOID NvmeShutdownController(IN PHW_DEVICE_EXTENSION DevExt)
 
     // First, mask all interrupts to prevent interrupt storms during shutdown
     NvmeWriteReg32(DevExt, NVME_REG_INTMS, 0xFFFFFFFF);
+
+    // Queue deletion completions must not re-arm Asynchronous Event Requests
+    DevExt->AsyncEventLimit = 0;
 #ifdef NVME2K_DBG
     ScsiDebugPrint(0, "nvme2k: NvmeShutdownController - masked all interrupts\n");
 #endif
@@ -1030,6 +2365,22 @@ cleanup_state:
     // Clear init state
     DevExt->InitComplete = FALSE;
     DevExt->NonTaggedInFlight = NULL;
+    for (i = 0; i < NVME_MAX_ADMIN_COMMANDS; i++) {
+        DevExt->AdminRequests[i].Srb = NULL;
+        DevExt->AdminRequests[i].Kind = ADMIN_KIND_FREE;
+        DevExt->AdminRequests[i].PrpListPage = 0xFF;
+    }
+    for (i = 0; i < NVME_MAX_IO_COMMANDS; i++) {
+        DevExt->IoRequests[i].Srb = NULL;
+        DevExt->IoRequests[i].Kind = IO_KIND_FREE;
+        DevExt->IoRequests[i].PrpListPage = 0xFF;
+    }
+    // Outstanding fills are gone with their CIDs, and the media may change while we're down
+    NvmeCacheReset(DevExt);
+    NvmeDeallocReset(DevExt);
+    NvmeSmartLogReset(DevExt);
+    DevExt->AsyncEventCids = 0;
+    DevExt->AsyncEventLogsPending = 0;
 
 #ifdef NVME2K_DBG
     ScsiDebugPrint(0, "nvme2k: Shutdown sequence complete\n");
@@ -1155,6 +2506,7 @@ BOOLEAN NvmeSanitizeController(IN PHW_DEVICE_EXTENSION DevExt)
 BOOLEAN NvmeInitializeController(IN PHW_DEVICE_EXTENSION DevExt)
 {
     ULONG cc, aqa;
+    ULONG i;
 
 #ifdef NVME2K_DBG
     ScsiDebugPrint(0, "nvme2k: NvmeInitializeController called\n");
@@ -1249,6 +2601,19 @@ BOOLEAN NvmeInitializeController(IN PHW_DEVICE_EXTENSION DevExt)
 #endif
             return FALSE;
         }
+
+        // 6. TRIM pattern page, TRIM mode stays unavailable without it
+        {
+            PVOID pattern;
+            PHYSICAL_ADDRESS patternPhys;
+
+            if (AllocateUncachedMemory(DevExt, NVME_TRIM_PAGE_SIZE, NVME_PAGE_SIZE, &pattern, &patternPhys)) {
+                DevExt->TrimPattern = (PULONG)pattern;
+            }
+        }
+
+        // 7. Read cache slot pages and table, if ReadCacheKB asked for one
+        NvmeCacheInitialize(DevExt);
     }
 
     // Now all uncached memory is allocated - log final usage
@@ -1326,11 +2691,37 @@ BOOLEAN NvmeInitializeController(IN PHW_DEVICE_EXTENSION DevExt)
     // NOTE: Interrupts stay masked (INTMS=0xFFFFFFFF from earlier)
     // They will be unmasked in the completion handler when InitComplete is set to TRUE
 
-    DevExt->NamespaceSizeInBlocks = 0;
-    DevExt->NamespaceBlockSize = 512;  // Default to 512 bytes
+    // Namespaces are discovered by the init sequence, nothing is ready until then
+    DevExt->NamespaceCount = 0;
+    DevExt->NamespaceInitIndex = 0;
+    memset(DevExt->Namespaces, 0, sizeof(DevExt->Namespaces));
+    for (i = 0; i < NVME_MAX_NAMESPACES; i++) {
+        DevExt->Namespaces[i].BlockSize = 512;  // Default to 512 bytes
+    }
 
-    DevExt->NextNonTaggedId = 0;  // Initialize non-tagged CID sequence
+    DevExt->NextIoCommandId = 0;  // Initialize I/O CID allocator
     DevExt->NonTaggedInFlight = NULL;  // No non-tagged request in flight initially
+    for (i = 0; i < NVME_MAX_IO_COMMANDS; i++) {
+        DevExt->IoRequests[i].Srb = NULL;
+        DevExt->IoRequests[i].Kind = IO_KIND_FREE;
+        DevExt->IoRequests[i].PrpListPage = 0xFF;
+    }
+    NvmeCalibrateTimestamp(DevExt);
+    DevExt->ReadExpireTicks = (ULONGLONG)DevExt->ReadExpireMs * DevExt->TimestampTicksPerMs;
+    DevExt->WriteExpireTicks = (ULONGLONG)DevExt->WriteExpireMs * DevExt->TimestampTicksPerMs;
+    DevExt->LatencyTargetTicks = ((ULONGLONG)DevExt->LatencyTargetUs * DevExt->TimestampTicksPerMs) / 1000;
+    DevExt->SmartLogTtlTicks = (ULONGLONG)DevExt->SmartCacheMs * DevExt->TimestampTicksPerMs;
+    DevExt->QueueDepthLimit = NVME_MAX_QUEUE_SIZE;
+    DevExt->LatencyEstimate = 0;
+    DevExt->ThrottleWindowCount = 0;
+    DevExt->ThrottleLimitReached = FALSE;
+    DevExt->ThrottleDecreases = 0;
+    DevExt->ThrottleIncreases = 0;
+    for (i = 0; i < NVME_MAX_ADMIN_COMMANDS; i++) {
+        DevExt->AdminRequests[i].Srb = NULL;
+        DevExt->AdminRequests[i].Kind = ADMIN_KIND_FREE;
+        DevExt->AdminRequests[i].PrpListPage = 0xFF;
+    }
 
     // Initialize statistics
     DevExt->CurrentQueueDepth = 0;
@@ -1345,10 +2736,63 @@ BOOLEAN NvmeInitializeController(IN PHW_DEVICE_EXTENSION DevExt)
     DevExt->MaxReadSize = 0;
     DevExt->MaxWriteSize = 0;
     DevExt->RejectedRequests = 0;
+    DevExt->UnalignedReads = 0;
+    DevExt->RmwWrites = 0;
+    DevExt->BoundarySplits = 0;
+    NvmeDeallocReset(DevExt);
+    DevExt->DeallocReads = 0;
+    DevExt->DeallocExtentsDropped = 0;
+    DevExt->TrimPages = 0;
+    NvmeSmartLogReset(DevExt);
+    DevExt->SmartLogHits = 0;
+    DevExt->SmartLogRefreshes = 0;
+    DevExt->SmartLogMerged = 0;
+
+    // Asynchronous Event Requests are sent once init completes (AERL from Identify Controller)
+    DevExt->AsyncEventLimit = 0;
+    DevExt->AsyncEventCids = 0;
+    DevExt->AsyncEventLogsPending = 0;
+    DevExt->AsyncEvents = 0;
+    DevExt->AsyncEventsError = 0;
+    DevExt->AsyncEventsHealth = 0;
+    DevExt->AsyncEventsNotice = 0;
+    DevExt->LastAsyncEvent = 0;
+    DevExt->CriticalWarning = 0;
+
+    // Nothing written yet, so nothing to flush (per namespace state cleared above)
+    DevExt->FlushesIssued = 0;
+    DevExt->FlushesElided = 0;
+    DevExt->FlushesMerged = 0;
+    DevExt->StagedHead = NULL;
+    DevExt->StagedTail = NULL;
+    DevExt->StagedRestarting = NULL;
+    DevExt->StagedCount = 0;
+    DevExt->RequestsStaged = 0;
+    DevExt->MaxStagedDepth = 0;
+    DevExt->BusyReturned = 0;
+    DevExt->StagedTimeTotal = 0;
+    DevExt->StagedTimeMax = 0;
+    DevExt->OrderedInFlight = NULL;
+    DevExt->SchedReadHead = NULL;
+    DevExt->SchedReadTail = NULL;
+    DevExt->SchedWriteHead = NULL;
+    DevExt->SchedWriteTail = NULL;
+    DevExt->SchedQueued = 0;
+    DevExt->WriteBytesInFlight = 0;
+    DevExt->WritesStarved = 0;
+    DevExt->WritesExpired = 0;
+    DevExt->WriteCapHits = 0;
+    memset(DevExt->ReadWaitHistogram, 0, sizeof(DevExt->ReadWaitHistogram));
+    memset(DevExt->WriteWaitHistogram, 0, sizeof(DevExt->WriteWaitHistogram));
 
     DevExt->SMARTEnabled = TRUE;
     DevExt->Busy = FALSE;
 
+    // Assume a write cache until Identify Controller says otherwise
+    DevExt->VolatileWriteCache = TRUE;
+    DevExt->WriteCacheEnabled = TRUE;
+    DevExt->WriteCacheRequested = TRUE;
+
 #ifdef NVME2K_DBG
     ScsiDebugPrint(0, "nvme2k: PRP list pool initialized at VA=%p PA=%08X%08X (%d pages)\n",
                     DevExt->PrpListPages,
@@ -1365,7 +2809,8 @@ BOOLEAN NvmeInitializeController(IN PHW_DEVICE_EXTENSION DevExt)
 
     // POLL for init completion (interrupts are masked during init)
     // The completion handler chain will process: Create I/O CQ -> Create I/O SQ ->
-    // Identify Controller -> Identify Namespace -> set InitComplete = TRUE
+    // Identify Controller -> Active NSID list -> Identify Namespace (each) -> [Get Features VWC]
+    // -> [Set Features AEC] -> set InitComplete = TRUE
 #ifdef NVME2K_DBG
     ScsiDebugPrint(0, "nvme2k: NvmeInitializeController - polling for init completion...\n");
 #endif
@@ -7,6 +7,285 @@ static BOOLEAN IsTagged(IN PSCSI_REQUEST_BLOCK Srb)
     return (Srb->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE && Srb->QueueTag != SP_UNTAGGED);
 }
 
+static BOOLEAN IsOrdered(IN PSCSI_REQUEST_BLOCK Srb)
+{
+    return (IsTagged(Srb) && Srb->QueueAction == SRB_ORDERED_QUEUE_TAG_REQUEST);
+}
+
+//
+// IsUnaligned - READ/WRITE on a 512e namespace that doesn't cover whole device LBAs
+//
+static BOOLEAN IsUnaligned(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, OUT PBOOLEAN IsWrite)
+{
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    ULONGLONG lba;
+    ULONG numBlocks;
+    BOOLEAN fua;
+
+    *IsWrite = FALSE;
+    if (ns->LbaShift == 0 || Srb->Function != SRB_FUNCTION_EXECUTE_SCSI) {
+        return FALSE;
+    }
+    switch (Srb->Cdb[0]) {
+        case SCSIOP_READ6:
+        case SCSIOP_WRITE6:
+        case SCSIOP_READ:
+        case SCSIOP_WRITE:
+        case SCSIOP_READ16:
+        case SCSIOP_WRITE16:
+            break;
+        default:
+            return FALSE;
+    }
+    *IsWrite = ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua);
+    return ((lba | numBlocks) & ((1UL << ns->LbaShift) - 1)) != 0;
+}
+
+//
+// IsExclusive - SRB that runs alone once everything before it has completed:
+// an ORDERED SRB, or an unaligned 512e write (its read-modify-write must not
+// race other writes to the same device block)
+//
+static BOOLEAN IsExclusive(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    BOOLEAN isWrite;
+
+    if (IsOrdered(Srb)) {
+        return TRUE;
+    }
+    return IsUnaligned(DevExt, Srb, &isWrite) && isWrite;
+}
+
+//
+// Staging queue
+// When the SQ, the CID table or the PRP pool is exhausted, I/O SRBs are queued
+// in the driver instead of being handed back with ScsiBusy (which makes ScsiPort
+// retry on its own timer), and ScsiPort is asked for more right away.
+// NvmeProcessIoCompletion restarts them in arrival order as completions free
+// resources. Once anything is staged, new I/O queues up behind it.
+//
+
+//
+// ScsiStageSrb - Queue an I/O SRB that can't be submitted right now
+// Returns FALSE if the staging queue is full
+//
+static BOOLEAN ScsiStageSrb(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+
+    if (!srbExt) {
+        return FALSE;
+    }
+
+    // Restarted from the head and still short of resources: put it back where it was
+    if (Srb == DevExt->StagedRestarting) {
+        srbExt->NextStaged = DevExt->StagedHead;
+        DevExt->StagedHead = Srb;
+        if (!DevExt->StagedTail) {
+            DevExt->StagedTail = Srb;
+        }
+        DevExt->StagedCount++;
+        Srb->SrbStatus = SRB_STATUS_PENDING;
+        return TRUE;
+    }
+
+    if (NVME_STAGING_FULL(DevExt)) {
+        return FALSE;
+    }
+
+    srbExt->StageTime = NvmeReadTimestamp(DevExt);
+    srbExt->NextStaged = NULL;
+    if (DevExt->StagedTail) {
+        ((PNVME_SRB_EXTENSION)DevExt->StagedTail->SrbExtension)->NextStaged = Srb;
+    } else {
+        DevExt->StagedHead = Srb;
+    }
+    DevExt->StagedTail = Srb;
+    DevExt->StagedCount++;
+    DevExt->RequestsStaged++;
+    if (DevExt->StagedCount > DevExt->MaxStagedDepth) {
+        DevExt->MaxStagedDepth = DevExt->StagedCount;
+    }
+
+#ifdef NVME2K_DBG_EXTRA
+    ScsiDebugPrint(0, "nvme2k: Staged SRB=%p tag %02X, %u staged\n", Srb, Srb->QueueTag, DevExt->StagedCount);
+#endif
+
+    // Nothing behind an ORDERED SRB may start, so don't ask for more
+    return ScsiPending(DevExt, Srb, !IsExclusive(DevExt, Srb));
+}
+
+//
+// ScsiStageOrBusy - Stage an I/O SRB that is short of resources
+// ScsiBusy is only the fallback when the staging queue itself is full
+//
+static BOOLEAN ScsiStageOrBusy(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    if (ScsiStageSrb(DevExt, Srb)) {
+        return TRUE;
+    }
+
+    DevExt->BusyReturned++;
+    if (DevExt->NonTaggedInFlight == Srb) {
+        DevExt->NonTaggedInFlight = NULL;
+    }
+    return ScsiBusy(DevExt, Srb);
+}
+
+//
+// ScsiMustStage - New I/O goes behind already staged SRBs to keep arrival order,
+// and waits while an exclusive SRB runs (ScsiPort may still hand us more after
+// a non-I/O SRB completes)
+//
+static BOOLEAN ScsiMustStage(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    return ((DevExt->StagedHead != NULL || DevExt->OrderedInFlight != NULL) &&
+            Srb != DevExt->StagedRestarting);
+}
+
+//
+// ScsiOrderedBarrier - Hold an ORDERED SRB until all prior I/O commands complete
+// NVMe doesn't order commands within a queue, so ordering is done on the host:
+// the ORDERED SRB is staged (without asking ScsiPort for more, so nothing behind it
+// starts) until the queue drains and nothing is staged ahead of it, then it runs
+// alone. SRBs waiting in the scheduler FIFOs count as prior I/O.
+// Durability, if wanted, comes from FUA on the command itself, not from a flush.
+// Unaligned 512e writes go through the same barrier (IsExclusive).
+// Returns TRUE if the SRB was staged (or returned busy); ScsiStartStagedSrbs restarts it.
+//
+static BOOLEAN ScsiOrderedBarrier(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    if (!IsExclusive(DevExt, Srb)) {
+        return FALSE;
+    }
+    if (DevExt->CurrentQueueDepth == 0 && DevExt->SchedQueued == 0 && !ScsiMustStage(DevExt, Srb)) {
+        return FALSE;
+    }
+
+#ifdef NVME2K_DBG_EXTRA
+    ScsiDebugPrint(0, "nvme2k: ORDERED tag %02X held until %u commands drain\n",
+                   Srb->QueueTag, DevExt->CurrentQueueDepth);
+#endif
+    return ScsiStageOrBusy(DevExt, Srb);
+}
+
+//
+// ScsiPendingOrdered - Mark a submitted I/O SRB pending
+// Nothing is started behind a submitted ORDERED SRB (or unaligned 512e write) until it completes
+//
+static BOOLEAN ScsiPendingOrdered(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN int Next)
+{
+    if (IsExclusive(DevExt, Srb)) {
+        DevExt->OrderedInFlight = Srb;
+        return ScsiPending(DevExt, Srb, 0);
+    }
+    return ScsiPending(DevExt, Srb, Next);
+}
+
+//
+// ScsiStartStagedSrbs - Restart staged SRBs in arrival order
+// Called from completion context after resources have been freed. Stops at the
+// first SRB that is still short of resources, at an ORDERED SRB that has to wait
+// for the queue to drain, and while an ORDERED SRB is in flight.
+//
+VOID ScsiStartStagedSrbs(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    PSCSI_REQUEST_BLOCK Srb;
+    PNVME_SRB_EXTENSION srbExt;
+    ULONGLONG waited;
+
+    while (DevExt->StagedHead && !DevExt->OrderedInFlight) {
+        Srb = DevExt->StagedHead;
+        srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+
+        if (IsExclusive(DevExt, Srb) && (DevExt->CurrentQueueDepth > 0 || DevExt->SchedQueued > 0)) {
+            break;
+        }
+
+        DevExt->StagedHead = srbExt->NextStaged;
+        if (!DevExt->StagedHead) {
+            DevExt->StagedTail = NULL;
+        }
+        DevExt->StagedCount--;
+        srbExt->NextStaged = NULL;
+
+        // The SRB may be completed by the handler, take the wait time first
+        waited = NvmeReadTimestamp(DevExt) - srbExt->StageTime;
+
+        DevExt->StagedRestarting = Srb;
+        if (Srb->Function == SRB_FUNCTION_EXECUTE_SCSI && Srb->Cdb[0] == SCSIOP_SYNCHRONIZE_CACHE) {
+            ScsiHandleFlush(DevExt, Srb);
+        } else if (Srb->Function == SRB_FUNCTION_EXECUTE_SCSI &&
+                   (Srb->Cdb[0] == SCSIOP_ATA_PASSTHROUGH16 || Srb->Cdb[0] == SCSIOP_ATA_PASSTHROUGH12)) {
+            // Only SAT TRIM is ever staged
+            ScsiHandleSatPassthrough(DevExt, Srb);
+        } else {
+            ScsiHandleReadWrite(DevExt, Srb);
+        }
+        DevExt->StagedRestarting = NULL;
+
+        // Still short of resources, it went back to the head
+        if (DevExt->StagedHead == Srb) {
+            break;
+        }
+
+        DevExt->StagedTimeTotal += waited;
+        if (waited > DevExt->StagedTimeMax) {
+            DevExt->StagedTimeMax = waited;
+        }
+    }
+}
+
+//
+// ScsiFlushStagedSrbs - Forget staged and scheduler queued SRBs, and flushes
+// merged into one in flight, after ScsiPort completed them on a bus reset
+//
+VOID ScsiFlushStagedSrbs(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    PSCSI_REQUEST_BLOCK queues[3];
+    PSCSI_REQUEST_BLOCK Srb;
+    PNVME_NAMESPACE ns;
+    ULONG i;
+
+    queues[0] = DevExt->StagedHead;
+    queues[1] = DevExt->SchedReadHead;
+    queues[2] = DevExt->SchedWriteHead;
+
+    for (i = 0; i < 3; i++) {
+        Srb = queues[i];
+        while (Srb) {
+            PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+
+            if (DevExt->NonTaggedInFlight == Srb) {
+                DevExt->NonTaggedInFlight = NULL;
+            }
+            Srb = srbExt->NextStaged;
+            srbExt->NextStaged = NULL;
+        }
+    }
+    DevExt->StagedHead = NULL;
+    DevExt->StagedTail = NULL;
+    DevExt->StagedCount = 0;
+    DevExt->SchedReadHead = NULL;
+    DevExt->SchedReadTail = NULL;
+    DevExt->SchedWriteHead = NULL;
+    DevExt->SchedWriteTail = NULL;
+    DevExt->SchedQueued = 0;
+
+    // The device flush completes without its SRB, nothing is left to release
+    for (i = 0; i < NVME_MAX_NAMESPACES; i++) {
+        ns = &DevExt->Namespaces[i];
+        Srb = ns->FlushInFlight;
+        while (Srb) {
+            PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+
+            Srb = srbExt->NextWaiter;
+            srbExt->NextWaiter = NULL;
+        }
+        ns->FlushInFlight = NULL;
+    }
+}
+
 BOOLEAN ScsiSuccess(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
 {
     Srb->SrbStatus = SRB_STATUS_SUCCESS;
@@ -28,6 +307,16 @@ BOOLEAN ScsiBusy(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
     return TRUE;
 }
 
+//
+// ScsiOrderedBusy - TRUE while an ORDERED SRB is running
+// Nothing new starts behind it, IOCTLs that go to the I/O queue included; they
+// tell the caller to send them again.
+//
+BOOLEAN ScsiOrderedBusy(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    return (DevExt->OrderedInFlight != NULL) ? TRUE : FALSE;
+}
+
 BOOLEAN ScsiError(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR SrbStatus)
 {
     Srb->SrbStatus = SrbStatus;
@@ -39,7 +328,7 @@ BOOLEAN ScsiError(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN
 BOOLEAN ScsiPending(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN int Next)
 {
     Srb->SrbStatus = SRB_STATUS_PENDING;
-    if (!Next) {
+    if (!Next || NVME_STAGING_FULL(DevExt)) {
         DevExt->Busy = TRUE; // completion will send next reqest
         return TRUE;
     }
@@ -110,15 +399,18 @@ BOOLEAN ScsiHandleInquiry(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
             return ScsiSuccess(DevExt, Srb);
         } else if (pageCode == 0xB0) {
             // VPD page 0xB0: Block Limits (SBC-3)
+            PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
             ULONG maxTransferBlocks;
+            ULONG optimalTransferBlocks;
+            ULONG optimalGranularity;
 
             if (Srb->DataTransferLength < 64) {
                 return ScsiError(DevExt, Srb, SRB_STATUS_DATA_OVERRUN);
             }
 
             // Calculate maximum transfer length in blocks
-            if (DevExt->NamespaceBlockSize > 0) {
-                maxTransferBlocks = DevExt->MaxTransferSizeBytes / DevExt->NamespaceBlockSize;
+            if (NVME_SRB_NAMESPACE(DevExt, Srb)->BlockSize > 0) {
+                maxTransferBlocks = DevExt->MaxTransferSizeBytes / NVME_SRB_NAMESPACE(DevExt, Srb)->BlockSize;
             } else {
                 maxTransferBlocks = DevExt->MaxTransferSizeBytes / 512;  // Assume 512 if not initialized
             }
@@ -134,9 +426,11 @@ BOOLEAN ScsiHandleInquiry(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
             // Byte 5: Maximum Compare and Write Length - 0 (not supported)
             inquiryData[5] = 0x00;
 
-            // Bytes 6-7: Optimal Transfer Length Granularity - 0
-            inquiryData[6] = 0x00;
-            inquiryData[7] = 0x00;
+            // Bytes 6-7: Optimal Transfer Length Granularity - the preferred write unit
+            // (NPWG/NPWA) or the device LBA on 512e, else 0
+            optimalGranularity = ns->PhysicalShift ? (1UL << ns->PhysicalShift) : 0;
+            inquiryData[6] = (UCHAR)((optimalGranularity >> 8) & 0xFF);
+            inquiryData[7] = (UCHAR)(optimalGranularity & 0xFF);
 
             // Bytes 8-11: Maximum Transfer Length (in blocks)
             inquiryData[8] = (UCHAR)((maxTransferBlocks >> 24) & 0xFF);
@@ -144,11 +438,22 @@ BOOLEAN ScsiHandleInquiry(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
             inquiryData[10] = (UCHAR)((maxTransferBlocks >> 8) & 0xFF);
             inquiryData[11] = (UCHAR)(maxTransferBlocks & 0xFF);
 
-            // Bytes 12-15: Optimal Transfer Length - same as maximum
-            inquiryData[12] = inquiryData[8];
-            inquiryData[13] = inquiryData[9];
-            inquiryData[14] = inquiryData[10];
-            inquiryData[15] = inquiryData[11];
+            // Bytes 12-15: Optimal Transfer Length - NOWS, else the optimal I/O boundary
+            // (larger transfers are split there anyway), else same as maximum
+            if (ns->OptimalWriteBlocks != 0) {
+                optimalTransferBlocks = ns->OptimalWriteBlocks << ns->LbaShift;
+            } else if (ns->BoundaryShift != 0) {
+                optimalTransferBlocks = 1UL << (ns->BoundaryShift + ns->LbaShift);
+            } else {
+                optimalTransferBlocks = maxTransferBlocks;
+            }
+            if (optimalTransferBlocks > maxTransferBlocks) {
+                optimalTransferBlocks = maxTransferBlocks;
+            }
+            inquiryData[12] = (UCHAR)((optimalTransferBlocks >> 24) & 0xFF);
+            inquiryData[13] = (UCHAR)((optimalTransferBlocks >> 16) & 0xFF);
+            inquiryData[14] = (UCHAR)((optimalTransferBlocks >> 8) & 0xFF);
+            inquiryData[15] = (UCHAR)(optimalTransferBlocks & 0xFF);
 
             // Bytes 16-19: Maximum Prefetch/XDRead/XDWrite Transfer Length - 0
             inquiryData[16] = 0x00;
@@ -322,6 +627,7 @@ BOOLEAN ScsiHandleInquiry(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
 //
 BOOLEAN ScsiHandleReadCapacity(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
 {
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
     PULONG capacityData;
     ULONG lastLba;
     ULONG blockSize;
@@ -333,18 +639,18 @@ BOOLEAN ScsiHandleReadCapacity(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_
     capacityData = (PULONG)Srb->DataBuffer;
 
     // Check if namespace has been identified
-    if (DevExt->NamespaceSizeInBlocks == 0) {
+    if (ns->SizeInBlocks == 0) {
         // Return default values
         lastLba = 0xFFFFFFFF;
         blockSize = 512;
     } else {
         // Check if capacity exceeds 32-bit
-        if (DevExt->NamespaceSizeInBlocks > 0xFFFFFFFF) {
+        if (ns->SizeInBlocks > 0xFFFFFFFF) {
             lastLba = 0xFFFFFFFF;  // Indicate to use READ CAPACITY(16)
         } else {
-            lastLba = (ULONG)(DevExt->NamespaceSizeInBlocks - 1);
+            lastLba = (ULONG)(ns->SizeInBlocks - 1);
         }
-        blockSize = DevExt->NamespaceBlockSize;
+        blockSize = ns->BlockSize;
     }
 
     // Return in big-endian format
@@ -368,6 +674,7 @@ BOOLEAN ScsiHandleReadCapacity(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_
 //
 BOOLEAN ScsiHandleReadCapacity16(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
 {
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
     PUCHAR capacityData;
     ULONGLONG lastLba;
     ULONG blockSize;
@@ -390,13 +697,13 @@ BOOLEAN ScsiHandleReadCapacity16(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUES
     }
 
     // Check if namespace has been identified
-    if (DevExt->NamespaceSizeInBlocks == 0) {
+    if (ns->SizeInBlocks == 0) {
         // Return default values
         lastLba = 0xFFFFFFFFFFFFFFFFu;
         blockSize = 512;
     } else {
-        lastLba = DevExt->NamespaceSizeInBlocks - 1;
-        blockSize = DevExt->NamespaceBlockSize;
+        lastLba = ns->SizeInBlocks - 1;
+        blockSize = ns->BlockSize;
     }
 
     // Bytes 0-7: Returned Logical Block Address (64-bit big-endian)
@@ -415,12 +722,13 @@ BOOLEAN ScsiHandleReadCapacity16(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUES
     capacityData[10] = (UCHAR)(blockSize >> 8);
     capacityData[11] = (UCHAR)(blockSize);
 
-    // Bytes 12-13: Additional fields (set to 0 for now)
-    // Byte 12, bit 0: PROT_EN (protection type enabled) - 0
-    // Byte 13: P_TYPE and P_I_EXPONENT - 0
+    // Byte 12: P_TYPE and PROT_EN (protection type enabled) - 0
+
+    // Byte 13: P_I_EXPONENT (bits 7-4) - 0 and
+    // logical blocks per physical block exponent (bits 3-0) - the preferred write
+    // unit (NPWG/NPWA) or the device LBA on 512e
+    capacityData[13] = ns->PhysicalShift & 0x0F;
 
-    // Bytes 14-15: Logical blocks per physical block exponent and alignment
-    // Byte 14, bits 3-0: Logical blocks per physical block exponent - 0
     // Bytes 14-15: Lowest aligned logical block address - 0
 
     // Bytes 16-31: Reserved (already zeroed)
@@ -430,17 +738,592 @@ BOOLEAN ScsiHandleReadCapacity16(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUES
 }
 
 //
-// ScsiHandleReadWrite - Handle SCSI READ/WRITE commands
+// ScsiSubmitSegments - Claim, build and submit the NVMe commands of a split read or write
+// Everything is claimed before anything is submitted, so the SRB is either fully
+// on the SQ or not at all. Returns like ScsiSubmitReadWrite.
 //
-BOOLEAN ScsiHandleReadWrite(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+static int ScsiSubmitSegments(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PSCSI_REQUEST_BLOCK Srb,
+    IN PUCHAR Segment,
+    IN ULONG Count,
+    IN BOOLEAN IsWrite,
+    IN BOOLEAN Fua)
+{
+    PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+    NVME_COMMAND nvmeCmd[NVME_MAX_BOUNDARY_PIECES];
+    USHORT commandId[NVME_MAX_BOUNDARY_PIECES];
+    ULONG i;
+    int rc = 1;
+
+    if (NvmeIoQueueFreeSlots(DevExt) < Count) {
+        return 0;
+    }
+
+    // Claim CIDs and PRP/bounce pages for all of them
+    for (i = 0; i < Count; i++) {
+        UCHAR kind;
+
+        if (!IsWrite) {
+            kind = IO_KIND_SPLIT_READ;
+        } else if (NVME_SPLIT_BOUNCED(Segment[i])) {
+            kind = IO_KIND_RMW_READ;
+        } else {
+            kind = IO_KIND_SPLIT_WRITE;
+        }
+        commandId[i] = NvmeAllocIoRequest(DevExt, Srb, kind);
+        if (commandId[i] == NVME_IO_CID_NONE) {
+            rc = 0;
+            break;
+        }
+        DevExt->IoRequests[commandId[i]].Segment = Segment[i];
+        rc = NvmeBuildSplitCommand(DevExt, Srb, &nvmeCmd[i], commandId[i], Fua);
+        if (rc <= 0) {
+            i++;
+            break;
+        }
+    }
+    if (rc <= 0) {
+        while (i-- > 0) {
+            if (commandId[i] != NVME_IO_CID_NONE) {
+                NvmeFreeIoRequest(DevExt, &DevExt->IoRequests[commandId[i]]);
+            }
+        }
+        if (rc < 0) {
+            DevExt->RejectedRequests++;
+            DevExt->NonTaggedInFlight = NULL;
+            ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+        }
+        return rc;
+    }
+
+    // The SQ had room for all of them
+    srbExt->SplitPending = (UCHAR)Count;
+    for (i = 0; i < Count; i++) {
+        NvmeSubmitIoCommand(DevExt, &nvmeCmd[i]);
+    }
+
+    DevExt->TotalRequests++;
+    if (IsWrite) {
+        DevExt->TotalWrites++;
+        DevExt->TotalBytesWritten += Srb->DataTransferLength;
+        NVME_SRB_NAMESPACE(DevExt, Srb)->WritesOutstanding++;
+        DevExt->WriteBytesInFlight += Srb->DataTransferLength;
+    } else {
+        DevExt->TotalReads++;
+        DevExt->TotalBytesRead += Srb->DataTransferLength;
+    }
+    return 1;
+}
+
+//
+// ScsiSubmitSplitReadWrite - Submit a read or write on a 512e namespace that
+// doesn't cover whole device LBAs
+// It becomes up to three NVMe commands (NVME_SPLIT_*): the whole device blocks go
+// straight to the SRB buffer, a partial block at either end through a bounce
+// page. A read copies the bounce pages out as they complete. A write first reads
+// the partial blocks (IO_KIND_RMW_READ); each one is merged and written back by
+// NvmeProcessSplitCompletion. The write is exclusive, so nothing else touches
+// those blocks in between. The SRB completes with the last of its commands.
+// Returns like ScsiSubmitReadWrite.
+//
+static int ScsiSubmitSplitReadWrite(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    UCHAR segment[3];
+    ULONG count = 0;
+    ULONGLONG lba;
+    ULONG numBlocks;
+    ULONG srbOffset;
+    ULONG bounceOffset;
+    ULONG length;
+    BOOLEAN isWrite;
+    BOOLEAN fua;
+    int rc;
+
+    isWrite = ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua);
+    if (!srbExt || numBlocks == 0 ||
+        numBlocks * ns->BlockSize > Srb->DataTransferLength ||
+        numBlocks * ns->BlockSize > DevExt->MaxTransferSizeBytes) {
+        DevExt->RejectedRequests++;
+        DevExt->NonTaggedInFlight = NULL;
+        ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+        return -1;
+    }
+    srbExt->SplitLba = lba;
+    srbExt->SplitBlocks = numBlocks;
+    srbExt->SplitStatus = NVME_SC_SUCCESS;
+
+    // Which pieces there are
+    if (((lba + numBlocks - 1) >> ns->LbaShift) == (lba >> ns->LbaShift)) {
+        segment[count++] = NVME_SPLIT_ONLY;
+    } else {
+        if (lba & ((1UL << ns->LbaShift) - 1)) {
+            segment[count++] = NVME_SPLIT_HEAD;
+        }
+        NvmeGetSplitSegment(ns, srbExt, NVME_SPLIT_MIDDLE, &srbOffset, &bounceOffset, &length);
+        if (length != 0) {
+            segment[count++] = NVME_SPLIT_MIDDLE;
+        }
+        if ((lba + numBlocks) & ((1UL << ns->LbaShift) - 1)) {
+            segment[count++] = NVME_SPLIT_TAIL;
+        }
+    }
+
+    rc = ScsiSubmitSegments(DevExt, Srb, segment, count, isWrite, fua);
+    if (rc > 0) {
+        if (isWrite) {
+            DevExt->RmwWrites++;
+        } else {
+            DevExt->UnalignedReads++;
+        }
+#ifdef NVME2K_DBG_EXTRA
+        ScsiDebugPrint(0, "nvme2k: Unaligned 512e %s LBA %08X%08X blocks %u split into %u commands\n",
+                       isWrite ? "write" : "read", (ULONG)(lba >> 32), (ULONG)(lba & 0xFFFFFFFF), numBlocks, count);
+#endif
+    }
+    return rc;
+}
+
+//
+// BoundaryPieces - Number of NVMe commands an aligned read/write is split into at
+// the namespace's optimal I/O boundary, 1 if it doesn't cross one (or would need
+// more than NVME_MAX_BOUNDARY_PIECES).
+//
+static ULONG BoundaryPieces(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    ULONGLONG lba;
+    ULONGLONG first;
+    ULONGLONG last;
+    ULONG numBlocks;
+    ULONG pieces;
+    BOOLEAN fua;
+
+    if (ns->BoundaryShift == 0 || Srb->SrbExtension == NULL) {
+        return 1;
+    }
+    ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua);
+    if (numBlocks == 0 || numBlocks * ns->BlockSize > Srb->DataTransferLength) {
+        return 1;
+    }
+
+    first = lba >> ns->LbaShift;
+    last = (lba + numBlocks - 1) >> ns->LbaShift;
+    pieces = (ULONG)((last >> ns->BoundaryShift) - (first >> ns->BoundaryShift)) + 1;
+    return (pieces <= NVME_MAX_BOUNDARY_PIECES) ? pieces : 1;
+}
+
+//
+// ScsiSubmitBoundaryReadWrite - Submit an aligned read or write that crosses the
+// namespace's optimal I/O boundary as one NVMe command per boundary interval
+// (NVME_SPLIT_PIECE + n), all straight to the SRB buffer. The SRB completes with
+// the last of them. Returns like ScsiSubmitReadWrite.
+//
+static int ScsiSubmitBoundaryReadWrite(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN ULONG Pieces)
+{
+    PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+    UCHAR segment[NVME_MAX_BOUNDARY_PIECES];
+    ULONGLONG lba;
+    ULONG numBlocks;
+    ULONG i;
+    BOOLEAN isWrite;
+    BOOLEAN fua;
+    int rc;
+
+    isWrite = ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua);
+    srbExt->SplitLba = lba;
+    srbExt->SplitBlocks = numBlocks;
+    srbExt->SplitStatus = NVME_SC_SUCCESS;
+
+    for (i = 0; i < Pieces; i++) {
+        segment[i] = (UCHAR)(NVME_SPLIT_PIECE + i);
+    }
+
+    rc = ScsiSubmitSegments(DevExt, Srb, segment, Pieces, isWrite, fua);
+    if (rc > 0) {
+        DevExt->BoundarySplits++;
+    }
+    return rc;
+}
+
+//
+// ScsiSubmitTrimWrite - Submit a write in TRIM mode whose pattern pages are
+// deallocated (see NvmeTrimClassify)
+// The pattern runs go as one DSM and every other run as its own write, claimed
+// before anything is submitted like ScsiSubmitSegments. The SRB completes as a
+// write with the last of them. Returns like ScsiSubmitReadWrite.
+//
+static int ScsiSubmitTrimWrite(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb,
+                               IN PNVME_TRIM_RUN Runs, IN ULONG RunCount)
+{
+    PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
+    NVME_COMMAND nvmeCmd[NVME_MAX_BOUNDARY_PIECES];
+    USHORT commandId[NVME_MAX_BOUNDARY_PIECES];
+    ULONGLONG lba;
+    ULONG numBlocks;
+    ULONG pages = 0;
+    ULONG count = 0;
+    ULONG i;
+    BOOLEAN fua;
+    int rc;
+
+    ScsiParseReadWriteCdb(Srb, &lba, &numBlocks, &fua);
+    for (i = 0; i < RunCount; i++) {
+        if (!Runs[i].Pattern) {
+            count++;
+        } else {
+            pages += Runs[i].Length / NVME_TRIM_PAGE_SIZE;
+        }
+    }
+    count++;
+    if (NvmeIoQueueFreeSlots(DevExt) < count) {
+        return 0;
+    }
+
+    // The DSM first, then the writes
+    commandId[0] = NvmeAllocIoRequest(DevExt, Srb, IO_KIND_DEALLOCATE);
+    if (commandId[0] == NVME_IO_CID_NONE) {
+        return 0;
+    }
+    rc = NvmeBuildTrimDeallocCommand(DevExt, Srb, &nvmeCmd[0], commandId[0], Runs, RunCount);
+    count = 1;
+    for (i = 0; i < RunCount && rc > 0; i++) {
+        if (Runs[i].Pattern) {
+            continue;
+        }
+        commandId[count] = NvmeAllocIoRequest(DevExt, Srb, IO_KIND_SPLIT_WRITE);
+        if (commandId[count] == NVME_IO_CID_NONE) {
+            rc = 0;
+            break;
+        }
+        rc = NvmeBuildTrimWriteCommand(DevExt, Srb, &nvmeCmd[count], commandId[count], &Runs[i], fua);
+        count++;
+    }
+    if (rc <= 0) {
+        while (count-- > 0) {
+            NvmeFreeIoRequest(DevExt, &DevExt->IoRequests[commandId[count]]);
+        }
+        if (rc < 0) {
+            DevExt->RejectedRequests++;
+            DevExt->NonTaggedInFlight = NULL;
+            ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+        }
+        return rc;
+    }
+
+    // The deallocated ranges are recorded only if no other write completes meanwhile
+    srbExt->FlushGeneration = ns->WriteGeneration;
+    srbExt->SplitStatus = NVME_SC_SUCCESS;
+    srbExt->SplitPending = (UCHAR)count;
+    for (i = 0; i < count; i++) {
+        NvmeSubmitIoCommand(DevExt, &nvmeCmd[i]);
+    }
+
+    DevExt->TotalRequests++;
+    DevExt->TotalWrites++;
+    DevExt->TotalBytesWritten += Srb->DataTransferLength;
+    DevExt->TrimPages += pages;
+    ns->WritesOutstanding++;
+    DevExt->WriteBytesInFlight += Srb->DataTransferLength;
+    return 1;
+}
+
+//
+// ScsiSubmitCacheFill - Submit a read as a fill of its read cache chunk
+// The slot is released again if the command can't be submitted.
+// Returns like ScsiSubmitReadWrite.
+//
+static int ScsiSubmitCacheFill(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN ULONG Slot)
+{
+    NVME_COMMAND nvmeCmd;
+    USHORT commandId;
+
+    commandId = NvmeAllocIoRequest(DevExt, Srb, IO_KIND_CACHE_FILL);
+    if (commandId == NVME_IO_CID_NONE) {
+        NvmeCacheReleaseSlot(DevExt, Slot);
+        return 0;
+    }
+    DevExt->IoRequests[commandId].Segment = (UCHAR)Slot;
+
+    NvmeBuildCacheFillCommand(DevExt, Srb, &nvmeCmd, commandId);
+    if (!NvmeSubmitIoCommand(DevExt, &nvmeCmd)) {
+        NvmeFreeIoRequest(DevExt, &DevExt->IoRequests[commandId]);
+        NvmeCacheReleaseSlot(DevExt, Slot);
+        return 0;
+    }
+    return 1;
+}
+
+//
+// ScsiSubmitReadWrite - Claim a CID, build and submit the NVMe Read/Write command
+// Returns 1 if submitted, 0 if at the adaptive queue depth limit or short of a
+// CID, PRP list page or SQ slot (nothing is held, the caller stages the SRB) and
+// -1 if the builder completed the SRB.
+//
+static int ScsiSubmitReadWrite(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
 {
     NVME_COMMAND nvmeCmd;
     USHORT commandId;
+    PNVME_IO_REQUEST request;
+    NVME_TRIM_RUN trimRuns[NVME_TRIM_MAX_RUNS];
+    BOOLEAN isWrite;
+    ULONG pieces;
+    ULONG slot;
+    int rc;
+
+    // Held back by the adaptive limit, completions restart it
+    if (DevExt->CurrentQueueDepth >= DevExt->QueueDepthLimit) {
+        DevExt->ThrottleLimitReached = TRUE;
+        return 0;
+    }
+
+    // Again at submission, a DSM may have completed since the write was accepted
+    NvmeDeallocRemoveSrb(DevExt, Srb);
+
+    // Small read the read cache can keep: read its whole chunk
+    slot = NvmeCacheClaimSlot(DevExt, Srb);
+    if (slot != NVME_CACHE_NO_SLOT) {
+        return ScsiSubmitCacheFill(DevExt, Srb, slot);
+    }
+
+    // 512e I/O that doesn't cover whole device LBAs
+    if (IsUnaligned(DevExt, Srb, &isWrite)) {
+        return ScsiSubmitSplitReadWrite(DevExt, Srb);
+    }
+
+    // TRIM mode: pattern pages of a write are deallocated instead of written
+    if (DevExt->TrimEnable) {
+        pieces = NvmeTrimClassify(DevExt, Srb, trimRuns);
+        if (pieces != 0) {
+            return ScsiSubmitTrimWrite(DevExt, Srb, trimRuns, pieces);
+        }
+    }
+
+    // Aligned I/O that crosses the optimal I/O boundary
+    pieces = BoundaryPieces(DevExt, Srb);
+    if (pieces > 1) {
+        return ScsiSubmitBoundaryReadWrite(DevExt, Srb, pieces);
+    }
+
+    // Claim a command ID for the I/O command (upgraded to IO_KIND_WRITE by the builder)
+    commandId = NvmeAllocIoRequest(DevExt, Srb, IO_KIND_READ);
+    if (commandId == NVME_IO_CID_NONE) {
+        return 0;
+    }
+    request = &DevExt->IoRequests[commandId];
+
+    // Build the NVMe Read/Write command from the SCSI CDB.
+    memset(&nvmeCmd, 0, sizeof(NVME_COMMAND));
+    rc = NvmeBuildReadWriteCommand(DevExt, Srb, &nvmeCmd, commandId);
+    if (rc <=0) {
+        // most likely couldnt get memory for PRP list
+        NvmeFreeIoRequest(DevExt, request);
+
+        // otherwise NonTaggedInFlight cleared and ScsiError called by callee
+        return (rc == 0) ? 0 : -1;
+    }
+
+    // Submit the command to the I/O queue.
+    if (!NvmeSubmitIoCommand(DevExt, &nvmeCmd)) {
+        // Submission failed, likely a full queue.
+        NvmeFreeIoRequest(DevExt, request);
+        return 0;
+    }
+
+    if (request->Kind == IO_KIND_WRITE) {
+        NVME_SRB_NAMESPACE(DevExt, Srb)->WritesOutstanding++;
+        DevExt->WriteBytesInFlight += Srb->DataTransferLength;
+    }
+    return 1;
+}
+
+//
+// Deadline I/O scheduler (IoScheduler=deadline)
+// SIMPLE tagged reads and writes are queued in per-class FIFOs between HwStartIo
+// and the SQ, linked through the SRB extension like the staging queue, and
+// dispatched right away or from completion context. Reads go first; a write goes
+// ahead of waiting reads once it is past WriteExpireMs (unless the oldest read is
+// past ReadExpireMs too) or after NVME_SCHED_WRITES_STARVED reads, and while reads
+// wait no new write starts once WriteBytesCap bytes of writes are in flight.
+// ORDERED and untagged SRBs bypass the FIFOs: an ORDERED SRB waits for them to
+// drain (ScsiOrderedBarrier), and only one untagged SRB runs at a time as before.
+//
+#define SCHED_PICK_READ             0
+#define SCHED_PICK_READ_CAPPED      1   // a write was waiting but the in-flight cap held it
+#define SCHED_PICK_WRITE            2
+#define SCHED_PICK_WRITE_EXPIRED    3   // write sent ahead of waiting reads
+
+static BOOLEAN ScsiSchedExpired(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb,
+                                IN ULONGLONG ExpireTicks, IN ULONGLONG Now)
+{
+    PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+
+    // Without a clock only the starvation count protects writes
+    return (DevExt->TimestampTicksPerMs != 0 && Now - srbExt->StageTime >= ExpireTicks);
+}
+
+//
+// ScsiSchedPick - Choose the FIFO to dispatch from (SCHED_PICK_*)
+//
+static UCHAR ScsiSchedPick(IN PHW_DEVICE_EXTENSION DevExt, IN ULONGLONG Now)
+{
+    PSCSI_REQUEST_BLOCK read = DevExt->SchedReadHead;
+    PSCSI_REQUEST_BLOCK write = DevExt->SchedWriteHead;
+
+    if (!write) {
+        return SCHED_PICK_READ;
+    }
+    if (!read) {
+        return SCHED_PICK_WRITE;
+    }
+
+    // Reads are waiting: keep the write bytes in flight under the cap
+    if (DevExt->WriteBytesInFlight != 0 &&
+        DevExt->WriteBytesInFlight + write->DataTransferLength > DevExt->WriteBytesCap) {
+        return SCHED_PICK_READ_CAPPED;
+    }
+
+    if (ScsiSchedExpired(DevExt, read, DevExt->ReadExpireTicks, Now)) {
+        return SCHED_PICK_READ;
+    }
+    if (ScsiSchedExpired(DevExt, write, DevExt->WriteExpireTicks, Now) ||
+        DevExt->WritesStarved >= NVME_SCHED_WRITES_STARVED) {
+        return SCHED_PICK_WRITE_EXPIRED;
+    }
+    return SCHED_PICK_READ;
+}
+
+//
+// ScsiSchedRecordWait - Count a wait time in a NVME2KDB_WAIT_BUCKETS histogram
+//
+static VOID ScsiSchedRecordWait(IN PULONG Histogram, IN ULONG WaitedUs)
+{
+    ULONG bucket = 0;
+
+    if (WaitedUs >= 16) {
+        bucket = (log2(WaitedUs) - 4) / 2 + 1;
+        if (bucket >= NVME2KDB_WAIT_BUCKETS) {
+            bucket = NVME2KDB_WAIT_BUCKETS - 1;
+        }
+    }
+    Histogram[bucket]++;
+}
+
+//
+// ScsiSchedQueueSrb - Queue a SIMPLE tagged read or write and run the dispatcher
+//
+static BOOLEAN ScsiSchedQueueSrb(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    PNVME_SRB_EXTENSION srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+    PSCSI_REQUEST_BLOCK *head;
+    PSCSI_REQUEST_BLOCK *tail;
+
+    if (!srbExt || NVME_STAGING_FULL(DevExt)) {
+        return ScsiStageOrBusy(DevExt, Srb);
+    }
+
+    if (Srb->SrbFlags & SRB_FLAGS_DATA_OUT) {
+        head = &DevExt->SchedWriteHead;
+        tail = &DevExt->SchedWriteTail;
+    } else {
+        head = &DevExt->SchedReadHead;
+        tail = &DevExt->SchedReadTail;
+    }
+
+    srbExt->StageTime = NvmeReadTimestamp(DevExt);
+    srbExt->NextStaged = NULL;
+    if (*tail) {
+        ((PNVME_SRB_EXTENSION)(*tail)->SrbExtension)->NextStaged = Srb;
+    } else {
+        *head = Srb;
+    }
+    *tail = Srb;
+    DevExt->SchedQueued++;
+
+    // Pending before dispatching, the builder may complete it with an error
+    ScsiPending(DevExt, Srb, 1);
+    ScsiSchedDispatch(DevExt);
+    return TRUE;
+}
+
+//
+// ScsiSchedDispatch - Submit queued reads and writes in deadline order
+// Called after queueing and from completion context. Stops at the first SRB that
+// is short of resources, which goes back to the head of its FIFO.
+//
+VOID ScsiSchedDispatch(IN PHW_DEVICE_EXTENSION DevExt)
+{
+    PSCSI_REQUEST_BLOCK Srb;
     PNVME_SRB_EXTENSION srbExt;
+    PSCSI_REQUEST_BLOCK *head;
+    PSCSI_REQUEST_BLOCK *tail;
+    ULONGLONG now;
+    ULONG waitedUs;
+    UCHAR pick;
+
+    while (DevExt->SchedQueued && !DevExt->OrderedInFlight) {
+        now = NvmeReadTimestamp(DevExt);
+        pick = ScsiSchedPick(DevExt, now);
+        if (pick >= SCHED_PICK_WRITE) {
+            head = &DevExt->SchedWriteHead;
+            tail = &DevExt->SchedWriteTail;
+        } else {
+            head = &DevExt->SchedReadHead;
+            tail = &DevExt->SchedReadTail;
+        }
+
+        Srb = *head;
+        srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+        *head = srbExt->NextStaged;
+        if (!*head) {
+            *tail = NULL;
+        }
+        DevExt->SchedQueued--;
+
+        // The SRB may be completed by the builder, take the wait time first
+        waitedUs = (ULONG)NvmeTimestampToUs(DevExt, now - srbExt->StageTime);
+
+        if (ScsiSubmitReadWrite(DevExt, Srb) == 0) {
+            // Still short of resources, it stays first in its class
+            if (!*head) {
+                *tail = Srb;
+            }
+            *head = Srb;
+            DevExt->SchedQueued++;
+            break;
+        }
+        srbExt->NextStaged = NULL;
+
+        if (pick >= SCHED_PICK_WRITE) {
+            if (pick == SCHED_PICK_WRITE_EXPIRED) {
+                DevExt->WritesExpired++;
+            }
+            DevExt->WritesStarved = 0;
+            ScsiSchedRecordWait(DevExt->WriteWaitHistogram, waitedUs);
+        } else {
+            if (pick == SCHED_PICK_READ_CAPPED) {
+                DevExt->WriteCapHits++;
+            }
+            if (DevExt->SchedWriteHead) {
+                DevExt->WritesStarved++;
+            }
+            ScsiSchedRecordWait(DevExt->ReadWaitHistogram, waitedUs);
+        }
+    }
+}
+
+//
+// ScsiHandleReadWrite - Handle SCSI READ/WRITE commands
+//
+BOOLEAN ScsiHandleReadWrite(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
     int rc;
 
     // Check if namespace is identified. If not, the device is not ready for I/O.
-    if (DevExt->NamespaceSizeInBlocks == 0) {
+    if (NVME_SRB_NAMESPACE(DevExt, Srb)->SizeInBlocks == 0) {
         return ScsiBusy(DevExt, Srb);
     }
 
@@ -456,10 +1339,15 @@ BOOLEAN ScsiHandleReadWrite(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLO
         return ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
     }
 
+    // A write drops the read cache chunks and deallocated extents it covers
+    // before anything can hit them
+    NvmeCacheInvalidateSrb(DevExt, Srb);
+    NvmeDeallocRemoveSrb(DevExt, Srb);
+
     // Check if this is a non-tagged request (QueueTag == SP_UNTAGGED or no queue action enabled)
     if (!((Srb->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) && (Srb->QueueTag != SP_UNTAGGED))) {
-        // Non-tagged request - only one can be in flight at a time
-        if (DevExt->NonTaggedInFlight) {
+        // Non-tagged request - only one can be in flight at a time (a staged one counts)
+        if (DevExt->NonTaggedInFlight && DevExt->NonTaggedInFlight != Srb) {
 #ifdef NVME2K_DBG
             ScsiDebugPrint(0, "nvme2k: Non-tagged request rejected - another non-tagged request in flight tag:%02X\n", Srb->QueueTag);
 #endif
@@ -477,70 +1365,68 @@ BOOLEAN ScsiHandleReadWrite(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLO
     }
 #endif
 
-    // For ORDERED tags, submit a Flush command first to drain all prior operations
-    if ((Srb->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) &&
-        (Srb->QueueAction == SRB_ORDERED_QUEUE_TAG_REQUEST)) {
-        NVME_COMMAND flushCmd;
-        USHORT flushCommandId;
-
-#ifdef NVME2K_DBG_EXTRA
-        ScsiDebugPrint(0, "nvme2k: ORDERED tag on I/O - submitting Flush before I/O\n");
-#endif
-        // Build flush command with special ORDERED flush CID
-        flushCommandId = NvmeBuildFlushCommandId(Srb);
-
-        memset(&flushCmd, 0, sizeof(NVME_COMMAND));
-        flushCmd.CDW0.Fields.Opcode = NVME_CMD_FLUSH;
-        flushCmd.CDW0.Fields.Flags = 0;
-        flushCmd.CDW0.Fields.CommandId = flushCommandId;
-        flushCmd.NSID = 1;
-
-#ifdef NVME2K_DBG_EXTRA
-        ScsiDebugPrint(0, "nvme2k: Submitting Flush (CID=%d) before ORDERED I/O\n", flushCommandId);
-#endif
-        if (!NvmeSubmitIoCommand(DevExt, &flushCmd)) {
-            // Flush submission failed
-            return ScsiBusy(DevExt, Srb);
-        }
+    // For ORDERED tags, wait for everything submitted before to complete
+    if (ScsiOrderedBarrier(DevExt, Srb)) {
+        return TRUE;
     }
 
-    // Build command ID for the I/O command
-    commandId = NvmeBuildCommandId(DevExt, Srb);
-
-    // Initialize SRB extension
-    srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
-    srbExt->PrpListPage = 0xFF;  // No PRP list initially
+    // Keep arrival order behind SRBs already waiting for resources
+    if (ScsiMustStage(DevExt, Srb)) {
+        return ScsiStageOrBusy(DevExt, Srb);
+    }
 
-    // Build the NVMe Read/Write command from the SCSI CDB.
-    memset(&nvmeCmd, 0, sizeof(NVME_COMMAND));
-    rc = NvmeBuildReadWriteCommand(DevExt, Srb, &nvmeCmd, commandId);
-    if (rc <=0) {
-        // most likely couldnt get memory for PRP list
-        
-        if (rc == 0) {
+    // Read of deallocated blocks (zero-filled) or a read cache hit: complete it
+    // here, nothing goes to the device
+    if (NvmeDeallocLookup(DevExt, Srb) || NvmeCacheLookup(DevExt, Srb)) {
+        if (DevExt->NonTaggedInFlight == Srb) {
             DevExt->NonTaggedInFlight = NULL;
-            return ScsiBusy(DevExt, Srb);
-        } else {
-            // NonTaggedInFlight cleared by by callee to maintain ordering
-            // ScsiError called by callee
-            return TRUE; 
         }
+        return ScsiSuccess(DevExt, Srb);
     }
 
-    // Submit the command to the I/O queue.
-    if (NvmeSubmitIoCommand(DevExt, &nvmeCmd)) {
+    // Deadline scheduler: SIMPLE tagged reads and writes wait in the class FIFOs
+    if (DevExt->IoScheduler == NVME_SCHED_DEADLINE && IsTagged(Srb) && !IsExclusive(DevExt, Srb)) {
+        return ScsiSchedQueueSrb(DevExt, Srb);
+    }
+
+    rc = ScsiSubmitReadWrite(DevExt, Srb);
+    if (rc > 0) {
         // Command submitted successfully, mark SRB as pending.
-        return ScsiPending(DevExt, Srb, 
+        return ScsiPendingOrdered(DevExt, Srb, 
             DevExt->CurrentPrpListPagesUsed < (ULONG)(DevExt->SgListPages)
-            || DevExt->CurrentQueueDepth >= NVME_MAX_QUEUE_SIZE);
-    } else {
-        // Submission failed, likely a full queue. Free resources and mark as busy.
-        if (srbExt->PrpListPage != 0xFF) {
-            FreePrpListPage(DevExt, srbExt->PrpListPage);
-            srbExt->PrpListPage = 0xFF;
-        }
-        DevExt->NonTaggedInFlight = NULL;
-        return ScsiBusy(DevExt, Srb);
+            || DevExt->CurrentQueueDepth >= DevExt->QueueDepthLimit);
+    }
+    if (rc == 0) {
+        // At the queue depth limit or short of a CID, PRP list page or SQ slot: stage it
+        return ScsiStageOrBusy(DevExt, Srb);
+    }
+    // ScsiError called by callee
+    return TRUE;
+}
+
+//
+// ScsiSmartLog - Answer LOG SENSE or SAT SMART READ DATA from the SMART/Health log
+// A fresh cached copy completes the SRB here, otherwise it waits for a Get Log Page
+//
+static BOOLEAN ScsiSmartLog(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    switch (NvmeSmartLogRequest(DevExt, Srb)) {
+        case NVME_SMART_LOG_CACHED:
+            // SrbStatus was set from the cached log
+            ScsiPortNotification(RequestComplete, DevExt, Srb);
+            ScsiPortNotification(NextRequest, DevExt, NULL);
+            return TRUE;
+
+        case NVME_SMART_LOG_PENDING:
+            // Completed from NvmeProcessGetLogPageCompletion
+            return ScsiPending(DevExt, Srb, 1);
+
+        default:
+#ifdef NVME2K_DBG
+            ScsiDebugPrint(0, "nvme2k: Failed to submit Get Log Page for SMART/Health log\n");
+#endif
+            // Out of admin slots or PRP pages, retry later
+            return ScsiBusy(DevExt, Srb);
     }
 }
 
@@ -553,7 +1439,7 @@ BOOLEAN ScsiHandleLogSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOC
     UCHAR pageCode;
 
     // Check if namespace is identified
-    if (DevExt->NamespaceSizeInBlocks == 0) {
+    if (NVME_SRB_NAMESPACE(DevExt, Srb)->SizeInBlocks == 0) {
         return ScsiBusy(DevExt, Srb);
     }
 
@@ -568,26 +1454,83 @@ BOOLEAN ScsiHandleLogSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOC
     // A real implementation would check for other pages.
     // For simplicity, we assume any log sense is for SMART data.
     if (pageCode == SCSI_LOG_PAGE_INFORMATIONAL) {
+        return ScsiSmartLog(DevExt, Srb);
+    } else {
+        // Unsupported log page
+        return ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+    }
+}
+
+//
+// ScsiHandleSatTrim - ATA DATA SET MANAGEMENT (TRIM) through SAT ATA PASS-THROUGH
+// The range entries go to the drive as one Dataset Management deallocate
+// (IO_KIND_DSM) that completes the SRB like an I/O command. IDENTIFY DEVICE word 105
+// limits the payload to ATA_DSM_MAX_BLOCKS, so the entries always fit one range list.
+// It is ordered like a write: one non-tagged SRB at a time, behind ORDERED and
+// staged SRBs, and staged itself when short of a CID or PRP page.
+//
+static BOOLEAN ScsiHandleSatTrim(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    ULONG sent;
+    int rc;
+
+    if (!(DevExt->OptionalNvmCommands & NVME_ONCS_DSM) || Srb->SrbExtension == NULL ||
+        Srb->DataTransferLength == 0 || (Srb->DataTransferLength % 512) != 0 ||
+        Srb->DataTransferLength > ATA_DSM_MAX_BLOCKS * 512) {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: SAT TRIM rejected - ONCS=%04X length %u\n",
+                       DevExt->OptionalNvmCommands, Srb->DataTransferLength);
+#endif
+        return ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+    }
 
-        // Issue async NVMe Get Log Page command for SMART/Health info
-        if (!NvmeGetLogPage(DevExt, Srb, NVME_LOG_PAGE_SMART_HEALTH)) {
+    // Check if this is a non-tagged request (QueueTag == SP_UNTAGGED or no queue action enabled)
+    if (!((Srb->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) && (Srb->QueueTag != SP_UNTAGGED))) {
+        // Non-tagged request - only one can be in flight at a time (a staged one counts)
+        if (DevExt->NonTaggedInFlight && DevExt->NonTaggedInFlight != Srb) {
 #ifdef NVME2K_DBG
-            ScsiDebugPrint(0, "nvme2k: Failed to submit Get Log Page for LOG SENSE\n");
-#endif        
-            return ScsiError(DevExt, Srb, SRB_STATUS_ERROR);
+            ScsiDebugPrint(0, "nvme2k: Non-tagged SAT TRIM rejected - another non-tagged request in flight\n");
+#endif
+            return ScsiBusy(DevExt, Srb);
         }
+        DevExt->NonTaggedInFlight = Srb;
+    }
 
-        // Mark SRB as pending - will be completed in interrupt handler
-        return ScsiPending(DevExt, Srb, 1);
-    } else {
-        // Unsupported log page
-        return ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+    // ORDERED TRIM waits for prior commands like any other ORDERED SRB
+    if (ScsiOrderedBarrier(DevExt, Srb)) {
+        return TRUE;
+    }
+
+    // Keep arrival order behind SRBs already waiting for resources
+    if (ScsiMustStage(DevExt, Srb)) {
+        return ScsiStageOrBusy(DevExt, Srb);
+    }
+
+    rc = NvmeDeallocateAtaRanges(DevExt, Srb, (PUCHAR)Srb->DataBuffer,
+                                 Srb->DataTransferLength / ATA_DSM_ENTRY_SIZE, &sent);
+    if (rc == 0) {
+        // Short of a CID, PRP page or SQ slot: stage it
+        return ScsiStageOrBusy(DevExt, Srb);
+    }
+    if (rc < 0 || sent == 0) {
+        if (DevExt->NonTaggedInFlight == Srb) {
+            DevExt->NonTaggedInFlight = NULL;
+        }
+        if (rc < 0) {
+            return ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+        }
+        // Only padding, or nothing left once shrunk to whole device blocks
+        return ScsiSuccess(DevExt, Srb);
     }
+
+    // Completed in NvmeProcessIoCompletion
+    return ScsiPendingOrdered(DevExt, Srb, 1);
 }
 
 //
 // ScsiHandleSatPassthrough - Handle SAT ATA PASS-THROUGH commands (0x85, 0xA1)
-// Only supports SMART read operations (SMART READ DATA and IDENTIFY DEVICE)
+// Supports SMART READ DATA, SMART READ LOG, IDENTIFY DEVICE and DATA SET
+// MANAGEMENT (TRIM)
 //
 BOOLEAN ScsiHandleSatPassthrough(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
 {
@@ -597,14 +1540,14 @@ BOOLEAN ScsiHandleSatPassthrough(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUES
     UCHAR ataCylHigh;
 
     // Check if namespace is identified
-    if (DevExt->NamespaceSizeInBlocks == 0) {
+    if (NVME_SRB_NAMESPACE(DevExt, Srb)->SizeInBlocks == 0) {
         return ScsiBusy(DevExt, Srb);
     }
 
     // Parse and validate the SAT command
     if (!ScsiParseSatCommand(Srb, &ataCommand, &ataFeatures, &ataCylLow, &ataCylHigh)) {
 #ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: SAT command rejected - not a supported SMART read\n");
+        ScsiDebugPrint(0, "nvme2k: SAT command rejected - not a supported ATA command\n");
 #endif
         return ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
     }
@@ -622,13 +1565,7 @@ BOOLEAN ScsiHandleSatPassthrough(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUES
             return ScsiError(DevExt, Srb, SRB_STATUS_DATA_OVERRUN);
         }
 
-        // Issue async NVMe Get Log Page command for SMART/Health info
-        if (!NvmeGetLogPage(DevExt, Srb, NVME_LOG_PAGE_SMART_HEALTH)) {
-            return ScsiError(DevExt, Srb, SRB_STATUS_ERROR);
-        }
-
-        // Mark SRB as pending - will be completed in interrupt handler
-        return ScsiPending(DevExt, Srb, 1);
+        return ScsiSmartLog(DevExt, Srb);
     } else if (ataCommand == ATA_SMART_CMD && ataFeatures == ATA_SMART_READ_LOG) {
         // SMART READ LOG - return empty log (NVMe doesn't support ATA-style log pages)
         // Ensure we have buffer space for output (512 bytes)
@@ -646,8 +1583,10 @@ BOOLEAN ScsiHandleSatPassthrough(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUES
             return ScsiError(DevExt, Srb, SRB_STATUS_DATA_OVERRUN);
         }
 
-        NvmeToAtaIdentify(DevExt, (PATA_IDENTIFY_DEVICE_STRUCT)Srb->DataBuffer);
+        NvmeToAtaIdentify(DevExt, NVME_SRB_NAMESPACE(DevExt, Srb), (PATA_IDENTIFY_DEVICE_STRUCT)Srb->DataBuffer);
         return ScsiSuccess(DevExt, Srb);
+    } else if (ataCommand == ATA_DATA_SET_MANAGEMENT) {
+        return ScsiHandleSatTrim(DevExt, Srb);
     } else {
         // Unknown command (should not reach here due to validation)
         return ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
@@ -657,20 +1596,40 @@ BOOLEAN ScsiHandleSatPassthrough(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUES
 //
 // ScsiHandleFlush - Handle SCSI SYNCHRONIZE_CACHE command by sending NVMe Flush
 //
+// Flushes are elided when no write has completed or is outstanding since the
+// last successful device flush, and piggyback on an in-flight device flush when
+// no write has completed since that one was submitted.
+//
 BOOLEAN ScsiHandleFlush(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
 {
     NVME_COMMAND nvmeCmd;
     USHORT commandId;
+    PNVME_SRB_EXTENSION srbExt;
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
 
     // Check if namespace is identified
-    if (DevExt->NamespaceSizeInBlocks == 0) {
+    if (ns->SizeInBlocks == 0) {
         return ScsiBusy(DevExt, Srb);
     }
 
+    // No volatile write cache (or it is disabled): completed writes are already durable
+    if (!NVME_WRITE_CACHE_ACTIVE(DevExt)) {
+        return ScsiSuccess(DevExt, Srb);
+    }
+
+    // Nothing written to this namespace since its last successful flush
+    if (ns->WritesOutstanding == 0 && ns->WriteGeneration == ns->FlushedGeneration) {
+#ifdef NVME2K_DBG_EXTRA
+        ScsiDebugPrint(0, "nvme2k: Flush elided - NSID %u generation %u already flushed\n", ns->NamespaceId, ns->WriteGeneration);
+#endif
+        DevExt->FlushesElided++;
+        return ScsiSuccess(DevExt, Srb);
+    }
+
     // Check if this is a non-tagged request (QueueTag == SP_UNTAGGED or no queue action enabled)
     if (!((Srb->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) && (Srb->QueueTag != SP_UNTAGGED))) {
-        // Non-tagged request - only one can be in flight at a time
-        if (DevExt->NonTaggedInFlight) {
+        // Non-tagged request - only one can be in flight at a time (a staged one counts)
+        if (DevExt->NonTaggedInFlight && DevExt->NonTaggedInFlight != Srb) {
 #ifdef NVME2K_DBG
             ScsiDebugPrint(0, "nvme2k: Non-tagged flush rejected - another non-tagged request in flight\n");
 #endif
@@ -680,23 +1639,64 @@ BOOLEAN ScsiHandleFlush(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK S
         DevExt->NonTaggedInFlight = Srb;
     }
 
-    // Build command ID (flushes from SYNCHRONIZE_CACHE are standalone, not ORDERED tag flushes)
-    commandId = NvmeBuildCommandId(DevExt, Srb);
+    // ORDERED SYNCHRONIZE CACHE waits for prior commands like any other ORDERED SRB
+    if (ScsiOrderedBarrier(DevExt, Srb)) {
+        return TRUE;
+    }
+
+    // Keep arrival order behind SRBs already waiting for resources
+    if (ScsiMustStage(DevExt, Srb)) {
+        return ScsiStageOrBusy(DevExt, Srb);
+    }
+
+    srbExt = (PNVME_SRB_EXTENSION)Srb->SrbExtension;
+
+    // The in-flight device flush covers every write completed before it was
+    // submitted. If none completed since, wait for it instead of sending another.
+    if (srbExt && ns->FlushInFlight) {
+        PNVME_SRB_EXTENSION inFlightExt = (PNVME_SRB_EXTENSION)ns->FlushInFlight->SrbExtension;
+
+        if (ns->WriteGeneration == inFlightExt->FlushGeneration) {
+#ifdef NVME2K_DBG_EXTRA
+            ScsiDebugPrint(0, "nvme2k: Flush merged into in-flight flush SRB=%p\n", ns->FlushInFlight);
+#endif
+            srbExt->NextWaiter = inFlightExt->NextWaiter;
+            inFlightExt->NextWaiter = Srb;
+            DevExt->FlushesMerged++;
+            // Completed from NvmeProcessFlushCompletion
+            return ScsiPending(DevExt, Srb, 1);
+        }
+    }
+
+    // Claim a command ID
+    commandId = NvmeAllocIoRequest(DevExt, Srb, IO_KIND_FLUSH);
+    if (commandId == NVME_IO_CID_NONE) {
+        return ScsiStageOrBusy(DevExt, Srb);
+    }
 
     // Build NVMe Flush command
     memset(&nvmeCmd, 0, sizeof(NVME_COMMAND));
     nvmeCmd.CDW0.Fields.Opcode = NVME_CMD_FLUSH;
     nvmeCmd.CDW0.Fields.Flags = 0;
     nvmeCmd.CDW0.Fields.CommandId = commandId;
-    nvmeCmd.NSID = 1;  // Namespace ID 1
+    nvmeCmd.NSID = ns->NamespaceId;
+
+    if (srbExt) {
+        srbExt->FlushGeneration = ns->WriteGeneration;
+        srbExt->NextWaiter = NULL;
+    }
 
     // Submit the Flush command
     if (NvmeSubmitIoCommand(DevExt, &nvmeCmd)) {
-        return ScsiPending(DevExt, Srb, 1);
+        if (srbExt) {
+            ns->FlushInFlight = Srb;
+        }
+        DevExt->FlushesIssued++;
+        return ScsiPendingOrdered(DevExt, Srb, 1);
     } else {
-        // Submission failed
-        DevExt->NonTaggedInFlight = NULL;
-        return ScsiBusy(DevExt, Srb);
+        // Submission failed, likely a full queue
+        NvmeFreeIoRequest(DevExt, &DevExt->IoRequests[commandId]);
+        return ScsiStageOrBusy(DevExt, Srb);
     }
 }
 
@@ -764,6 +1764,7 @@ BOOLEAN ScsiHandleReadDefectData10(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQU
 BOOLEAN ScsiHandleModeSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
 {
     PCDB cdb = (PCDB)Srb->Cdb;
+    PNVME_NAMESPACE ns = NVME_SRB_NAMESPACE(DevExt, Srb);
     PUCHAR buffer;
     ULONG allocationLength;
     UCHAR pageCode;
@@ -833,8 +1834,8 @@ BOOLEAN ScsiHandleModeSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLO
     // Add block descriptor if not disabled
     if (!dbd && (offset + blockDescLength) <= Srb->DataTransferLength) {
         PUCHAR blockDesc = buffer + offset;
-        ULONG blockSize = DevExt->NamespaceBlockSize ? DevExt->NamespaceBlockSize : 512;
-        ULONGLONG numBlocks = DevExt->NamespaceSizeInBlocks;
+        ULONG blockSize = ns->BlockSize ? ns->BlockSize : 512;
+        ULONGLONG numBlocks = ns->SizeInBlocks;
 
         // Block descriptor format (8 bytes):
         // Byte 0: Density code (0 = default)
@@ -873,7 +1874,7 @@ BOOLEAN ScsiHandleModeSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLO
         if ((offset + 24) <= Srb->DataTransferLength) {
             PUCHAR formatPage = buffer + offset;
             ULONG sectorsPerTrack = 63;
-            ULONG blockSize = DevExt->NamespaceBlockSize ? DevExt->NamespaceBlockSize : 512;
+            ULONG blockSize = ns->BlockSize ? ns->BlockSize : 512;
 
             formatPage[0] = MODE_PAGE_FORMAT_DEVICE;  // Page code
             formatPage[1] = 22;  // Page length (n-1, total 24 bytes)
@@ -944,10 +1945,10 @@ BOOLEAN ScsiHandleModeSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLO
             // CAP (Caching Analysis Permitted) = 0
             // DISC (Discontinuity) = 0
             // SIZE (Size enable) = 0
-            // WCE (Write Cache Enable) = 1 (NVMe typically has write cache)
+            // WCE (Write Cache Enable) = current Volatile Write Cache feature state
             // MF (Multiplication Factor) = 0
             // RCD (Read Cache Disable) = 0 (read cache enabled)
-            cachePage[2] = 0x04;  // WCE=1, others=0
+            cachePage[2] = NVME_WRITE_CACHE_ACTIVE(DevExt) ? MODE_CACHING_WCE : 0x00;
 
             // Byte 3: Read retention priority (4 bits) and Write retention priority (4 bits)
             cachePage[3] = 0x00;  // Equal priority
@@ -988,6 +1989,12 @@ BOOLEAN ScsiHandleModeSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLO
             cachePage[18] = 0x00;
             cachePage[19] = 0x00;
 
+            if (pageControl == MODE_SENSE_CHANGEABLE_VALUES) {
+                // Only WCE is changeable, and only if there is a cache to switch
+                memset(cachePage + 2, 0, 18);
+                cachePage[2] = DevExt->VolatileWriteCache ? MODE_CACHING_WCE : 0x00;
+            }
+
             offset += 20;
         }
     }
@@ -1000,8 +2007,8 @@ BOOLEAN ScsiHandleModeSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLO
             ULONGLONG totalCylinders;
             ULONG sectorsPerTrack = 63;
             ULONG heads = 64;
-            ULONGLONG numBlocks = DevExt->NamespaceSizeInBlocks;
-            ULONG blockSize = DevExt->NamespaceBlockSize ? DevExt->NamespaceBlockSize : 512;
+            ULONGLONG numBlocks = ns->SizeInBlocks;
+            ULONG blockSize = ns->BlockSize ? ns->BlockSize : 512;
 
             // Calculate number of cylinders based on: Total Blocks = Cylinders * Heads * Sectors
             // Cylinders = Total Blocks / (Heads * Sectors)
@@ -1210,7 +2217,7 @@ BOOLEAN ScsiHandleModeSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLO
         buffer[0] = (UCHAR)((modeDataLength >> 8) & 0xFF);
         buffer[1] = (UCHAR)(modeDataLength & 0xFF);
         buffer[2] = 0x00;  // Medium type (0 = default)
-        buffer[3] = 0x00;  // Device-specific parameter
+        buffer[3] = MODE_DSP_FUA_SUPPORTED;  // Device-specific parameter: DPOFUA
         buffer[4] = 0x00;  // Reserved
         buffer[5] = 0x00;  // Reserved
         buffer[6] = (UCHAR)((blockDescLength >> 8) & 0xFF);
@@ -1225,7 +2232,7 @@ BOOLEAN ScsiHandleModeSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLO
 
         buffer[0] = modeDataLength;
         buffer[1] = 0x00;  // Medium type (0 = default)
-        buffer[2] = 0x00;  // Device-specific parameter
+        buffer[2] = MODE_DSP_FUA_SUPPORTED;  // Device-specific parameter: DPOFUA
         buffer[3] = (UCHAR)blockDescLength;
     }
 
@@ -1244,6 +2251,105 @@ BOOLEAN ScsiHandleModeSense(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLO
     return ScsiSuccess(DevExt, Srb);
 }
 
+//
+// ScsiHandleModeSelect - Handle SCSI MODE SELECT(6) and MODE SELECT(10) commands
+// Only the WCE bit of the caching page is acted on, via Set Features Volatile Write Cache
+//
+BOOLEAN ScsiHandleModeSelect(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    PUCHAR buffer;
+    ULONG paramLength;
+    ULONG headerSize;
+    ULONG blockDescLength;
+    ULONG offset;
+    BOOLEAN isModeSelect10;
+    BOOLEAN foundCachingPage = FALSE;
+    BOOLEAN wce = FALSE;
+
+    // Check if namespace is identified
+    if (NVME_SRB_NAMESPACE(DevExt, Srb)->SizeInBlocks == 0) {
+        return ScsiBusy(DevExt, Srb);
+    }
+
+    buffer = (PUCHAR)Srb->DataBuffer;
+    isModeSelect10 = (Srb->Cdb[0] == SCSIOP_MODE_SELECT10);
+
+    if (isModeSelect10) {
+        paramLength = ((ULONG)Srb->Cdb[7] << 8) | Srb->Cdb[8];
+        headerSize = 8;
+    } else {
+        paramLength = Srb->Cdb[4];
+        headerSize = 4;
+    }
+    if (paramLength > Srb->DataTransferLength) {
+        paramLength = Srb->DataTransferLength;
+    }
+
+    // Empty parameter list is a no-op
+    if (paramLength == 0) {
+        return ScsiSuccess(DevExt, Srb);
+    }
+    if (paramLength < headerSize) {
+        return ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+    }
+
+    if (isModeSelect10) {
+        blockDescLength = ((ULONG)buffer[6] << 8) | buffer[7];
+    } else {
+        blockDescLength = buffer[3];
+    }
+
+    // Walk the mode pages looking for the caching page, other pages are ignored
+    offset = headerSize + blockDescLength;
+    while (offset + 2 <= paramLength) {
+        UCHAR pageCode = buffer[offset] & 0x3F;
+        ULONG pageLength = buffer[offset + 1];
+
+        if (offset + 2 + pageLength > paramLength) {
+            return ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+        }
+        if (pageCode == MODE_PAGE_CACHING && pageLength >= 1) {
+            foundCachingPage = TRUE;
+            wce = (buffer[offset + 2] & MODE_CACHING_WCE) ? TRUE : FALSE;
+        }
+        offset += 2 + pageLength;
+    }
+
+#ifdef NVME2K_DBG
+    ScsiDebugPrint(0, "nvme2k: ModeSelect caching page=%u WCE=%u (current %u, VWC %u)\n",
+                   foundCachingPage, wce, DevExt->WriteCacheEnabled, DevExt->VolatileWriteCache);
+#endif
+
+    if (!foundCachingPage || wce == NVME_WRITE_CACHE_ACTIVE(DevExt)) {
+        return ScsiSuccess(DevExt, Srb);
+    }
+
+    // Can't enable a cache the controller doesn't have
+    if (!DevExt->VolatileWriteCache) {
+        return ScsiError(DevExt, Srb, SRB_STATUS_INVALID_REQUEST);
+    }
+
+    // Only one cache change at a time, WriteCacheRequested tracks it
+    if (DevExt->WriteCacheRequested != DevExt->WriteCacheEnabled) {
+        return ScsiBusy(DevExt, Srb);
+    }
+
+    // Writes the cache still holds are flushed first, nothing else will once it is off
+    if (!wce && !NvmeFlushWriteCache(DevExt)) {
+        return ScsiBusy(DevExt, Srb);
+    }
+
+    DevExt->WriteCacheRequested = wce;
+    if (!NvmeSetFeatures(DevExt, Srb, NVME_FEATURE_VOLATILE_WRITE_CACHE, wce ? 1 : 0,
+                         ADMIN_KIND_SET_FEATURES_VWC)) {
+        DevExt->WriteCacheRequested = DevExt->WriteCacheEnabled;
+        return ScsiBusy(DevExt, Srb);
+    }
+
+    // Completed in NvmeProcessSetFeaturesCompletion
+    return ScsiPending(DevExt, Srb, 1);
+}
+
 //
 // HandleIO_NVME2KDB - Process NVME2KDB custom IOCTLs
 //
@@ -1264,15 +2370,15 @@ BOOLEAN HandleIO_NVME2KDB(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
 #endif
 
     switch (srbControl->ControlCode) {
-        case 0x1000:  // NVME2KDB_IOCTL_QUERY_INFO
+        case NVME2KDB_IOCTL_QUERY_INFO:
 #ifdef NVME2K_DBG
             ScsiDebugPrint(0, "nvme2k: NVME2KDB QUERY_INFO\n");
 #endif
-            srbControl->ReturnCode = 0;  // Success
+            srbControl->ReturnCode = NVME2KDB_RC_SUCCESS;
             Srb->SrbStatus = SRB_STATUS_SUCCESS;
             return TRUE;
 
-        case 0x1001:  // NVME2KDB_IOCTL_TRIM_MODE_ON
+        case NVME2KDB_IOCTL_TRIM_MODE_ON:
 #ifdef NVME2K_DBG
             ScsiDebugPrint(0, "nvme2k: NVME2KDB TRIM_MODE_ON (Length=%u)\n", srbControl->Length);
 #endif
@@ -1283,17 +2389,26 @@ BOOLEAN HandleIO_NVME2KDB(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
                 ScsiDebugPrint(0, "nvme2k: NVME2KDB TRIM_MODE_ON invalid length (expected 4096, got %u)\n",
                                srbControl->Length);
 #endif
-                srbControl->ReturnCode = 1;  // Error
+                srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                Srb->SrbStatus = SRB_STATUS_ERROR;
+                return FALSE;
+            }
+
+            // No uncached page for the pattern
+            if (DevExt->TrimPattern == NULL) {
+                srbControl->ReturnCode = NVME2KDB_RC_ERROR;
                 Srb->SrbStatus = SRB_STATUS_ERROR;
                 return FALSE;
             }
 
-            // Copy the 4KB pattern to device extension
+            // Copy the 4KB pattern to its page, writes are compared against it at submission
             memcpy(
                 DevExt->TrimPattern,
                 (PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL),
-                4096
+                NVME_TRIM_PAGE_SIZE
             );
+            DevExt->TrimFingerprint[0] = DevExt->TrimPattern[0];
+            DevExt->TrimFingerprint[1] = DevExt->TrimPattern[NVME_TRIM_PAGE_SIZE / sizeof(ULONG) - 1];
 
             // Enable TRIM mode
             DevExt->TrimEnable = TRUE;
@@ -1302,10 +2417,10 @@ BOOLEAN HandleIO_NVME2KDB(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
             ScsiDebugPrint(0, "nvme2k: NVME2KDB TRIM mode enabled, pattern stored\n");
 #endif
             Srb->SrbStatus = SRB_STATUS_SUCCESS;
-            srbControl->ReturnCode = 0;  // Success
+            srbControl->ReturnCode = NVME2KDB_RC_SUCCESS;
             return TRUE;
 
-        case 0x1002:  // NVME2KDB_IOCTL_TRIM_MODE_OFF
+        case NVME2KDB_IOCTL_TRIM_MODE_OFF:
 #ifdef NVME2K_DBG
             ScsiDebugPrint(0, "nvme2k: NVME2KDB TRIM_MODE_OFF\n");
 #endif
@@ -1316,19 +2431,454 @@ BOOLEAN HandleIO_NVME2KDB(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
             ScsiDebugPrint(0, "nvme2k: NVME2KDB TRIM mode disabled\n");
 #endif
             Srb->SrbStatus = SRB_STATUS_SUCCESS;
-            srbControl->ReturnCode = 0;  // Success
+            srbControl->ReturnCode = NVME2KDB_RC_SUCCESS;
             return TRUE;
 
+        case NVME2KDB_IOCTL_QUERY_STATS:
+            {
+                PNVME2KDB_STATS stats = (PNVME2KDB_STATS)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+                ULONG i;
+
+                if (srbControl->Length < sizeof(NVME2KDB_STATS) ||
+                    Srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + sizeof(NVME2KDB_STATS)) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    Srb->SrbStatus = SRB_STATUS_DATA_OVERRUN;
+                    return FALSE;
+                }
+
+                memset(stats, 0, sizeof(NVME2KDB_STATS));
+                stats->Size = sizeof(NVME2KDB_STATS);
+                stats->TotalBytesRead = DevExt->TotalBytesRead;
+                stats->TotalBytesWritten = DevExt->TotalBytesWritten;
+                stats->TotalRequests = DevExt->TotalRequests;
+                stats->TotalReads = DevExt->TotalReads;
+                stats->TotalWrites = DevExt->TotalWrites;
+                stats->RejectedRequests = DevExt->RejectedRequests;
+                stats->CurrentQueueDepth = DevExt->CurrentQueueDepth;
+                stats->MaxQueueDepthReached = DevExt->MaxQueueDepthReached;
+                stats->FlushesIssued = DevExt->FlushesIssued;
+                stats->FlushesElided = DevExt->FlushesElided;
+                stats->FlushesMerged = DevExt->FlushesMerged;
+                stats->RequestsStaged = DevExt->RequestsStaged;
+                stats->CurrentStagedDepth = DevExt->StagedCount;
+                stats->MaxStagedDepth = DevExt->MaxStagedDepth;
+                stats->BusyReturned = DevExt->BusyReturned;
+                stats->StagedTimeTotalUs = NvmeTimestampToUs(DevExt, DevExt->StagedTimeTotal);
+                stats->StagedTimeMaxUs = NvmeTimestampToUs(DevExt, DevExt->StagedTimeMax);
+                stats->IoScheduler = DevExt->IoScheduler;
+                stats->CurrentSchedQueued = DevExt->SchedQueued;
+                stats->WriteBytesInFlight = DevExt->WriteBytesInFlight;
+                stats->WritesExpired = DevExt->WritesExpired;
+                stats->WriteCapHits = DevExt->WriteCapHits;
+                memcpy(stats->ReadWaitHistogram, DevExt->ReadWaitHistogram, sizeof(stats->ReadWaitHistogram));
+                memcpy(stats->WriteWaitHistogram, DevExt->WriteWaitHistogram, sizeof(stats->WriteWaitHistogram));
+                stats->QueueDepthLimit = DevExt->QueueDepthLimit;
+                stats->LatencyTargetUs = DevExt->LatencyTargetUs;
+                stats->LatencyEstimateUs = (ULONG)NvmeTimestampToUs(DevExt, DevExt->LatencyEstimate);
+                stats->ThrottleDecreases = DevExt->ThrottleDecreases;
+                stats->ThrottleIncreases = DevExt->ThrottleIncreases;
+                stats->UnalignedReads = DevExt->UnalignedReads;
+                stats->RmwWrites = DevExt->RmwWrites;
+                stats->BoundarySplits = DevExt->BoundarySplits;
+                stats->ReadCacheKB = DevExt->ReadCacheSlots << (NVME_PAGE_SHIFT - 10);
+                stats->ReadCacheHits = DevExt->ReadCacheHits;
+                stats->ReadCacheMisses = DevExt->ReadCacheMisses;
+                stats->ReadCacheInvalidations = DevExt->ReadCacheInvalidations;
+                stats->DeallocExtents = DevExt->DeallocExtentCount;
+                stats->DeallocReads = DevExt->DeallocReads;
+                stats->DeallocExtentsDropped = DevExt->DeallocExtentsDropped;
+                stats->TrimPages = DevExt->TrimPages;
+                stats->SmartCacheMs = DevExt->SmartCacheMs;
+                stats->SmartLogHits = DevExt->SmartLogHits;
+                stats->SmartLogRefreshes = DevExt->SmartLogRefreshes;
+                stats->SmartLogMerged = DevExt->SmartLogMerged;
+                for (i = 0; i < NVME_MAX_ASYNC_EVENTS; i++) {
+                    if (DevExt->AsyncEventCids & (1UL << i)) {
+                        stats->AsyncEventRequests++;
+                    }
+                }
+                stats->AsyncEvents = DevExt->AsyncEvents;
+                stats->AsyncEventsError = DevExt->AsyncEventsError;
+                stats->AsyncEventsHealth = DevExt->AsyncEventsHealth;
+                stats->AsyncEventsNotice = DevExt->AsyncEventsNotice;
+                stats->LastAsyncEvent = DevExt->LastAsyncEvent;
+                stats->CriticalWarning = DevExt->CriticalWarning;
+                stats->ApstStatus = DevExt->ApstStatus;
+                stats->ApstLatencyUs = DevExt->ApstLatencyUs;
+                stats->ApstStates = DevExt->ApstStates;
+                stats->ApstIdleMs = DevExt->ApstIdleMs;
+                stats->ApstWakeUs = DevExt->ApstWakeUs;
+                stats->PowerStates = DevExt->PowerStateCount;
+
+                srbControl->Length = sizeof(NVME2KDB_STATS);
+                srbControl->ReturnCode = NVME2KDB_RC_SUCCESS;
+                Srb->SrbStatus = SRB_STATUS_SUCCESS;
+                return TRUE;
+            }
+
+        case NVME2KDB_IOCTL_QUERY_LBA_FORMATS:
+        case NVME2KDB_IOCTL_FORMAT_BEST_LBAF:
+            {
+                PNVME2KDB_LBA_FORMATS formats = (PNVME2KDB_LBA_FORMATS)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+                PNVME_NAMESPACE ns;
+                ULONG confirm;
+
+                if (srbControl->Length < sizeof(NVME2KDB_LBA_FORMATS) ||
+                    Srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + sizeof(NVME2KDB_LBA_FORMATS)) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    Srb->SrbStatus = SRB_STATUS_DATA_OVERRUN;
+                    return FALSE;
+                }
+                if (formats->Lun >= DevExt->NamespaceCount) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    return FALSE;
+                }
+
+                ns = &DevExt->Namespaces[formats->Lun];
+                confirm = formats->Confirm;
+                NvmeToLbaFormats(DevExt, ns, formats);
+                srbControl->Length = sizeof(NVME2KDB_LBA_FORMATS);
+
+                if (srbControl->ControlCode == NVME2KDB_IOCTL_QUERY_LBA_FORMATS ||
+                    formats->BestFormat == formats->CurrentFormat) {
+                    srbControl->ReturnCode = NVME2KDB_RC_SUCCESS;  // nothing to format
+                    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+                    return TRUE;
+                }
+
+                // Format NVM erases the namespace: explicit confirmation, a usable target
+                // and nothing in flight or waiting in the driver
+                if (confirm != NVME2KDB_FORMAT_CONFIRM || !formats->FormatSupported ||
+                    formats->BestFormat == NVME2KDB_LBAF_NONE ||
+                    DevExt->CurrentQueueDepth != 0 || DevExt->StagedCount != 0 ||
+                    DevExt->SchedQueued != 0 || DevExt->NonTaggedInFlight != NULL) {
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: NVME2KDB FORMAT_BEST_LBAF refused - confirm=%08X supported=%u best=%u QD=%u staged=%u\n",
+                                   confirm, formats->FormatSupported, formats->BestFormat,
+                                   DevExt->CurrentQueueDepth, DevExt->StagedCount);
+#endif
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    return FALSE;
+                }
+
+                if (!NvmeFormatNvm(DevExt, Srb, ns->NamespaceId, formats->BestFormat)) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    return FALSE;
+                }
+
+                // LUN not ready until the re-identify, I/O sent meanwhile is returned busy
+                ns->SizeInBlocks = 0;
+                NvmeCacheInvalidateLun(DevExt, (UCHAR)formats->Lun);
+                NvmeDeallocRemove(DevExt, (UCHAR)formats->Lun, 0, ~(ULONGLONG)0);
+
+                Srb->SrbStatus = SRB_STATUS_PENDING;
+                srbControl->ReturnCode = NVME2KDB_RC_SUCCESS;  // completed async
+                return TRUE;
+            }
+
+        case NVME2KDB_IOCTL_DEALLOCATE:
+            {
+                PNVME2KDB_DEALLOCATE dealloc = (PNVME2KDB_DEALLOCATE)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+                ULONG length;
+                ULONG sent;
+                int result;
+
+                length = FIELD_OFFSET(NVME2KDB_DEALLOCATE, Ranges);
+                if (srbControl->Length < length ||
+                    Srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + length) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    Srb->SrbStatus = SRB_STATUS_DATA_OVERRUN;
+                    return FALSE;
+                }
+                if (dealloc->NumberOfRanges == 0 ||
+                    dealloc->NumberOfRanges > NVME2KDB_MAX_DEALLOCATE_RANGES) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    return FALSE;
+                }
+                length += dealloc->NumberOfRanges * sizeof(NVME2KDB_RANGE);
+                if (srbControl->Length < length ||
+                    Srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + length) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    Srb->SrbStatus = SRB_STATUS_DATA_OVERRUN;
+                    return FALSE;
+                }
+
+                // The completion needs the SRB extension, and a LUN that is ready
+                if (dealloc->Lun >= DevExt->NamespaceCount || Srb->SrbExtension == NULL ||
+                    DevExt->Namespaces[dealloc->Lun].SizeInBlocks == 0 ||
+                    !(DevExt->OptionalNvmCommands & NVME_ONCS_DSM)) {
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: NVME2KDB DEALLOCATE refused - LUN %u ONCS=%04X\n",
+                                   dealloc->Lun, DevExt->OptionalNvmCommands);
+#endif
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    return FALSE;
+                }
+
+                dealloc->Size = sizeof(NVME2KDB_DEALLOCATE);
+                dealloc->RangesSent = 0;
+
+                if (ScsiOrderedBusy(DevExt)) {
+                    srbControl->ReturnCode = NVME2KDB_RC_BUSY;
+                    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+                    return TRUE;
+                }
+
+                result = NvmeDeallocateRanges(DevExt, Srb, (UCHAR)dealloc->Lun, dealloc->Ranges,
+                                              dealloc->NumberOfRanges, &sent);
+                if (result < 0) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    return FALSE;
+                }
+                if (result == 0 || sent == 0) {
+                    srbControl->ReturnCode = (result == 0) ? NVME2KDB_RC_BUSY : NVME2KDB_RC_SUCCESS;
+                    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+                    return TRUE;
+                }
+
+                // Completed in NvmeProcessIoCompletion
+                dealloc->RangesSent = sent;
+                srbControl->ReturnCode = NVME2KDB_RC_SUCCESS;
+                return ScsiPending(DevExt, Srb, 1);
+            }
+
+        case NVME2KDB_IOCTL_COPY:
+            {
+                PNVME2KDB_COPY copy = (PNVME2KDB_COPY)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+                PNVME_NAMESPACE ns;
+                ULONGLONG total = 0;
+                ULONGLONG mask;
+                ULONG length;
+                ULONG i;
+
+                length = FIELD_OFFSET(NVME2KDB_COPY, Ranges);
+                if (srbControl->Length < length ||
+                    Srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + length) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    Srb->SrbStatus = SRB_STATUS_DATA_OVERRUN;
+                    return FALSE;
+                }
+                if (copy->NumberOfRanges == 0 || copy->NumberOfRanges > NVME2KDB_MAX_COPY_RANGES) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    return FALSE;
+                }
+                length += copy->NumberOfRanges * sizeof(NVME2KDB_RANGE);
+                if (srbControl->Length < length ||
+                    Srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + length) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    Srb->SrbStatus = SRB_STATUS_DATA_OVERRUN;
+                    return FALSE;
+                }
+
+                // The completion needs the SRB extension, and a LUN that is ready
+                if (copy->Lun >= DevExt->NamespaceCount || Srb->SrbExtension == NULL ||
+                    DevExt->Namespaces[copy->Lun].SizeInBlocks == 0) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    return FALSE;
+                }
+                ns = &DevExt->Namespaces[copy->Lun];
+
+                // Without Copy the blocks go through pool pages, a device block must fit one
+                if (ns->MaxCopyBlocks == 0 && (ns->BlockSize << ns->LbaShift) > NVME_PAGE_SIZE) {
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    return FALSE;
+                }
+
+                // Whole device blocks inside the namespace, the destination clear of every source
+                mask = ((ULONGLONG)1 << ns->LbaShift) - 1;
+                for (i = 0; i < copy->NumberOfRanges; i++) {
+                    PNVME2KDB_RANGE range = &copy->Ranges[i];
+
+                    if (range->Blocks == 0 || range->Lba >= ns->SizeInBlocks ||
+                        range->Blocks > ns->SizeInBlocks - range->Lba ||
+                        ((range->Lba | range->Blocks) & mask) != 0) {
+                        break;
+                    }
+                    total += range->Blocks;
+                }
+                if (i == copy->NumberOfRanges &&
+                    ((copy->DestinationLba | copy->BlocksDone) & mask) == 0 &&
+                    copy->DestinationLba < ns->SizeInBlocks &&
+                    total <= ns->SizeInBlocks - copy->DestinationLba &&
+                    copy->BlocksDone <= total) {
+                    for (i = 0; i < copy->NumberOfRanges; i++) {
+                        if (copy->Ranges[i].Lba < copy->DestinationLba + total &&
+                            copy->DestinationLba < copy->Ranges[i].Lba + copy->Ranges[i].Blocks) {
+                            break;
+                        }
+                    }
+                }
+                if (i != copy->NumberOfRanges) {
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: NVME2KDB COPY refused - LUN %u range %u\n", copy->Lun, i);
+#endif
+                    srbControl->ReturnCode = NVME2KDB_RC_ERROR;
+                    return FALSE;
+                }
+
+                copy->Size = sizeof(NVME2KDB_COPY);
+                copy->BlocksCopied = 0;
+                copy->Flags &= ~NVME2KDB_COPY_OFFLOADED;
+                if (copy->BlocksDone == total) {
+                    srbControl->ReturnCode = NVME2KDB_RC_SUCCESS;
+                    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+                    return TRUE;
+                }
+
+                if (ScsiOrderedBusy(DevExt) || !NvmeCopyStart(DevExt, Srb, copy)) {
+                    srbControl->ReturnCode = NVME2KDB_RC_BUSY;
+                    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+                    return TRUE;
+                }
+
+                // Completed in NvmeProcessIoCompletion
+                srbControl->ReturnCode = NVME2KDB_RC_SUCCESS;
+                return ScsiPending(DevExt, Srb, 1);
+            }
+
         default:
 #ifdef NVME2K_DBG
             ScsiDebugPrint(0, "nvme2k: NVME2KDB unknown ControlCode: 0x%08X\n", srbControl->ControlCode);
 #endif
-            srbControl->ReturnCode = 1;  // Error
+            srbControl->ReturnCode = NVME2KDB_RC_ERROR;
             // Don't set SRB status - let caller set SRB_STATUS_INVALID_REQUEST
             return FALSE;
     }
 }
 
+//
+// NvmeMiniFeatureAllowed - Get/Set Features whitelist for NvmeMini
+// Returns FALSE for features userspace may not touch, otherwise the size of the
+// feature's data buffer (0 if the value travels in CDW11 / DW0 only).
+// Features the driver configures itself (queues, async events) are read-only and
+// the host memory buffer, which needs host memory the driver doesn't own, is out.
+//
+static BOOLEAN NvmeMiniFeatureAllowed(IN UCHAR FeatureId, IN BOOLEAN Set, OUT PULONG DataLength)
+{
+    *DataLength = 0;
+    switch (FeatureId) {
+        case NVME_FEATURE_ARBITRATION:
+        case NVME_FEATURE_POWER_MANAGEMENT:
+        case NVME_FEATURE_TEMPERATURE_THRESHOLD:
+        case NVME_FEATURE_ERROR_RECOVERY:
+        case NVME_FEATURE_VOLATILE_WRITE_CACHE:
+        case NVME_FEATURE_INTERRUPT_COALESCING:
+        case NVME_FEATURE_INTERRUPT_VECTOR_CONFIG:
+        case NVME_FEATURE_WRITE_ATOMICITY:
+        case NVME_FEATURE_THERMAL_MANAGEMENT:
+        case NVME_FEATURE_NONOP_POWER_STATE:
+            return TRUE;
+        case NVME_FEATURE_AUTONOMOUS_POWER_STATE:
+            *DataLength = 256;
+            return TRUE;
+        case NVME_FEATURE_TIMESTAMP:
+            *DataLength = 8;
+            return TRUE;
+        case NVME_FEATURE_LBA_RANGE_TYPE:
+            *DataLength = NVME_PAGE_SIZE;
+            return !Set;
+        case NVME_FEATURE_NUMBER_OF_QUEUES:
+        case NVME_FEATURE_ASYNC_EVENT_CONFIG:
+            return !Set;
+        default:
+            return FALSE;
+    }
+}
+
+//
+// HandleIO_NvmeMiniIo - NvmeMini command for the I/O queue (QueueId != 0)
+// Only plain data commands pass: Read, Write, Compare, Dataset Management, Write
+// Zeroes, Verify and Flush, to a namespace exposed as a LUN. Data goes straight
+// between the device and the buffer after NVME_PASS_THROUGH, up to MDTS; metadata
+// pointers and SGLs are never used. The completion entry comes back in
+// Completion[] and the NVMe status decides ReturnCode.
+//
+static BOOLEAN HandleIO_NvmeMiniIo(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb)
+{
+    PSRB_IO_CONTROL srbControl = (PSRB_IO_CONTROL)Srb->DataBuffer;
+    PNVME_PASS_THROUGH nvmePassThru = (PNVME_PASS_THROUGH)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
+    PULONG nvmeCmd = nvmePassThru->Command;
+    UCHAR nvmeOpcode = (UCHAR)(nvmeCmd[0] & 0xFF);
+    PNVME_NAMESPACE ns;
+    ULONG deviceBlockSize;
+    ULONG length;
+    UCHAR lun;
+    int result;
+
+    // The namespace has to be one we expose, and ready
+    for (lun = 0; lun < DevExt->NamespaceCount; lun++) {
+        if (DevExt->Namespaces[lun].NamespaceId == nvmeCmd[1]) {
+            break;
+        }
+    }
+    if (lun >= DevExt->NamespaceCount || DevExt->Namespaces[lun].SizeInBlocks == 0 ||
+        Srb->SrbExtension == NULL || nvmePassThru->MetaDataLen != 0) {
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: NvmeMini I/O command refused - NSID=%08X MetaDataLen=%u\n",
+                       nvmeCmd[1], nvmePassThru->MetaDataLen);
+#endif
+        srbControl->ReturnCode = 1;  // Error
+        return FALSE;
+    }
+    ns = &DevExt->Namespaces[lun];
+    deviceBlockSize = ns->BlockSize << ns->LbaShift;
+
+    switch (nvmeOpcode) {
+        case NVME_CMD_READ:
+        case NVME_CMD_WRITE:
+        case NVME_CMD_COMPARE:
+            // CDW12 bits 15:0 = NLB (0's based)
+            if ((nvmeCmd[12] & 0xFFFF) >= DevExt->MaxTransferSizeBytes / deviceBlockSize) {
+                srbControl->ReturnCode = 1;  // Error
+                return FALSE;
+            }
+            length = ((nvmeCmd[12] & 0xFFFF) + 1) * deviceBlockSize;
+            break;
+        case NVME_CMD_DSM:
+            // CDW10 bits 7:0 = NR (0's based), 16 bytes per range
+            length = ((nvmeCmd[10] & 0xFF) + 1) * sizeof(NVME_DSM_RANGE);
+            break;
+        case NVME_CMD_ZERO:
+        case NVME_CMD_VERIFY:
+        case NVME_CMD_FLUSH:
+            length = 0;
+            break;
+        default:
+#ifdef NVME2K_DBG
+            ScsiDebugPrint(0, "nvme2k: NvmeMini I/O opcode %02X not allowed\n", nvmeOpcode);
+#endif
+            srbControl->ReturnCode = 1;  // Error
+            return FALSE;
+    }
+
+    if (Srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH) + length) {
+        srbControl->ReturnCode = 5;  // insufficient out buffer
+        Srb->SrbStatus = SRB_STATUS_ERROR;
+        return FALSE;
+    }
+
+    if (ScsiOrderedBusy(DevExt)) {
+        srbControl->ReturnCode = 2;  // busy, send it again
+        Srb->SrbStatus = SRB_STATUS_SUCCESS;
+        return TRUE;
+    }
+
+    result = NvmeUserIoCommand(DevExt, Srb, lun, length);
+    if (result < 0) {
+        srbControl->ReturnCode = 1;  // Error
+        return FALSE;
+    }
+    if (result == 0) {
+        srbControl->ReturnCode = 2;  // busy, send it again
+        Srb->SrbStatus = SRB_STATUS_SUCCESS;
+        return TRUE;
+    }
+
+    // Completed in NvmeProcessIoCompletion
+    srbControl->ReturnCode = 0;
+    return ScsiPending(DevExt, Srb, 1);
+}
+
 //
 // HandleIO_NvmeMini - Process NvmeMini IOCTLs (NVMe passthrough)
 //
@@ -1344,7 +2894,6 @@ BOOLEAN HandleIO_NvmeMini(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
     UCHAR nvmeOpcode;
     ULONG namespaceId;
     UCHAR parameter;
-    USHORT commandId;
 
 #ifdef NVME2K_DBG
     ScsiDebugPrint(0, "nvme2k: HandleIO_NvmeMini called - DataTransferLength=%u\n",
@@ -1368,13 +2917,9 @@ BOOLEAN HandleIO_NvmeMini(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
                    nvmePassThru->MetaDataLen, nvmePassThru->ReturnBufferLen);
 #endif
 
-    // Verify this is an Admin queue command (QueueId == 0)
+    // Anything but the admin queue (QueueId == 0) goes to the driver's I/O queue
     if (nvmePassThru->QueueId != 0) {
-#ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: HandleIO_NvmeMini not Admin queue (QueueId=%u)\n",
-                       nvmePassThru->QueueId);
-#endif
-        return FALSE;
+        return HandleIO_NvmeMiniIo(DevExt, Srb);
     }
 
     // Extract NVMe command parameters from the 64-byte command
@@ -1395,16 +2940,22 @@ BOOLEAN HandleIO_NvmeMini(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
             // CDW10 bits 0-7 = CNS (Controller or Namespace Structure)
             // IDENTIFY always returns 4KB of data
             parameter = (UCHAR)(nvmeCmd[10] & 0xFF);
-            commandId = ADMIN_CID_USER_IDENTIFY;
 
 #ifdef NVME2K_DBG
-            ScsiDebugPrint(0, "nvme2k: NvmeMini IDENTIFY - NSID=%u CNS=%02X CDW10=%08X CID=%04X\n",
-                           namespaceId, parameter, nvmeCmd[10], commandId);
+            ScsiDebugPrint(0, "nvme2k: NvmeMini IDENTIFY - NSID=%u CNS=%02X CDW10=%08X\n",
+                           namespaceId, parameter, nvmeCmd[10]);
 #endif
 
-            if (!NvmeIdentifyEx(DevExt, namespaceId, parameter, commandId, Srb)) {
+            if (Srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH) + NVME_PAGE_SIZE) {
+                srbControl->ReturnCode = 5;  // insufficient out buffer
+                Srb->SrbStatus = SRB_STATUS_ERROR;
+                return FALSE;
+            }
+
+            // The identify data lands straight in the caller's buffer
+            if (!NvmeUserTransfer(DevExt, Srb, NULL, ADMIN_KIND_USER_IDENTIFY, 0, NVME_PAGE_SIZE)) {
 #ifdef NVME2K_DBG
-                ScsiDebugPrint(0, "nvme2k: NvmeIdentifyEx failed\n");
+                ScsiDebugPrint(0, "nvme2k: NvmeUserTransfer failed\n");
 #endif
                 srbControl->ReturnCode = 1;  // Error
                 Srb->SrbStatus = SRB_STATUS_ERROR;
@@ -1420,20 +2971,39 @@ BOOLEAN HandleIO_NvmeMini(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
             // GET_LOG_PAGE command
             // CDW10 bits 0-7 = Log Page ID
             // CDW10 bits 31:16 = NUMDL (Number of Dwords Lower)
+            // CDW11 bits 15:0 = NUMDU (Number of Dwords Upper)
+            // CDW12/CDW13 = LPOL/LPOU (byte offset into the log)
             {
                 ULONG numDwords;
                 ULONG numdl = (nvmeCmd[10] >> 16) & 0xFFFF;
+                ULONG numdu = nvmeCmd[11] & 0xFFFF;
+                ULONG available;
+                BOOLEAN extended = (BOOLEAN)((DevExt->LogPageAttributes & NVME_LPA_EXTENDED_DATA) != 0);
 
                 parameter = (UCHAR)(nvmeCmd[10] & 0xFF);
-                commandId = ADMIN_CID_USER_GET_LOG_PAGE;
 
 #ifdef NVME2K_DBG
-                ScsiDebugPrint(0, "nvme2k: NvmeMini GET_LOG_PAGE - NSID=%u LID=%02X CDW10=%08X (NUMDL=%u) CID=%04X\n",
-                               namespaceId, parameter, nvmeCmd[10], numdl, commandId);
+                ScsiDebugPrint(0, "nvme2k: NvmeMini GET_LOG_PAGE - NSID=%u LID=%02X CDW10=%08X (NUMDL=%u NUMDU=%u LPO=%08X%08X)\n",
+                               namespaceId, parameter, nvmeCmd[10], numdl, numdu, nvmeCmd[13], nvmeCmd[12]);
+#endif
+
+                // NUMDU and the log offset need the controller's extended data support
+                if (!extended && (numdu != 0 || nvmeCmd[12] != 0 || nvmeCmd[13] != 0)) {
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: NvmeMini GET_LOG_PAGE - NUMDU/LPO without LPA extended data\n");
 #endif
+                    srbControl->ReturnCode = 1;  // Error
+                    Srb->SrbStatus = SRB_STATUS_ERROR;
+                    return FALSE;
+                }
 
-                // Extract NUMDL and convert to NumDwords (NUMDL+1)
-                numDwords = numdl + 1;
+                // Extract NUMD and convert to NumDwords (NUMD+1), the LPO must be dword aligned
+                if ((numdu == 0xFFFF && numdl == 0xFFFF) || (nvmeCmd[12] & 3) != 0) {
+                    srbControl->ReturnCode = 1;  // Error
+                    Srb->SrbStatus = SRB_STATUS_ERROR;
+                    return FALSE;
+                }
+                numDwords = ((numdu << 16) | numdl) + 1;
 
                 // Sanity check: Fix obviously wrong NUMDL values based on known log page sizes
                 // Some applications (like SIV) may set incorrect NUMDL values
@@ -1473,10 +3043,95 @@ BOOLEAN HandleIO_NvmeMini(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK
                         break;
                 }
 
-                if (!NvmeGetLogPageEx(DevExt, Srb, parameter, namespaceId, commandId, numDwords)) {
+                // The whole log goes straight into the caller's buffer, MDTS sized
+                // pieces at increasing offsets when one command can't move it all
+                available = Srb->DataTransferLength - (sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH));
+                if (Srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH) ||
+                    numDwords > (available >> 2)) {
+                    srbControl->ReturnCode = 5;  // insufficient out buffer
+                    Srb->SrbStatus = SRB_STATUS_ERROR;
+                    return FALSE;
+                }
+                if (!extended && (numDwords << 2) > DevExt->MaxTransferSizeBytes - NVME_PAGE_SIZE) {
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: NvmeMini GET_LOG_PAGE - %u bytes needs LPA extended data to split\n",
+                                   numDwords << 2);
+#endif
+                    srbControl->ReturnCode = 1;  // Error
+                    Srb->SrbStatus = SRB_STATUS_ERROR;
+                    return FALSE;
+                }
+
+                if (!NvmeUserTransfer(DevExt, Srb, NULL, ADMIN_KIND_USER_GET_LOG_PAGE, 0, numDwords << 2)) {
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: NvmeUserTransfer failed\n");
+#endif
+                    srbControl->ReturnCode = 1;  // Error
+                    Srb->SrbStatus = SRB_STATUS_ERROR;
+                    return FALSE;
+                }
+
+                // Mark as pending - will complete in interrupt handler
+                Srb->SrbStatus = SRB_STATUS_PENDING;
+                srbControl->ReturnCode = 0;  // Success (will be completed async)
+                return TRUE;
+            }
+
+        case NVME_ADMIN_GET_FEATURES:
+        case NVME_ADMIN_SET_FEATURES:
+            // GET/SET_FEATURES command
+            // CDW10 bits 7:0 = FID, Get: bits 10:8 = SEL, Set: bit 31 = SV
+            // CDW11 = value (Set), DW0 of the completion = value (Get)
+            {
+                BOOLEAN set = (BOOLEAN)(nvmeOpcode == NVME_ADMIN_SET_FEATURES);
+                ULONG dataOffset = sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH);
+                ULONG dataLength;
+
+                parameter = (UCHAR)(nvmeCmd[10] & NVME_FEATURE_FID_MASK);
+
+#ifdef NVME2K_DBG
+                ScsiDebugPrint(0, "nvme2k: NvmeMini %s_FEATURES - NSID=%08X FID=%02X CDW10=%08X CDW11=%08X\n",
+                               set ? "SET" : "GET", namespaceId, parameter, nvmeCmd[10], nvmeCmd[11]);
+#endif
+
+                if (!NvmeMiniFeatureAllowed(parameter, set, &dataLength)) {
+#ifdef NVME2K_DBG
+                    ScsiDebugPrint(0, "nvme2k: NvmeMini feature %02X not allowed\n", parameter);
+#endif
+                    srbControl->ReturnCode = 1;  // Error
+                    return FALSE;
+                }
+
+                // Feature data sits where the IDENTIFY/log data goes
+                if (Srb->DataTransferLength < dataOffset + dataLength ||
+                    nvmePassThru->DataBufferLen < dataLength) {
+                    srbControl->ReturnCode = 5;  // insufficient buffer
+                    return FALSE;
+                }
+
+                if (set && parameter == NVME_FEATURE_VOLATILE_WRITE_CACHE) {
+                    // Same bookkeeping as MODE SELECT, one cache change at a time
+                    if (!DevExt->VolatileWriteCache ||
+                        DevExt->WriteCacheRequested != DevExt->WriteCacheEnabled) {
+                        srbControl->ReturnCode = 1;  // Error
+                        return FALSE;
+                    }
+                    // Flushed first when it turns the cache off, as for MODE SELECT
+                    if (!(nvmeCmd[11] & 1) && !NvmeFlushWriteCache(DevExt)) {
+                        srbControl->ReturnCode = 2;  // busy, send it again
+                        Srb->SrbStatus = SRB_STATUS_SUCCESS;
+                        return TRUE;
+                    }
+                    DevExt->WriteCacheRequested = (BOOLEAN)(nvmeCmd[11] & 1);
+                }
+
+                if (!NvmeUserFeatures(DevExt, Srb, nvmeCmd, (PUCHAR)Srb->DataBuffer + dataOffset, dataLength)) {
 #ifdef NVME2K_DBG
-                    ScsiDebugPrint(0, "nvme2k: NvmeGetLogPageEx failed\n");
+                    ScsiDebugPrint(0, "nvme2k: NvmeUserFeatures failed\n");
 #endif
+                    if (set && parameter == NVME_FEATURE_VOLATILE_WRITE_CACHE) {
+                        DevExt->WriteCacheRequested = DevExt->WriteCacheEnabled;
+                    }
                     srbControl->ReturnCode = 1;  // Error
                     Srb->SrbStatus = SRB_STATUS_ERROR;
                     return FALSE;
@@ -1576,7 +3231,7 @@ BOOLEAN HandleSmartIdentify(
     sendCmdOut = (PSENDCMDOUTPARAMS)((PUCHAR)Srb->DataBuffer + sizeof(SRB_IO_CONTROL));
 
     // Generate ATA IDENTIFY data from NVMe controller/namespace info
-    NvmeToAtaIdentify(DevExt, (PATA_IDENTIFY_DEVICE_STRUCT)sendCmdOut->bBuffer);
+    NvmeToAtaIdentify(DevExt, NVME_SRB_NAMESPACE(DevExt, Srb), (PATA_IDENTIFY_DEVICE_STRUCT)sendCmdOut->bBuffer);
 
     // Set driver status
     memset(&sendCmdOut->DriverStatus, 0, sizeof(DRIVERSTATUS));
@@ -1621,13 +3276,20 @@ BOOLEAN HandleSmartReadAttribs(
         return FALSE;
     }
 
-    // Issue async NVMe Get Log Page command for SMART/Health info
-    // The completion handler will convert NVMe SMART to ATA SMART format
-    if (!NvmeGetLogPage(DevExt, Srb, NVME_LOG_PAGE_SMART_HEALTH)) {
+    // Answer from the cached SMART/Health log, or wait for a Get Log Page whose
+    // completion converts NVMe SMART to ATA SMART format
+    switch (NvmeSmartLogRequest(DevExt, Srb)) {
+        case NVME_SMART_LOG_CACHED:
+            return TRUE;
+
+        case NVME_SMART_LOG_PENDING:
+            break;
+
+        default:
 #ifdef NVME2K_DBG
-        ScsiDebugPrint(0, "nvme2k: Failed to submit Get Log Page for SMART attributes\n");
+            ScsiDebugPrint(0, "nvme2k: Failed to submit Get Log Page for SMART attributes\n");
 #endif
-        return FALSE;
+            return FALSE;
     }
 
     // Mark SRB as pending - will be completed in interrupt handler
@@ -1678,15 +3340,22 @@ BOOLEAN HandleSmartReturnStatus(
     sendCmdOut->DriverStatus.bIDEError = 0;
 
     // Return SMART status in bReserved bytes (used as output registers)
-    // For NVMe, we return PASSING status
     // PASSING: CylLow=0x4F, CylHigh=0xC2
     // FAILING: CylLow=0xF4, CylHigh=0x2C
-    //
-    // Ideally we'd check NVMe CriticalWarning field, but that requires
-    // async Get Log Page. For now, return PASSING.
+    // Any NVMe critical warning counts as a threshold exceeded; CriticalWarning is
+    // kept current by the SMART/Health log cache and the asynchronous events.
     // Note: bReserved[0] = CylLow, bReserved[1] = CylHigh (by convention)
-    sendCmdOut->DriverStatus.bReserved[0] = SMART_CYL_LOW;   // 0x4F = PASSING
-    sendCmdOut->DriverStatus.bReserved[1] = SMART_CYL_HI;    // 0xC2 = PASSING
+    if (DevExt->CriticalWarning != 0) {
+        sendCmdOut->DriverStatus.bReserved[0] = SMART_CYL_LOW_EXCEEDED;
+        sendCmdOut->DriverStatus.bReserved[1] = SMART_CYL_HI_EXCEEDED;
+#ifdef NVME2K_DBG
+        ScsiDebugPrint(0, "nvme2k: RETURN_STATUS threshold exceeded - critical warning 0x%02X\n",
+                       DevExt->CriticalWarning);
+#endif
+    } else {
+        sendCmdOut->DriverStatus.bReserved[0] = SMART_CYL_LOW;
+        sendCmdOut->DriverStatus.bReserved[1] = SMART_CYL_HI;
+    }
 
     Srb->DataTransferLength = sizeof(SRB_IO_CONTROL) + sizeof(SENDCMDOUTPARAMS) - 1;
     srbControl->ReturnCode = 0;
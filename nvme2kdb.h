@@ -0,0 +1,230 @@
+//
+// NVME2KDB private IOCTL interface
+// Shared between the driver and user mode tools, so only basic types are used here.
+// Sent as IOCTL_SCSI_MINIPORT with SRB_IO_CONTROL.Signature = "NVME2KDB",
+// the payload follows the SRB_IO_CONTROL header.
+//
+
+#ifndef _NVME2KDB_H_
+#define _NVME2KDB_H_
+
+//
+// Control codes (SRB_IO_CONTROL.ControlCode)
+//
+#define NVME2KDB_IOCTL_QUERY_INFO       0x1000
+#define NVME2KDB_IOCTL_TRIM_MODE_ON     0x1001  // payload: 4KB pattern
+#define NVME2KDB_IOCTL_TRIM_MODE_OFF    0x1002
+#define NVME2KDB_IOCTL_QUERY_STATS      0x1003  // returns NVME2KDB_STATS
+#define NVME2KDB_IOCTL_QUERY_LBA_FORMATS 0x1004 // in/out: NVME2KDB_LBA_FORMATS
+#define NVME2KDB_IOCTL_FORMAT_BEST_LBAF 0x1005  // in/out: NVME2KDB_LBA_FORMATS, ERASES the namespace
+#define NVME2KDB_IOCTL_DEALLOCATE       0x1006  // in/out: NVME2KDB_DEALLOCATE, DISCARDS the ranges
+#define NVME2KDB_IOCTL_COPY             0x1007  // in/out: NVME2KDB_COPY, OVERWRITES the destination
+
+//
+// SRB_IO_CONTROL.ReturnCode
+//
+#define NVME2KDB_RC_SUCCESS             0
+#define NVME2KDB_RC_ERROR               1
+#define NVME2KDB_RC_BUSY                2       // no command slot right now, send it again
+
+//
+// Scheduler wait time histogram buckets, in microseconds from queueing to submission:
+// bucket 0 is < 16us, bucket n covers [16 * 4^(n-1), 16 * 4^n), the last one is open ended
+//
+#define NVME2KDB_WAIT_BUCKETS           8
+
+//
+// APST policy in NVME2KDB_STATS.ApstStatus
+//
+#define NVME2KDB_APST_UNSUPPORTED       0       // controller has no APST (APSTA clear)
+#define NVME2KDB_APST_FIRMWARE          1       // left as the drive had it (ApstLatencyUs=firmware)
+#define NVME2KDB_APST_DISABLED          2       // no power state fits the budget, APST turned off
+#define NVME2KDB_APST_ENABLED           3       // table of ApstStates programmed
+#define NVME2KDB_APST_FAILED            4       // Set Features failed, the drive keeps its own setting
+#define NVME2KDB_APST_USER              5       // changed through NvmeMini Set Features since init
+
+//
+// NVME2KDB_IOCTL_QUERY_STATS output
+// Size is filled in by the driver; tools should only trust fields below it
+// so older/newer driver and tool versions can be mixed.
+//
+#pragma pack(push, 4)
+typedef struct _NVME2KDB_STATS {
+    ULONG Size;                     // sizeof(NVME2KDB_STATS) as known by the driver
+    ULONG Reserved;
+
+    ULONGLONG TotalBytesRead;
+    ULONGLONG TotalBytesWritten;
+    ULONG TotalRequests;
+    ULONG TotalReads;
+    ULONG TotalWrites;
+    ULONG RejectedRequests;
+    ULONG CurrentQueueDepth;
+    ULONG MaxQueueDepthReached;
+
+    // Flush elision
+    ULONG FlushesIssued;            // NVMe Flush commands sent for SYNCHRONIZE CACHE
+    ULONG FlushesElided;            // completed without a device flush (nothing written since last flush)
+    ULONG FlushesMerged;            // piggybacked on an already in-flight device flush
+
+    // Staging queue (I/O held in the driver while SQ slots, CIDs or PRP pages are short)
+    ULONG RequestsStaged;           // SRBs staged instead of returned busy
+    ULONG CurrentStagedDepth;
+    ULONG MaxStagedDepth;
+    ULONG BusyReturned;             // I/O SRBs returned with SRB_STATUS_BUSY (staging queue full)
+    ULONGLONG StagedTimeTotalUs;    // time spent staged, 0 if the platform has no timestamp source
+    ULONGLONG StagedTimeMaxUs;
+
+    // Deadline scheduler (IoScheduler=deadline in DriverParameter)
+    ULONG IoScheduler;              // 0 = arrival order, 1 = deadline
+    ULONG CurrentSchedQueued;       // SRBs waiting in the read and write FIFOs
+    ULONG WriteBytesInFlight;
+    ULONG WritesExpired;            // writes sent ahead of waiting reads (deadline or starvation)
+    ULONG WriteCapHits;             // reads sent while the in-flight cap held writes back
+    ULONG ReadWaitHistogram[NVME2KDB_WAIT_BUCKETS];   // all in bucket 0 without a timestamp source
+    ULONG WriteWaitHistogram[NVME2KDB_WAIT_BUCKETS];
+
+    // Adaptive queue depth (LatencyTargetUs in DriverParameter)
+    ULONG QueueDepthLimit;          // read/write commands currently allowed outstanding
+    ULONG LatencyTargetUs;          // 0 if the limit is fixed
+    ULONG LatencyEstimateUs;        // smoothed read/write completion latency
+    ULONG ThrottleDecreases;
+    ULONG ThrottleIncreases;
+
+    // 512-byte sector emulation on namespaces formatted with larger LBAs
+    ULONG UnalignedReads;           // reads not aligned to the device LBA size
+    ULONG RmwWrites;                // writes that needed a read-modify-write, 0 on aligned partitions
+
+    // Optimal I/O boundary (NOIOB)
+    ULONG BoundarySplits;           // aligned reads/writes split into one command per boundary interval
+
+    // Read cache (ReadCacheKB in DriverParameter)
+    ULONG ReadCacheKB;              // 0 if off
+    ULONG ReadCacheHits;            // reads completed from the cache
+    ULONG ReadCacheMisses;          // cacheable reads that went to the device
+    ULONG ReadCacheInvalidations;   // cached chunks dropped by writes, TRIM or format
+
+    // Deallocated extent map (namespaces whose DLFEAT reads deallocated blocks as zeroes)
+    ULONG DeallocExtents;           // ranges currently known to read back as zeroes
+    ULONG DeallocReads;             // reads zero-filled without device I/O
+    ULONG DeallocExtentsDropped;    // ranges forgotten because the map was full
+
+    // TRIM mode (NVME2KDB_IOCTL_TRIM_MODE_ON)
+    ULONG TrimPages;                // 4KB write pages deallocated instead of written
+
+    // SMART/Health log cache (SmartCacheMs in DriverParameter)
+    ULONG SmartCacheMs;             // 0 if off
+    ULONG SmartLogHits;             // LOG SENSE, SAT and SMART IOCTL requests answered from the cache
+    ULONG SmartLogRefreshes;        // Get Log Page commands sent for them
+    ULONG SmartLogMerged;           // requests that waited for a refresh already outstanding
+
+    // Asynchronous events (kept outstanding once the controller is initialized)
+    ULONG AsyncEventRequests;       // Asynchronous Event Requests currently outstanding
+    ULONG AsyncEvents;              // events reported by the controller since init
+    ULONG AsyncEventsError;         // error status events, also in the system event log
+    ULONG AsyncEventsHealth;        // SMART/Health events, also in the system event log
+    ULONG AsyncEventsNotice;        // notices (namespace attribute, firmware activation)
+    ULONG LastAsyncEvent;           // completion DW0 of the last event: type bits 2:0, info 15:8, log page 23:16
+    ULONG CriticalWarning;          // SMART/Health critical warning byte last read by the driver
+
+    // Autonomous power state transitions (ApstLatencyUs in DriverParameter)
+    ULONG ApstStatus;               // NVME2KDB_APST_*
+    ULONG ApstLatencyUs;            // budget for entry + exit latency, 0xFFFFFFFF if left to the firmware
+    ULONG ApstStates;               // bit n set: power state n is a transition target
+    ULONG ApstIdleMs;               // idle time before the drive leaves PS0
+    ULONG ApstWakeUs;               // worst wake-up latency (entry + exit of the deepest target)
+    ULONG PowerStates;              // power states the controller has (NPSS + 1)
+} NVME2KDB_STATS, *PNVME2KDB_STATS;
+#pragma pack(pop)
+
+//
+// NVME2KDB_IOCTL_QUERY_LBA_FORMATS and NVME2KDB_IOCTL_FORMAT_BEST_LBAF payload
+// The caller fills Lun (and Confirm for a format), the driver fills the rest.
+// FORMAT_BEST_LBAF issues Format NVM (no secure erase) with BestFormat, re-identifies
+// the namespace and returns the new table. It is refused unless Confirm matches, the
+// controller can format this namespace alone and no I/O is outstanding; if the
+// namespace is already in BestFormat nothing is sent. The disk must be rescanned
+// afterwards since its capacity and block size may have changed.
+//
+#define NVME2KDB_FORMAT_CONFIRM         0x544D5246  // 'FRMT'
+#define NVME2KDB_MAX_LBA_FORMATS        16
+#define NVME2KDB_LBAF_NONE              0xFF
+
+#pragma pack(push, 4)
+typedef struct _NVME2KDB_LBA_FORMAT {
+    ULONG DataSize;                 // LBA data size in bytes
+    USHORT MetadataSize;            // metadata bytes per LBA
+    UCHAR RelativePerformance;      // 0 best, 1 better, 2 good, 3 degraded
+    UCHAR Usable;                   // FORMAT_BEST_LBAF may pick it: no metadata, 512 to 4096 byte LBAs
+} NVME2KDB_LBA_FORMAT, *PNVME2KDB_LBA_FORMAT;
+
+typedef struct _NVME2KDB_LBA_FORMATS {
+    ULONG Size;                     // sizeof(NVME2KDB_LBA_FORMATS) as known by the driver
+    ULONG Lun;                      // in: LUN of the namespace
+    ULONG Confirm;                  // in: NVME2KDB_FORMAT_CONFIRM, FORMAT_BEST_LBAF only
+    ULONG NamespaceId;
+    UCHAR NumberOfFormats;          // valid entries in Formats (NLBAF + 1)
+    UCHAR CurrentFormat;            // FLBAS format index
+    UCHAR BestFormat;               // usable format with the best RP, NVME2KDB_LBAF_NONE if none
+    UCHAR FormatSupported;          // Format NVM can be sent for this namespace
+    NVME2KDB_LBA_FORMAT Formats[NVME2KDB_MAX_LBA_FORMATS];
+} NVME2KDB_LBA_FORMATS, *PNVME2KDB_LBA_FORMATS;
+#pragma pack(pop)
+
+//
+// NVME2KDB_IOCTL_DEALLOCATE payload
+// One Dataset Management deallocate command for up to NVME2KDB_MAX_DEALLOCATE_RANGES
+// ranges of the namespace. Ranges are in the LUN's logical blocks (512 bytes on a 512e
+// namespace) and are shrunk to whole device blocks; ranges left empty are not sent.
+// The payload may stop after Ranges[NumberOfRanges - 1]. The data in the ranges is
+// gone once this completes, the tool must only pass blocks the file system has free.
+//
+#define NVME2KDB_MAX_DEALLOCATE_RANGES  256
+
+#pragma pack(push, 4)
+typedef struct _NVME2KDB_RANGE {
+    ULONGLONG Lba;
+    ULONG Blocks;                   // 1 or more
+    ULONG Reserved;
+} NVME2KDB_RANGE, *PNVME2KDB_RANGE;
+
+typedef struct _NVME2KDB_DEALLOCATE {
+    ULONG Size;                     // sizeof(NVME2KDB_DEALLOCATE) as known by the driver
+    ULONG Lun;                      // in: LUN of the namespace
+    ULONG NumberOfRanges;           // in: valid entries in Ranges
+    ULONG RangesSent;               // out: ranges left after rounding, 0 if nothing was sent
+    NVME2KDB_RANGE Ranges[NVME2KDB_MAX_DEALLOCATE_RANGES];
+} NVME2KDB_DEALLOCATE, *PNVME2KDB_DEALLOCATE;
+#pragma pack(pop)
+
+//
+// NVME2KDB_IOCTL_COPY payload
+// Copies the source ranges, back to back, to DestinationLba of the same namespace
+// without the data passing through the caller. Each call does one step and adds
+// what it copied to BlocksDone: one NVMe Copy command (up to the namespace's MSRC
+// ranges, MSSRL blocks per range and MCL blocks) if the controller has Copy,
+// otherwise up to NVME2KDB_COPY_STEP_BYTES read into driver pool pages and written
+// back. Send the same payload again until BlocksDone reaches the sum of the ranges.
+// Blocks are the LUN's logical blocks and must be whole device blocks on a 512e
+// namespace; the destination may not overlap a source range.
+//
+#define NVME2KDB_MAX_COPY_RANGES        256
+#define NVME2KDB_COPY_STEP_BYTES        (1024 * 1024)
+
+#define NVME2KDB_COPY_READ_WRITE        0x00000001  // in: don't use the Copy command
+#define NVME2KDB_COPY_OFFLOADED         0x00000002  // out: this step was an NVMe Copy
+
+#pragma pack(push, 4)
+typedef struct _NVME2KDB_COPY {
+    ULONG Size;                     // sizeof(NVME2KDB_COPY) as known by the driver
+    ULONG Lun;                      // in: LUN of the namespace
+    ULONG NumberOfRanges;           // in: valid entries in Ranges
+    ULONG Flags;                    // in/out: NVME2KDB_COPY_*
+    ULONGLONG DestinationLba;       // in: where the first source block goes
+    ULONGLONG BlocksDone;           // in/out: blocks of the ranges already copied, 0 on the first call
+    ULONGLONG BlocksCopied;         // out: blocks this step copied
+    NVME2KDB_RANGE Ranges[NVME2KDB_MAX_COPY_RANGES];
+} NVME2KDB_COPY, *PNVME2KDB_COPY;
+#pragma pack(pop)
+
+#endif // _NVME2KDB_H_
@@ -54,6 +54,20 @@
 #define MODE_PAGE_FAULT_REPORTING       0x1C
 #endif
 
+#ifndef MODE_DSP_FUA_SUPPORTED
+#define MODE_DSP_FUA_SUPPORTED          0x10  // Device-specific parameter: DPOFUA
+#endif
+
+//
+// Caching mode page (08h) byte 2 flags
+//
+#define MODE_CACHING_WCE                0x04  // Write Cache Enable
+
+//
+// FUA bit in READ(10)/WRITE(10)/READ(16)/WRITE(16) CDB byte 1
+//
+#define SCSI_CDB_FUA                    0x08
+
 #ifndef IOCTL_SCSI_FREE_DUMP_POINTERS
 #define IOCTL_SCSI_FREE_DUMP_POINTERS   CTL_CODE(IOCTL_SCSI_BASE, 0x0409, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #endif
@@ -156,6 +170,18 @@ typedef struct _UNMAP_BLOCK_DESCRIPTOR {
 #define ATA_SMART_READ_LOG_DMA_EXT      0x57 // SMART log, bit 0
 #define ATA_SMART_READ_LOG_EXT          0x58
 #define ATA_SMART_WRITE_LOG_EXT         0x5B
+#define ATA_DATA_SET_MANAGEMENT         0x06
+#define ATA_DSM_TRIM                    0x01 // features bit 0
+
+// DATA SET MANAGEMENT payload: 512-byte blocks of 64 8-byte range entries
+#define ATA_DSM_ENTRY_SIZE              8
+#define ATA_DSM_ENTRIES_PER_BLOCK       64
+#define ATA_DSM_MAX_BLOCKS              4    // IDENTIFY word 105, one NVMe DSM holds 256 ranges
+
+// IDENTIFY DEVICE bits for TRIM
+#define ATA_ID69_DRAT                   0x4000 // word 69: deterministic read after TRIM
+#define ATA_ID69_RZAT                   0x0020 // word 69: read zeroes after TRIM
+#define ATA_ID169_TRIM                  0x0001 // word 169: DATA SET MANAGEMENT TRIM supported
 
 // SCSI ops not defined in win2k scsi.h
 #define SCSIOP_RESERVE6                 0x16
@@ -171,6 +197,8 @@ typedef struct _UNMAP_BLOCK_DESCRIPTOR {
 //
 #define SMART_CYL_LOW                   0x4F
 #define SMART_CYL_HI                    0xC2
+#define SMART_CYL_LOW_EXCEEDED          0xF4    // RETURN STATUS: threshold exceeded
+#define SMART_CYL_HI_EXCEEDED           0x2C
 
 //
 // Windows 2000 ATA Pass-through structures for SMART support
@@ -335,7 +363,8 @@ typedef struct _ATA_IDENTIFY_DEVICE_STRUCT {
     UCHAR RecommendedMdmaCycleTime[2];   // Word 66: Recommended MDMA transfer cycle time
     UCHAR MinPioCycleTime[2];            // Word 67: Minimum PIO transfer cycle time
     UCHAR MinPioCycleTimeIordy[2];       // Word 68: Minimum PIO cycle time with IORDY
-    UCHAR Reserved8[12];                 // Word 69-74: Reserved
+    UCHAR AdditionalSupported[2];        // Word 69: Additional supported (DRAT, RZAT)
+    UCHAR Reserved8[10];                 // Word 70-74: Reserved
     UCHAR QueueDepth[2];                 // Word 75: Queue depth
     UCHAR Reserved9[8];                  // Word 76-79: Reserved for SATA
     UCHAR MajorVersion[2];               // Word 80: Major version number
@@ -354,13 +383,17 @@ typedef struct _ATA_IDENTIFY_DEVICE_STRUCT {
     UCHAR HardwareResetResult[2];        // Word 93: Hardware reset result
     UCHAR Reserved10[12];                // Word 94-99: Reserved
     UCHAR TotalAddressableSectors48[8];  // Word 100-103: Total addressable sectors (LBA-48)
-    UCHAR Reserved11a[8];                // Word 104-107: Reserved
+    UCHAR Reserved11a[2];                // Word 104: Reserved
+    UCHAR MaxDsmBlocks[2];               // Word 105: Max 512-byte blocks of DATA SET MANAGEMENT ranges
+    UCHAR Reserved11c[4];                // Word 106-107: Reserved
     UCHAR WorldWideName[8];              // Word 108-111: World Wide Name (WWN) - 64-bit identifier
     UCHAR Reserved11b[28];               // Word 112-125: Reserved
     UCHAR RemovableMediaStatus[2];       // Word 126: Removable media status notification
     UCHAR SecurityStatus[2];             // Word 127: Security status
     UCHAR VendorSpecific[62];            // Word 128-158: Vendor specific
-    UCHAR Reserved12[116];               // Word 159-216: Reserved
+    UCHAR Reserved12[20];                // Word 159-168: Reserved
+    UCHAR DataSetManagement[2];          // Word 169: DATA SET MANAGEMENT support (TRIM)
+    UCHAR Reserved12b[94];               // Word 170-216: Reserved
     UCHAR NominalMediaRotationRate[2];   // Word 217: Nominal Media Rotation Rate (1=SSD, 0x0401-0xFFFE=RPM)
     UCHAR Reserved13[76];                // Word 218-255: Reserved
 } ATA_IDENTIFY_DEVICE_STRUCT, *PATA_IDENTIFY_DEVICE_STRUCT;
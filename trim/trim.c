@@ -1,7 +1,18 @@
 /*
  * trim.c - Windows 2000 NVMe TRIM/UNMAP utility
  *
- * Console application to send TRIM commands to NVMe devices
+ * Console application to send TRIM commands to NVMe devices.
+ *
+ * The free clusters of the volume are turned into disk LBA ranges (trimcore.c)
+ * and deallocated with the NVME2KDB DEALLOCATE IOCTL, 256 ranges per command,
+ * so nothing is written. If the volume can be locked they come straight from its
+ * allocation bitmap; otherwise (system volume, open files) the free space is
+ * first claimed by a temporary file, without writing it, so the file system can't
+ * reuse a cluster while it is being deallocated, and the file's extents are used.
+ * Drivers without DEALLOCATE get the old method: the free space is filled with a
+ * pattern the driver turns into deallocates (-p forces it).
+ *
+ * Build: cl trim.c trimcore.c
  */
 
 #include <windows.h>
@@ -10,20 +21,33 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../nvme2kdb.h"
+#include "trimcore.h"
+
 // Debug: Limit number of pages to write (0 = no limit)
 #define DEBUG_MAX_PAGES 0
 
 // TRIM chunk size - write this many bytes at a time (must be multiple of 4096)
 #define TRIM_CHUNK_SIZE (1024 * 1024)  // 1MB chunks
 
+// Volume bitmap read per FSCTL_GET_VOLUME_BITMAP (8M clusters, 32GB with 4KB clusters)
+#define BITMAP_CHUNK_SIZE (1024 * 1024)
+
+// Retries of a DEALLOCATE the driver had no command slot for
+#define DEALLOCATE_BUSY_RETRIES 1000
+
 // SCSI IOCTL definitions
 #define IOCTL_SCSI_BASE                 FILE_DEVICE_CONTROLLER
 #define IOCTL_SCSI_MINIPORT             CTL_CODE(IOCTL_SCSI_BASE, 0x0402, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define IOCTL_SCSI_GET_ADDRESS          CTL_CODE(IOCTL_SCSI_BASE, 0x0406, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
-// Custom NVME2KDB control codes
-#define NVME2KDB_IOCTL_QUERY_INFO       0x1000
-#define NVME2KDB_IOCTL_TRIM_MODE_ON     0x1001
-#define NVME2KDB_IOCTL_TRIM_MODE_OFF    0x1002
+typedef struct _SCSI_ADDRESS {
+    ULONG Length;
+    UCHAR PortNumber;
+    UCHAR PathId;
+    UCHAR TargetId;
+    UCHAR Lun;
+} SCSI_ADDRESS, *PSCSI_ADDRESS;
 
 // SRB_IO_CONTROL structure for SCSI miniport communication
 #pragma pack(push, 1)
@@ -460,32 +484,503 @@ int parse_volume_argument(const char *arg, char *device_path, size_t path_size,
     return 0;
 }
 
+/*
+ * Context of the DEALLOCATE batches sent for one volume
+ */
+typedef struct _DEALLOCATE_CONTEXT {
+    HANDLE hDevice;
+    ULONG lun;
+    ULONG ioctls;
+    ULONG busy_retries;
+    ULONGLONG blocks;
+    BOOL unsupported;               // the first DEALLOCATE was refused
+} DEALLOCATE_CONTEXT, *PDEALLOCATE_CONTEXT;
+
+/*
+ * Send one batch of LBA ranges with NVME2KDB_IOCTL_DEALLOCATE (trim_flush_fn)
+ * Returns 0 on success, -1 on failure
+ */
+int send_deallocate(void *context, const trim_range *ranges, unsigned long count)
+{
+    PDEALLOCATE_CONTEXT ctx = (PDEALLOCATE_CONTEXT)context;
+    UCHAR buffer[sizeof(SRB_IO_CONTROL) + sizeof(NVME2KDB_DEALLOCATE)];
+    PSRB_IO_CONTROL srb_control;
+    PNVME2KDB_DEALLOCATE dealloc;
+    DWORD bytes_returned;
+    ULONG data_size;
+    ULONG retries;
+    ULONG i;
+
+    data_size = FIELD_OFFSET(NVME2KDB_DEALLOCATE, Ranges) + count * sizeof(NVME2KDB_RANGE);
+
+    for (retries = 0; retries <= DEALLOCATE_BUSY_RETRIES; retries++) {
+        memset(buffer, 0, sizeof(SRB_IO_CONTROL) + data_size);
+
+        srb_control = (PSRB_IO_CONTROL)buffer;
+        srb_control->HeaderLength = sizeof(SRB_IO_CONTROL);
+        memcpy(srb_control->Signature, "NVME2KDB", 8);
+        srb_control->Timeout = 30;
+        srb_control->ControlCode = NVME2KDB_IOCTL_DEALLOCATE;
+        srb_control->Length = data_size;
+
+        dealloc = (PNVME2KDB_DEALLOCATE)(buffer + sizeof(SRB_IO_CONTROL));
+        dealloc->Lun = ctx->lun;
+        dealloc->NumberOfRanges = count;
+        for (i = 0; i < count; i++) {
+            dealloc->Ranges[i].Lba = ranges[i].lba;
+            dealloc->Ranges[i].Blocks = ranges[i].blocks;
+        }
+
+        if (!DeviceIoControl(ctx->hDevice, IOCTL_SCSI_MINIPORT,
+                             buffer, sizeof(SRB_IO_CONTROL) + data_size,
+                             buffer, sizeof(SRB_IO_CONTROL) + data_size,
+                             &bytes_returned, NULL)) {
+            printf("\nError: DEALLOCATE failed. Error code: %lu\n", GetLastError());
+            ctx->unsupported = (ctx->ioctls == 0);
+            return -1;
+        }
+
+        if (srb_control->ReturnCode == NVME2KDB_RC_SUCCESS) {
+            break;
+        }
+        if (srb_control->ReturnCode != NVME2KDB_RC_BUSY) {
+            printf("\nError: Driver returned error code: %lu\n", srb_control->ReturnCode);
+            ctx->unsupported = (ctx->ioctls == 0);
+            return -1;
+        }
+        // Every CID or PRP page is taken by regular I/O, give it a moment
+        ctx->busy_retries++;
+        Sleep(1);
+    }
+
+    if (retries > DEALLOCATE_BUSY_RETRIES) {
+        printf("\nError: Driver stayed busy.\n");
+        return -1;
+    }
+
+    ctx->ioctls++;
+    for (i = 0; i < count; i++) {
+        ctx->blocks += ranges[i].blocks;
+    }
+    return 0;
+}
+
+/*
+ * Get the LUN of the opened physical drive
+ * Returns 0 on success, -1 on failure
+ */
+int get_scsi_lun(HANDLE hDevice, ULONG *lun)
+{
+    SCSI_ADDRESS address;
+    DWORD bytes_returned;
+
+    if (!DeviceIoControl(hDevice, IOCTL_SCSI_GET_ADDRESS, NULL, 0,
+                         &address, sizeof(address), &bytes_returned, NULL)) {
+        printf("Error: Failed to get SCSI address. Error code: %lu\n", GetLastError());
+        return -1;
+    }
+
+    printf("SCSI address: Port %u Path %u Target %u Lun %u\n",
+           address.PortNumber, address.PathId, address.TargetId, address.Lun);
+    *lun = address.Lun;
+    return 0;
+}
+
+/*
+ * Work out where cluster 0 of the volume is on the disk and how many disk
+ * sectors a cluster has. NTFS numbers clusters from the start of the partition,
+ * FAT from the start of its data area.
+ * Returns 0 on success, -1 on failure
+ */
+int get_volume_geometry(HANDLE hVolume, const char *volume_root,
+                        trim_u64 *first_lba, ULONG *sectors_per_cluster)
+{
+    PARTITION_INFORMATION partition;
+    DISK_GEOMETRY disk;
+    DWORD bytes_returned;
+    DWORD fs_sectors_per_cluster;
+    DWORD fs_bytes_per_sector;
+    DWORD free_clusters;
+    DWORD total_clusters;
+    char fs_name[16];
+    ULONGLONG data_offset = 0;
+    ULONGLONG cluster_size;
+    ULONGLONG start;
+
+    if (!DeviceIoControl(hVolume, IOCTL_DISK_GET_PARTITION_INFO, NULL, 0,
+                         &partition, sizeof(partition), &bytes_returned, NULL) ||
+        !DeviceIoControl(hVolume, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0,
+                         &disk, sizeof(disk), &bytes_returned, NULL)) {
+        printf("Error: Failed to get partition information. Error code: %lu\n", GetLastError());
+        return -1;
+    }
+
+    if (!GetDiskFreeSpace(volume_root, &fs_sectors_per_cluster, &fs_bytes_per_sector,
+                          &free_clusters, &total_clusters) ||
+        !GetVolumeInformation(volume_root, NULL, 0, NULL, NULL, NULL, fs_name, sizeof(fs_name))) {
+        printf("Error: Failed to get volume information. Error code: %lu\n", GetLastError());
+        return -1;
+    }
+
+    if (strncmp(fs_name, "FAT", 3) == 0) {
+        UCHAR *boot_sector;
+        DWORD bytes_read;
+
+        // Raw volume reads must be sector sized and aligned
+        boot_sector = (UCHAR *)VirtualAlloc(NULL, disk.BytesPerSector, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (boot_sector == NULL) {
+            printf("Error: Failed to allocate boot sector buffer.\n");
+            return -1;
+        }
+        if (SetFilePointer(hVolume, 0, NULL, FILE_BEGIN) != 0 ||
+            !ReadFile(hVolume, boot_sector, disk.BytesPerSector, &bytes_read, NULL) ||
+            bytes_read < 512 || trim_fat_data_offset(boot_sector, &data_offset) < 0) {
+            printf("Error: Failed to read the FAT boot sector.\n");
+            VirtualFree(boot_sector, 0, MEM_RELEASE);
+            return -1;
+        }
+        VirtualFree(boot_sector, 0, MEM_RELEASE);
+    } else if (strcmp(fs_name, "NTFS") != 0) {
+        printf("Error: Unsupported file system %s.\n", fs_name);
+        return -1;
+    }
+
+    cluster_size = (ULONGLONG)fs_sectors_per_cluster * fs_bytes_per_sector;
+    start = partition.StartingOffset.QuadPart + data_offset;
+    if (disk.BytesPerSector == 0 || (cluster_size % disk.BytesPerSector) != 0 ||
+        (start % disk.BytesPerSector) != 0) {
+        printf("Error: Clusters of %lu bytes at offset 0x%08lX%08lX don't map to %lu byte sectors.\n",
+               (ULONG)cluster_size, (ULONG)(start >> 32), (ULONG)(start & 0xFFFFFFFF), disk.BytesPerSector);
+        return -1;
+    }
+
+    *first_lba = start / disk.BytesPerSector;
+    *sectors_per_cluster = (ULONG)(cluster_size / disk.BytesPerSector);
+
+    printf("File system: %s, %lu byte clusters, %lu byte sectors\n",
+           fs_name, (ULONG)cluster_size, disk.BytesPerSector);
+    printf("Cluster 0 at LBA 0x%08lX%08lX\n",
+           (ULONG)(*first_lba >> 32), (ULONG)(*first_lba & 0xFFFFFFFF));
+    return 0;
+}
+
+/*
+ * Feed the free clusters from the volume allocation bitmap to the builder
+ * The volume must be locked, or the file system may reuse a cluster meanwhile.
+ * Returns 0 on success, otherwise an error or the builder's callback result
+ */
+int trim_from_bitmap(HANDLE hVolume, trim_builder *b)
+{
+    STARTING_LCN_INPUT_BUFFER input;
+    PVOLUME_BITMAP_BUFFER bitmap;
+    DWORD bytes_returned;
+    ULONGLONG chunk;
+    BOOL more;
+    int result = 0;
+
+    bitmap = (PVOLUME_BITMAP_BUFFER)VirtualAlloc(NULL, BITMAP_CHUNK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (bitmap == NULL) {
+        printf("Error: Failed to allocate bitmap buffer.\n");
+        return -1;
+    }
+
+    input.StartingLcn.QuadPart = 0;
+    do {
+        more = FALSE;
+        if (!DeviceIoControl(hVolume, FSCTL_GET_VOLUME_BITMAP, &input, sizeof(input),
+                             bitmap, BITMAP_CHUNK_SIZE, &bytes_returned, NULL)) {
+            if (GetLastError() != ERROR_MORE_DATA) {
+                printf("\nError: Failed to get volume bitmap. Error code: %lu\n", GetLastError());
+                result = -1;
+                break;
+            }
+            more = TRUE;
+        }
+
+        // BitmapSize counts every cluster from StartingLcn, the buffer holds what fit
+        chunk = 0;
+        if (bytes_returned > FIELD_OFFSET(VOLUME_BITMAP_BUFFER, Buffer)) {
+            chunk = (ULONGLONG)(bytes_returned - FIELD_OFFSET(VOLUME_BITMAP_BUFFER, Buffer)) * 8;
+        }
+        if (chunk > (ULONGLONG)bitmap->BitmapSize.QuadPart) {
+            chunk = bitmap->BitmapSize.QuadPart;
+        }
+
+        result = trim_add_bitmap(b, bitmap->Buffer, bitmap->StartingLcn.QuadPart, chunk);
+        input.StartingLcn.QuadPart = bitmap->StartingLcn.QuadPart + chunk;
+
+        printf("\rScanned 0x%08lX%08lX clusters, 0x%08lX%08lX free",
+               (ULONG)((ULONGLONG)input.StartingLcn.QuadPart >> 32),
+               (ULONG)(input.StartingLcn.QuadPart & 0xFFFFFFFF),
+               (ULONG)(b->clusters >> 32), (ULONG)(b->clusters & 0xFFFFFFFF));
+        fflush(stdout);
+    } while (more && result == 0 && chunk != 0);
+    printf("\n");
+
+    // The deallocates must finish before the volume is unlocked
+    if (result == 0) {
+        result = trim_finish(b);
+    }
+
+    VirtualFree(bitmap, 0, MEM_RELEASE);
+    return result;
+}
+
+/*
+ * Claim the free space with a temporary file and feed its clusters to the builder
+ * SetEndOfFile allocates the clusters without writing them, and the file owns them
+ * until it is deleted, so the file system can't reuse one while it is deallocated.
+ * The file is deleted when the handle is closed, even if the utility dies.
+ * Returns 0 on success, otherwise an error or the builder's callback result
+ */
+int trim_from_reserve_file(const char *volume_letter, trim_builder *b)
+{
+    char file_path[MAX_PATH];
+    char volume_root[8];
+    ULARGE_INTEGER free_bytes_available;
+    ULARGE_INTEGER total_bytes;
+    ULARGE_INTEGER total_free_bytes;
+    STARTING_VCN_INPUT_BUFFER input;
+    PRETRIEVAL_POINTERS_BUFFER extents;
+    DWORD bytes_returned;
+    DWORD sectors_per_cluster;
+    DWORD bytes_per_sector;
+    DWORD free_clusters;
+    DWORD total_clusters;
+    ULONGLONG cluster_size;
+    ULONGLONG size;
+    ULONGLONG vcn;
+    LONG size_high;
+    HANDLE hFile;
+    BOOL more;
+    DWORD i;
+    int attempt;
+    int result = 0;
+
+    snprintf(volume_root, sizeof(volume_root), "%s\\", volume_letter);
+    snprintf(file_path, sizeof(file_path), "%s\\nvme2ktrim", volume_letter);
+
+    if (!GetDiskFreeSpaceEx(volume_root, &free_bytes_available, &total_bytes, &total_free_bytes) ||
+        !GetDiskFreeSpace(volume_root, &sectors_per_cluster, &bytes_per_sector, &free_clusters, &total_clusters)) {
+        printf("Error: Failed to get disk free space. Error code: %lu\n", GetLastError());
+        return -1;
+    }
+    cluster_size = (ULONGLONG)sectors_per_cluster * bytes_per_sector;
+
+    hFile = CreateFile(file_path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        printf("Error: Failed to create file. Error code: %lu\n", GetLastError());
+        return -1;
+    }
+
+    // Leave a little room for whatever else is writing, less on each retry
+    size = free_bytes_available.QuadPart - free_bytes_available.QuadPart / 32;
+    for (attempt = 0; attempt < 8; attempt++) {
+        size -= size % cluster_size;
+        printf("Reserving 0x%08lX%08lX bytes in %s...\n",
+               (ULONG)(size >> 32), (ULONG)(size & 0xFFFFFFFF), file_path);
+
+        size_high = (LONG)(size >> 32);
+        if ((SetFilePointer(hFile, (LONG)(size & 0xFFFFFFFF), &size_high, FILE_BEGIN) != 0xFFFFFFFF ||
+             GetLastError() == NO_ERROR) && SetEndOfFile(hFile)) {
+            break;
+        }
+        if (GetLastError() != ERROR_DISK_FULL) {
+            printf("Error: Failed to extend file. Error code: %lu\n", GetLastError());
+            CloseHandle(hFile);
+            return -1;
+        }
+        size -= size / 8;
+    }
+    if (attempt == 8) {
+        printf("Error: Free space keeps shrinking.\n");
+        CloseHandle(hFile);
+        return -1;
+    }
+
+    extents = (PRETRIEVAL_POINTERS_BUFFER)VirtualAlloc(NULL, BITMAP_CHUNK_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (extents == NULL) {
+        printf("Error: Failed to allocate extent buffer.\n");
+        CloseHandle(hFile);
+        return -1;
+    }
+
+    input.StartingVcn.QuadPart = 0;
+    do {
+        more = FALSE;
+        if (!DeviceIoControl(hFile, FSCTL_GET_RETRIEVAL_POINTERS, &input, sizeof(input),
+                             extents, BITMAP_CHUNK_SIZE, &bytes_returned, NULL)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) {
+                break;  // nothing allocated
+            }
+            if (GetLastError() != ERROR_MORE_DATA) {
+                printf("Error: Failed to get file extents. Error code: %lu\n", GetLastError());
+                result = -1;
+                break;
+            }
+            more = TRUE;
+        }
+
+        vcn = extents->StartingVcn.QuadPart;
+        for (i = 0; i < extents->ExtentCount && result == 0; i++) {
+            // Lcn -1: not allocated (compressed or sparse)
+            if (extents->Extents[i].Lcn.QuadPart != -1) {
+                result = trim_add_clusters(b, extents->Extents[i].Lcn.QuadPart,
+                                           extents->Extents[i].NextVcn.QuadPart - vcn);
+            }
+            vcn = extents->Extents[i].NextVcn.QuadPart;
+        }
+        input.StartingVcn.QuadPart = vcn;
+    } while (more && result == 0 && extents->ExtentCount != 0);
+
+    // The deallocates must finish before the clusters go back to the file system
+    if (result == 0) {
+        result = trim_finish(b);
+    }
+
+    VirtualFree(extents, 0, MEM_RELEASE);
+    CloseHandle(hFile);
+    return result;
+}
+
+/*
+ * Deallocate the free space of a volume with NVME2KDB_IOCTL_DEALLOCATE
+ * Returns 0 on success, 1 if nothing was deallocated because the driver
+ * doesn't support it, -1 on failure
+ */
+int trim_free_space(HANDLE hDevice, const char *volume_letter)
+{
+    char volume_path[32];
+    char volume_root[8];
+    DEALLOCATE_CONTEXT ctx;
+    trim_builder b;
+    trim_u64 first_lba;
+    ULONG sectors_per_cluster;
+    HANDLE hVolume;
+    DWORD bytes_returned;
+    DWORD start_ticks;
+    BOOL locked;
+    int result;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.hDevice = hDevice;
+    if (get_scsi_lun(hDevice, &ctx.lun) < 0) {
+        return -1;
+    }
+
+    snprintf(volume_path, sizeof(volume_path), "\\\\.\\%s", volume_letter);
+    snprintf(volume_root, sizeof(volume_root), "%s\\", volume_letter);
+
+    hVolume = CreateFile(volume_path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         NULL, OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE) {
+        printf("Error: Failed to open volume %s. Error code: %lu\n", volume_letter, GetLastError());
+        return -1;
+    }
+
+    if (get_volume_geometry(hVolume, volume_root, &first_lba, &sectors_per_cluster) < 0) {
+        CloseHandle(hVolume);
+        return -1;
+    }
+
+    trim_builder_init(&b, first_lba, sectors_per_cluster, 1, send_deallocate, &ctx);
+
+    start_ticks = GetTickCount();
+    locked = DeviceIoControl(hVolume, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &bytes_returned, NULL);
+    if (locked) {
+        printf("Volume locked, deallocating free clusters from the allocation bitmap...\n");
+        result = trim_from_bitmap(hVolume, &b);
+        DeviceIoControl(hVolume, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &bytes_returned, NULL);
+    } else {
+        printf("Volume in use (error %lu), deallocating the free space through a reserve file...\n",
+               GetLastError());
+        result = trim_from_reserve_file(volume_letter, &b);
+    }
+    CloseHandle(hVolume);
+
+    printf("Free runs: 0x%08lX%08lX, clusters: 0x%08lX%08lX\n",
+           (ULONG)(b.runs >> 32), (ULONG)(b.runs & 0xFFFFFFFF),
+           (ULONG)(b.clusters >> 32), (ULONG)(b.clusters & 0xFFFFFFFF));
+    printf("DEALLOCATE IOCTLs: %lu (busy retries %lu), 0x%08lX%08lX sectors in %lu ms\n",
+           ctx.ioctls, ctx.busy_retries,
+           (ULONG)(ctx.blocks >> 32), (ULONG)(ctx.blocks & 0xFFFFFFFF),
+           GetTickCount() - start_ticks);
+
+    if (result != 0 && ctx.unsupported) {
+        return 1;
+    }
+    return (result == 0) ? 0 : -1;
+}
+
+/*
+ * Old method: fill the free space with a pattern the driver turns into deallocates
+ * Returns 0 on success, -1 on failure
+ */
+int trim_with_pattern(HANDLE hDevice, const char *volume_letter)
+{
+    int result = 0;
+
+    // Initialize the global random buffer
+    if (initialize_random_buffer() < 0) {
+        return -1;
+    }
+
+    // Enable TRIM mode with random buffer
+    if (enable_trim_mode(hDevice) == 0) {
+        printf("TRIM mode enabled successfully.\n\n");
+
+        // Fill volume with random pattern
+        if (fill_volume_with_pattern(volume_letter) < 0) {
+            printf("Warning: Failed to fill volume with pattern.\n");
+            result = -1;
+        }
+
+        // Disable TRIM mode
+        printf("\nDisabling TRIM mode...\n");
+        if (send_nvme2kdb_ioctl(hDevice, NVME2KDB_IOCTL_TRIM_MODE_OFF, NULL, 0) == 0) {
+            printf("TRIM mode disabled successfully.\n");
+        } else {
+            printf("Failed to disable TRIM mode.\n");
+            result = -1;
+        }
+    } else {
+        printf("Failed to enable TRIM mode.\n");
+        result = -1;
+    }
+
+    free_random_buffer();
+    return result;
+}
+
 int main(int argc, char *argv[])
 {
     char device_path[128];
     char volume_letter[3];
     HANDLE hDevice;
+    BOOL use_pattern = FALSE;
     int result = 0;
 
     printf("NVMe TRIM Utility for Windows 2000\n");
     printf("===================================\n\n");
 
+    if (argc >= 2 && (strcmp(argv[1], "-p") == 0 || strcmp(argv[1], "/p") == 0)) {
+        use_pattern = TRUE;
+        argc--;
+        argv++;
+    }
+
     if (argc < 2) {
-        printf("Usage: %s <volume_letter>\n", argv[0]);
+        printf("Usage: %s [-p] <volume_letter>\n", argv[0]);
+        printf("  -p  fill the free space with a TRIM pattern instead of deallocating it directly\n");
         printf("Examples:\n");
         printf("  %s C:               (volume letter)\n", argv[0]);
         printf("  %s E                (volume letter without colon)\n", argv[0]);
         return 1;
     }
 
-    // Initialize the global random buffer
-    if (initialize_random_buffer() < 0) {
-        return 1;
-    }
-
     // Parse the volume argument and get physical drive path
     if (parse_volume_argument(argv[1], device_path, sizeof(device_path), volume_letter) < 0) {
-        free_random_buffer();
         return 1;
     }
 
@@ -503,7 +998,6 @@ int main(int argc, char *argv[])
 
     if (hDevice == INVALID_HANDLE_VALUE) {
         printf("Error: Failed to open device. Error code: %lu\n", GetLastError());
-        free_random_buffer();
         return 1;
     }
 
@@ -519,32 +1013,19 @@ int main(int argc, char *argv[])
         printf("QUERY_INFO IOCTL failed.\n\n");
     }
 
-    // Enable TRIM mode with random buffer
-    if (enable_trim_mode(hDevice) == 0) {
-        printf("TRIM mode enabled successfully.\n\n");
-
-        // Fill volume with random pattern
-        if (fill_volume_with_pattern(volume_letter) < 0) {
-            printf("Warning: Failed to fill volume with pattern.\n");
-            result = 1;
-        }
-
-        // Disable TRIM mode
-        printf("\nDisabling TRIM mode...\n");
-        if (send_nvme2kdb_ioctl(hDevice, NVME2KDB_IOCTL_TRIM_MODE_OFF, NULL, 0) == 0) {
-            printf("TRIM mode disabled successfully.\n");
-        } else {
-            printf("Failed to disable TRIM mode.\n");
-            result = 1;
+    if (!use_pattern) {
+        result = trim_free_space(hDevice, volume_letter);
+        if (result > 0) {
+            printf("\nDriver has no DEALLOCATE support, filling the free space instead.\n\n");
+            use_pattern = TRUE;
         }
-    } else {
-        printf("Failed to enable TRIM mode.\n");
-        result = 1;
+    }
+    if (use_pattern) {
+        result = trim_with_pattern(hDevice, volume_letter);
     }
 
     CloseHandle(hDevice);
-    free_random_buffer();
 
     printf("\nOperation completed.\n");
-    return result;
+    return (result == 0) ? 0 : 1;
 }
@@ -0,0 +1,219 @@
+/*
+ * trimcore.c - Free space to LBA range conversion for the trim utility
+ *
+ * Free clusters come in either as a volume allocation bitmap (one bit per
+ * cluster, LSB first, 1 = in use) or as cluster runs. Adjacent runs are joined,
+ * runs are turned into disk sector ranges and handed out in batches of up to
+ * TRIM_MAX_RANGES for one DEALLOCATE IOCTL each.
+ */
+
+#include "trimcore.h"
+
+void trim_builder_init(trim_builder *b, trim_u64 first_lba, unsigned long sectors_per_cluster,
+                       trim_u64 min_clusters, trim_flush_fn flush, void *context)
+{
+    b->first_lba = first_lba;
+    b->sectors_per_cluster = sectors_per_cluster;
+    b->min_clusters = min_clusters ? min_clusters : 1;
+    b->flush = flush;
+    b->context = context;
+    b->run_start = 0;
+    b->run_length = 0;
+    b->batch_count = 0;
+    b->runs = 0;
+    b->clusters = 0;
+    b->batches = 0;
+}
+
+/*
+ * Hand the current batch to the flush callback
+ */
+static int trim_flush_batch(trim_builder *b)
+{
+    int result;
+
+    if (b->batch_count == 0) {
+        return 0;
+    }
+    result = b->flush(b->context, b->batch, b->batch_count);
+    b->batch_count = 0;
+    b->batches++;
+    return result;
+}
+
+/*
+ * Turn a finished free run into one or more sector ranges
+ */
+static int trim_emit_run(trim_builder *b, trim_u64 lcn, trim_u64 count)
+{
+    trim_u64 lba;
+    trim_u64 blocks;
+    unsigned long n;
+    int result;
+
+    if (count < b->min_clusters) {
+        return 0;
+    }
+    b->runs++;
+    b->clusters += count;
+
+    lba = b->first_lba + lcn * b->sectors_per_cluster;
+    blocks = count * b->sectors_per_cluster;
+    while (blocks > 0) {
+        n = (blocks > TRIM_MAX_RANGE_BLOCKS) ? TRIM_MAX_RANGE_BLOCKS : (unsigned long)blocks;
+        b->batch[b->batch_count].lba = lba;
+        b->batch[b->batch_count].blocks = n;
+        b->batch_count++;
+        if (b->batch_count == TRIM_MAX_RANGES) {
+            result = trim_flush_batch(b);
+            if (result != 0) {
+                return result;
+            }
+        }
+        lba += n;
+        blocks -= n;
+    }
+    return 0;
+}
+
+/*
+ * Close the open run, if any
+ */
+static int trim_close_run(trim_builder *b)
+{
+    trim_u64 length = b->run_length;
+
+    if (length == 0) {
+        return 0;
+    }
+    b->run_length = 0;
+    return trim_emit_run(b, b->run_start, length);
+}
+
+/*
+ * Add free clusters: extends the open run if they follow it, otherwise closes it
+ * and starts a new one. Runs must come in ascending cluster order to be joined.
+ */
+int trim_add_clusters(trim_builder *b, trim_u64 lcn, trim_u64 count)
+{
+    int result;
+
+    if (count == 0) {
+        return 0;
+    }
+    if (b->run_length != 0 && b->run_start + b->run_length == lcn) {
+        b->run_length += count;
+        return 0;
+    }
+    result = trim_close_run(b);
+    if (result != 0) {
+        return result;
+    }
+    b->run_start = lcn;
+    b->run_length = count;
+    return 0;
+}
+
+/*
+ * Add one chunk of the volume bitmap covering clusters [start_lcn, start_lcn + clusters).
+ * A run still free at the end of the chunk stays open for the next chunk.
+ */
+int trim_add_bitmap(trim_builder *b, const unsigned char *bitmap, trim_u64 start_lcn, trim_u64 clusters)
+{
+    trim_u64 i = 0;
+    unsigned char bits;
+    int result;
+
+    while (i < clusters) {
+        /* Whole bytes at once: mostly empty or mostly full volumes are the common case */
+        if ((i & 7) == 0 && i + 8 <= clusters) {
+            bits = bitmap[i >> 3];
+            if (bits == 0xFF) {
+                result = trim_close_run(b);
+                if (result != 0) {
+                    return result;
+                }
+                i += 8;
+                continue;
+            }
+            if (bits == 0) {
+                result = trim_add_clusters(b, start_lcn + i, 8);
+                if (result != 0) {
+                    return result;
+                }
+                i += 8;
+                continue;
+            }
+        }
+
+        if (bitmap[i >> 3] & (1 << (unsigned)(i & 7))) {
+            result = trim_close_run(b);
+        } else {
+            result = trim_add_clusters(b, start_lcn + i, 1);
+        }
+        if (result != 0) {
+            return result;
+        }
+        i++;
+    }
+    return 0;
+}
+
+/*
+ * Close the open run and send the last batch
+ */
+int trim_finish(trim_builder *b)
+{
+    int result;
+
+    result = trim_close_run(b);
+    if (result != 0) {
+        return result;
+    }
+    return trim_flush_batch(b);
+}
+
+/*
+ * FAT numbers clusters from the start of the data area (cluster 2 is LCN 0),
+ * which follows the reserved sectors, the FATs and the FAT12/16 root directory.
+ * Returns 0 and the byte offset of the data area in the volume, -1 if the boot
+ * sector doesn't hold a FAT BPB.
+ */
+int trim_fat_data_offset(const unsigned char *boot_sector, trim_u64 *data_offset)
+{
+    unsigned long bytes_per_sector;
+    unsigned long sectors_per_cluster;
+    unsigned long reserved_sectors;
+    unsigned long fat_count;
+    unsigned long root_entries;
+    unsigned long fat_size;
+    unsigned long root_sectors;
+
+    if (boot_sector[510] != 0x55 || boot_sector[511] != 0xAA) {
+        return -1;
+    }
+
+    bytes_per_sector = boot_sector[11] | ((unsigned long)boot_sector[12] << 8);
+    sectors_per_cluster = boot_sector[13];
+    reserved_sectors = boot_sector[14] | ((unsigned long)boot_sector[15] << 8);
+    fat_count = boot_sector[16];
+    root_entries = boot_sector[17] | ((unsigned long)boot_sector[18] << 8);
+    fat_size = boot_sector[22] | ((unsigned long)boot_sector[23] << 8);
+    if (fat_size == 0) {
+        /* FAT32 BPB_FATSz32 */
+        fat_size = boot_sector[36] | ((unsigned long)boot_sector[37] << 8) |
+                   ((unsigned long)boot_sector[38] << 16) | ((unsigned long)boot_sector[39] << 24);
+    }
+
+    if (bytes_per_sector < 512 || bytes_per_sector > 4096 ||
+        (bytes_per_sector & (bytes_per_sector - 1)) != 0 ||
+        sectors_per_cluster == 0 || (sectors_per_cluster & (sectors_per_cluster - 1)) != 0 ||
+        reserved_sectors == 0 || fat_count == 0 || fat_size == 0) {
+        return -1;
+    }
+
+    root_sectors = (root_entries * 32 + bytes_per_sector - 1) / bytes_per_sector;
+    *data_offset = ((trim_u64)reserved_sectors + (trim_u64)fat_count * fat_size + root_sectors) *
+                   bytes_per_sector;
+    return 0;
+}
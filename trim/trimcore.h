@@ -0,0 +1,69 @@
+/*
+ * trimcore.h - Free space to LBA range conversion for the trim utility
+ *
+ * No Windows headers here: the volume bitmap and cluster runs come in as plain
+ * bytes and numbers, so this part builds and runs anywhere.
+ */
+
+#ifndef _TRIMCORE_H_
+#define _TRIMCORE_H_
+
+#ifdef _MSC_VER
+typedef unsigned __int64 trim_u64;
+#else
+typedef unsigned long long trim_u64;
+#endif
+
+/* Ranges per NVME2KDB_IOCTL_DEALLOCATE */
+#define TRIM_MAX_RANGES     256
+
+/*
+ * Largest range handed out, in disk sectors. Power of 2 so splitting a run
+ * doesn't break the alignment of its pieces to the device block size.
+ */
+#define TRIM_MAX_RANGE_BLOCKS   0x80000000UL
+
+typedef struct _trim_range {
+    trim_u64 lba;
+    unsigned long blocks;
+} trim_range;
+
+/*
+ * Receives each full batch and the last partial one.
+ * Returns 0 to go on, anything else stops the scan and is returned by trim_*().
+ */
+typedef int (*trim_flush_fn)(void *context, const trim_range *ranges, unsigned long count);
+
+typedef struct _trim_builder {
+    /* Geometry: disk sector of cluster 0 and disk sectors per cluster */
+    trim_u64 first_lba;
+    unsigned long sectors_per_cluster;
+
+    /* Free runs shorter than this many clusters are left alone */
+    trim_u64 min_clusters;
+
+    trim_flush_fn flush;
+    void *context;
+
+    /* Free run still open at the end of the last bitmap chunk */
+    trim_u64 run_start;
+    trim_u64 run_length;
+
+    trim_range batch[TRIM_MAX_RANGES];
+    unsigned long batch_count;
+
+    /* Totals */
+    trim_u64 runs;
+    trim_u64 clusters;
+    unsigned long batches;
+} trim_builder;
+
+void trim_builder_init(trim_builder *b, trim_u64 first_lba, unsigned long sectors_per_cluster,
+                       trim_u64 min_clusters, trim_flush_fn flush, void *context);
+int trim_add_clusters(trim_builder *b, trim_u64 lcn, trim_u64 count);
+int trim_add_bitmap(trim_builder *b, const unsigned char *bitmap, trim_u64 start_lcn, trim_u64 clusters);
+int trim_finish(trim_builder *b);
+
+int trim_fat_data_offset(const unsigned char *boot_sector, trim_u64 *data_offset);
+
+#endif /* _TRIMCORE_H_ */
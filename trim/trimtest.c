@@ -0,0 +1,300 @@
+/*
+ * trimtest.c - Tests for trimcore.c on synthetic bitmaps and boot sectors
+ *
+ * Build and run: make test (host gcc/clang, no Windows headers needed)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "trimcore.h"
+
+#define MAX_RECORDED    1024
+
+typedef struct _recorder {
+    trim_range ranges[MAX_RECORDED];
+    unsigned long count;
+    unsigned long batch_sizes[16];
+    unsigned long batches;
+} recorder;
+
+static recorder rec;
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static int record_flush(void *context, const trim_range *ranges, unsigned long count)
+{
+    recorder *r = (recorder *)context;
+    unsigned long i;
+
+    if (r->batches < sizeof(r->batch_sizes) / sizeof(r->batch_sizes[0])) {
+        r->batch_sizes[r->batches] = count;
+    }
+    r->batches++;
+    for (i = 0; i < count && r->count < MAX_RECORDED; i++) {
+        r->ranges[r->count++] = ranges[i];
+    }
+    return 0;
+}
+
+static void start(trim_builder *b, trim_u64 first_lba, unsigned long sectors_per_cluster,
+                  trim_u64 min_clusters)
+{
+    memset(&rec, 0, sizeof(rec));
+    trim_builder_init(b, first_lba, sectors_per_cluster, min_clusters, record_flush, &rec);
+}
+
+/* Mark clusters [first, first + count) of a bitmap in use */
+static void set_used(unsigned char *bitmap, unsigned long first, unsigned long count)
+{
+    unsigned long i;
+
+    for (i = first; i < first + count; i++) {
+        bitmap[i >> 3] |= (unsigned char)(1 << (i & 7));
+    }
+}
+
+/* A run free at the end of one chunk joins the one free at the start of the next */
+static void test_run_across_chunks(void)
+{
+    static trim_builder b;
+    unsigned char chunk1[2];
+    unsigned char chunk2[2];
+
+    memset(chunk1, 0, sizeof(chunk1));
+    memset(chunk2, 0, sizeof(chunk2));
+    set_used(chunk1, 0, 12);        /* clusters 12-15 free */
+    set_used(chunk2, 4, 12);        /* clusters 16-19 free */
+
+    start(&b, 100, 8, 1);
+    CHECK(trim_add_bitmap(&b, chunk1, 0, 16) == 0);
+    CHECK(rec.count == 0);
+    CHECK(trim_add_bitmap(&b, chunk2, 16, 16) == 0);
+    CHECK(trim_finish(&b) == 0);
+
+    CHECK(rec.count == 1);
+    CHECK(rec.ranges[0].lba == 100 + 12 * 8);
+    CHECK(rec.ranges[0].blocks == 8 * 8);
+    CHECK(b.runs == 1);
+    CHECK(b.clusters == 8);
+
+    /* Chunk lengths that aren't whole bytes, bit by bit */
+    memset(chunk1, 0xFF, sizeof(chunk1));
+    chunk1[0] = 0x3F;               /* clusters 6-7 free, chunk ends at 8 + 3 */
+    chunk1[1] = 0xF8;               /* clusters 8-10 free */
+    memset(chunk2, 0, sizeof(chunk2));
+    set_used(chunk2, 2, 1);         /* clusters 11-12 free, 13 used, 14 free */
+
+    start(&b, 0, 1, 1);
+    CHECK(trim_add_bitmap(&b, chunk1, 0, 11) == 0);
+    CHECK(trim_add_bitmap(&b, chunk2, 11, 4) == 0);
+    CHECK(trim_finish(&b) == 0);
+
+    CHECK(rec.count == 2);
+    CHECK(rec.ranges[0].lba == 6 && rec.ranges[0].blocks == 7);
+    CHECK(rec.ranges[1].lba == 14 && rec.ranges[1].blocks == 1);
+}
+
+/* Free runs shorter than min_clusters are left alone */
+static void test_min_clusters(void)
+{
+    static trim_builder b;
+    unsigned char bitmap[4];
+
+    memset(bitmap, 0xFF, sizeof(bitmap));
+    bitmap[0] = 0xFE;               /* cluster 0 free: 1 */
+    bitmap[1] = 0xF8;               /* clusters 8-10 free: 3 */
+    bitmap[2] = 0xE0;               /* clusters 16-20 free: 5 */
+    bitmap[3] = 0xF0;               /* clusters 24-27 free: 4 */
+
+    start(&b, 0, 1, 4);
+    CHECK(trim_add_bitmap(&b, bitmap, 0, 32) == 0);
+    CHECK(trim_finish(&b) == 0);
+
+    CHECK(rec.count == 2);
+    CHECK(rec.ranges[0].lba == 16 && rec.ranges[0].blocks == 5);
+    CHECK(rec.ranges[1].lba == 24 && rec.ranges[1].blocks == 4);
+    CHECK(b.runs == 2);
+    CHECK(b.clusters == 9);
+
+    /* 0 means every run counts */
+    start(&b, 0, 1, 0);
+    CHECK(trim_add_bitmap(&b, bitmap, 0, 32) == 0);
+    CHECK(trim_finish(&b) == 0);
+    CHECK(rec.count == 4);
+}
+
+/* A full batch goes out at TRIM_MAX_RANGES ranges, the rest on trim_finish */
+static void test_flush_at_max_ranges(void)
+{
+    static trim_builder b;
+    unsigned long i;
+
+    start(&b, 0, 1, 1);
+    for (i = 0; i < 300; i++) {
+        CHECK(trim_add_clusters(&b, i * 2, 1) == 0);
+    }
+    /* The 300th run is still open and the 257th range filled nothing yet */
+    CHECK(rec.batches == 1);
+    CHECK(rec.batch_sizes[0] == TRIM_MAX_RANGES);
+
+    CHECK(trim_finish(&b) == 0);
+    CHECK(rec.batches == 2);
+    CHECK(rec.batch_sizes[1] == 300 - TRIM_MAX_RANGES);
+    CHECK(b.batches == 2);
+    CHECK(rec.count == 300);
+    CHECK(rec.ranges[TRIM_MAX_RANGES].lba == TRIM_MAX_RANGES * 2);
+    CHECK(rec.ranges[299].lba == 598 && rec.ranges[299].blocks == 1);
+
+    /* Exactly one batch: nothing left for trim_finish to send */
+    start(&b, 0, 1, 1);
+    for (i = 0; i < TRIM_MAX_RANGES; i++) {
+        CHECK(trim_add_clusters(&b, i * 2, 1) == 0);
+    }
+    CHECK(trim_finish(&b) == 0);
+    CHECK(rec.batches == 1);
+    CHECK(rec.count == TRIM_MAX_RANGES);
+}
+
+static int stop_flush(void *context, const trim_range *ranges, unsigned long count)
+{
+    (void)ranges;
+    (void)count;
+    (*(int *)context)++;
+    return 7;
+}
+
+/* A non-zero flush result stops the scan and comes back out */
+static void test_flush_stops(void)
+{
+    static trim_builder b;
+    unsigned long i;
+    int calls = 0;
+    int result = 0;
+
+    trim_builder_init(&b, 0, 1, 1, stop_flush, &calls);
+    for (i = 0; i <= TRIM_MAX_RANGES && result == 0; i++) {
+        result = trim_add_clusters(&b, i * 2, 1);
+    }
+    CHECK(result == 7);
+    CHECK(calls == 1);
+}
+
+/* Runs longer than TRIM_MAX_RANGE_BLOCKS sectors are cut into back to back ranges */
+static void test_split_at_max_range_blocks(void)
+{
+    static trim_builder b;
+    trim_u64 clusters = (trim_u64)TRIM_MAX_RANGE_BLOCKS * 2 + 5;
+
+    start(&b, 1000, 1, 1);
+    CHECK(trim_add_clusters(&b, 0, clusters) == 0);
+    CHECK(trim_finish(&b) == 0);
+
+    CHECK(rec.count == 3);
+    CHECK(rec.ranges[0].lba == 1000 && rec.ranges[0].blocks == TRIM_MAX_RANGE_BLOCKS);
+    CHECK(rec.ranges[1].lba == 1000 + (trim_u64)TRIM_MAX_RANGE_BLOCKS &&
+          rec.ranges[1].blocks == TRIM_MAX_RANGE_BLOCKS);
+    CHECK(rec.ranges[2].lba == 1000 + (trim_u64)TRIM_MAX_RANGE_BLOCKS * 2 &&
+          rec.ranges[2].blocks == 5);
+    CHECK(b.runs == 1);
+    CHECK(b.clusters == clusters);
+
+    /* Sectors per cluster count towards the limit, and it is a whole multiple */
+    start(&b, 0, 64, 1);
+    CHECK(trim_add_clusters(&b, 0, TRIM_MAX_RANGE_BLOCKS / 64 * 3) == 0);
+    CHECK(trim_finish(&b) == 0);
+    CHECK(rec.count == 3);
+    CHECK(rec.ranges[2].lba == (trim_u64)TRIM_MAX_RANGE_BLOCKS * 2 &&
+          rec.ranges[2].blocks == TRIM_MAX_RANGE_BLOCKS);
+}
+
+static void put16(unsigned char *p, unsigned long value)
+{
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+static void put32(unsigned char *p, unsigned long value)
+{
+    put16(p, value & 0xFFFF);
+    put16(p + 2, value >> 16);
+}
+
+static void boot_sector(unsigned char *bs, unsigned long bytes_per_sector, unsigned char sectors_per_cluster,
+                        unsigned long reserved, unsigned char fats, unsigned long root_entries,
+                        unsigned long fat16_size, unsigned long fat32_size)
+{
+    memset(bs, 0, 512);
+    bs[0] = 0xEB;
+    put16(bs + 11, bytes_per_sector);
+    bs[13] = sectors_per_cluster;
+    put16(bs + 14, reserved);
+    bs[16] = fats;
+    put16(bs + 17, root_entries);
+    put16(bs + 22, fat16_size);
+    put32(bs + 36, fat32_size);
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
+}
+
+static void test_fat_data_offset(void)
+{
+    unsigned char bs[512];
+    trim_u64 offset;
+
+    /* FAT16: 4 reserved, 2 FATs of 200 sectors, 512 root entries (32 sectors) */
+    boot_sector(bs, 512, 4, 4, 2, 512, 200, 0);
+    offset = 0;
+    CHECK(trim_fat_data_offset(bs, &offset) == 0);
+    CHECK(offset == (trim_u64)(4 + 2 * 200 + 32) * 512);
+
+    /* Root directory that doesn't fill its last sector, 2K sectors */
+    boot_sector(bs, 2048, 1, 1, 2, 100, 16, 0);
+    CHECK(trim_fat_data_offset(bs, &offset) == 0);
+    CHECK(offset == (trim_u64)(1 + 2 * 16 + 2) * 2048);
+
+    /* FAT32: BPB_FATSz16 is 0, the size comes from BPB_FATSz32, no root sectors */
+    boot_sector(bs, 512, 8, 32, 2, 0, 0, 0x12345);
+    CHECK(trim_fat_data_offset(bs, &offset) == 0);
+    CHECK(offset == ((trim_u64)32 + 2 * 0x12345UL) * 512);
+
+    /* FAT32 large enough that the offset passes 4GB */
+    boot_sector(bs, 4096, 8, 32, 2, 0, 0, 0x00800000UL);
+    CHECK(trim_fat_data_offset(bs, &offset) == 0);
+    CHECK(offset == ((trim_u64)32 + 2 * (trim_u64)0x00800000UL) * 4096);
+
+    /* Not a FAT boot sector */
+    boot_sector(bs, 512, 4, 4, 2, 512, 200, 0);
+    bs[511] = 0;
+    CHECK(trim_fat_data_offset(bs, &offset) == -1);
+    boot_sector(bs, 512, 3, 4, 2, 512, 200, 0);
+    CHECK(trim_fat_data_offset(bs, &offset) == -1);
+    boot_sector(bs, 520, 4, 4, 2, 512, 200, 0);
+    CHECK(trim_fat_data_offset(bs, &offset) == -1);
+    boot_sector(bs, 512, 4, 4, 2, 0, 0, 0);
+    CHECK(trim_fat_data_offset(bs, &offset) == -1);
+}
+
+int main(void)
+{
+    test_run_across_chunks();
+    test_min_clusters();
+    test_flush_at_max_ranges();
+    test_flush_stops();
+    test_split_at_max_range_blocks();
+    test_fat_data_offset();
+
+    if (failures != 0) {
+        printf("trimtest: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("trimtest: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,425 @@
+/*
+ * tune.c - Windows 2000 NVMe feature tuning utility
+ *
+ * Console application to read and set NVMe controller features (arbitration
+ * burst, interrupt coalescing, volatile write cache, power state, temperature
+ * threshold...) through the driver's NvmeMini Get/Set Features passthrough.
+ *
+ * A tuning profile holds one feature per line (see tunecore.c). The whole
+ * profile is checked before anything is sent, fields a line leaves out keep the
+ * drive's current value, and each feature is read back after it is set.
+ *
+ * Build: cl tune.c tunecore.c
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tunecore.h"
+
+// Profile lines per run
+#define MAX_SETTINGS 64
+
+// FILETIME of 1970-01-01 (100ns units since 1601)
+#define FILETIME_UNIX_EPOCH 0x019DB1DED53E8000
+
+// NVMe admin opcodes and Get/Set Features CDW10 bits
+#define NVME_ADMIN_SET_FEATURES 0x09
+#define NVME_ADMIN_GET_FEATURES 0x0A
+#define NVME_FEATURE_SAVE       0x80000000  // Set: SV
+
+// Status codes worth naming (generic and command specific)
+#define NVME_SC_INVALID_FIELD           0x002
+#define NVME_SC_FEATURE_NOT_SAVEABLE    0x10D
+#define NVME_SC_FEATURE_NOT_CHANGEABLE  0x10E
+
+// SCSI IOCTL definitions
+#define IOCTL_SCSI_BASE                 FILE_DEVICE_CONTROLLER
+#define IOCTL_SCSI_MINIPORT             CTL_CODE(IOCTL_SCSI_BASE, 0x0402, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+// Control code of the NvmeMini interface (the driver goes by the signature)
+#define NVME_MINI_CONTROL_CODE          0xE0002000
+
+// SRB_IO_CONTROL structure for SCSI miniport communication
+#pragma pack(push, 1)
+typedef struct _SRB_IO_CONTROL {
+    ULONG HeaderLength;
+    UCHAR Signature[8];
+    ULONG Timeout;
+    ULONG ControlCode;
+    ULONG ReturnCode;
+    ULONG Length;
+} SRB_IO_CONTROL, *PSRB_IO_CONTROL;
+#pragma pack(pop)
+
+// Follows SRB_IO_CONTROL, the feature data follows it (scsiext.h)
+typedef struct _NVME_PASS_THROUGH {
+    ULONG VendorSpecific[6];
+    ULONG Command[16];
+    ULONG Completion[4];
+    ULONG Direction;            // 0 no transfer, 1 h->d, 2 d->h
+    ULONG QueueId;              // 0 admin
+    ULONG DataBufferLen;
+    ULONG MetaDataLen;
+    ULONG ReturnBufferLen;
+} NVME_PASS_THROUGH, *PNVME_PASS_THROUGH;
+
+// MSVC 6.0 compatibility
+#if _MSC_VER <= 1200
+#define snprintf _snprintf
+#endif
+
+// Features "show" reads, in order
+static const UCHAR g_show_features[] = {
+    TUNE_FID_ARBITRATION,
+    TUNE_FID_POWER_MANAGEMENT,
+    TUNE_FID_TEMPERATURE,
+    TUNE_FID_ERROR_RECOVERY,
+    TUNE_FID_WRITE_CACHE,
+    TUNE_FID_NUMBER_OF_QUEUES,
+    TUNE_FID_COALESCING,
+    TUNE_FID_VECTOR_CONFIG,
+    TUNE_FID_WRITE_ATOMICITY,
+    TUNE_FID_ASYNC_EVENTS,
+    TUNE_FID_APST,
+    TUNE_FID_TIMESTAMP,
+    TUNE_FID_THERMAL_MANAGEMENT,
+    TUNE_FID_NONOP_POWER_STATE
+};
+
+/*
+ * Send one Get or Set Features through NvmeMini
+ * Returns 0 on success, 1 if the drive failed the command (*status holds the
+ * NVMe status, SCT in bits 10:8 and SC in 7:0), -1 if the driver refused it
+ */
+int nvme_feature(HANDLE hDevice, UCHAR opcode, ULONG cdw10, ULONG cdw11,
+                 UCHAR *data, ULONG data_length, ULONG *dw0, ULONG *status)
+{
+    UCHAR buffer[sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH) + TUNE_MAX_DATA];
+    PSRB_IO_CONTROL srb_control;
+    PNVME_PASS_THROUGH pass_through;
+    DWORD bytes_returned;
+    ULONG total_size;
+
+    *dw0 = 0;
+    *status = 0;
+    if (data_length > TUNE_MAX_DATA) {
+        return -1;
+    }
+    total_size = sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH) + data_length;
+
+    memset(buffer, 0, sizeof(buffer));
+
+    srb_control = (PSRB_IO_CONTROL)buffer;
+    srb_control->HeaderLength = sizeof(SRB_IO_CONTROL);
+    memcpy(srb_control->Signature, "NvmeMini", 8);
+    srb_control->Timeout = 30;
+    srb_control->ControlCode = NVME_MINI_CONTROL_CODE;
+    srb_control->Length = total_size - sizeof(SRB_IO_CONTROL);
+
+    pass_through = (PNVME_PASS_THROUGH)(buffer + sizeof(SRB_IO_CONTROL));
+    pass_through->Command[0] = opcode;
+    pass_through->Command[10] = cdw10;
+    pass_through->Command[11] = cdw11;
+    pass_through->QueueId = 0;
+    pass_through->DataBufferLen = data_length;
+    pass_through->ReturnBufferLen = total_size;
+    if (data_length == 0) {
+        pass_through->Direction = 0;
+    } else if (opcode == NVME_ADMIN_SET_FEATURES) {
+        pass_through->Direction = 1;
+        memcpy(buffer + sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH), data, data_length);
+    } else {
+        pass_through->Direction = 2;
+    }
+
+    if (!DeviceIoControl(hDevice, IOCTL_SCSI_MINIPORT, buffer, total_size, buffer, total_size,
+                         &bytes_returned, NULL)) {
+        return -1;
+    }
+
+    if (srb_control->ReturnCode != 0) {
+        // Completion DW3 bits 31:17 are the status field without the phase tag
+        *status = (pass_through->Completion[3] >> 17) & 0x7FF;
+        return (*status != 0) ? 1 : -1;
+    }
+
+    *dw0 = pass_through->Completion[0];
+    if (data_length != 0 && opcode == NVME_ADMIN_GET_FEATURES) {
+        memcpy(data, buffer + sizeof(SRB_IO_CONTROL) + sizeof(NVME_PASS_THROUGH), data_length);
+    }
+    return 0;
+}
+
+/*
+ * Print why a feature command failed
+ */
+void print_failure(const char *name, int result, ULONG status)
+{
+    if (result < 0) {
+        printf("  %-20s refused by the driver (error %lu)\n", name, GetLastError());
+    } else if (status == NVME_SC_INVALID_FIELD) {
+        printf("  %-20s not supported (invalid field)\n", name);
+    } else if (status == NVME_SC_FEATURE_NOT_SAVEABLE) {
+        printf("  %-20s can't be saved\n", name);
+    } else if (status == NVME_SC_FEATURE_NOT_CHANGEABLE) {
+        printf("  %-20s can't be changed\n", name);
+    } else {
+        printf("  %-20s failed, SCT %lu SC 0x%02lX\n", name, status >> 8, status & 0xFF);
+    }
+}
+
+/*
+ * Get Features CDW11: temperature threshold and interrupt vector configuration
+ * say which threshold / vector to read there, the others take nothing
+ */
+ULONG get_cdw11(UCHAR fid, ULONG cdw11)
+{
+    switch (fid) {
+        case TUNE_FID_TEMPERATURE:
+            return cdw11 & 0x3F0000;    // TMPSEL, THSEL
+        case TUNE_FID_VECTOR_CONFIG:
+            return cdw11 & 0xFFFF;      // IV
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Read a feature and print it
+ * Returns 0 on success, -1 on failure
+ */
+int show_feature(HANDLE hDevice, UCHAR fid, ULONG cdw11)
+{
+    UCHAR data[TUNE_MAX_DATA];
+    char text[128];
+    const char *name = tune_feature_name(fid);
+    ULONG dw0;
+    ULONG status;
+    int result;
+
+    memset(data, 0, sizeof(data));
+    result = nvme_feature(hDevice, NVME_ADMIN_GET_FEATURES, fid, get_cdw11(fid, cdw11),
+                          data, tune_feature_data_length(fid), &dw0, &status);
+    if (result != 0) {
+        print_failure(name, result, status);
+        return -1;
+    }
+
+    if (fid == TUNE_FID_TIMESTAMP) {
+        // Bytes 5:0 milliseconds since 1970, byte 6 bit 0 set if it was ever stopped
+        ULONG low = data[0] | ((ULONG)data[1] << 8) | ((ULONG)data[2] << 16) | ((ULONG)data[3] << 24);
+        ULONG high = data[4] | ((ULONG)data[5] << 8);
+        snprintf(text, sizeof(text), "0x%04lX%08lX ms%s", high, low, (data[6] & 1) ? " (stopped since set)" : "");
+    } else {
+        tune_describe(fid, dw0, text, sizeof(text));
+    }
+    printf("  %-20s %s\n", name, text);
+    return 0;
+}
+
+/*
+ * Current time as an NVMe timestamp (milliseconds since 1970)
+ */
+void fill_timestamp(UCHAR *data)
+{
+    FILETIME now;
+    ULARGE_INTEGER ticks;
+    ULONG i;
+
+    GetSystemTimeAsFileTime(&now);
+    ticks.LowPart = now.dwLowDateTime;
+    ticks.HighPart = now.dwHighDateTime;
+    ticks.QuadPart = (ticks.QuadPart - FILETIME_UNIX_EPOCH) / 10000;
+
+    memset(data, 0, 8);
+    for (i = 0; i < 6; i++) {
+        data[i] = (UCHAR)(ticks.QuadPart >> (i * 8));
+    }
+}
+
+/*
+ * Read every feature the driver passes through
+ */
+void show_features(HANDLE hDevice)
+{
+    ULONG i;
+
+    printf("Current feature values:\n");
+    for (i = 0; i < sizeof(g_show_features); i++) {
+        show_feature(hDevice, g_show_features[i], 0);
+    }
+}
+
+/*
+ * Check a profile, then set each feature in it and read it back
+ * Returns 0 if every feature was set, 1 otherwise
+ */
+int apply_profile(HANDLE hDevice, const char *path, BOOL dry_run)
+{
+    static tune_setting settings[MAX_SETTINGS];
+    UCHAR data[TUNE_MAX_DATA];
+    char line[512];
+    char error[128];
+    const char *name;
+    FILE *file;
+    ULONG count = 0;
+    ULONG i;
+    ULONG cdw11;
+    ULONG dw0;
+    ULONG status;
+    int line_number = 0;
+    int errors = 0;
+    int failed = 0;
+    int result;
+
+    file = fopen(path, "r");
+    if (!file) {
+        printf("Error: can't open profile %s\n", path);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        result = tune_parse_line(line, &settings[count], error, sizeof(error));
+        if (result < 0) {
+            printf("%s:%d: %s\n", path, line_number, error);
+            errors++;
+        } else if (result > 0) {
+            if (count == MAX_SETTINGS) {
+                printf("%s:%d: more than %d settings\n", path, line_number, MAX_SETTINGS);
+                errors++;
+                break;
+            }
+            settings[count].line = line_number;
+            count++;
+        }
+    }
+    fclose(file);
+
+    if (errors) {
+        printf("Profile not applied.\n");
+        return 1;
+    }
+
+    printf("Applying %lu settings from %s%s\n", count, path, dry_run ? " (dry run)" : "");
+    for (i = 0; i < count; i++) {
+        name = tune_feature_name(settings[i].fid);
+        cdw11 = settings[i].cdw11;
+
+        // Keep the current value of the fields the line didn't give
+        if (settings[i].mask != 0xFFFFFFFFUL) {
+            result = nvme_feature(hDevice, NVME_ADMIN_GET_FEATURES, settings[i].fid,
+                                  get_cdw11(settings[i].fid, cdw11), NULL, 0, &dw0, &status);
+            if (result != 0) {
+                print_failure(name, result, status);
+                failed++;
+                continue;
+            }
+            cdw11 = (dw0 & ~settings[i].mask) | (cdw11 & settings[i].mask);
+        }
+
+        if (dry_run) {
+            printf("  line %d: Set Features FID 0x%02X CDW11 0x%08lX%s\n", settings[i].line,
+                   settings[i].fid, cdw11, settings[i].save ? " (save)" : "");
+            continue;
+        }
+
+        memset(data, 0, sizeof(data));
+        if (settings[i].timestamp) {
+            fill_timestamp(data);
+        }
+        result = nvme_feature(hDevice, NVME_ADMIN_SET_FEATURES,
+                              settings[i].fid | (settings[i].save ? NVME_FEATURE_SAVE : 0), cdw11,
+                              data, settings[i].data_length, &dw0, &status);
+        if (result != 0) {
+            print_failure(name, result, status);
+            failed++;
+            continue;
+        }
+        if (show_feature(hDevice, settings[i].fid, cdw11) != 0) {
+            failed++;
+        }
+    }
+
+    if (failed) {
+        printf("%d of %lu settings failed.\n", failed, count);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char device_path[64];
+    HANDLE hDevice;
+    BOOL dry_run = FALSE;
+    int drive;
+    int result;
+
+    printf("NVMe Feature Tuning Utility for Windows 2000\n");
+    printf("============================================\n\n");
+
+    if (argc >= 2 && (strcmp(argv[1], "-n") == 0 || strcmp(argv[1], "/n") == 0)) {
+        dry_run = TRUE;
+        argc--;
+        argv++;
+    }
+
+    if (argc < 3 || (strcmp(argv[2], "show") != 0 && strcmp(argv[2], "apply") != 0) ||
+        (strcmp(argv[2], "apply") == 0 && argc < 4)) {
+        printf("Usage: %s [-n] <disk_number> show\n", argv[0]);
+        printf("       %s [-n] <disk_number> apply <profile>\n", argv[0]);
+        printf("  -n  check the profile and print the commands without sending them\n");
+        printf("Profile lines (fields left out keep their current value, 'save' makes it persistent):\n");
+        printf("  arbitration burst=<1..64|unlimited> low=<1..256> medium=<1..256> high=<1..256>\n");
+        printf("  coalescing time=<100us units> threshold=<completions>\n");
+        printf("  vector-config vector=<n> coalescing=on|off\n");
+        printf("  write-cache on|off\n");
+        printf("  power state=<n> workload=<n>\n");
+        printf("  temperature kelvin=<k>|celsius=<c> sensor=<0..8> [under]\n");
+        printf("  error-recovery timeout=<100ms units> [dulbe]\n");
+        printf("  write-atomicity on|off      nonop-power on|off\n");
+        printf("  thermal-management tmt1=<k> tmt2=<k>\n");
+        printf("  apst off                    timestamp now\n");
+        printf("  feature <fid> <cdw11>\n");
+        return 1;
+    }
+
+    drive = atoi(argv[1]);
+    snprintf(device_path, sizeof(device_path), "\\\\.\\PhysicalDrive%d", drive);
+
+    hDevice = CreateFile(
+        device_path,
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL
+    );
+
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        printf("Error: Failed to open %s. Error code: %lu\n", device_path, GetLastError());
+        return 1;
+    }
+
+    if (strcmp(argv[2], "show") == 0) {
+        // Optional features the drive lacks are listed as not supported, that's no error
+        show_features(hDevice);
+        result = 0;
+    } else {
+        result = apply_profile(hDevice, argv[3], dry_run);
+        if (result == 0 && !dry_run) {
+            printf("\n");
+            show_features(hDevice);
+        }
+    }
+
+    CloseHandle(hDevice);
+    return (result == 0) ? 0 : 1;
+}
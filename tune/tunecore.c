@@ -0,0 +1,483 @@
+/*
+ * tunecore.c - Tuning profile parsing for the tune utility
+ *
+ * A profile line is a feature keyword followed by its fields, e.g.
+ *
+ *   coalescing time=2 threshold=8     # 200us or 8 completions
+ *   write-cache off save
+ *
+ * and becomes the CDW11 of one Set Features command. The field layouts are the
+ * NVMe ones, so a line maps to exactly one command and nothing else is touched.
+ * Fields a line leaves out are in the mask as not given, the utility keeps the
+ * drive's current value for them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#include "tunecore.h"
+
+#define TUNE_MAX_TOKENS 8
+#define TUNE_MAX_LINE   256
+
+/* Longest message: the strings in it all come from one profile line */
+#define TUNE_MAX_MESSAGE    (TUNE_MAX_LINE * 2 + 64)
+
+typedef struct _tune_feature {
+    unsigned char fid;
+    const char *name;
+    unsigned long data_length;
+} tune_feature;
+
+static const tune_feature tune_features[] = {
+    { TUNE_FID_ARBITRATION,        "arbitration",        0 },
+    { TUNE_FID_POWER_MANAGEMENT,   "power",              0 },
+    { TUNE_FID_TEMPERATURE,        "temperature",        0 },
+    { TUNE_FID_ERROR_RECOVERY,     "error-recovery",     0 },
+    { TUNE_FID_WRITE_CACHE,        "write-cache",        0 },
+    { TUNE_FID_NUMBER_OF_QUEUES,   "queues",             0 },
+    { TUNE_FID_COALESCING,         "coalescing",         0 },
+    { TUNE_FID_VECTOR_CONFIG,      "vector-config",      0 },
+    { TUNE_FID_WRITE_ATOMICITY,    "write-atomicity",    0 },
+    { TUNE_FID_ASYNC_EVENTS,       "async-events",       0 },
+    { TUNE_FID_APST,               "apst",               TUNE_MAX_DATA },
+    { TUNE_FID_TIMESTAMP,          "timestamp",          8 },
+    { TUNE_FID_THERMAL_MANAGEMENT, "thermal-management", 0 },
+    { TUNE_FID_NONOP_POWER_STATE,  "nonop-power",        0 }
+};
+
+#define TUNE_FEATURE_COUNT (sizeof(tune_features) / sizeof(tune_features[0]))
+
+const char *tune_feature_name(unsigned char fid)
+{
+    unsigned int i;
+
+    for (i = 0; i < TUNE_FEATURE_COUNT; i++) {
+        if (tune_features[i].fid == fid) {
+            return tune_features[i].name;
+        }
+    }
+    return NULL;
+}
+
+unsigned long tune_feature_data_length(unsigned char fid)
+{
+    unsigned int i;
+
+    for (i = 0; i < TUNE_FEATURE_COUNT; i++) {
+        if (tune_features[i].fid == fid) {
+            return tune_features[i].data_length;
+        }
+    }
+    return 0;
+}
+
+/*
+ * sprintf cut to size, C89 has no snprintf. The message goes to a buffer sized
+ * for the longest one first.
+ */
+static void tune_format(char *out, size_t size, const char *format, ...)
+{
+    char text[TUNE_MAX_MESSAGE];
+    va_list args;
+
+    if (size == 0) {
+        return;
+    }
+    va_start(args, format);
+    vsprintf(text, format, args);
+    va_end(args);
+    strncpy(out, text, size - 1);
+    out[size - 1] = '\0';
+}
+
+/*
+ * Whole-token number, decimal or 0x hex. Returns 0 on success.
+ */
+static int tune_number(const char *text, unsigned long max, unsigned long *value)
+{
+    char *end;
+
+    if (*text == '\0' || *text == '-') {
+        return -1;
+    }
+    *value = strtoul(text, &end, 0);
+    if (*end != '\0' || *value > max) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * on/off token. Returns 1, 0, or -1 if it is neither.
+ */
+static int tune_switch(const char *text)
+{
+    if (strcmp(text, "on") == 0) {
+        return 1;
+    }
+    if (strcmp(text, "off") == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Split "key=value"; value is NULL for a bare word
+ */
+static void tune_split(char *token, char **key, char **value)
+{
+    char *equals = strchr(token, '=');
+
+    *key = token;
+    *value = NULL;
+    if (equals) {
+        *equals = '\0';
+        *value = equals + 1;
+    }
+}
+
+/*
+ * Set one CDW11 field and remember it was given, so the rest can be kept
+ */
+static void tune_field(tune_setting *setting, unsigned long mask, unsigned int shift, unsigned long value)
+{
+    setting->cdw11 = (setting->cdw11 & ~(mask << shift)) | (value << shift);
+    setting->mask |= mask << shift;
+}
+
+/*
+ * log2 of a power of two, -1 otherwise
+ */
+static int tune_log2(unsigned long value)
+{
+    int shift = 0;
+
+    if (value == 0 || (value & (value - 1)) != 0) {
+        return -1;
+    }
+    while (value > 1) {
+        value >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+int tune_parse_line(const char *line, tune_setting *setting, char *error, size_t error_size)
+{
+    char buffer[TUNE_MAX_LINE];
+    char *tokens[TUNE_MAX_TOKENS];
+    int count = 0;
+    char *p;
+    char *key;
+    char *value;
+    unsigned long number;
+    unsigned long weight;
+    unsigned int i;
+    int t;
+    int on;
+
+    if (strlen(line) >= sizeof(buffer)) {
+        tune_format(error, error_size, "line too long");
+        return -1;
+    }
+    strcpy(buffer, line);
+
+    /* Comments run to the end of the line */
+    p = strchr(buffer, '#');
+    if (p) {
+        *p = '\0';
+    }
+
+    p = buffer;
+    for (;;) {
+        while (*p && isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (count == TUNE_MAX_TOKENS) {
+            tune_format(error, error_size, "too many fields");
+            return -1;
+        }
+        tokens[count++] = p;
+        while (*p && !isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p) {
+            *p++ = '\0';
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    memset(setting, 0, sizeof(*setting));
+
+    /* "save" may go anywhere after the keyword */
+    for (t = 1; t < count; t++) {
+        if (strcmp(tokens[t], "save") == 0) {
+            setting->save = 1;
+            tokens[t] = tokens[--count];
+            t--;
+        }
+    }
+
+    if (strcmp(tokens[0], "feature") == 0) {
+        /* Raw: feature <fid> <cdw11>, for features without a data buffer */
+        if (count != 3 || tune_number(tokens[1], 0xFF, &number) != 0) {
+            tune_format(error, error_size, "usage: feature <fid> <cdw11> [save]");
+            return -1;
+        }
+        setting->fid = (unsigned char)number;
+        if (!tune_feature_name(setting->fid) || tune_feature_data_length(setting->fid) != 0 ||
+            setting->fid == TUNE_FID_NUMBER_OF_QUEUES || setting->fid == TUNE_FID_ASYNC_EVENTS) {
+            tune_format(error, error_size, "feature 0x%02X can't be set raw", setting->fid);
+            return -1;
+        }
+        if (tune_number(tokens[2], 0xFFFFFFFFUL, &setting->cdw11) != 0) {
+            tune_format(error, error_size, "bad value '%s'", tokens[2]);
+            return -1;
+        }
+        setting->mask = 0xFFFFFFFFUL;
+        return 1;
+    }
+
+    for (i = 0; i < TUNE_FEATURE_COUNT; i++) {
+        if (strcmp(tokens[0], tune_features[i].name) == 0) {
+            break;
+        }
+    }
+    if (i == TUNE_FEATURE_COUNT) {
+        tune_format(error, error_size, "unknown feature '%s'", tokens[0]);
+        return -1;
+    }
+    setting->fid = tune_features[i].fid;
+    setting->data_length = tune_features[i].data_length;
+
+    switch (setting->fid) {
+        case TUNE_FID_WRITE_CACHE:
+        case TUNE_FID_NONOP_POWER_STATE:
+            /* Bit 0: WCE / NOPPME */
+            if (count != 2 || (on = tune_switch(tokens[1])) < 0) {
+                tune_format(error, error_size, "usage: %s on|off [save]", tokens[0]);
+                return -1;
+            }
+            setting->cdw11 = (unsigned long)on;
+            setting->mask = 0xFFFFFFFFUL;
+            return 1;
+
+        case TUNE_FID_WRITE_ATOMICITY:
+            /* Bit 0: DN, off means the host doesn't rely on AWUN/NAWUN */
+            if (count != 2 || (on = tune_switch(tokens[1])) < 0) {
+                tune_format(error, error_size, "usage: write-atomicity on|off [save]");
+                return -1;
+            }
+            setting->cdw11 = on ? 0 : 1;
+            setting->mask = 0xFFFFFFFFUL;
+            return 1;
+
+        case TUNE_FID_APST:
+            /* Bit 0: APSTE. The transition table needs the drive's power states, so only off */
+            if (count != 2 || strcmp(tokens[1], "off") != 0) {
+                tune_format(error, error_size, "usage: apst off [save]");
+                return -1;
+            }
+            setting->cdw11 = 0;
+            setting->mask = 0xFFFFFFFFUL;
+            return 1;
+
+        case TUNE_FID_TIMESTAMP:
+            if (count != 2 || strcmp(tokens[1], "now") != 0) {
+                tune_format(error, error_size, "usage: timestamp now");
+                return -1;
+            }
+            setting->timestamp = 1;
+            setting->mask = 0xFFFFFFFFUL;
+            return 1;
+
+        case TUNE_FID_NUMBER_OF_QUEUES:
+        case TUNE_FID_ASYNC_EVENTS:
+            tune_format(error, error_size, "%s is set by the driver", tokens[0]);
+            return -1;
+    }
+
+    /* The rest are key=value fields */
+    for (t = 1; t < count; t++) {
+        tune_split(tokens[t], &key, &value);
+
+        switch (setting->fid) {
+            case TUNE_FID_ARBITRATION:
+                /* AB 2:0 (log2 of the burst, 7 = no limit), LPW 15:8, MPW 23:16, HPW 31:24 */
+                if (strcmp(key, "burst") == 0 && value) {
+                    if (strcmp(value, "unlimited") == 0) {
+                        number = 7;
+                    } else if (tune_number(value, 64, &number) != 0 || tune_log2(number) < 0) {
+                        tune_format(error, error_size, "burst must be a power of 2 up to 64 or unlimited");
+                        return -1;
+                    } else {
+                        number = (unsigned long)tune_log2(number);
+                    }
+                    tune_field(setting, 0x7, 0, number);
+                    continue;
+                }
+                if (value && (strcmp(key, "low") == 0 || strcmp(key, "medium") == 0 ||
+                              strcmp(key, "high") == 0)) {
+                    if (tune_number(value, 256, &weight) != 0 || weight == 0) {
+                        tune_format(error, error_size, "%s weight must be 1 to 256", key);
+                        return -1;
+                    }
+                    number = (key[0] == 'l') ? 8 : (key[0] == 'm') ? 16 : 24;
+                    tune_field(setting, 0xFF, (unsigned int)number, weight - 1);
+                    continue;
+                }
+                break;
+
+            case TUNE_FID_POWER_MANAGEMENT:
+                /* PS 4:0, WH 7:5 */
+                if (strcmp(key, "state") == 0 && value && tune_number(value, 31, &number) == 0) {
+                    tune_field(setting, 0x1F, 0, number);
+                    continue;
+                }
+                if (strcmp(key, "workload") == 0 && value && tune_number(value, 7, &number) == 0) {
+                    tune_field(setting, 0x7, 5, number);
+                    continue;
+                }
+                break;
+
+            case TUNE_FID_TEMPERATURE:
+                /* TMPTH 15:0 (Kelvin), TMPSEL 19:16, THSEL 21:20 (0 over, 1 under) */
+                if (strcmp(key, "kelvin") == 0 && value && tune_number(value, 0xFFFF, &number) == 0) {
+                    tune_field(setting, 0xFFFF, 0, number);
+                    continue;
+                }
+                if (strcmp(key, "celsius") == 0 && value && tune_number(value, 0xFFFF - 273, &number) == 0) {
+                    tune_field(setting, 0xFFFF, 0, number + 273);
+                    continue;
+                }
+                if (strcmp(key, "sensor") == 0 && value && tune_number(value, 8, &number) == 0) {
+                    tune_field(setting, 0xF, 16, number);
+                    continue;
+                }
+                if (strcmp(key, "under") == 0 && !value) {
+                    tune_field(setting, 0x3, 20, 1);
+                    continue;
+                }
+                break;
+
+            case TUNE_FID_ERROR_RECOVERY:
+                /* TLER 15:0 (100ms units), DULBE bit 16 */
+                if (strcmp(key, "timeout") == 0 && value && tune_number(value, 0xFFFF, &number) == 0) {
+                    tune_field(setting, 0xFFFF, 0, number);
+                    continue;
+                }
+                if (strcmp(key, "dulbe") == 0 && !value) {
+                    tune_field(setting, 0x1, 16, 1);
+                    continue;
+                }
+                break;
+
+            case TUNE_FID_COALESCING:
+                /* THR 7:0 (completions, 0's based), TIME 15:8 (100us units) */
+                if (strcmp(key, "threshold") == 0 && value && tune_number(value, 256, &number) == 0 &&
+                    number != 0) {
+                    tune_field(setting, 0xFF, 0, number - 1);
+                    continue;
+                }
+                if (strcmp(key, "time") == 0 && value && tune_number(value, 255, &number) == 0) {
+                    tune_field(setting, 0xFF, 8, number);
+                    continue;
+                }
+                break;
+
+            case TUNE_FID_VECTOR_CONFIG:
+                /* IV 15:0, CD bit 16 (coalescing disable) */
+                if (strcmp(key, "vector") == 0 && value && tune_number(value, 0xFFFF, &number) == 0) {
+                    tune_field(setting, 0xFFFF, 0, number);
+                    continue;
+                }
+                if (strcmp(key, "coalescing") == 0 && value && (on = tune_switch(value)) >= 0) {
+                    tune_field(setting, 0x1, 16, on ? 0 : 1);
+                    continue;
+                }
+                break;
+
+            case TUNE_FID_THERMAL_MANAGEMENT:
+                /* TMT1 31:16, TMT2 15:0 (Kelvin, 0 = disabled) */
+                if (strcmp(key, "tmt1") == 0 && value && tune_number(value, 0xFFFF, &number) == 0) {
+                    tune_field(setting, 0xFFFF, 16, number);
+                    continue;
+                }
+                if (strcmp(key, "tmt2") == 0 && value && tune_number(value, 0xFFFF, &number) == 0) {
+                    tune_field(setting, 0xFFFF, 0, number);
+                    continue;
+                }
+                break;
+        }
+
+        if (value) {
+            tune_format(error, error_size, "bad field '%s=%s' for %s", key, value, tokens[0]);
+        } else {
+            tune_format(error, error_size, "bad field '%s' for %s", key, tokens[0]);
+        }
+        return -1;
+    }
+
+    if (count == 1) {
+        tune_format(error, error_size, "%s needs at least one field", tokens[0]);
+        return -1;
+    }
+    return 1;
+}
+
+void tune_describe(unsigned char fid, unsigned long dw0, char *text, size_t size)
+{
+    switch (fid) {
+        case TUNE_FID_ARBITRATION:
+            if ((dw0 & 7) == 7) {
+                tune_format(text, size, "burst=unlimited low=%lu medium=%lu high=%lu",
+                            ((dw0 >> 8) & 0xFF) + 1, ((dw0 >> 16) & 0xFF) + 1, ((dw0 >> 24) & 0xFF) + 1);
+            } else {
+                tune_format(text, size, "burst=%lu low=%lu medium=%lu high=%lu", 1UL << (dw0 & 7),
+                            ((dw0 >> 8) & 0xFF) + 1, ((dw0 >> 16) & 0xFF) + 1, ((dw0 >> 24) & 0xFF) + 1);
+            }
+            break;
+        case TUNE_FID_POWER_MANAGEMENT:
+            tune_format(text, size, "state=%lu workload=%lu", dw0 & 0x1F, (dw0 >> 5) & 7);
+            break;
+        case TUNE_FID_TEMPERATURE:
+            tune_format(text, size, "kelvin=%lu (%ld C) sensor=%lu%s", dw0 & 0xFFFF,
+                        (long)(dw0 & 0xFFFF) - 273, (dw0 >> 16) & 0xF, ((dw0 >> 20) & 3) ? " under" : "");
+            break;
+        case TUNE_FID_ERROR_RECOVERY:
+            tune_format(text, size, "timeout=%lu%s", dw0 & 0xFFFF, (dw0 & 0x10000UL) ? " dulbe" : "");
+            break;
+        case TUNE_FID_WRITE_CACHE:
+        case TUNE_FID_NONOP_POWER_STATE:
+        case TUNE_FID_APST:
+            tune_format(text, size, "%s", (dw0 & 1) ? "on" : "off");
+            break;
+        case TUNE_FID_WRITE_ATOMICITY:
+            tune_format(text, size, "%s", (dw0 & 1) ? "off" : "on");
+            break;
+        case TUNE_FID_NUMBER_OF_QUEUES:
+            tune_format(text, size, "submission=%lu completion=%lu", (dw0 & 0xFFFF) + 1, (dw0 >> 16) + 1);
+            break;
+        case TUNE_FID_COALESCING:
+            tune_format(text, size, "time=%lu threshold=%lu", (dw0 >> 8) & 0xFF, (dw0 & 0xFF) + 1);
+            break;
+        case TUNE_FID_VECTOR_CONFIG:
+            tune_format(text, size, "vector=%lu coalescing=%s", dw0 & 0xFFFF, (dw0 & 0x10000UL) ? "off" : "on");
+            break;
+        case TUNE_FID_THERMAL_MANAGEMENT:
+            tune_format(text, size, "tmt1=%lu tmt2=%lu", dw0 >> 16, dw0 & 0xFFFF);
+            break;
+        default:
+            tune_format(text, size, "0x%08lX", dw0);
+            break;
+    }
+}
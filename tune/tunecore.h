@@ -0,0 +1,57 @@
+/*
+ * tunecore.h - Tuning profile parsing for the tune utility
+ *
+ * No Windows headers here: profile lines come in as strings and go out as the
+ * feature ID and CDW11 of a Set Features command, so this part builds anywhere.
+ */
+
+#ifndef _TUNECORE_H_
+#define _TUNECORE_H_
+
+#include <stddef.h>
+
+/* Feature IDs the driver passes through (see NvmeMiniFeatureAllowed) */
+#define TUNE_FID_ARBITRATION        0x01
+#define TUNE_FID_POWER_MANAGEMENT   0x02
+#define TUNE_FID_TEMPERATURE        0x04
+#define TUNE_FID_ERROR_RECOVERY     0x05
+#define TUNE_FID_WRITE_CACHE        0x06
+#define TUNE_FID_NUMBER_OF_QUEUES   0x07
+#define TUNE_FID_COALESCING         0x08
+#define TUNE_FID_VECTOR_CONFIG      0x09
+#define TUNE_FID_WRITE_ATOMICITY    0x0A
+#define TUNE_FID_ASYNC_EVENTS       0x0B
+#define TUNE_FID_APST               0x0C
+#define TUNE_FID_TIMESTAMP          0x0E
+#define TUNE_FID_THERMAL_MANAGEMENT 0x10
+#define TUNE_FID_NONOP_POWER_STATE  0x11
+
+/* Largest feature data buffer (APST table) */
+#define TUNE_MAX_DATA       256
+
+typedef struct _tune_setting {
+    unsigned char fid;
+    unsigned long cdw11;
+    unsigned long mask;         /* CDW11 bits the line gave, the others keep their current value */
+    int save;                   /* SV: keep across power cycles */
+    int timestamp;              /* Timestamp: data is the current time */
+    unsigned long data_length;  /* Feature data sent with the Set (zeroed unless timestamp) */
+    int line;                   /* Profile line it came from */
+} tune_setting;
+
+/*
+ * Parse one profile line. Returns 1 and fills the setting, 0 for a blank or
+ * comment line, -1 with a message in error for anything else.
+ */
+int tune_parse_line(const char *line, tune_setting *setting, char *error, size_t error_size);
+
+/* Profile keyword of a feature, NULL if the driver doesn't pass it through */
+const char *tune_feature_name(unsigned char fid);
+
+/* Size of the feature's data buffer, 0 if the value is all in CDW11 / DW0 */
+unsigned long tune_feature_data_length(unsigned char fid);
+
+/* Readable description of a Get Features DW0 */
+void tune_describe(unsigned char fid, unsigned long dw0, char *text, size_t size);
+
+#endif /* _TUNECORE_H_ */
@@ -0,0 +1,244 @@
+/*
+ * tunetest.c - Tests for the tunecore.c profile parser
+ *
+ * Build and run: make test (host gcc/clang, no Windows headers needed)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tunecore.h"
+
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static tune_setting setting;
+static char error[128];
+
+static int parse(const char *line)
+{
+    memset(&setting, 0xCC, sizeof(setting));
+    error[0] = '\0';
+    return tune_parse_line(line, &setting, error, sizeof(error));
+}
+
+static void test_blank_and_comments(void)
+{
+    CHECK(parse("") == 0);
+    CHECK(parse("   \t ") == 0);
+    CHECK(parse("# write-cache off") == 0);
+    CHECK(parse("  # just a comment") == 0);
+}
+
+static void test_switches(void)
+{
+    CHECK(parse("write-cache on") == 1);
+    CHECK(setting.fid == TUNE_FID_WRITE_CACHE);
+    CHECK(setting.cdw11 == 1);
+    CHECK(setting.mask == 0xFFFFFFFFUL);
+    CHECK(setting.save == 0);
+    CHECK(setting.data_length == 0);
+
+    CHECK(parse("write-cache off save   # keep it") == 1);
+    CHECK(setting.cdw11 == 0);
+    CHECK(setting.save == 1);
+
+    CHECK(parse("nonop-power on") == 1);
+    CHECK(setting.fid == TUNE_FID_NONOP_POWER_STATE && setting.cdw11 == 1);
+
+    /* DN is the inverse of the keyword */
+    CHECK(parse("write-atomicity on") == 1);
+    CHECK(setting.fid == TUNE_FID_WRITE_ATOMICITY && setting.cdw11 == 0);
+    CHECK(parse("write-atomicity off") == 1);
+    CHECK(setting.cdw11 == 1);
+
+    CHECK(parse("write-cache maybe") == -1);
+    CHECK(strcmp(error, "usage: write-cache on|off [save]") == 0);
+    CHECK(parse("write-cache on off") == -1);
+
+    CHECK(parse("apst off") == 1);
+    CHECK(setting.fid == TUNE_FID_APST && setting.cdw11 == 0);
+    CHECK(setting.data_length == TUNE_MAX_DATA);
+    CHECK(parse("apst on") == -1);
+
+    CHECK(parse("timestamp now") == 1);
+    CHECK(setting.fid == TUNE_FID_TIMESTAMP && setting.timestamp == 1);
+    CHECK(setting.data_length == 8);
+    CHECK(parse("timestamp 0") == -1);
+}
+
+static void test_fields(void)
+{
+    /* THR is 0's based, TIME in 100us units */
+    CHECK(parse("coalescing time=2 threshold=8") == 1);
+    CHECK(setting.fid == TUNE_FID_COALESCING);
+    CHECK(setting.cdw11 == 0x0207);
+    CHECK(setting.mask == 0xFFFF);
+
+    /* Fields left out stay out of the mask, save may go anywhere */
+    CHECK(parse("coalescing save time=0x10") == 1);
+    CHECK(setting.cdw11 == 0x1000 && setting.mask == 0xFF00 && setting.save == 1);
+
+    CHECK(parse("coalescing threshold=0") == -1);
+    CHECK(parse("coalescing threshold=257") == -1);
+    CHECK(parse("coalescing time=256") == -1);
+
+    /* AB is log2 of the burst, weights are 0's based */
+    CHECK(parse("arbitration burst=8 high=4") == 1);
+    CHECK(setting.fid == TUNE_FID_ARBITRATION);
+    CHECK(setting.cdw11 == (3UL | (3UL << 24)));
+    CHECK(setting.mask == (0x7UL | (0xFFUL << 24)));
+
+    CHECK(parse("arbitration burst=unlimited low=256 medium=1") == 1);
+    CHECK(setting.cdw11 == (7UL | (0xFFUL << 8)));
+    CHECK(setting.mask == (0x7UL | (0xFFFFUL << 8)));
+
+    CHECK(parse("arbitration burst=3") == -1);
+    CHECK(strcmp(error, "burst must be a power of 2 up to 64 or unlimited") == 0);
+    CHECK(parse("arbitration burst=128") == -1);
+    CHECK(parse("arbitration low=0") == -1);
+    CHECK(strcmp(error, "low weight must be 1 to 256") == 0);
+
+    /* Celsius becomes Kelvin, "under" sets THSEL */
+    CHECK(parse("temperature celsius=70 sensor=1 under") == 1);
+    CHECK(setting.fid == TUNE_FID_TEMPERATURE);
+    CHECK(setting.cdw11 == (343UL | (1UL << 16) | (1UL << 20)));
+    CHECK(setting.mask == (0xFFFFUL | (0xFUL << 16) | (0x3UL << 20)));
+    CHECK(parse("temperature sensor=9") == -1);
+
+    CHECK(parse("power state=3 workload=2") == 1);
+    CHECK(setting.cdw11 == (3UL | (2UL << 5)) && setting.mask == 0xFF);
+    CHECK(parse("power state=32") == -1);
+
+    CHECK(parse("error-recovery timeout=50 dulbe") == 1);
+    CHECK(setting.cdw11 == (50UL | 0x10000UL) && setting.mask == 0x1FFFF);
+
+    CHECK(parse("vector-config vector=1 coalescing=off") == 1);
+    CHECK(setting.cdw11 == (1UL | 0x10000UL) && setting.mask == 0x1FFFF);
+
+    CHECK(parse("thermal-management tmt1=353 tmt2=363") == 1);
+    CHECK(setting.cdw11 == ((353UL << 16) | 363UL) && setting.mask == 0xFFFFFFFFUL);
+
+    /* Numbers are whole tokens, no signs */
+    CHECK(parse("coalescing time=2x") == -1);
+    CHECK(parse("coalescing time=-1") == -1);
+    CHECK(parse("coalescing time=") == -1);
+}
+
+static void test_raw(void)
+{
+    CHECK(parse("feature 0x08 0x0207 save") == 1);
+    CHECK(setting.fid == TUNE_FID_COALESCING);
+    CHECK(setting.cdw11 == 0x0207 && setting.mask == 0xFFFFFFFFUL && setting.save == 1);
+
+    CHECK(parse("feature 8") == -1);
+    CHECK(strcmp(error, "usage: feature <fid> <cdw11> [save]") == 0);
+
+    /* Features with a data buffer, set by the driver or not passed through */
+    CHECK(parse("feature 0x0C 0") == -1);
+    CHECK(strcmp(error, "feature 0x0C can't be set raw") == 0);
+    CHECK(parse("feature 0x07 0") == -1);
+    CHECK(parse("feature 0x0B 0") == -1);
+    CHECK(parse("feature 0x0D 0") == -1);
+    CHECK(parse("feature 0x08 0x100000000") == -1);
+}
+
+static void test_errors(void)
+{
+    char line[400];
+    char small[8];
+
+    CHECK(parse("turbo on") == -1);
+    CHECK(strcmp(error, "unknown feature 'turbo'") == 0);
+
+    CHECK(parse("queues submission=4") == -1);
+    CHECK(strcmp(error, "queues is set by the driver") == 0);
+    CHECK(parse("async-events 0") == -1);
+
+    CHECK(parse("coalescing") == -1);
+    CHECK(strcmp(error, "coalescing needs at least one field") == 0);
+
+    CHECK(parse("coalescing speed=3") == -1);
+    CHECK(strcmp(error, "bad field 'speed=3' for coalescing") == 0);
+    CHECK(parse("coalescing fast") == -1);
+    CHECK(strcmp(error, "bad field 'fast' for coalescing") == 0);
+
+    CHECK(parse("arbitration a=1 b=2 c=3 d=4 e=5 f=6 g=7 h=8") == -1);
+    CHECK(strcmp(error, "too many fields") == 0);
+
+    memset(line, 'a', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    CHECK(parse(line) == -1);
+    CHECK(strcmp(error, "line too long") == 0);
+
+    /* The longest message a line can make fits, cut to the caller's buffer */
+    memset(line, 0, sizeof(line));
+    strcpy(line, "coalescing ");
+    memset(line + strlen(line), 'k', 120);
+    strcat(line, "=");
+    memset(line + strlen(line), 'v', 120);
+    CHECK(parse(line) == -1);
+    CHECK(strlen(error) == sizeof(error) - 1);
+    CHECK(strncmp(error, "bad field 'kkk", 14) == 0);
+
+    CHECK(tune_parse_line("turbo on", &setting, small, sizeof(small)) == -1);
+    CHECK(strcmp(small, "unknown") == 0);
+}
+
+static void test_describe(void)
+{
+    char text[80];
+
+    tune_describe(TUNE_FID_COALESCING, 0x0207, text, sizeof(text));
+    CHECK(strcmp(text, "time=2 threshold=8") == 0);
+
+    tune_describe(TUNE_FID_ARBITRATION, 3UL | (3UL << 24), text, sizeof(text));
+    CHECK(strcmp(text, "burst=8 low=1 medium=1 high=4") == 0);
+    tune_describe(TUNE_FID_ARBITRATION, 7, text, sizeof(text));
+    CHECK(strcmp(text, "burst=unlimited low=1 medium=1 high=1") == 0);
+
+    tune_describe(TUNE_FID_TEMPERATURE, 343UL | (1UL << 16) | (1UL << 20), text, sizeof(text));
+    CHECK(strcmp(text, "kelvin=343 (70 C) sensor=1 under") == 0);
+
+    tune_describe(TUNE_FID_WRITE_ATOMICITY, 1, text, sizeof(text));
+    CHECK(strcmp(text, "off") == 0);
+
+    tune_describe(TUNE_FID_NUMBER_OF_QUEUES, 0x000F000FUL, text, sizeof(text));
+    CHECK(strcmp(text, "submission=16 completion=16") == 0);
+
+    tune_describe(0x80, 0xDEADBEEFUL, text, sizeof(text));
+    CHECK(strcmp(text, "0xDEADBEEF") == 0);
+
+    tune_describe(TUNE_FID_COALESCING, 0x0207, text, 5);
+    CHECK(strcmp(text, "time") == 0);
+
+    CHECK(strcmp(tune_feature_name(TUNE_FID_COALESCING), "coalescing") == 0);
+    CHECK(tune_feature_name(0x0D) == NULL);
+    CHECK(tune_feature_data_length(TUNE_FID_APST) == TUNE_MAX_DATA);
+    CHECK(tune_feature_data_length(TUNE_FID_TIMESTAMP) == 8);
+    CHECK(tune_feature_data_length(TUNE_FID_WRITE_CACHE) == 0);
+}
+
+int main(void)
+{
+    test_blank_and_comments();
+    test_switches();
+    test_fields();
+    test_raw();
+    test_errors();
+    test_describe();
+
+    if (failures != 0) {
+        printf("tunetest: %d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("tunetest: all checks passed\n");
+    return 0;
+}
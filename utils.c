@@ -322,7 +322,8 @@ BOOLEAN NvmeLogPageToScsiLogPage(
 }
 
 //
-// ScsiParseSatCommand - Parse SAT ATA PASS-THROUGH command and validate it's a SMART read
+// ScsiParseSatCommand - Parse SAT ATA PASS-THROUGH command and validate it's a SMART read,
+// IDENTIFY DEVICE or DATA SET MANAGEMENT (TRIM)
 // Returns TRUE if it's a valid SMART READ command (READ DATA or IDENTIFY)
 //
 BOOLEAN ScsiParseSatCommand(
@@ -361,7 +362,23 @@ BOOLEAN ScsiParseSatCommand(
         return FALSE;
     }
 
-    // We only support PIO/UDMA Data-In protocol (read operations)
+    // DATA SET MANAGEMENT with the TRIM bit is the only data-out command (a DMA one)
+    if (command == ATA_DATA_SET_MANAGEMENT) {
+        if (!(features & ATA_DSM_TRIM) ||
+            (protocol != SAT_PROTOCOL_DMA && protocol != SAT_PROTOCOL_UDMA_DATA_OUT)) {
+#ifdef NVME2K_DBG
+            ScsiDebugPrint(0, "nvme2k: parse sat command DSM features %02X protocol %02X unsupported\n", features, protocol);
+#endif
+            return FALSE;
+        }
+        *AtaCommand = command;
+        *AtaFeatures = features;
+        *AtaCylLow = lbaMid;
+        *AtaCylHigh = lbaHigh;
+        return TRUE;
+    }
+
+    // Otherwise we only support PIO/UDMA Data-In protocol (read operations)
     if (protocol != SAT_PROTOCOL_PIO_DATA_IN && protocol != SAT_PROTOCOL_UDMA_DATA_IN && protocol != SAT_PROTOCOL_DEVICE_DIAGNOSTIC) {
 #ifdef NVME2K_DBG
         ScsiDebugPrint(0, "nvme2k: parse sat command unsupported protocol %02X\n", protocol);
@@ -408,12 +425,79 @@ BOOLEAN ScsiParseSatCommand(
     return FALSE;
 }
 
+//
+// ScsiParseReadWriteCdb - Get the LBA, block count and FUA bit of a READ/WRITE(6/10/16)
+// Returns TRUE for writes
+//
+BOOLEAN ScsiParseReadWriteCdb(
+    IN PSCSI_REQUEST_BLOCK Srb,
+    OUT PULONGLONG Lba,
+    OUT PULONG NumBlocks,
+    OUT PBOOLEAN Fua)
+{
+    PCDB cdb = (PCDB)Srb->Cdb;
+    BOOLEAN isWrite = FALSE;
+
+    *Lba = 0;
+    *NumBlocks = 0;
+    *Fua = FALSE;
+
+    switch (cdb->CDB10.OperationCode) {
+        case SCSIOP_READ6:
+        case SCSIOP_WRITE6:
+            *Lba = ((ULONG)(cdb->CDB6READWRITE.LogicalBlockMsb1) << 16) |
+                   ((ULONG)(cdb->CDB6READWRITE.LogicalBlockMsb0) << 8) |
+                   ((ULONG)(cdb->CDB6READWRITE.LogicalBlockLsb));
+            *NumBlocks = cdb->CDB6READWRITE.TransferBlocks;
+            if (*NumBlocks == 0) {
+                *NumBlocks = 256;  // 0 means 256 blocks in READ(6)/WRITE(6)
+            }
+            isWrite = (cdb->CDB6READWRITE.OperationCode == SCSIOP_WRITE6);
+            break;
+
+        case SCSIOP_READ:
+        case SCSIOP_WRITE:
+            *Lba = ((ULONG)cdb->CDB10.LogicalBlockByte0 << 24) |
+                   ((ULONG)cdb->CDB10.LogicalBlockByte1 << 16) |
+                   ((ULONG)cdb->CDB10.LogicalBlockByte2 << 8) |
+                   ((ULONG)cdb->CDB10.LogicalBlockByte3);
+            *NumBlocks = ((ULONG)cdb->CDB10.TransferBlocksMsb << 8) |
+                         ((ULONG)cdb->CDB10.TransferBlocksLsb);
+            isWrite = (cdb->CDB10.OperationCode == SCSIOP_WRITE);
+            *Fua = (Srb->Cdb[1] & SCSI_CDB_FUA) ? TRUE : FALSE;
+            break;
+
+        case SCSIOP_READ16:
+        case SCSIOP_WRITE16:
+            // READ(16)/WRITE(16) - Bytes 2-9: LBA (64-bit big-endian)
+            *Lba = ((ULONGLONG)Srb->Cdb[2] << 56) |
+                   ((ULONGLONG)Srb->Cdb[3] << 48) |
+                   ((ULONGLONG)Srb->Cdb[4] << 40) |
+                   ((ULONGLONG)Srb->Cdb[5] << 32) |
+                   ((ULONGLONG)Srb->Cdb[6] << 24) |
+                   ((ULONGLONG)Srb->Cdb[7] << 16) |
+                   ((ULONGLONG)Srb->Cdb[8] << 8) |
+                   ((ULONGLONG)Srb->Cdb[9]);
+            // Bytes 10-13: Transfer Length (32-bit big-endian)
+            *NumBlocks = ((ULONG)Srb->Cdb[10] << 24) |
+                         ((ULONG)Srb->Cdb[11] << 16) |
+                         ((ULONG)Srb->Cdb[12] << 8) |
+                         ((ULONG)Srb->Cdb[13]);
+            isWrite = (Srb->Cdb[0] == SCSIOP_WRITE16);
+            *Fua = (Srb->Cdb[1] & SCSI_CDB_FUA) ? TRUE : FALSE;
+            break;
+    }
+
+    return isWrite;
+}
+
 //
 // NvmeToAtaIdentify - Build ATA IDENTIFY DEVICE structure from NVMe controller/namespace info
 // Emulates an LBA-capable IDE hard drive
 //
 VOID NvmeToAtaIdentify(
     IN PHW_DEVICE_EXTENSION DevExt,
+    IN PNVME_NAMESPACE Namespace,
     OUT PATA_IDENTIFY_DEVICE_STRUCT AtaIdentify)
 {
     ULONG i;
@@ -428,7 +512,7 @@ VOID NvmeToAtaIdentify(
     WRITE_USHORT(AtaIdentify->GeneralConfiguration, 0x0040);
 
     // Get total sectors from namespace
-    totalSectors = DevExt->NamespaceSizeInBlocks;
+    totalSectors = Namespace->SizeInBlocks;
 
     // Calculate CHS geometry (emulate old IDE drives)
     // Use standard translation: 16 heads, 63 sectors per track
@@ -550,8 +634,25 @@ VOID NvmeToAtaIdentify(
     WRITE_USHORT(AtaIdentify->MinPioCycleTime, 240);
     WRITE_USHORT(AtaIdentify->MinPioCycleTimeIordy, 120);
 
-    // Word 75: Queue depth
-    WRITE_USHORT(AtaIdentify->QueueDepth, 0x0000);
+    // Word 69: Additional supported - DRAT if DLFEAT says what deallocated blocks
+    // read back as, RZAT if that is zeroes
+    if ((DevExt->OptionalNvmCommands & NVME_ONCS_DSM) && Namespace->DeallocDeterministic) {
+        WRITE_USHORT(AtaIdentify->AdditionalSupported,
+                     ATA_ID69_DRAT | (Namespace->DeallocReadsZero ? ATA_ID69_RZAT : 0));
+    }
+
+    // Word 75: Queue depth (0's based), what the I/O queue can take up to the ATA maximum of 32
+    {
+        ULONG depth = DevExt->IoQueue.QueueSize - 1;
+
+        if (depth > NVME_MAX_IO_COMMANDS) {
+            depth = NVME_MAX_IO_COMMANDS;
+        }
+        if (depth > 32) {
+            depth = 32;
+        }
+        WRITE_USHORT(AtaIdentify->QueueDepth, (USHORT)((depth != 0) ? depth - 1 : 0));
+    }
 
     // Word 80: Major version (ATA/ATAPI-7)
     WRITE_USHORT(AtaIdentify->MajorVersion, 0x007E);
@@ -598,6 +699,11 @@ VOID NvmeToAtaIdentify(
     WRITE_USHORT(AtaIdentify->TotalAddressableSectors48 + 4, (USHORT)((totalSectors >> 32) & 0xFFFF));
     WRITE_USHORT(AtaIdentify->TotalAddressableSectors48 + 6, (USHORT)((totalSectors >> 48) & 0xFFFF));
 
+    // Word 105: Payload blocks one DATA SET MANAGEMENT may carry
+    if (DevExt->OptionalNvmCommands & NVME_ONCS_DSM) {
+        WRITE_USHORT(AtaIdentify->MaxDsmBlocks, ATA_DSM_MAX_BLOCKS);
+    }
+
     // Word 108-111: World Wide Name (WWN) - 64-bit identifier
     // Set to "NVME2K\0\0" with word byte-swapping for ATA format
     // In ATA, strings are stored with bytes swapped within each word
@@ -621,10 +727,91 @@ VOID NvmeToAtaIdentify(
     // Word 128: Security status
     WRITE_USHORT(AtaIdentify->SecurityStatus, 0x0000);
 
+    // Word 169: DATA SET MANAGEMENT TRIM, sent to the drive as a Dataset Management deallocate
+    if (DevExt->OptionalNvmCommands & NVME_ONCS_DSM) {
+        WRITE_USHORT(AtaIdentify->DataSetManagement, ATA_ID169_TRIM);
+    }
+
     // Word 217: Nominal Media Rotation Rate (1 = SSD)
     WRITE_USHORT(AtaIdentify->NominalMediaRotationRate, 0x0001);
 }
 
+//
+// NvmeLbaFormatUsable - Can FORMAT_BEST_LBAF switch a namespace to this LBA format
+// No metadata (the SCSI path has no metadata buffer) and 512 bytes to one page per LBA
+//
+BOOLEAN NvmeLbaFormatUsable(IN PNVME_LBA_FORMAT LbaFormat)
+{
+    return (LbaFormat->MetadataSize == 0 &&
+            LbaFormat->LbaDataSize >= 9 &&
+            LbaFormat->LbaDataSize <= NVME_PAGE_SHIFT) ? TRUE : FALSE;
+}
+
+//
+// NvmeBestLbaFormat - Usable LBA format with the best Relative Performance
+// The current format wins ties, so a namespace is never reformatted for nothing.
+// Returns NVME2KDB_LBAF_NONE if no format is usable.
+//
+UCHAR NvmeBestLbaFormat(IN PNVME_NAMESPACE Namespace)
+{
+    UCHAR current = Namespace->FormattedLbaSize & NVME_FLBAS_FORMAT_MASK;
+    UCHAR best = NVME2KDB_LBAF_NONE;
+    UCHAR i;
+
+    if (current < Namespace->NumberOfLbaFormats && NvmeLbaFormatUsable(&Namespace->LbaFormats[current])) {
+        best = current;
+    }
+
+    for (i = 0; i < Namespace->NumberOfLbaFormats; i++) {
+        if (!NvmeLbaFormatUsable(&Namespace->LbaFormats[i])) {
+            continue;
+        }
+        if (best == NVME2KDB_LBAF_NONE ||
+            (Namespace->LbaFormats[i].RelativePerformance & NVME_LBAF_RP_MASK) <
+            (Namespace->LbaFormats[best].RelativePerformance & NVME_LBAF_RP_MASK)) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+//
+// NvmeToLbaFormats - Fill the NVME2KDB LBA format table for a namespace
+// Lun is kept as the caller passed it, everything else is overwritten
+//
+VOID NvmeToLbaFormats(
+    IN PHW_DEVICE_EXTENSION DevExt,
+    IN PNVME_NAMESPACE Namespace,
+    IN OUT PNVME2KDB_LBA_FORMATS Formats)
+{
+    ULONG lun = Formats->Lun;
+    UCHAR i;
+
+    memset(Formats, 0, sizeof(NVME2KDB_LBA_FORMATS));
+    Formats->Size = sizeof(NVME2KDB_LBA_FORMATS);
+    Formats->Lun = lun;
+    Formats->NamespaceId = Namespace->NamespaceId;
+    Formats->NumberOfFormats = Namespace->NumberOfLbaFormats;
+    Formats->CurrentFormat = Namespace->FormattedLbaSize & NVME_FLBAS_FORMAT_MASK;
+    Formats->BestFormat = NvmeBestLbaFormat(Namespace);
+
+    // With FNA bit 0 set a format wipes every namespace, only allow that if there is one
+    Formats->FormatSupported =
+        ((DevExt->OptionalAdminCommands & NVME_OACS_FORMAT_NVM) &&
+         !((DevExt->FormatNvmAttributes & NVME_FNA_FORMAT_ALL) && DevExt->NamespaceCount > 1)) ? 1 : 0;
+
+    for (i = 0; i < Namespace->NumberOfLbaFormats && i < NVME2KDB_MAX_LBA_FORMATS; i++) {
+        PNVME_LBA_FORMAT lbaFormat = &Namespace->LbaFormats[i];
+
+        Formats->Formats[i].DataSize = (lbaFormat->LbaDataSize >= 9 && lbaFormat->LbaDataSize < 32) ?
+                                       (1UL << lbaFormat->LbaDataSize) : 0;
+        Formats->Formats[i].MetadataSize = lbaFormat->MetadataSize;
+        Formats->Formats[i].RelativePerformance = lbaFormat->RelativePerformance & NVME_LBAF_RP_MASK;
+        Formats->Formats[i].Usable = NvmeLbaFormatUsable(lbaFormat) ? 1 : 0;
+    }
+}
+
 //
 // AllocatePrpListPage - Allocate a PRP list page from the pool
 // Returns page index (0-9) or 0xFF if none available
@@ -853,3 +1040,132 @@ ULONG log2(ULONG n)
     }
     return bits;
 }
+
+//
+// NvmeReadTimestamp - Free running timestamp for per-command latency
+// ScsiPort gives miniports no clock, so on x86 this reads the TSC (Pentium and
+// later). Elsewhere it is a per-adapter sequence number that only orders events,
+// TimestampTicksPerMs is 0 in that case.
+//
+ULONGLONG NvmeReadTimestamp(IN PHW_DEVICE_EXTENSION DevExt)
+{
+#if defined(_X86_)
+    ULONG lo, hi;
+
+    __asm {
+        _emit 0x0F          // rdtsc
+        _emit 0x31
+        mov lo, eax
+        mov hi, edx
+    }
+    return ((ULONGLONG)hi << 32) | lo;
+#else
+    return ++DevExt->TimestampSequence;
+#endif
+}
+
+//
+// NvmeCalibrateTimestamp - Measure timestamp ticks per millisecond
+//
+VOID NvmeCalibrateTimestamp(IN PHW_DEVICE_EXTENSION DevExt)
+{
+#if defined(_X86_)
+    ULONGLONG start;
+
+    start = NvmeReadTimestamp(DevExt);
+    ScsiPortStallExecution(1000);
+    DevExt->TimestampTicksPerMs = (ULONG)(NvmeReadTimestamp(DevExt) - start);
+#else
+    DevExt->TimestampSequence = 0;
+    DevExt->TimestampTicksPerMs = 0;
+#endif
+}
+
+//
+// NvmeTimestampToUs - Convert a timestamp delta to microseconds
+// Returns 0 when timestamps are only a sequence number
+//
+ULONGLONG NvmeTimestampToUs(IN PHW_DEVICE_EXTENSION DevExt, IN ULONGLONG Ticks)
+{
+    if (DevExt->TimestampTicksPerMs == 0) {
+        return 0;
+    }
+    return (Ticks * 1000) / DevExt->TimestampTicksPerMs;
+}
+
+//
+// Load-time parameters
+// ScsiPort hands the DriverParameter registry string (Parameters\Device) to
+// HwFindAdapter as ArgumentString, e.g. "IoScheduler=deadline;ReadExpireMs=20".
+// Entries are separated by ';', ',' or blanks, keys and keywords are case insensitive.
+//
+static BOOLEAN IsArgumentSeparator(IN CHAR c)
+{
+    return (c == '\0' || c == ';' || c == ',' || c == ' ' || c == '\t');
+}
+
+static CHAR ArgumentToUpper(IN CHAR c)
+{
+    return (c >= 'a' && c <= 'z') ? (CHAR)(c - 'a' + 'A') : c;
+}
+
+//
+// NvmeFindArgument - Find "Key=" in the argument string
+// Returns the value (terminated by a separator), or NULL if the key isn't there
+//
+PCHAR NvmeFindArgument(IN PCHAR ArgumentString, IN PCHAR Key)
+{
+    PCHAR p = ArgumentString;
+    ULONG i;
+
+    if (!p) {
+        return NULL;
+    }
+
+    while (*p) {
+        while (*p && IsArgumentSeparator(*p)) {
+            p++;
+        }
+        for (i = 0; Key[i] && ArgumentToUpper(p[i]) == ArgumentToUpper(Key[i]); i++)
+            ;
+        if (!Key[i] && p[i] == '=') {
+            return p + i + 1;
+        }
+        while (*p && !IsArgumentSeparator(*p)) {
+            p++;
+        }
+    }
+    return NULL;
+}
+
+//
+// NvmeArgumentIs - Compare an argument value with a keyword
+//
+BOOLEAN NvmeArgumentIs(IN PCHAR Value, IN PCHAR Keyword)
+{
+    ULONG i;
+
+    for (i = 0; Keyword[i]; i++) {
+        if (ArgumentToUpper(Value[i]) != ArgumentToUpper(Keyword[i])) {
+            return FALSE;
+        }
+    }
+    return IsArgumentSeparator(Value[i]);
+}
+
+//
+// NvmeArgumentToUlong - Decimal argument value, Default if Value is NULL or not a number
+//
+ULONG NvmeArgumentToUlong(IN PCHAR Value, IN ULONG Default)
+{
+    ULONG result = 0;
+
+    if (!Value || Value[0] < '0' || Value[0] > '9') {
+        return Default;
+    }
+    while (*Value >= '0' && *Value <= '9') {
+        result = result * 10 + (ULONG)(*Value - '0');
+        Value++;
+    }
+    return result;
+}
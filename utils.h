@@ -23,6 +23,10 @@ struct _ATA_SMART_DATA;
 #define WRITE_ULONG(p, val) do { (p)[0] = (UCHAR)(val); (p)[1] = (UCHAR)((val) >> 8); \
                                   (p)[2] = (UCHAR)((val) >> 16); (p)[3] = (UCHAR)((val) >> 24); } while(0)
 
+// ATA DATA SET MANAGEMENT range entry: 48-bit LBA, then a 16-bit sector count
+#define ATA_DSM_ENTRY_LBA(p)    ((ULONGLONG)READ_ULONG(p) | ((ULONGLONG)READ_USHORT((p)+4) << 32))
+#define ATA_DSM_ENTRY_COUNT(p)  READ_USHORT((p)+6)
+
 
 VOID NvmeSmartToAtaSmart(IN struct _NVME_SMART_INFO *NvmeSmart, OUT struct _ATA_SMART_DATA *AtaSmart);
 BOOLEAN NvmeGetLogPage(IN PHW_DEVICE_EXTENSION DevExt, IN PSCSI_REQUEST_BLOCK Srb, IN UCHAR LogPageId);